@@ -1,18 +1,25 @@
 import ctypes
+import os
 from read_numbers import *
 
+# Which build of the library to load: unset for libmymllib.so, or f32, f64 or bf16 for libmymllib_<precision>.so,
+# whose functions all carry the prefix mllib_<precision>_
+PRECISION = os.environ.get("MLLIB_PRECISION")
+c_number = ctypes.c_double if PRECISION == "f64" else ctypes.c_float
+
 # Define the vector structure in ctypes
 class Vector(ctypes.Structure):
     _fields_ = [
-        ("v", ctypes.POINTER(ctypes.c_float)),
+        ("v", ctypes.POINTER(c_number)),
         ("size", ctypes.c_size_t)
     ]
 
 class Matrix(ctypes.Structure):
     _fields_ = [
-        ("m", ctypes.POINTER(ctypes.c_float)),
+        ("m", ctypes.POINTER(c_number)),
         ("number_of_rows", ctypes.c_size_t),
-        ("number_of_cols", ctypes.c_size_t)
+        ("number_of_cols", ctypes.c_size_t),
+        ("leading_dimension", ctypes.c_size_t)
     ]
 
 class Batch(ctypes.Structure):
@@ -37,16 +44,22 @@ class ArtificialNeuralNetwork(ctypes.Structure):
         ("biases", ctypes.POINTER(ctypes.POINTER(Vector))),
         ("layers", ctypes.POINTER(ctypes.c_size_t)),
         ("number_of_layers", ctypes.c_size_t),
-        ("gamma", ctypes.c_float)
+        ("gamma", c_number)
     ]
 
 
 # Get the shared library
-lib = ctypes.CDLL("../lib/libmymllib.so")
+if PRECISION is None:
+    lib = ctypes.CDLL("../lib/libmymllib.so")
+else:
+    lib = ctypes.CDLL(f"../lib/libmymllib_{PRECISION}.so")
+
+def function(name):
+    return getattr(lib, name if PRECISION is None else f"mllib_{PRECISION}_{name}")
 
 # List out all the methods in the shared library, ones that we will be explicitly using anyways
 def initialize_ann(layers):
-    lib.initialize_ann
+    function("initialize_ann")
     ...
 
 def load_data_into_batches(data: list[list[float]], number_of_data_points: int, number_of_batches: int):
@@ -61,10 +74,11 @@ def load_data_into_batches(data: list[list[float]], number_of_data_points: int,
     arg2 = ctypes.c_size_t(number_of_data_points)
     arg3 = ctypes.c_size_t(number_of_batches)
     
-    lib.load_data_into_batches.argtypes = [ctypes.POINTER(ctypes.POINTER(Vector)), ctypes.c_size_t, ctypes.c_size_t]
-    lib.load_data_into_batches.restype = ctypes.POINTER(ManyBatches)
+    load = function("load_data_into_batches")
+    load.argtypes = [ctypes.POINTER(ctypes.POINTER(Vector)), ctypes.c_size_t, ctypes.c_size_t]
+    load.restype = ctypes.POINTER(ManyBatches)
     
-    mb = lib.load_data_into_batches(arg1, arg2, arg3)
+    mb = load(arg1, arg2, arg3)
     print(mb)
     return mb
     ...
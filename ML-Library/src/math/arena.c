@@ -0,0 +1,70 @@
+// Bump allocator for matrices, vectors and anything else that lives and dies together
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+static arena_slab* init_slab(size_t capacity) {
+	arena_slab* slab = (arena_slab *)malloc(sizeof(arena_slab));
+
+	slab->capacity = ARENA_ROUND_UP(capacity);
+	slab->memory = (char *)aligned_alloc(ARENA_ALIGNMENT, slab->capacity);
+	slab->used = 0;
+	slab->next = NULL;
+
+	#ifdef ML_LIB_DEBUG_MODE
+	memset(slab->memory, 0, slab->capacity);
+	#endif
+
+	return slab;
+}
+
+arena* init_arena(size_t slab_size) {
+	arena* memory;
+	#ifdef ML_LIB_DEBUG_MODE
+	memory = (arena *)calloc(1, sizeof(arena));
+	#else
+	memory = (arena *)malloc(sizeof(arena));
+	#endif
+
+	memory->slab_size = ARENA_ROUND_UP(slab_size > 0 ? slab_size : ARENA_ALIGNMENT);
+	memory->first = init_slab(memory->slab_size);
+	memory->current = memory->first;
+
+	return memory;
+}
+
+void del_arena(arena* memory) {
+	arena_slab* slab = memory->first;
+	while (slab != NULL) {
+		arena_slab* next = slab->next;
+		free(slab->memory);
+		free(slab);
+		slab = next;
+	}
+	free(memory);
+}
+
+void reset_arena(arena* memory) {
+	for (arena_slab* slab = memory->first; slab != NULL; slab = slab->next) {
+		slab->used = 0;
+	}
+	memory->current = memory->first;
+}
+
+void* arena_alloc(arena* memory, size_t bytes) {
+	bytes = ARENA_ROUND_UP(bytes);
+
+	// after a reset, later slabs are still chained on and get reused in order
+	arena_slab* slab = memory->current;
+	while (slab->capacity - slab->used < bytes) {
+		if (slab->next == NULL) {
+			slab->next = init_slab(bytes > memory->slab_size ? bytes : memory->slab_size);
+		}
+		slab = slab->next;
+	}
+	memory->current = slab;
+
+	void* allocation = slab->memory + slab->used;
+	slab->used += bytes;
+	return allocation;
+}
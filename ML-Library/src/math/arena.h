@@ -0,0 +1,46 @@
+#include "../mllib.h"
+#include <stddef.h>
+
+#ifndef MLLIB_ARENA_H
+#define MLLIB_ARENA_H
+
+// every allocation from an arena starts on a cache line, which is also the widest vector load
+#define ARENA_ALIGNMENT 64
+
+/**
+ * An arena hands out memory by bumping a pointer through large slabs. Individual allocations are never freed;
+ * the whole arena is rewound with reset_arena() or released with del_arena(). When a slab runs out a new one
+ * is chained on, so an arena never fails for lack of space, it just becomes less compact.
+ */
+struct arena_slab_ {
+	char* memory;
+	size_t capacity;
+	size_t used;
+	struct arena_slab_* next;
+};
+typedef struct arena_slab_ arena_slab;
+
+struct arena_ {
+	arena_slab* first;
+	arena_slab* current;
+	size_t slab_size;
+};
+typedef struct arena_ arena;
+
+arena* init_arena(size_t slab_size);
+void del_arena(arena* memory);
+
+/**
+ * Rewind the arena so its slabs can be reused. Everything allocated from it becomes invalid.
+ */
+void reset_arena(arena* memory);
+
+/**
+ * Allocate ARENA_ALIGNMENT-aligned memory. In debug mode the memory is zeroed the first time a slab is used.
+ */
+void* arena_alloc(arena* memory, size_t bytes);
+
+// round a size up so consecutive allocations stay aligned
+#define ARENA_ROUND_UP(bytes) (((bytes) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+#endif
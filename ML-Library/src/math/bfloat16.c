@@ -0,0 +1,20 @@
+// Conversions between 'number' and the bfloat16 storage format
+#include "bfloat16.h"
+
+void convert_to_bfloat16(bfloat16* out, const number* in, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = float_to_bfloat16((float)in[i]);
+	}
+}
+
+void convert_from_bfloat16(number* out, const bfloat16* in, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = bfloat16_to_float(in[i]);
+	}
+}
+
+void matrix_to_bfloat16(bfloat16* out, size_t ldo, const matrix* in) {
+	for (size_t i = 0; i < in->number_of_rows; i++) {
+		convert_to_bfloat16(out + i * ldo, &VALUE_AT(in, i, 0), in->number_of_cols);
+	}
+}
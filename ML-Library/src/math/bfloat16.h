@@ -0,0 +1,42 @@
+#include "../mllib.h"
+#include "matrix.h"
+#include <stdint.h>
+#include <string.h>
+
+#ifndef MLLIB_BFLOAT16_H
+#define MLLIB_BFLOAT16_H
+
+/**
+ * bfloat16 is the top half of an IEEE float: the same sign and exponent, and 7 bits of mantissa. It is only a
+ * storage format here. Values are widened to 'number' before any arithmetic, so sums still accumulate in full
+ * precision while the stored data takes half the memory and bandwidth of a float.
+ */
+typedef uint16_t bfloat16;
+
+// round to nearest, ties to even; NaNs stay NaN
+static inline bfloat16 float_to_bfloat16(float x) {
+	uint32_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	if ((bits & 0x7FFFFFFF) > 0x7F800000) {
+		return (bfloat16)((bits >> 16) | 0x40);
+	}
+	bits += 0x7FFF + ((bits >> 16) & 1);
+	return (bfloat16)(bits >> 16);
+}
+
+static inline float bfloat16_to_float(bfloat16 x) {
+	uint32_t bits = (uint32_t)x << 16;
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+void convert_to_bfloat16(bfloat16* out, const number* in, size_t n);
+void convert_from_bfloat16(number* out, const bfloat16* in, size_t n);
+
+/**
+ * Round every entry of 'in' to bfloat16, row by row, into out[i * ldo + j]
+ */
+void matrix_to_bfloat16(bfloat16* out, size_t ldo, const matrix* in);
+
+#endif
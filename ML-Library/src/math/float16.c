@@ -0,0 +1,14 @@
+// Conversions between 'number' and IEEE half precision storage
+#include "float16.h"
+
+void convert_to_float16(float16* out, const number* in, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = float_to_float16((float)in[i]);
+	}
+}
+
+void convert_from_float16(number* out, const float16* in, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = float16_to_float(in[i]);
+	}
+}
@@ -0,0 +1,81 @@
+#include "../mllib.h"
+#include "matrix.h"
+#include <stdint.h>
+#include <string.h>
+
+#ifndef MLLIB_FLOAT16_H
+#define MLLIB_FLOAT16_H
+
+/**
+ * IEEE half precision: 5 bits of exponent and 10 of mantissa. Like bfloat16 it is only a storage format, but it
+ * trades range for precision: the largest value is 65504 and anything below 2^-24 is lost, which is what loss
+ * scaling is for. The conversions are done in software so they give the same bits on every host.
+ */
+typedef uint16_t float16;
+
+// round to nearest, ties to even; overflow becomes infinity and NaNs stay NaN
+static inline float16 float_to_float16(float x) {
+	uint32_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	uint32_t sign = (bits >> 16) & 0x8000;
+	uint32_t magnitude = bits & 0x7FFFFFFF;
+
+	if (magnitude >= 0x7F800000) {
+		return (float16)(sign | 0x7C00 | ((magnitude > 0x7F800000) ? 0x200 : 0));
+	}
+	// 65520 and up round past the largest half
+	if (magnitude >= 0x477FF000) {
+		return (float16)(sign | 0x7C00);
+	}
+	// 2^-25 and below round to zero
+	if (magnitude <= 0x33000000) {
+		return (float16)sign;
+	}
+
+	uint32_t half;
+	uint32_t remainder;
+	uint32_t halfway;
+	if (magnitude < 0x38800000) {
+		// subnormal: the value in units of 2^-24
+		uint32_t shift = 126 - (magnitude >> 23);
+		uint32_t mantissa = (magnitude & 0x7FFFFF) | 0x800000;
+		half = mantissa >> shift;
+		remainder = mantissa & ((1u << shift) - 1);
+		halfway = 1u << (shift - 1);
+	} else {
+		// normal: rebias the exponent from 127 to 15 and drop 13 bits of mantissa
+		half = (magnitude - 0x38000000) >> 13;
+		remainder = magnitude & 0x1FFF;
+		halfway = 0x1000;
+	}
+	if (remainder > halfway || (remainder == halfway && (half & 1))) {
+		half++;
+	}
+	return (float16)(sign | half);
+}
+
+static inline float float16_to_float(float16 x) {
+	uint32_t sign = (uint32_t)(x & 0x8000) << 16;
+	uint32_t exponent = (x >> 10) & 0x1F;
+	uint32_t mantissa = x & 0x3FF;
+	uint32_t bits;
+
+	if (exponent == 0) {
+		// zero or subnormal, mantissa * 2^-24
+		float value = (float)mantissa * (1.0f / 16777216);
+		return sign ? -value : value;
+	}
+	if (exponent == 31) {
+		bits = sign | 0x7F800000 | (mantissa << 13);
+	} else {
+		bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+	}
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+void convert_to_float16(float16* out, const number* in, size_t n);
+void convert_from_float16(number* out, const float16* in, size_t n);
+
+#endif
@@ -0,0 +1,386 @@
+// Cache-blocked, register-tiled matrix multiplication.
+// The loop structure follows Goto's algorithm: the (k, n) operand is packed panel by panel, the (m, k) operand
+// is packed block by block, and a small micro-kernel does all of the arithmetic out of the packed buffers.
+// The micro-kernel, and with it the width of the packed B panels, comes from the kernel table (kernels.c).
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gemm.h"
+#include "kernels.h"
+#include "../processing/thread_pool.h"
+
+// below this many multiply-adds, packing costs more than it saves
+#define GEMM_SMALL_PROBLEM (32 * 32 * 32)
+
+// below this many multiply-adds, waking the thread pool costs more than it saves
+#define GEMM_PARALLEL_PROBLEM (128 * 128 * 128)
+
+static size_t min_size(size_t a, size_t b) {
+	return (a < b) ? a : b;
+}
+
+/**
+ * The packing buffers of one thread. They grow to the largest blocks the thread has packed and are kept, so
+ * once a thread has done a multiplication of some size, later ones of that size allocate nothing. They are
+ * freed when the thread exits.
+ */
+struct pack_buffers_ {
+	number* a;
+	size_t a_capacity;
+	number* b;
+	size_t b_capacity;
+};
+typedef struct pack_buffers_ pack_buffers;
+
+static pthread_key_t pack_buffers_key;
+static pthread_once_t pack_buffers_key_created = PTHREAD_ONCE_INIT;
+
+static void free_pack_buffers(void* buffers) {
+	free(((pack_buffers *)buffers)->a);
+	free(((pack_buffers *)buffers)->b);
+	free(buffers);
+}
+
+static void create_pack_buffers_key(void) {
+	pthread_key_create(&pack_buffers_key, free_pack_buffers);
+}
+
+static pack_buffers* thread_pack_buffers(void) {
+	pthread_once(&pack_buffers_key_created, create_pack_buffers_key);
+	pack_buffers* buffers = (pack_buffers *)pthread_getspecific(pack_buffers_key);
+	if (buffers == NULL) {
+		buffers = (pack_buffers *)calloc(1, sizeof(pack_buffers));
+		pthread_setspecific(pack_buffers_key, buffers);
+	}
+	return buffers;
+}
+
+static number* reserve_pack_buffer(number** buffer, size_t* capacity, size_t number_of_entries) {
+	if (number_of_entries > *capacity) {
+		free(*buffer);
+		// aligned_alloc wants the size to be a multiple of the alignment
+		size_t bytes = (number_of_entries * sizeof(number) + 63) & ~(size_t)63;
+		*buffer = (number *)aligned_alloc(64, bytes);
+		if (*buffer == NULL) {
+			fprintf(stderr, "ERROR IN GENERAL MATRIX MULT: Cannot allocate %zu bytes of packing buffer\n", bytes);
+			exit(EXIT_FAILURE);
+		}
+		*capacity = number_of_entries;
+	}
+	return *buffer;
+}
+
+/**
+ * Pack an (mc, kc) block of op(a) into row panels of GEMM_MR rows. Within a panel the entries are stored
+ * column by column, so the micro-kernel reads GEMM_MR consecutive values for every step of k.
+ * Rows past mc are padded with zeros so the micro-kernel never needs a remainder loop.
+ */
+static void pack_a(number* packed, const number* a, size_t row_stride, size_t col_stride, size_t mc, size_t kc) {
+	for (size_t panel = 0; panel < mc; panel += GEMM_MR) {
+		size_t rows = min_size(GEMM_MR, mc - panel);
+		const number* a_panel = a + panel * row_stride;
+
+		for (size_t p = 0; p < kc; p++) {
+			size_t i = 0;
+			for (; i < rows; i++) {
+				packed[i] = a_panel[i * row_stride + p * col_stride];
+			}
+			for (; i < GEMM_MR; i++) {
+				packed[i] = 0;
+			}
+			packed += GEMM_MR;
+		}
+	}
+}
+
+// pack_a for a bfloat16 operand, widening every entry on the way into the packed block
+static void pack_a_bf16(number* packed, const bfloat16* a, size_t row_stride, size_t col_stride, size_t mc, size_t kc) {
+	for (size_t panel = 0; panel < mc; panel += GEMM_MR) {
+		size_t rows = min_size(GEMM_MR, mc - panel);
+		const bfloat16* a_panel = a + panel * row_stride;
+
+		for (size_t p = 0; p < kc; p++) {
+			size_t i = 0;
+			for (; i < rows; i++) {
+				packed[i] = bfloat16_to_float(a_panel[i * row_stride + p * col_stride]);
+			}
+			for (; i < GEMM_MR; i++) {
+				packed[i] = 0;
+			}
+			packed += GEMM_MR;
+		}
+	}
+}
+
+/**
+ * Pack a (kc, nc) panel of op(b) into column panels of nr columns, stored row by row,
+ * padding columns past nc with zeros.
+ */
+static void pack_b(number* packed, const number* b, size_t row_stride, size_t col_stride, size_t kc, size_t nc, size_t nr) {
+	for (size_t panel = 0; panel < nc; panel += nr) {
+		size_t cols = min_size(nr, nc - panel);
+		const number* b_panel = b + panel * col_stride;
+
+		for (size_t p = 0; p < kc; p++) {
+			const number* b_row = b_panel + p * row_stride;
+			size_t j = 0;
+			if (col_stride == 1) {
+				memcpy(packed, b_row, cols * sizeof(number));
+				j = cols;
+			} else {
+				for (; j < cols; j++) {
+					packed[j] = b_row[j * col_stride];
+				}
+			}
+			for (; j < nr; j++) {
+				packed[j] = 0;
+			}
+			packed += nr;
+		}
+	}
+}
+
+/**
+ * Apply the epilogue to the (rows, cols) block of c whose top-left entry is at (row, col) of the output.
+ */
+static void apply_epilogue(const gemm_epilogue* epilogue, number* c, size_t ldc, size_t row, size_t col,
+		size_t rows, size_t cols) {
+	for (size_t i = 0; i < rows; i++) {
+		number* c_row = c + i * ldc;
+		number bias = (epilogue->row_bias != NULL) ? epilogue->row_bias[row + i] : 0;
+		number* z_row = c_row;
+
+		if (epilogue->z != NULL) {
+			z_row = epilogue->z + (row + i) * epilogue->ldz + col;
+			kernels->add_scalar(z_row, c_row, bias, cols);
+		} else if (bias != 0) {
+			kernels->add_scalar(c_row, c_row, bias, cols);
+		}
+
+		if (epilogue->apply_leaky_relu) {
+			kernels->leaky_relu(c_row, z_row, epilogue->slope, cols);
+		}
+	}
+}
+
+/**
+ * Straightforward i-p-j loop for problems too small to amortize packing. The innermost loop streams
+ * contiguous rows of c (and of b when it is not transposed). Exactly one of a and a_bf16 is set.
+ */
+static void gemm_small(boolean transpose_a, boolean transpose_b, size_t m, size_t n, size_t k,
+		number alpha, const number* a, const bfloat16* a_bf16, size_t lda, const number* b, size_t ldb,
+		number beta, number* c, size_t ldc) {
+	for (size_t i = 0; i < m; i++) {
+		number* c_row = c + i * ldc;
+		for (size_t j = 0; j < n; j++) {
+			c_row[j] = (beta == 0) ? 0 : beta * c_row[j];
+		}
+
+		for (size_t p = 0; p < k; p++) {
+			size_t a_index = transpose_a ? p * lda + i : i * lda + p;
+			number a_entry = alpha * ((a_bf16 != NULL) ? bfloat16_to_float(a_bf16[a_index]) : a[a_index]);
+			if (transpose_b) {
+				for (size_t j = 0; j < n; j++) {
+					c_row[j] += a_entry * b[j * ldb + p];
+				}
+			} else {
+				const number* b_row = b + p * ldb;
+				for (size_t j = 0; j < n; j++) {
+					c_row[j] += a_entry * b_row[j];
+				}
+			}
+		}
+	}
+}
+
+/**
+ * The serial blocked algorithm for problems large enough to be worth packing.
+ */
+static void gemm_blocked(boolean transpose_a, boolean transpose_b, size_t m, size_t n, size_t k,
+		number alpha, const number* a, const bfloat16* a_bf16, size_t lda, const number* b, size_t ldb,
+		number beta, number* c, size_t ldc, const gemm_epilogue* epilogue) {
+	// strides to walk op(a) and op(b) along their rows and columns
+	size_t a_row_stride = transpose_a ? 1 : lda;
+	size_t a_col_stride = transpose_a ? lda : 1;
+	size_t b_row_stride = transpose_b ? 1 : ldb;
+	size_t b_col_stride = transpose_b ? ldb : 1;
+
+	const kernel_table* table = kernels;
+	size_t gemm_nr = table->gemm_nr;
+
+	size_t nc_max = min_size(GEMM_NC, (n + gemm_nr - 1) / gemm_nr * gemm_nr);
+	size_t mc_max = min_size(GEMM_MC, (m + GEMM_MR - 1) / GEMM_MR * GEMM_MR);
+	size_t kc_max = min_size(GEMM_KC, k);
+	pack_buffers* buffers = thread_pack_buffers();
+	number* packed_a = reserve_pack_buffer(&buffers->a, &buffers->a_capacity, mc_max * kc_max);
+	number* packed_b = reserve_pack_buffer(&buffers->b, &buffers->b_capacity, kc_max * nc_max);
+
+	for (size_t jc = 0; jc < n; jc += GEMM_NC) {
+		size_t nc = min_size(GEMM_NC, n - jc);
+
+		for (size_t pc = 0; pc < k; pc += GEMM_KC) {
+			size_t kc = min_size(GEMM_KC, k - pc);
+			// the first pass over k applies beta, the later ones accumulate into c
+			number beta_block = (pc == 0) ? beta : 1;
+
+			pack_b(packed_b, b + pc * b_row_stride + jc * b_col_stride, b_row_stride, b_col_stride, kc, nc, gemm_nr);
+
+			for (size_t ic = 0; ic < m; ic += GEMM_MC) {
+				size_t mc = min_size(GEMM_MC, m - ic);
+
+				size_t a_offset = ic * a_row_stride + pc * a_col_stride;
+				if (a_bf16 != NULL) {
+					pack_a_bf16(packed_a, a_bf16 + a_offset, a_row_stride, a_col_stride, mc, kc);
+				} else {
+					pack_a(packed_a, a + a_offset, a_row_stride, a_col_stride, mc, kc);
+				}
+
+				for (size_t jr = 0; jr < nc; jr += gemm_nr) {
+					size_t nr = min_size(gemm_nr, nc - jr);
+
+					for (size_t ir = 0; ir < mc; ir += GEMM_MR) {
+						size_t mr = min_size(GEMM_MR, mc - ir);
+
+						number* c_tile = c + (ic + ir) * ldc + jc + jr;
+						table->gemm_micro_kernel(kc, packed_a + ir * kc, packed_b + jr * kc, alpha, beta_block,
+							c_tile, ldc, mr, nr);
+
+						// the tile is finished after the last block of k, and still in L1
+						if (epilogue != NULL && pc + kc == k) {
+							apply_epilogue(epilogue, c_tile, ldc, ic + ir, jc + jr, mr, nr);
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+/**
+ * One block of c for the threaded path.
+ */
+struct gemm_parallel_job_ {
+	boolean transpose_a;
+	boolean transpose_b;
+	size_t m, n, k;
+	number alpha;
+	const number* a;
+	const bfloat16* a_bf16;
+	size_t lda;
+	const number* b;
+	size_t ldb;
+	number beta;
+	number* c;
+	size_t ldc;
+	const gemm_epilogue* epilogue;
+
+	size_t row_blocks, col_blocks;
+	size_t rows_per_block, cols_per_block;
+};
+typedef struct gemm_parallel_job_ gemm_parallel_job;
+
+static void gemm_parallel_task(void* context, size_t task_index) {
+	gemm_parallel_job* job = (gemm_parallel_job *)context;
+	size_t row = (task_index / job->col_blocks) * job->rows_per_block;
+	size_t col = (task_index % job->col_blocks) * job->cols_per_block;
+	if (row >= job->m || col >= job->n) {
+		return;
+	}
+	size_t rows = min_size(job->rows_per_block, job->m - row);
+	size_t cols = min_size(job->cols_per_block, job->n - col);
+
+	size_t a_offset = job->transpose_a ? row : row * job->lda;
+	const number* a = (job->a != NULL) ? job->a + a_offset : NULL;
+	const bfloat16* a_bf16 = (job->a_bf16 != NULL) ? job->a_bf16 + a_offset : NULL;
+	const number* b = job->transpose_b ? job->b + col * job->ldb : job->b + col;
+
+	// the epilogue indexes the bias and z from the origin of the block
+	gemm_epilogue shifted;
+	const gemm_epilogue* epilogue = NULL;
+	if (job->epilogue != NULL) {
+		shifted = *job->epilogue;
+		if (shifted.row_bias != NULL) {
+			shifted.row_bias += row;
+		}
+		if (shifted.z != NULL) {
+			shifted.z += row * shifted.ldz + col;
+		}
+		epilogue = &shifted;
+	}
+
+	gemm_blocked(job->transpose_a, job->transpose_b, rows, cols, job->k, job->alpha, a, a_bf16, job->lda, b, job->ldb,
+		job->beta, job->c + row * job->ldc + col, job->ldc, epilogue);
+}
+
+/**
+ * Picks the algorithm by problem size. Exactly one of a and a_bf16 is set.
+ */
+static void gemm_dispatch(boolean transpose_a, boolean transpose_b, size_t m, size_t n, size_t k,
+		number alpha, const number* a, const bfloat16* a_bf16, size_t lda, const number* b, size_t ldb,
+		number beta, number* c, size_t ldc, const gemm_epilogue* epilogue) {
+	if (m == 0 || n == 0) {
+		return;
+	}
+
+	if (k == 0 || alpha == 0) {
+		for (size_t i = 0; i < m; i++) {
+			for (size_t j = 0; j < n; j++) {
+				c[i * ldc + j] = (beta == 0) ? 0 : beta * c[i * ldc + j];
+			}
+		}
+		if (epilogue != NULL) {
+			apply_epilogue(epilogue, c, ldc, 0, 0, m, n);
+		}
+		return;
+	}
+
+	if (m * n * k <= GEMM_SMALL_PROBLEM) {
+		gemm_small(transpose_a, transpose_b, m, n, k, alpha, a, a_bf16, lda, b, ldb, beta, c, ldc);
+		if (epilogue != NULL) {
+			apply_epilogue(epilogue, c, ldc, 0, 0, m, n);
+		}
+		return;
+	}
+
+	size_t number_of_threads = get_number_of_threads();
+	if (number_of_threads == 1 || m * n * k < GEMM_PARALLEL_PROBLEM) {
+		gemm_blocked(transpose_a, transpose_b, m, n, k, alpha, a, a_bf16, lda, b, ldb, beta, c, ldc, epilogue);
+		return;
+	}
+
+	// Split c into a grid of blocks, rows first since each row block packs its own slice of a.
+	// Block edges fall on micro-tile boundaries, so every entry of c is computed exactly as in the serial case.
+	size_t gemm_nr = kernels->gemm_nr;
+	size_t row_tiles = (m + GEMM_MR - 1) / GEMM_MR;
+	size_t col_tiles = (n + gemm_nr - 1) / gemm_nr;
+
+	gemm_parallel_job job = {
+		.transpose_a = transpose_a, .transpose_b = transpose_b, .m = m, .n = n, .k = k,
+		.alpha = alpha, .a = a, .a_bf16 = a_bf16, .lda = lda, .b = b, .ldb = ldb, .beta = beta, .c = c, .ldc = ldc,
+		.epilogue = epilogue,
+	};
+	job.row_blocks = min_size(number_of_threads, row_tiles);
+	job.col_blocks = min_size((number_of_threads + job.row_blocks - 1) / job.row_blocks, col_tiles);
+	job.rows_per_block = (row_tiles + job.row_blocks - 1) / job.row_blocks * GEMM_MR;
+	job.cols_per_block = (col_tiles + job.col_blocks - 1) / job.col_blocks * gemm_nr;
+
+	parallel_for(job.row_blocks * job.col_blocks, gemm_parallel_task, &job);
+}
+
+void general_matrix_mult(boolean transpose_a, boolean transpose_b, size_t m, size_t n, size_t k,
+		number alpha, const number* a, size_t lda, const number* b, size_t ldb,
+		number beta, number* c, size_t ldc) {
+	gemm_dispatch(transpose_a, transpose_b, m, n, k, alpha, a, NULL, lda, b, ldb, beta, c, ldc, NULL);
+}
+
+void general_matrix_mult_epilogue(boolean transpose_a, boolean transpose_b, size_t m, size_t n, size_t k,
+		number alpha, const number* a, size_t lda, const number* b, size_t ldb,
+		number beta, number* c, size_t ldc, const gemm_epilogue* epilogue) {
+	gemm_dispatch(transpose_a, transpose_b, m, n, k, alpha, a, NULL, lda, b, ldb, beta, c, ldc, epilogue);
+}
+
+void general_matrix_mult_bf16_epilogue(boolean transpose_a, boolean transpose_b, size_t m, size_t n, size_t k,
+		number alpha, const bfloat16* a, size_t lda, const number* b, size_t ldb,
+		number beta, number* c, size_t ldc, const gemm_epilogue* epilogue) {
+	gemm_dispatch(transpose_a, transpose_b, m, n, k, alpha, NULL, a, lda, b, ldb, beta, c, ldc, epilogue);
+}
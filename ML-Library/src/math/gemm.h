@@ -0,0 +1,56 @@
+#include "../mllib.h"
+#include "matrix.h"
+#include "bfloat16.h"
+
+#ifndef MLLIB_GEMM_H
+#define MLLIB_GEMM_H
+
+/**
+ * Blocking parameters of the GEMM engine. The micro-kernel computes a GEMM_MR x gemm_nr tile of the
+ * output in registers, where gemm_nr comes from the kernel table of the host's instruction set.
+ * A GEMM_KC x gemm_nr sliver of packed B is sized to stay in L1, a GEMM_MC x GEMM_KC block of packed A
+ * is sized to stay in L2, and a GEMM_KC x GEMM_NC panel of packed B is sized for L3.
+ * GEMM_NC must be a multiple of every gemm_nr.
+ */
+#define GEMM_MR 6
+#define GEMM_KC 256
+#define GEMM_MC 96
+#define GEMM_NC 4096
+
+/**
+ * General matrix multiplication on row-major storage: c = alpha * op(a) * op(b) + beta * c, where
+ * op(a) is (m, k), op(b) is (k, n) and c is (m, n). op(x) is the transpose of x when the matching flag is set,
+ * and the transpose is folded into the packing so it is never materialized. lda, ldb and ldc are the row
+ * strides of the matrices as they are stored. When beta is zero, c is never read.
+ */
+void general_matrix_mult(boolean transpose_a, boolean transpose_b, size_t m, size_t n, size_t k,
+	number alpha, const number* a, size_t lda, const number* b, size_t ldb,
+	number beta, number* c, size_t ldc);
+
+/**
+ * Work folded into the GEMM after the last block of k has been accumulated into a tile of c, while the tile
+ * is still in L1. Row i of the product gets row_bias[i] added; the result is stored to z (row stride ldz)
+ * when z is not NULL, and c receives the Leaky-ReLU of it when apply_leaky_relu is set.
+ */
+struct gemm_epilogue_ {
+	const number* row_bias;
+	number* z;
+	size_t ldz;
+	boolean apply_leaky_relu;
+	number slope;
+};
+typedef struct gemm_epilogue_ gemm_epilogue;
+
+void general_matrix_mult_epilogue(boolean transpose_a, boolean transpose_b, size_t m, size_t n, size_t k,
+	number alpha, const number* a, size_t lda, const number* b, size_t ldb,
+	number beta, number* c, size_t ldc, const gemm_epilogue* epilogue);
+
+/**
+ * The same with a stored as bfloat16. Its entries are widened as they are packed, so the arithmetic and c are
+ * in full precision and only the reads of a are halved.
+ */
+void general_matrix_mult_bf16_epilogue(boolean transpose_a, boolean transpose_b, size_t m, size_t n, size_t k,
+	number alpha, const bfloat16* a, size_t lda, const number* b, size_t ldb,
+	number beta, number* c, size_t ldc, const gemm_epilogue* epilogue);
+
+#endif
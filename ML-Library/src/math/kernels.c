@@ -0,0 +1,564 @@
+// Instruction set dispatch for the innermost loops.
+// kernels_simd.h is expanded here once per instruction set, each time under the matching target pragma,
+// so a single build of the library carries SSE, AVX2 and AVX-512 code and picks between them at load time.
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kernels.h"
+#include "gemm.h"
+#include "../processing/thread_pool.h"
+
+/* *** Scalar fallback *** */
+
+static void scalar_add(number* out, const number* a, const number* b, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = a[i] + b[i];
+	}
+}
+
+static void scalar_sub(number* out, const number* a, const number* b, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = a[i] - b[i];
+	}
+}
+
+static void scalar_scale(number* out, const number* in, number scale, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = scale * in[i];
+	}
+}
+
+static void scalar_add_scalar(number* out, const number* in, number scalar, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = in[i] + scalar;
+	}
+}
+
+static void scalar_multiply(number* out, const number* a, const number* b, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = a[i] * b[i];
+	}
+}
+
+static number scalar_sum(const number* in, size_t n) {
+	number total = 0;
+	for (size_t i = 0; i < n; i++) {
+		total += in[i];
+	}
+	return total;
+}
+
+static void scalar_leaky_relu(number* out, const number* in, number slope, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = (in[i] > 0) ? in[i] : (slope * in[i]);
+	}
+}
+
+static void scalar_leaky_relu_derivative(number* out, const number* in, number slope, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = (in[i] > 0) ? 1 : slope;
+	}
+}
+
+static number scalar_leaky_relu_backward(number* dE_dz, const number* dE_dy, const number* target, const number* z,
+		number slope, size_t n) {
+	number total = 0;
+	for (size_t i = 0; i < n; i++) {
+		number upstream = (target != NULL) ? dE_dy[i] - target[i] : dE_dy[i];
+		dE_dz[i] = upstream * ((z[i] > 0) ? 1 : slope);
+		total += dE_dz[i];
+	}
+	return total;
+}
+
+static number scalar_leaky_relu_output_backward(number* dE_dz, const number* y, const number* target, const number* z,
+		number slope, size_t n, number* squared_error) {
+	number total = 0;
+	number squares = 0;
+	for (size_t i = 0; i < n; i++) {
+		number error = y[i] - target[i];
+		squares += error * error;
+		dE_dz[i] = error * ((z[i] > 0) ? 1 : slope);
+		total += dE_dz[i];
+	}
+	*squared_error += squares;
+	return total;
+}
+
+static void scalar_momentum_update(number* w, number* velocity, const number* g, const optimizer_constants* constants, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		velocity[i] = constants->beta1 * velocity[i] + constants->gradient_scale * g[i];
+		w[i] -= constants->learning_rate * velocity[i];
+	}
+}
+
+static void scalar_adam_update(number* w, number* m, number* v, const number* g, const optimizer_constants* constants, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		number gradient = constants->gradient_scale * g[i];
+		m[i] = constants->beta1 * m[i] + (1 - constants->beta1) * gradient;
+		v[i] = constants->beta2 * v[i] + (1 - constants->beta2) * gradient * gradient;
+		w[i] -= constants->learning_rate * m[i] / (NUMBER_SQRT(v[i]) + constants->epsilon);
+	}
+}
+
+/* *** Softmax *** */
+
+static number scalar_softmax_cross_entropy(number* out, size_t ldo, const number* z, size_t ldz, const number* target,
+		size_t ldt, size_t rows, size_t n) {
+	number total = 0;
+	for (size_t c = 0; c < n; c++) {
+		number largest = z[c];
+		for (size_t i = 1; i < rows; i++) {
+			largest = (z[i * ldz + c] > largest) ? z[i * ldz + c] : largest;
+		}
+
+		// out holds the exponentials until the sum is known; z is read before it is overwritten
+		number sum = 0;
+		number target_sum = 0;
+		number target_dot_z = 0;
+		for (size_t i = 0; i < rows; i++) {
+			number logit = z[i * ldz + c];
+			if (target != NULL) {
+				target_sum += target[i * ldt + c];
+				target_dot_z += target[i * ldt + c] * logit;
+			}
+			out[i * ldo + c] = NUMBER_EXP(logit - largest);
+			sum += out[i * ldo + c];
+		}
+
+		number inverse_sum = 1 / sum;
+		for (size_t i = 0; i < rows; i++) {
+			out[i * ldo + c] = out[i * ldo + c] * inverse_sum - ((target != NULL) ? target[i * ldt + c] : 0);
+		}
+		if (target != NULL) {
+			total += target_sum * (largest + NUMBER_LOG(sum)) - target_dot_z;
+		}
+	}
+	return total;
+}
+
+/* *** int8 GEMM *** */
+
+// rows of w that the int8 kernels sweep together, sharing every load of x
+#define INT8_GEMM_ROWS 4
+
+/**
+ * Point rows[] at the block of rows of w starting at row i and return how many of them are real. Past the
+ * end of w the block repeats row i, and the sums of those rows are thrown away.
+ */
+static inline size_t int8_gemm_rows(const int8_t** rows, const int8_t* w, size_t ldw, size_t i, size_t m) {
+	size_t real_rows = (m - i < INT8_GEMM_ROWS) ? m - i : INT8_GEMM_ROWS;
+	for (size_t r = 0; r < INT8_GEMM_ROWS; r++) {
+		rows[r] = w + (i + ((r < real_rows) ? r : 0)) * ldw;
+	}
+	return real_rows;
+}
+
+/**
+ * The epilogue shared by every int8 kernel: dequantize the tile of sums for rows [i, i + rows) and the samples
+ * [j, j + cols) into out, adding the bias and applying Leaky-ReLU
+ */
+static inline void int8_gemm_store(number* out, size_t ldo, const int32_t tile[INT8_GEMM_ROWS][INT8_GEMM_N_ALIGN],
+		size_t i, size_t j, size_t rows, size_t cols, const number* scale, const number* bias, number slope) {
+	for (size_t r = 0; r < rows; r++) {
+		number* out_row = out + (i + r) * ldo + j;
+		for (size_t c = 0; c < cols; c++) {
+			number z = scale[i + r] * (number)tile[r][c] + bias[i + r];
+			out_row[c] = (z > 0) ? z : (slope * z);
+		}
+	}
+}
+
+static void scalar_int8_gemm(number* out, size_t ldo, const int8_t* w, size_t ldw, const int8_t* x, size_t ldx,
+		size_t m, size_t n, size_t k, const number* scale, const number* bias, number slope) {
+	int32_t tile[INT8_GEMM_ROWS][INT8_GEMM_N_ALIGN];
+	for (size_t i = 0; i < m; i += INT8_GEMM_ROWS) {
+		size_t rows = (m - i < INT8_GEMM_ROWS) ? m - i : INT8_GEMM_ROWS;
+		for (size_t j = 0; j < n; j += INT8_GEMM_N_ALIGN) {
+			size_t cols = (n - j < INT8_GEMM_N_ALIGN) ? n - j : INT8_GEMM_N_ALIGN;
+			for (size_t r = 0; r < rows; r++) {
+				for (size_t c = 0; c < cols; c++) {
+					int32_t sum = 0;
+					for (size_t p = 0; p < k; p++) {
+						sum += (int32_t)w[(i + r) * ldw + p] * x[(p / 4) * ldx + 4 * (j + c) + p % 4];
+					}
+					tile[r][c] = sum;
+				}
+			}
+			int8_gemm_store(out, ldo, tile, i, j, rows, cols, scale, bias, slope);
+		}
+	}
+}
+
+static inline int8_t scalar_quantize(number value, number inverse_scale) {
+	number scaled = value * inverse_scale;
+	scaled = (scaled > 127) ? 127 : scaled;
+	scaled = (scaled < -127) ? -127 : scaled;
+	return (int8_t)(int32_t)(scaled + ((scaled < 0) ? (number)-0.5 : (number)0.5));
+}
+
+static void scalar_quantize_int8(int8_t* out, const number* const* rows, number inverse_scale, size_t n) {
+	for (size_t j = 0; j < n; j++) {
+		for (int q = 0; q < 4; q++) {
+			out[4 * j + q] = scalar_quantize(rows[q][j], inverse_scale);
+		}
+	}
+}
+
+/* *** Vector instances *** */
+
+// 16-byte vectors need nothing beyond the baseline on x86-64, and GCC lowers them on other architectures
+#define KERNEL_NAME(x) sse_##x
+#define KERNEL_ISA_NAME "sse"
+#define KERNEL_VECTOR_BYTES 16
+#include "kernels_simd.h"
+#undef KERNEL_NAME
+#undef KERNEL_ISA_NAME
+#undef KERNEL_VECTOR_BYTES
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MLLIB_KERNELS_X86
+
+#include <immintrin.h>
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+
+/**
+ * pmaddubsw multiplies unsigned bytes by signed bytes into saturating int16 pairs. Handing it |x|, and w with the
+ * sign of x moved over, gives the same products; with both sides within 127 a pair sums to at most 32258 and
+ * never saturates. pmaddwd against ones then adds the pairs of each 32-bit lane, which finishes the four products
+ * of a group. Half a tile of samples is done at a time, to keep the accumulators in registers.
+ */
+static void avx2_int8_gemm_maddubs(number* restrict out, size_t ldo, const int8_t* restrict w, size_t ldw,
+		const int8_t* restrict x, size_t ldx, size_t m, size_t n, size_t k, const number* scale, const number* bias,
+		number slope) {
+	const __m256i ones = _mm256_set1_epi16(1);
+	int32_t tile[INT8_GEMM_ROWS][INT8_GEMM_N_ALIGN] __attribute__((aligned(32)));
+
+	for (size_t i = 0; i < m; i += INT8_GEMM_ROWS) {
+		const int8_t* w_rows[INT8_GEMM_ROWS];
+		size_t rows = int8_gemm_rows(w_rows, w, ldw, i, m);
+
+		for (size_t j = 0; j < n; j += INT8_GEMM_N_ALIGN) {
+			for (size_t half = 0; half < INT8_GEMM_N_ALIGN; half += 16) {
+				__m256i accumulator[INT8_GEMM_ROWS][2];
+				#pragma GCC unroll 4
+				for (int r = 0; r < INT8_GEMM_ROWS; r++) {
+					accumulator[r][0] = _mm256_setzero_si256();
+					accumulator[r][1] = _mm256_setzero_si256();
+				}
+
+				const int8_t* x_group = x + 4 * (j + half);
+				for (size_t p = 0; p < k; p += 4) {
+					__m256i x_vector[2] = {
+						_mm256_loadu_si256((const __m256i *)x_group),
+						_mm256_loadu_si256((const __m256i *)(x_group + 32)),
+					};
+					__m256i x_magnitude[2] = {
+						_mm256_sign_epi8(x_vector[0], x_vector[0]),
+						_mm256_sign_epi8(x_vector[1], x_vector[1]),
+					};
+					#pragma GCC unroll 4
+					for (int r = 0; r < INT8_GEMM_ROWS; r++) {
+						int32_t w_group;
+						memcpy(&w_group, w_rows[r] + p, sizeof(w_group));
+						__m256i w_vector = _mm256_set1_epi32(w_group);
+						#pragma GCC unroll 2
+						for (int v = 0; v < 2; v++) {
+							__m256i pairs = _mm256_maddubs_epi16(x_magnitude[v], _mm256_sign_epi8(w_vector, x_vector[v]));
+							accumulator[r][v] = _mm256_add_epi32(accumulator[r][v], _mm256_madd_epi16(pairs, ones));
+						}
+					}
+					x_group += ldx;
+				}
+
+				for (int r = 0; r < INT8_GEMM_ROWS; r++) {
+					_mm256_store_si256((__m256i *)&tile[r][half], accumulator[r][0]);
+					_mm256_store_si256((__m256i *)&tile[r][half + 8], accumulator[r][1]);
+				}
+			}
+
+			size_t cols = (n - j < INT8_GEMM_N_ALIGN) ? n - j : INT8_GEMM_N_ALIGN;
+			int8_gemm_store(out, ldo, tile, i, j, rows, cols, scale, bias, slope);
+		}
+	}
+}
+
+#define KERNEL_INT8_GEMM avx2_int8_gemm_maddubs
+#define KERNEL_NAME(x) avx2_##x
+#define KERNEL_ISA_NAME "avx2"
+#define KERNEL_VECTOR_BYTES 32
+#include "kernels_simd.h"
+#undef KERNEL_NAME
+#undef KERNEL_ISA_NAME
+#undef KERNEL_VECTOR_BYTES
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+// AVX-512F has no byte multiplies of its own; every host with it has AVX2
+#define KERNEL_INT8_GEMM avx2_int8_gemm_maddubs
+#define KERNEL_NAME(x) avx512_##x
+#define KERNEL_ISA_NAME "avx512"
+#define KERNEL_VECTOR_BYTES 64
+#include "kernels_simd.h"
+#undef KERNEL_NAME
+#undef KERNEL_ISA_NAME
+#undef KERNEL_VECTOR_BYTES
+#pragma GCC pop_options
+
+// the AVX-512 kernels again, with an int8 GEMM on the VNNI byte dot product
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw,avx512vnni")
+
+/**
+ * vpdpbusd adds the four unsigned-by-signed byte products of each 32-bit lane straight into an int32 lane, so
+ * one instruction does a whole group for 16 samples. x is made unsigned by adding 128 (flipping the top bit),
+ * which adds 128 * (sum of the row of w) to every dot product; that is taken off again before the epilogue.
+ */
+static void avx512vnni_int8_gemm_dpbusd(number* restrict out, size_t ldo, const int8_t* restrict w, size_t ldw,
+		const int8_t* restrict x, size_t ldx, size_t m, size_t n, size_t k, const number* scale, const number* bias,
+		number slope) {
+	const __m512i top_bit = _mm512_set1_epi8((char)0x80);
+	const __m512i ones = _mm512_set1_epi8(1);
+	int32_t tile[INT8_GEMM_ROWS][INT8_GEMM_N_ALIGN] __attribute__((aligned(64)));
+
+	for (size_t i = 0; i < m; i += INT8_GEMM_ROWS) {
+		const int8_t* w_rows[INT8_GEMM_ROWS];
+		size_t rows = int8_gemm_rows(w_rows, w, ldw, i, m);
+
+		// the row sums come from the same instruction against ones, 64 bytes at a time
+		__m512i correction[INT8_GEMM_ROWS];
+		for (int r = 0; r < INT8_GEMM_ROWS; r++) {
+			__m512i row_sum = _mm512_setzero_si512();
+			for (size_t p = 0; p < k; p += 64) {
+				__mmask64 inside = (k - p >= 64) ? ~(__mmask64)0 : (((__mmask64)1 << (k - p)) - 1);
+				row_sum = _mm512_dpbusd_epi32(row_sum, ones, _mm512_maskz_loadu_epi8(inside, w_rows[r] + p));
+			}
+			correction[r] = _mm512_set1_epi32(128 * _mm512_reduce_add_epi32(row_sum));
+		}
+
+		for (size_t j = 0; j < n; j += INT8_GEMM_N_ALIGN) {
+			__m512i accumulator[INT8_GEMM_ROWS][2];
+			#pragma GCC unroll 4
+			for (int r = 0; r < INT8_GEMM_ROWS; r++) {
+				accumulator[r][0] = _mm512_setzero_si512();
+				accumulator[r][1] = _mm512_setzero_si512();
+			}
+
+			const int8_t* x_group = x + 4 * j;
+			for (size_t p = 0; p < k; p += 4) {
+				__m512i x_unsigned[2] = {
+					_mm512_xor_si512(_mm512_loadu_si512(x_group), top_bit),
+					_mm512_xor_si512(_mm512_loadu_si512(x_group + 64), top_bit),
+				};
+				#pragma GCC unroll 4
+				for (int r = 0; r < INT8_GEMM_ROWS; r++) {
+					int32_t w_group;
+					memcpy(&w_group, w_rows[r] + p, sizeof(w_group));
+					__m512i w_vector = _mm512_set1_epi32(w_group);
+					accumulator[r][0] = _mm512_dpbusd_epi32(accumulator[r][0], x_unsigned[0], w_vector);
+					accumulator[r][1] = _mm512_dpbusd_epi32(accumulator[r][1], x_unsigned[1], w_vector);
+				}
+				x_group += ldx;
+			}
+
+			for (int r = 0; r < INT8_GEMM_ROWS; r++) {
+				_mm512_store_si512(&tile[r][0], _mm512_sub_epi32(accumulator[r][0], correction[r]));
+				_mm512_store_si512(&tile[r][16], _mm512_sub_epi32(accumulator[r][1], correction[r]));
+			}
+
+			size_t cols = (n - j < INT8_GEMM_N_ALIGN) ? n - j : INT8_GEMM_N_ALIGN;
+			int8_gemm_store(out, ldo, tile, i, j, rows, cols, scale, bias, slope);
+		}
+	}
+}
+
+#define KERNEL_INT8_GEMM avx512vnni_int8_gemm_dpbusd
+#define KERNEL_NAME(x) avx512vnni_##x
+#define KERNEL_ISA_NAME "avx512vnni"
+#define KERNEL_VECTOR_BYTES 64
+#include "kernels_simd.h"
+#undef KERNEL_NAME
+#undef KERNEL_ISA_NAME
+#undef KERNEL_VECTOR_BYTES
+#pragma GCC pop_options
+#endif
+
+// The scalar table has no micro-kernel of its own; the 16-byte one is valid on every host
+static const kernel_table scalar_table = {
+	.name = "scalar",
+	.add = scalar_add,
+	.sub = scalar_sub,
+	.scale = scalar_scale,
+	.add_scalar = scalar_add_scalar,
+	.multiply = scalar_multiply,
+	.sum = scalar_sum,
+	.leaky_relu = scalar_leaky_relu,
+	.leaky_relu_derivative = scalar_leaky_relu_derivative,
+	.leaky_relu_backward = scalar_leaky_relu_backward,
+	.leaky_relu_output_backward = scalar_leaky_relu_output_backward,
+	.softmax_cross_entropy = scalar_softmax_cross_entropy,
+	.momentum_update = scalar_momentum_update,
+	.adam_update = scalar_adam_update,
+	.gemm_nr = 2 * (16 / sizeof(number)),
+	.gemm_micro_kernel = sse_gemm_micro_kernel,
+	.int8_gemm = scalar_int8_gemm,
+	.quantize_int8 = scalar_quantize_int8,
+};
+
+const kernel_table* kernels = &scalar_table;
+
+/* *** Selection *** */
+
+static boolean host_supports(const char* name) {
+	if (strcmp(name, "scalar") == 0 || strcmp(name, "sse") == 0) {
+		return TRUE;
+	}
+	#ifdef MLLIB_KERNELS_X86
+	if (strcmp(name, "avx2") == 0) {
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	}
+	if (strcmp(name, "avx512") == 0) {
+		return __builtin_cpu_supports("avx512f");
+	}
+	if (strcmp(name, "avx512vnni") == 0) {
+		return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+			__builtin_cpu_supports("avx512vnni");
+	}
+	#endif
+	return FALSE;
+}
+
+static const kernel_table* find_table(const char* name) {
+	if (strcmp(name, "scalar") == 0) {
+		return &scalar_table;
+	}
+	if (strcmp(name, "sse") == 0) {
+		return &sse_table;
+	}
+	#ifdef MLLIB_KERNELS_X86
+	if (strcmp(name, "avx2") == 0) {
+		return &avx2_table;
+	}
+	if (strcmp(name, "avx512") == 0) {
+		return &avx512_table;
+	}
+	if (strcmp(name, "avx512vnni") == 0) {
+		return &avx512vnni_table;
+	}
+	#endif
+	return NULL;
+}
+
+boolean use_kernels(const char* name) {
+	const kernel_table* table = find_table(name);
+	if (table == NULL || !host_supports(name)) {
+		return FALSE;
+	}
+	kernels = table;
+	return TRUE;
+}
+
+/**
+ * Runs when the library is loaded. Picks the widest instruction set the host has,
+ * unless MLLIB_KERNELS names a different one.
+ */
+__attribute__((constructor))
+static void select_kernels(void) {
+	#ifdef MLLIB_KERNELS_X86
+	__builtin_cpu_init();
+	#endif
+
+	const char* requested = getenv("MLLIB_KERNELS");
+	if (requested != NULL && use_kernels(requested)) {
+		return;
+	}
+
+	const char* preference[] = { "avx512vnni", "avx512", "avx2", "sse" };
+	for (int i = 0; i < sizeof(preference) / sizeof(preference[0]); i++) {
+		if (use_kernels(preference[i])) {
+			return;
+		}
+	}
+}
+
+/* *** Threaded elementwise loops *** */
+
+// below this many entries an elementwise loop stays on the calling thread
+#define PARALLEL_ELEMENTWISE_MIN 65536
+
+// chunk boundaries fall on whole cache lines so no two threads write to the same one
+#define PARALLEL_ELEMENTWISE_ALIGN (64 / sizeof(number))
+
+struct elementwise_job_ {
+	binary_kernel binary;
+	scalar_kernel scalar_op;
+	number* out;
+	const number* a;
+	const number* b;
+	number scalar;
+	size_t n;
+	size_t chunk;
+};
+typedef struct elementwise_job_ elementwise_job;
+
+static void elementwise_task(void* context, size_t task_index) {
+	elementwise_job* job = (elementwise_job *)context;
+	size_t begin = task_index * job->chunk;
+	if (begin >= job->n) {
+		return;
+	}
+	size_t count = (job->n - begin < job->chunk) ? job->n - begin : job->chunk;
+
+	if (job->binary != NULL) {
+		job->binary(job->out + begin, job->a + begin, job->b + begin, count);
+	} else {
+		job->scalar_op(job->out + begin, job->a + begin, job->scalar, count);
+	}
+}
+
+static void run_elementwise(elementwise_job* job) {
+	size_t number_of_threads = get_number_of_threads();
+	if (number_of_threads == 1 || job->n < PARALLEL_ELEMENTWISE_MIN) {
+		elementwise_task(job, 0);
+		return;
+	}
+
+	size_t chunk = (job->n + number_of_threads - 1) / number_of_threads;
+	job->chunk = (chunk + PARALLEL_ELEMENTWISE_ALIGN - 1) / PARALLEL_ELEMENTWISE_ALIGN * PARALLEL_ELEMENTWISE_ALIGN;
+	parallel_for((job->n + job->chunk - 1) / job->chunk, elementwise_task, job);
+}
+
+void parallel_binary_kernel(binary_kernel kernel, number* out, const number* a, const number* b, size_t n) {
+	elementwise_job job = { .binary = kernel, .out = out, .a = a, .b = b, .n = n, .chunk = n };
+	run_elementwise(&job);
+}
+
+void parallel_scalar_kernel(scalar_kernel kernel, number* out, const number* in, number scalar, size_t n) {
+	elementwise_job job = { .scalar_op = kernel, .out = out, .a = in, .scalar = scalar, .n = n, .chunk = n };
+	run_elementwise(&job);
+}
+
+void parallel_matrix_binary_kernel(binary_kernel kernel, matrix* out, const matrix* a, const matrix* b) {
+	if (MATRIX_IS_CONTIGUOUS(out) && MATRIX_IS_CONTIGUOUS(a) && MATRIX_IS_CONTIGUOUS(b)) {
+		parallel_binary_kernel(kernel, out->m, a->m, b->m, out->number_of_rows * out->number_of_cols);
+		return;
+	}
+	for (size_t i = 0; i < out->number_of_rows; i++) {
+		parallel_binary_kernel(kernel, out->m + i * out->leading_dimension, a->m + i * a->leading_dimension,
+			b->m + i * b->leading_dimension, out->number_of_cols);
+	}
+}
+
+void parallel_matrix_scalar_kernel(scalar_kernel kernel, matrix* out, const matrix* in, number scalar) {
+	if (MATRIX_IS_CONTIGUOUS(out) && MATRIX_IS_CONTIGUOUS(in)) {
+		parallel_scalar_kernel(kernel, out->m, in->m, scalar, out->number_of_rows * out->number_of_cols);
+		return;
+	}
+	for (size_t i = 0; i < out->number_of_rows; i++) {
+		parallel_scalar_kernel(kernel, out->m + i * out->leading_dimension, in->m + i * in->leading_dimension,
+			scalar, out->number_of_cols);
+	}
+}
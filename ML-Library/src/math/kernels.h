@@ -0,0 +1,143 @@
+#include "../mllib.h"
+#include "matrix.h"
+#include <stdint.h>
+
+#ifndef MLLIB_KERNELS_H
+#define MLLIB_KERNELS_H
+
+/**
+ * Square root, exponential and logarithm of a 'number'. The library is built with -fno-math-errno, so the square
+ * root is a single instruction; softmax takes the other two from libm.
+ */
+#if defined(MLLIB_PRECISION_F64)
+#define NUMBER_SQRT __builtin_sqrt
+#define NUMBER_EXP exp
+#define NUMBER_LOG log
+#else
+#define NUMBER_SQRT __builtin_sqrtf
+#define NUMBER_EXP expf
+#define NUMBER_LOG logf
+#endif
+
+/**
+ * The scalars of one optimizer update, shared by every array the step touches
+ */
+struct optimizer_constants_ {
+	number gradient_scale;	// applied to the gradient before anything else, such as 1 / batch size
+	number learning_rate;	// for Adam, with the bias corrections of the step folded in
+	number beta1;	// the momentum, or Adam's decay of the first moment
+	number beta2;	// Adam's decay of the second moment
+	number epsilon;	// Adam's, with the bias correction folded in
+};
+typedef struct optimizer_constants_ optimizer_constants;
+
+/**
+ * Table of the innermost loops of the library. Every elementwise operation works on contiguous arrays of
+ * 'number', so matrices and vectors are handed over as a flat pointer and a count. One table exists per
+ * instruction set, and the widest one the host supports is picked via CPUID when the library is loaded.
+ * Output arrays may alias an input exactly (for in-place updates) but must not partially overlap.
+ */
+struct kernel_table_ {
+	const char* name;
+
+	void (*add)(number* out, const number* a, const number* b, size_t n);
+	void (*sub)(number* out, const number* a, const number* b, size_t n);
+	void (*scale)(number* out, const number* in, number scale, size_t n);
+	void (*add_scalar)(number* out, const number* in, number scalar, size_t n);
+	void (*multiply)(number* out, const number* a, const number* b, size_t n);
+	number (*sum)(const number* in, size_t n);
+
+	void (*leaky_relu)(number* out, const number* in, number slope, size_t n);
+	void (*leaky_relu_derivative)(number* out, const number* in, number slope, size_t n);
+
+	/**
+	 * Backward step through Leaky-ReLU: dE_dz = (dE_dy - target) * f'(z), with target treated as zero when NULL.
+	 * Returns the sum of dE_dz, which is the bias gradient when the arrays are a row of a batch.
+	 */
+	number (*leaky_relu_backward)(number* dE_dz, const number* dE_dy, const number* target, const number* z,
+		number slope, size_t n);
+
+	/**
+	 * The same step at the output layer, where dE_dy is the output y and target is never NULL, also adding the
+	 * squared error sum((y - target)^2) to *squared_error, so the loss comes out of the pass that forms the gradient.
+	 */
+	number (*leaky_relu_output_backward)(number* dE_dz, const number* y, const number* target, const number* z,
+		number slope, size_t n, number* squared_error);
+
+	/**
+	 * Softmax over each of n columns of a rows x n block, which is over every sample of a batch, with the largest
+	 * entry of a column subtracted before exponentiating so nothing overflows. Rows are ldo and ldz apart in out and z.
+	 * With target NULL, out = softmax(z) and 0 is returned. Otherwise out = softmax(z) - target, the gradient of the
+	 * cross-entropy with respect to z, and the cross-entropy -sum(target * log(softmax(z))) of all n columns is
+	 * returned, taken as sum(target * (log-sum-exp(z) - z)). out may alias z when ldo == ldz.
+	 */
+	number (*softmax_cross_entropy)(number* out, size_t ldo, const number* z, size_t ldz, const number* target,
+		size_t ldt, size_t rows, size_t n);
+
+	/**
+	 * Optimizer updates of n parameters w from their gradient g, each in a single pass over the parameters, the
+	 * gradient and the optimizer's state, with g' = gradient_scale * g:
+	 * momentum: velocity = beta1 * velocity + g', w -= learning_rate * velocity
+	 * Adam: m = beta1 * m + (1 - beta1) * g', v = beta2 * v + (1 - beta2) * g'^2, w -= learning_rate * m / (sqrt(v) + epsilon)
+	 */
+	void (*momentum_update)(number* w, number* velocity, const number* g, const optimizer_constants* constants, size_t n);
+	void (*adam_update)(number* w, number* m, number* v, const number* g, const optimizer_constants* constants, size_t n);
+
+	/**
+	 * GEMM micro-kernel for a GEMM_MR x gemm_nr tile. a is a packed GEMM_MR x kc sliver, b a packed kc x gemm_nr
+	 * sliver. alpha * (a * b) + beta * c is written to the leading (mr, nr) corner of c; c is not read if beta is zero.
+	 */
+	size_t gemm_nr;
+	void (*gemm_micro_kernel)(size_t kc, const number* a, const number* b, number alpha, number beta,
+		number* c, size_t ldc, size_t mr, size_t nr);
+
+	/**
+	 * int8 GEMM for quantized inference. w is m x k, row-major. x holds n samples with their inputs in groups of four:
+	 * input p of sample j is x[(p / 4) * ldx + 4 * j + p % 4], so each 32-bit lane carries four inputs of one sample.
+	 * Entries are in [-127, 127], k is a multiple of INT8_GEMM_K_ALIGN, and x must be readable for n rounded up to
+	 * INT8_GEMM_N_ALIGN samples (the sums of the extra ones are thrown away). The dot products are summed exactly in
+	 * int32 and dequantized in the epilogue: out[i * ldo + j] = f(scale[i] * (w_i . x_j) + bias[i]), f being
+	 * Leaky-ReLU with the given slope.
+	 */
+	void (*int8_gemm)(number* out, size_t ldo, const int8_t* w, size_t ldw, const int8_t* x, size_t ldx,
+		size_t m, size_t n, size_t k, const number* scale, const number* bias, number slope);
+
+	/**
+	 * Quantize one group of four rows of n entries into the x operand of int8_gemm:
+	 * out[4 * j + q] = rows[q][j] * inverse_scale, rounded to nearest (halves away from zero) and clamped to
+	 * [-127, 127].
+	 */
+	void (*quantize_int8)(int8_t* out, const number* const* rows, number inverse_scale, size_t n);
+};
+typedef struct kernel_table_ kernel_table;
+
+// A sum of k products of at most 127 * 127 fits in int32 for k up to 133000
+#define INT8_GEMM_K_ALIGN 4
+#define INT8_GEMM_N_ALIGN 32
+
+// The table in use. Set before main() runs, and by use_kernels()
+extern const kernel_table* kernels;
+
+/**
+ * Switch to the kernels of a named instruction set ("scalar", "sse", "avx2", "avx512" or "avx512vnni").
+ * Returns FALSE, and leaves the current table in place, if the name is unknown or the host lacks the instructions.
+ * The environment variable MLLIB_KERNELS is consulted the same way at load time.
+ */
+boolean use_kernels(const char* name);
+
+/**
+ * Run one of the elementwise kernels above over n entries, split across the thread pool once n is large enough
+ * to pay for waking it. Every entry is computed the same way whatever the split, so results do not depend on the
+ * number of threads.
+ */
+typedef void (*binary_kernel)(number* out, const number* a, const number* b, size_t n);
+typedef void (*scalar_kernel)(number* out, const number* in, number scalar, size_t n);
+
+void parallel_binary_kernel(binary_kernel kernel, number* out, const number* a, const number* b, size_t n);
+void parallel_scalar_kernel(scalar_kernel kernel, number* out, const number* in, number scalar, size_t n);
+
+// The same over every entry of matrices of equal shape, row by row when any of them is a strided view
+void parallel_matrix_binary_kernel(binary_kernel kernel, matrix* out, const matrix* a, const matrix* b);
+void parallel_matrix_scalar_kernel(scalar_kernel kernel, matrix* out, const matrix* in, number scalar);
+
+#endif
@@ -0,0 +1,509 @@
+// Vector kernels, written once with GCC vector extensions and expanded by kernels.c for each instruction set.
+// Before including, define KERNEL_NAME(x) to give every function a per-instruction-set name,
+// KERNEL_ISA_NAME to the name reported by the table and KERNEL_VECTOR_BYTES to the register width.
+// KERNEL_INT8_GEMM may name an int8 GEMM written for the instruction set, to be used instead of the generic one.
+// There is deliberately no include guard.
+
+typedef number KERNEL_NAME(vector) __attribute__((vector_size(KERNEL_VECTOR_BYTES)));
+
+#define KERNEL_VECTOR KERNEL_NAME(vector)
+#define KERNEL_LANES (KERNEL_VECTOR_BYTES / sizeof(number))
+
+static inline KERNEL_VECTOR KERNEL_NAME(load)(const number* p) {
+	KERNEL_VECTOR x;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+static inline void KERNEL_NAME(store)(number* p, KERNEL_VECTOR x) {
+	memcpy(p, &x, sizeof(x));
+}
+
+static void KERNEL_NAME(add)(number* out, const number* a, const number* b, size_t n) {
+	size_t i = 0;
+	#pragma GCC unroll 4
+	for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+		KERNEL_NAME(store)(out + i, KERNEL_NAME(load)(a + i) + KERNEL_NAME(load)(b + i));
+	}
+	for (; i < n; i++) {
+		out[i] = a[i] + b[i];
+	}
+}
+
+static void KERNEL_NAME(sub)(number* out, const number* a, const number* b, size_t n) {
+	size_t i = 0;
+	#pragma GCC unroll 4
+	for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+		KERNEL_NAME(store)(out + i, KERNEL_NAME(load)(a + i) - KERNEL_NAME(load)(b + i));
+	}
+	for (; i < n; i++) {
+		out[i] = a[i] - b[i];
+	}
+}
+
+static void KERNEL_NAME(scale)(number* out, const number* in, number scale, size_t n) {
+	size_t i = 0;
+	#pragma GCC unroll 4
+	for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+		KERNEL_NAME(store)(out + i, scale * KERNEL_NAME(load)(in + i));
+	}
+	for (; i < n; i++) {
+		out[i] = scale * in[i];
+	}
+}
+
+static void KERNEL_NAME(add_scalar)(number* out, const number* in, number scalar, size_t n) {
+	size_t i = 0;
+	#pragma GCC unroll 4
+	for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+		KERNEL_NAME(store)(out + i, KERNEL_NAME(load)(in + i) + scalar);
+	}
+	for (; i < n; i++) {
+		out[i] = in[i] + scalar;
+	}
+}
+
+static void KERNEL_NAME(multiply)(number* out, const number* a, const number* b, size_t n) {
+	size_t i = 0;
+	#pragma GCC unroll 4
+	for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+		KERNEL_NAME(store)(out + i, KERNEL_NAME(load)(a + i) * KERNEL_NAME(load)(b + i));
+	}
+	for (; i < n; i++) {
+		out[i] = a[i] * b[i];
+	}
+}
+
+static number KERNEL_NAME(sum)(const number* in, size_t n) {
+	// two accumulators hide the latency of the vector add
+	KERNEL_VECTOR partial_one = {0};
+	KERNEL_VECTOR partial_two = {0};
+	size_t i = 0;
+	for (; i + 2 * KERNEL_LANES <= n; i += 2 * KERNEL_LANES) {
+		partial_one += KERNEL_NAME(load)(in + i);
+		partial_two += KERNEL_NAME(load)(in + i + KERNEL_LANES);
+	}
+	partial_one += partial_two;
+
+	number total = 0;
+	for (int lane = 0; lane < KERNEL_LANES; lane++) {
+		total += partial_one[lane];
+	}
+	for (; i < n; i++) {
+		total += in[i];
+	}
+	return total;
+}
+
+/**
+ * Comparisons of vectors give a lane mask of all ones where true, which selects between the bit patterns
+ * of 1 and slope without branching.
+ */
+typedef __typeof__((KERNEL_VECTOR){0} > (KERNEL_VECTOR){0}) KERNEL_NAME(mask);
+
+static inline KERNEL_VECTOR KERNEL_NAME(leaky_relu_factor)(KERNEL_VECTOR x, number slope) {
+	KERNEL_NAME(mask) positive = x > (KERNEL_VECTOR){0};
+	KERNEL_NAME(mask) one_bits = (KERNEL_NAME(mask))((KERNEL_VECTOR){0} + 1);
+	KERNEL_NAME(mask) slope_bits = (KERNEL_NAME(mask))((KERNEL_VECTOR){0} + slope);
+	return (KERNEL_VECTOR)((positive & one_bits) | (~positive & slope_bits));
+}
+
+static void KERNEL_NAME(leaky_relu)(number* out, const number* in, number slope, size_t n) {
+	size_t i = 0;
+	#pragma GCC unroll 4
+	for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+		KERNEL_VECTOR x = KERNEL_NAME(load)(in + i);
+		KERNEL_NAME(store)(out + i, x * KERNEL_NAME(leaky_relu_factor)(x, slope));
+	}
+	for (; i < n; i++) {
+		out[i] = (in[i] > 0) ? in[i] : (slope * in[i]);
+	}
+}
+
+static void KERNEL_NAME(leaky_relu_derivative)(number* out, const number* in, number slope, size_t n) {
+	size_t i = 0;
+	#pragma GCC unroll 4
+	for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+		KERNEL_NAME(store)(out + i, KERNEL_NAME(leaky_relu_factor)(KERNEL_NAME(load)(in + i), slope));
+	}
+	for (; i < n; i++) {
+		out[i] = (in[i] > 0) ? 1 : slope;
+	}
+}
+
+static number KERNEL_NAME(leaky_relu_backward)(number* dE_dz, const number* dE_dy, const number* target, const number* z,
+		number slope, size_t n) {
+	KERNEL_VECTOR partial = {0};
+	size_t i = 0;
+	for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+		KERNEL_VECTOR upstream = KERNEL_NAME(load)(dE_dy + i);
+		if (target != NULL) {
+			upstream -= KERNEL_NAME(load)(target + i);
+		}
+		KERNEL_VECTOR gradient = upstream * KERNEL_NAME(leaky_relu_factor)(KERNEL_NAME(load)(z + i), slope);
+		KERNEL_NAME(store)(dE_dz + i, gradient);
+		partial += gradient;
+	}
+
+	number total = 0;
+	for (int lane = 0; lane < KERNEL_LANES; lane++) {
+		total += partial[lane];
+	}
+	for (; i < n; i++) {
+		number upstream = (target != NULL) ? dE_dy[i] - target[i] : dE_dy[i];
+		dE_dz[i] = upstream * ((z[i] > 0) ? 1 : slope);
+		total += dE_dz[i];
+	}
+	return total;
+}
+
+static number KERNEL_NAME(leaky_relu_output_backward)(number* dE_dz, const number* y, const number* target, const number* z,
+		number slope, size_t n, number* squared_error) {
+	KERNEL_VECTOR partial = {0};
+	KERNEL_VECTOR partial_squares = {0};
+	size_t i = 0;
+	for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+		KERNEL_VECTOR error = KERNEL_NAME(load)(y + i) - KERNEL_NAME(load)(target + i);
+		partial_squares += error * error;
+		KERNEL_VECTOR gradient = error * KERNEL_NAME(leaky_relu_factor)(KERNEL_NAME(load)(z + i), slope);
+		KERNEL_NAME(store)(dE_dz + i, gradient);
+		partial += gradient;
+	}
+
+	number total = 0;
+	number squares = 0;
+	for (int lane = 0; lane < KERNEL_LANES; lane++) {
+		total += partial[lane];
+		squares += partial_squares[lane];
+	}
+	for (; i < n; i++) {
+		number error = y[i] - target[i];
+		squares += error * error;
+		dE_dz[i] = error * ((z[i] > 0) ? 1 : slope);
+		total += dE_dz[i];
+	}
+	*squared_error += squares;
+	return total;
+}
+
+static inline KERNEL_VECTOR KERNEL_NAME(select)(KERNEL_NAME(mask) condition, KERNEL_VECTOR a, KERNEL_VECTOR b) {
+	return (KERNEL_VECTOR)((condition & (KERNEL_NAME(mask))a) | (~condition & (KERNEL_NAME(mask))b));
+}
+
+// libm's exponential a lane at a time
+static inline KERNEL_VECTOR KERNEL_NAME(exp)(KERNEL_VECTOR x) {
+	for (int lane = 0; lane < KERNEL_LANES; lane++) {
+		x[lane] = NUMBER_EXP(x[lane]);
+	}
+	return x;
+}
+
+/**
+ * Softmax a vector of columns at a time: the lanes are samples, so every step down the rows is a whole vector
+ * and the largest entry, the sum and the dot product with the target each stay in one register.
+ * The columns left over go through the scalar kernel.
+ */
+static number KERNEL_NAME(softmax_cross_entropy)(number* out, size_t ldo, const number* z, size_t ldz,
+		const number* target, size_t ldt, size_t rows, size_t n) {
+	number total = 0;
+	size_t c = 0;
+	for (; c + KERNEL_LANES <= n; c += KERNEL_LANES) {
+		KERNEL_VECTOR largest = KERNEL_NAME(load)(z + c);
+		for (size_t i = 1; i < rows; i++) {
+			KERNEL_VECTOR logit = KERNEL_NAME(load)(z + i * ldz + c);
+			largest = KERNEL_NAME(select)(logit > largest, logit, largest);
+		}
+
+		KERNEL_VECTOR sum = {0};
+		KERNEL_VECTOR target_sum = {0};
+		KERNEL_VECTOR target_dot_z = {0};
+		for (size_t i = 0; i < rows; i++) {
+			KERNEL_VECTOR logit = KERNEL_NAME(load)(z + i * ldz + c);
+			if (target != NULL) {
+				KERNEL_VECTOR expected = KERNEL_NAME(load)(target + i * ldt + c);
+				target_sum += expected;
+				target_dot_z += expected * logit;
+			}
+			KERNEL_VECTOR exponential = KERNEL_NAME(exp)(logit - largest);
+			KERNEL_NAME(store)(out + i * ldo + c, exponential);
+			sum += exponential;
+		}
+
+		KERNEL_VECTOR inverse_sum = 1 / sum;
+		for (size_t i = 0; i < rows; i++) {
+			KERNEL_VECTOR probability = KERNEL_NAME(load)(out + i * ldo + c) * inverse_sum;
+			if (target != NULL) {
+				probability -= KERNEL_NAME(load)(target + i * ldt + c);
+			}
+			KERNEL_NAME(store)(out + i * ldo + c, probability);
+		}
+		if (target != NULL) {
+			for (int lane = 0; lane < KERNEL_LANES; lane++) {
+				total += target_sum[lane] * (largest[lane] + NUMBER_LOG(sum[lane])) - target_dot_z[lane];
+			}
+		}
+	}
+
+	if (c < n) {
+		total += scalar_softmax_cross_entropy(out + c, ldo, z + c, ldz, (target != NULL) ? target + c : NULL, ldt, rows, n - c);
+	}
+	return total;
+}
+
+// lane by lane, which GCC turns into one vector square root
+static inline KERNEL_VECTOR KERNEL_NAME(sqrt)(KERNEL_VECTOR x) {
+	for (int lane = 0; lane < KERNEL_LANES; lane++) {
+		x[lane] = NUMBER_SQRT(x[lane]);
+	}
+	return x;
+}
+
+static void KERNEL_NAME(momentum_update)(number* w, number* velocity, const number* g, const optimizer_constants* constants,
+		size_t n) {
+	number gradient_scale = constants->gradient_scale;
+	number learning_rate = constants->learning_rate;
+	number momentum = constants->beta1;
+	size_t i = 0;
+	#pragma GCC unroll 2
+	for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+		KERNEL_VECTOR step = momentum * KERNEL_NAME(load)(velocity + i) + gradient_scale * KERNEL_NAME(load)(g + i);
+		KERNEL_NAME(store)(velocity + i, step);
+		KERNEL_NAME(store)(w + i, KERNEL_NAME(load)(w + i) - learning_rate * step);
+	}
+	for (; i < n; i++) {
+		velocity[i] = momentum * velocity[i] + gradient_scale * g[i];
+		w[i] -= learning_rate * velocity[i];
+	}
+}
+
+static void KERNEL_NAME(adam_update)(number* w, number* m, number* v, const number* g, const optimizer_constants* constants,
+		size_t n) {
+	number gradient_scale = constants->gradient_scale;
+	number learning_rate = constants->learning_rate;
+	number beta1 = constants->beta1;
+	number beta2 = constants->beta2;
+	number epsilon = constants->epsilon;
+	size_t i = 0;
+	for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+		KERNEL_VECTOR gradient = gradient_scale * KERNEL_NAME(load)(g + i);
+		KERNEL_VECTOR first = beta1 * KERNEL_NAME(load)(m + i) + (1 - beta1) * gradient;
+		KERNEL_VECTOR second = beta2 * KERNEL_NAME(load)(v + i) + (1 - beta2) * gradient * gradient;
+		KERNEL_NAME(store)(m + i, first);
+		KERNEL_NAME(store)(v + i, second);
+		KERNEL_NAME(store)(w + i, KERNEL_NAME(load)(w + i) - learning_rate * first / (KERNEL_NAME(sqrt)(second) + epsilon));
+	}
+	for (; i < n; i++) {
+		number gradient = gradient_scale * g[i];
+		m[i] = beta1 * m[i] + (1 - beta1) * gradient;
+		v[i] = beta2 * v[i] + (1 - beta2) * gradient * gradient;
+		w[i] -= learning_rate * m[i] / (NUMBER_SQRT(v[i]) + epsilon);
+	}
+}
+
+/**
+ * GEMM micro-kernel. The tile is GEMM_MR rows by two vectors, so the table reports gemm_nr as two vectors' worth of lanes.
+ * All of the accumulators stay in registers for the whole kc loop.
+ */
+#define KERNEL_GEMM_VECTORS 2
+
+static void KERNEL_NAME(gemm_micro_kernel)(size_t kc, const number* restrict a, const number* restrict b,
+		number alpha, number beta, number* restrict c, size_t ldc, size_t mr, size_t nr) {
+	KERNEL_VECTOR accumulator[GEMM_MR][KERNEL_GEMM_VECTORS];
+
+	#pragma GCC unroll 16
+	for (int i = 0; i < GEMM_MR; i++) {
+		#pragma GCC unroll 4
+		for (int j = 0; j < KERNEL_GEMM_VECTORS; j++) {
+			accumulator[i][j] = (KERNEL_VECTOR){0};
+		}
+	}
+
+	const KERNEL_VECTOR* b_vectors = (const KERNEL_VECTOR *)b;
+	for (size_t p = 0; p < kc; p++) {
+		KERNEL_VECTOR b_row[KERNEL_GEMM_VECTORS];
+		#pragma GCC unroll 4
+		for (int j = 0; j < KERNEL_GEMM_VECTORS; j++) {
+			b_row[j] = b_vectors[j];
+		}
+
+		#pragma GCC unroll 16
+		for (int i = 0; i < GEMM_MR; i++) {
+			number a_entry = a[i];
+			#pragma GCC unroll 4
+			for (int j = 0; j < KERNEL_GEMM_VECTORS; j++) {
+				accumulator[i][j] += a_entry * b_row[j];
+			}
+		}
+
+		a += GEMM_MR;
+		b_vectors += KERNEL_GEMM_VECTORS;
+	}
+
+	if (mr == GEMM_MR && nr == KERNEL_GEMM_VECTORS * KERNEL_LANES) {
+		#pragma GCC unroll 16
+		for (int i = 0; i < GEMM_MR; i++) {
+			#pragma GCC unroll 4
+			for (int j = 0; j < KERNEL_GEMM_VECTORS; j++) {
+				number* c_entry = c + i * ldc + j * KERNEL_LANES;
+				KERNEL_VECTOR result = alpha * accumulator[i][j];
+				if (beta != 0) {
+					result += beta * KERNEL_NAME(load)(c_entry);
+				}
+				KERNEL_NAME(store)(c_entry, result);
+			}
+		}
+	} else {
+		number tile[GEMM_MR * KERNEL_GEMM_VECTORS * KERNEL_LANES] __attribute__((aligned(64)));
+		memcpy(tile, accumulator, sizeof(tile));
+
+		for (size_t i = 0; i < mr; i++) {
+			for (size_t j = 0; j < nr; j++) {
+				number result = alpha * tile[i * KERNEL_GEMM_VECTORS * KERNEL_LANES + j];
+				if (beta != 0) {
+					result += beta * c[i * ldc + j];
+				}
+				c[i * ldc + j] = result;
+			}
+		}
+	}
+}
+
+#ifndef KERNEL_INT8_GEMM
+#define KERNEL_INT8_SAMPLES (KERNEL_VECTOR_BYTES / 4)
+#define KERNEL_INT8_CHUNKS (INT8_GEMM_N_ALIGN / KERNEL_INT8_SAMPLES)
+
+typedef int16_t KERNEL_NAME(int16_vector) __attribute__((vector_size(KERNEL_VECTOR_BYTES)));
+typedef int32_t KERNEL_NAME(int32_vector) __attribute__((vector_size(KERNEL_VECTOR_BYTES)));
+
+// the int16 lanes (low, high) of every int32 lane of the result
+static inline KERNEL_NAME(int16_vector) KERNEL_NAME(int16_pair)(const int8_t* group, int low, int high) {
+	uint32_t pair = (uint32_t)(uint16_t)group[low] | ((uint32_t)(uint16_t)group[high] << 16);
+	return (KERNEL_NAME(int16_vector))((KERNEL_NAME(int32_vector)){0} + (int32_t)pair);
+}
+
+/**
+ * Generic int8 GEMM. A load of x, read as int16 lanes, holds one group of four inputs for KERNEL_INT8_SAMPLES
+ * samples; shifts split it into the even and the odd bytes, sign extended. Multiplied by the matching bytes of w,
+ * two products fit in an int16 lane since 127 * 127 * 2 does, and each int32 lane then adds its two int16 lanes
+ * to finish the group of one sample. Lane order is little-endian, as on every target the library is built for.
+ */
+static void KERNEL_NAME(int8_gemm)(number* restrict out, size_t ldo, const int8_t* restrict w, size_t ldw,
+		const int8_t* restrict x, size_t ldx, size_t m, size_t n, size_t k, const number* scale, const number* bias,
+		number slope) {
+	int32_t tile[INT8_GEMM_ROWS][INT8_GEMM_N_ALIGN];
+
+	for (size_t i = 0; i < m; i += INT8_GEMM_ROWS) {
+		const int8_t* w_rows[INT8_GEMM_ROWS];
+		size_t rows = int8_gemm_rows(w_rows, w, ldw, i, m);
+
+		for (size_t j = 0; j < n; j += INT8_GEMM_N_ALIGN) {
+			KERNEL_NAME(int32_vector) accumulator[INT8_GEMM_ROWS][KERNEL_INT8_CHUNKS];
+			for (int r = 0; r < INT8_GEMM_ROWS; r++) {
+				for (int c = 0; c < KERNEL_INT8_CHUNKS; c++) {
+					accumulator[r][c] = (KERNEL_NAME(int32_vector)){0};
+				}
+			}
+
+			const int8_t* x_group = x + 4 * j;
+			for (size_t p = 0; p < k; p += 4) {
+				KERNEL_NAME(int16_vector) w_even[INT8_GEMM_ROWS];
+				KERNEL_NAME(int16_vector) w_odd[INT8_GEMM_ROWS];
+				#pragma GCC unroll 4
+				for (int r = 0; r < INT8_GEMM_ROWS; r++) {
+					w_even[r] = KERNEL_NAME(int16_pair)(w_rows[r] + p, 0, 2);
+					w_odd[r] = KERNEL_NAME(int16_pair)(w_rows[r] + p, 1, 3);
+				}
+
+				for (int c = 0; c < KERNEL_INT8_CHUNKS; c++) {
+					KERNEL_NAME(int16_vector) x_vector;
+					memcpy(&x_vector, x_group + c * KERNEL_VECTOR_BYTES, sizeof(x_vector));
+					KERNEL_NAME(int16_vector) x_even = (x_vector << 8) >> 8;
+					KERNEL_NAME(int16_vector) x_odd = x_vector >> 8;
+
+					#pragma GCC unroll 4
+					for (int r = 0; r < INT8_GEMM_ROWS; r++) {
+						KERNEL_NAME(int32_vector) pairs = (KERNEL_NAME(int32_vector))(x_even * w_even[r] + x_odd * w_odd[r]);
+						accumulator[r][c] += ((pairs << 16) >> 16) + (pairs >> 16);
+					}
+				}
+				x_group += ldx;
+			}
+
+			for (int r = 0; r < INT8_GEMM_ROWS; r++) {
+				memcpy(tile[r], accumulator[r], sizeof(accumulator[r]));
+			}
+			size_t cols = (n - j < INT8_GEMM_N_ALIGN) ? n - j : INT8_GEMM_N_ALIGN;
+			int8_gemm_store(out, ldo, tile, i, j, rows, cols, scale, bias, slope);
+		}
+	}
+}
+
+#define KERNEL_INT8_GEMM KERNEL_NAME(int8_gemm)
+#undef KERNEL_INT8_SAMPLES
+#undef KERNEL_INT8_CHUNKS
+#endif
+
+typedef int32_t KERNEL_NAME(group_vector) __attribute__((vector_size(KERNEL_LANES * sizeof(int32_t))));
+
+static inline KERNEL_NAME(group_vector) KERNEL_NAME(quantize)(KERNEL_VECTOR x, number inverse_scale) {
+	const KERNEL_VECTOR limit = (KERNEL_VECTOR){0} + 127;
+	KERNEL_VECTOR scaled = x * inverse_scale;
+
+	// clamp by picking bits, since arithmetic on the out-of-range lanes would round
+	KERNEL_NAME(mask) above = scaled > limit;
+	scaled = (KERNEL_VECTOR)((above & (KERNEL_NAME(mask))limit) | (~above & (KERNEL_NAME(mask))scaled));
+	KERNEL_NAME(mask) below = scaled < -limit;
+	scaled = (KERNEL_VECTOR)((below & (KERNEL_NAME(mask))-limit) | (~below & (KERNEL_NAME(mask))scaled));
+
+	// the mask converts to -1 in the negative lanes, making the 0.5 there -0.5; the conversion then truncates
+	KERNEL_VECTOR half = (number)0.5 + __builtin_convertvector(scaled < 0, KERNEL_VECTOR);
+	return __builtin_convertvector(scaled + half, KERNEL_NAME(group_vector));
+}
+
+/**
+ * Each lane of the four quantized rows is one byte of a 32-bit group, so the interleaving is shifts and ors
+ */
+static void KERNEL_NAME(quantize_int8)(int8_t* restrict out, const number* const* rows, number inverse_scale, size_t n) {
+	size_t j = 0;
+	for (; j + KERNEL_LANES <= n; j += KERNEL_LANES) {
+		KERNEL_NAME(group_vector) group = (KERNEL_NAME(group_vector)){0};
+		#pragma GCC unroll 4
+		for (int q = 0; q < 4; q++) {
+			KERNEL_NAME(group_vector) quantized = KERNEL_NAME(quantize)(KERNEL_NAME(load)(rows[q] + j), inverse_scale);
+			group |= (quantized & 0xFF) << (8 * q);
+		}
+		memcpy(out + 4 * j, &group, sizeof(group));
+	}
+	for (; j < n; j++) {
+		for (int q = 0; q < 4; q++) {
+			out[4 * j + q] = scalar_quantize(rows[q][j], inverse_scale);
+		}
+	}
+}
+
+static const kernel_table KERNEL_NAME(table) = {
+	.name = KERNEL_ISA_NAME,
+	.add = KERNEL_NAME(add),
+	.sub = KERNEL_NAME(sub),
+	.scale = KERNEL_NAME(scale),
+	.add_scalar = KERNEL_NAME(add_scalar),
+	.multiply = KERNEL_NAME(multiply),
+	.sum = KERNEL_NAME(sum),
+	.leaky_relu = KERNEL_NAME(leaky_relu),
+	.leaky_relu_derivative = KERNEL_NAME(leaky_relu_derivative),
+	.leaky_relu_backward = KERNEL_NAME(leaky_relu_backward),
+	.leaky_relu_output_backward = KERNEL_NAME(leaky_relu_output_backward),
+	.softmax_cross_entropy = KERNEL_NAME(softmax_cross_entropy),
+	.momentum_update = KERNEL_NAME(momentum_update),
+	.adam_update = KERNEL_NAME(adam_update),
+	.gemm_nr = KERNEL_GEMM_VECTORS * KERNEL_LANES,
+	.gemm_micro_kernel = KERNEL_NAME(gemm_micro_kernel),
+	.int8_gemm = KERNEL_INT8_GEMM,
+	.quantize_int8 = KERNEL_NAME(quantize_int8),
+};
+
+#undef KERNEL_INT8_GEMM
+
+#undef KERNEL_GEMM_VECTORS
+#undef KERNEL_VECTOR
+#undef KERNEL_LANES
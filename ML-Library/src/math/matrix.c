@@ -1,6 +1,9 @@
 // Simple functions to enhance functionality
 // When finished, use malloc rather than calloc
+#include <string.h>
 #include "matrix.h"
+#include "gemm.h"
+#include "kernels.h"
 
 vector* init_vec(size_t s) {
 	vector* vec;
@@ -37,6 +40,7 @@ matrix* init_mat(size_t nrows, size_t ncols) {
 
 	mat->number_of_rows = nrows;
 	mat->number_of_cols = ncols;
+	mat->leading_dimension = ncols;
 	
 	#ifdef ML_LIB_DEBUG_MODE
 	mat->m = (number *)calloc(nrows * ncols, sizeof(number));
@@ -52,6 +56,57 @@ void del_mat(matrix* mat) {
 	free(mat);
 }
 
+size_t vec_footprint(size_t size) {
+	return ARENA_ROUND_UP(sizeof(vector)) + ARENA_ROUND_UP(size * sizeof(number));
+}
+
+size_t mat_footprint(size_t nrows, size_t ncols) {
+	return ARENA_ROUND_UP(sizeof(matrix)) + ARENA_ROUND_UP(nrows * ncols * sizeof(number));
+}
+
+vector* init_vec_in(arena* memory, size_t s) {
+	// one allocation holds the header followed by the data, so the two share a slab and usually a page
+	char* block = (char *)arena_alloc(memory, vec_footprint(s));
+	vector* vec = (vector *)block;
+
+	vec->size = s;
+	vec->v = (number *)(block + ARENA_ROUND_UP(sizeof(vector)));
+
+	return vec;
+}
+
+matrix* init_mat_in(arena* memory, size_t nrows, size_t ncols) {
+	char* block = (char *)arena_alloc(memory, mat_footprint(nrows, ncols));
+	matrix* mat = (matrix *)block;
+
+	mat->number_of_rows = nrows;
+	mat->number_of_cols = ncols;
+	mat->leading_dimension = ncols;
+	mat->m = (number *)(block + ARENA_ROUND_UP(sizeof(matrix)));
+
+	return mat;
+}
+
+void init_mat_view(matrix* view, matrix* in, size_t first_row, size_t first_col, size_t nrows, size_t ncols) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if ((first_row + nrows > in->number_of_rows) || (first_col + ncols > in->number_of_cols)) {
+		fprintf(stderr, "ERROR IN MATRIX VIEW: The view does not fit inside the matrix.\n");
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	view->m = in->m + first_row * in->leading_dimension + first_col;
+	view->number_of_rows = nrows;
+	view->number_of_cols = ncols;
+	view->leading_dimension = in->leading_dimension;
+}
+
+matrix* init_mat_view_in(arena* memory, matrix* in, size_t first_row, size_t first_col, size_t nrows, size_t ncols) {
+	matrix* view = (matrix *)arena_alloc(memory, sizeof(matrix));
+	init_mat_view(view, in, first_row, first_col, nrows, ncols);
+	return view;
+}
+
 /* *** General vector, matrix operations *** */
 
 
@@ -67,9 +122,7 @@ void vector_add(vector* out, vector* a, vector* b) {
 		// however, unsure of the situation when dealing with cuda
 	}
 	#endif
-	for (int i = 0; i < a->size; i++) {
-		out->v[i] = a->v[i] + b->v[i];
-	}
+	parallel_binary_kernel(kernels->add, out->v, a->v, b->v, a->size);
 }
 
 /**
@@ -84,12 +137,7 @@ void matrix_add(matrix* out, matrix* a, matrix* b) {
 	}
 	#endif
 
-	for (int i = 0; i < a->number_of_rows; i++) {
-		for (int j = 0; j < a->number_of_cols; j++) {
-			VALUE_AT(out, i, j) = VALUE_AT(a, i, j) + VALUE_AT(b, i, j);
-			// out->m[i * ncols + j] = a->m[i * ncols + j] + b->m[i * ncols + j];
-		}
-	}
+	parallel_matrix_binary_kernel(kernels->add, out, a, b);
 }
 
 void vector_sub(vector* out, vector* a, vector* b) {
@@ -101,9 +149,7 @@ void vector_sub(vector* out, vector* a, vector* b) {
 		// however, unsure of the situation when dealing with cuda
 	}
 	#endif
-	for (int i = 0; i < a->size; i++) {
-		out->v[i] = a->v[i] - b->v[i];
-	}
+	parallel_binary_kernel(kernels->sub, out->v, a->v, b->v, a->size);
 }
 
 void matrix_sub(matrix* out, matrix* a, matrix* b) {
@@ -115,12 +161,7 @@ void matrix_sub(matrix* out, matrix* a, matrix* b) {
 	}
 	#endif
 
-	for (int i = 0; i < a->number_of_rows; i++) {
-		for (int j = 0; j < a->number_of_cols; j++) {
-			VALUE_AT(out, i, j) = VALUE_AT(a, i, j) - VALUE_AT(b, i, j);
-			// out->m[i * ncols + j] = a->m[i * ncols + j] - b->m[i * ncols + j];
-		}
-	}
+	parallel_matrix_binary_kernel(kernels->sub, out, a, b);
 }
 
 
@@ -131,9 +172,7 @@ void vector_scale(vector* out, vector* in, number scale) {
 		exit(EXIT_FAILURE);
 	}
 	#endif
-	for (int i = 0; i < in->size; i++) {
-		out->v[i] = scale * in->v[i];
-	}
+	parallel_scalar_kernel(kernels->scale, out->v, in->v, scale, in->size);
 }
 
 void matrix_scale(matrix* out, matrix* in, number scale) {
@@ -144,15 +183,11 @@ void matrix_scale(matrix* out, matrix* in, number scale) {
 	}
 	#endif
 
-	for (int i = 0; i < out->number_of_rows; i++) {
-		for (int j = 0; j < out->number_of_cols; j++) {
-			VALUE_AT(out, i, j) = scale * VALUE_AT(in, i, j);
-		}
-	}
+	parallel_matrix_scalar_kernel(kernels->scale, out, in, scale);
 }
 
 /**
- * Basic matrix multiplication.
+ * Basic matrix multiplication. The work is done by the blocked GEMM engine in gemm.c.
  */
 void matrix_mult(matrix* out, matrix* a, matrix* b) {
 	#ifdef ML_LIB_DEBUG_MODE
@@ -165,17 +200,42 @@ void matrix_mult(matrix* out, matrix* a, matrix* b) {
 	}
 	#endif
 
-	for (int i = 0; i < out->number_of_rows; i++) {
-		for (int j = 0; j < out->number_of_cols; j++) {
-			VALUE_AT(out, i, j) = 0;
-			// out->m[i * n + j] = 0;
-			for (int k = 0; k < a->number_of_cols; k++) {
-				VALUE_AT(out, i, j) += VALUE_AT(a, i, k) * VALUE_AT(b, k, j);
-				// out->m[i * n + j] += a->m[i * p + k] * b->m[k * n + j];
-			}
-		}
+	general_matrix_mult(FALSE, FALSE, out->number_of_rows, out->number_of_cols, a->number_of_cols,
+		1, a->m, a->leading_dimension, b->m, b->leading_dimension, 0, out->m, out->leading_dimension);
+}
+
+/**
+ * Multiply the transpose of a by b without forming the transpose. a is (p, m) and b is (p, n).
+ */
+void matrix_mult_tn(matrix* out, matrix* a, matrix* b) {
+	#ifdef ML_LIB_DEBUG_MODE
+	// transpose(a) is (m, p), so the output is (m, n)
+	if (! (a->number_of_rows == b->number_of_rows && a->number_of_cols == out->number_of_rows
+			&& b->number_of_cols == out->number_of_cols) ) {
+		fprintf(stderr, "ERROR IN TRANSPOSED MATRIX MULTIPLICATION (A^T B): Dimension mismatch\n");
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	general_matrix_mult(TRUE, FALSE, out->number_of_rows, out->number_of_cols, a->number_of_rows,
+		1, a->m, a->leading_dimension, b->m, b->leading_dimension, 0, out->m, out->leading_dimension);
+}
+
+/**
+ * Multiply a by the transpose of b without forming the transpose. a is (m, p) and b is (n, p).
+ */
+void matrix_mult_nt(matrix* out, matrix* a, matrix* b) {
+	#ifdef ML_LIB_DEBUG_MODE
+	// transpose(b) is (p, n), so the output is (m, n)
+	if (! (a->number_of_cols == b->number_of_cols && a->number_of_rows == out->number_of_rows
+			&& b->number_of_rows == out->number_of_cols) ) {
+		fprintf(stderr, "ERROR IN TRANSPOSED MATRIX MULTIPLICATION (A B^T): Dimension mismatch\n");
+		exit(EXIT_FAILURE);
 	}
+	#endif
 
+	general_matrix_mult(FALSE, TRUE, out->number_of_rows, out->number_of_cols, a->number_of_cols,
+		1, a->m, a->leading_dimension, b->m, b->leading_dimension, 0, out->m, out->leading_dimension);
 }
 
 /**
@@ -213,10 +273,9 @@ void add_vector_to_matrix(matrix* out, matrix* mat, vector* vec) {
 	}
 	#endif
 
+	// each row of the matrix gets the same entry of the vector
 	for (int i = 0; i < vec->size; i++) {
-		for (int col = 0; col < mat->number_of_cols; col++) {
-			VALUE_AT(out, i, col) = VALUE_AT(mat, i, col) + vec->v[i];
-		}
+		kernels->add_scalar(out->m + i * out->leading_dimension, mat->m + i * mat->leading_dimension, vec->v[i], mat->number_of_cols);
 	}
 }
 
@@ -235,12 +294,7 @@ void matrix_entrywise_product(matrix* out, matrix* product_one, matrix* product_
 	}
 	#endif
 
-	for (int i = 0; i < out->number_of_rows; i++) {
-		for (int j = 0; j < out->number_of_cols; j++) {
-			VALUE_AT(out, i, j) = VALUE_AT(product_one, i, j) * VALUE_AT(product_two, i, j);
-			// out->m[i * out->number_of_cols + j] = product_one->m[i * out->number_of_cols + j] + product_two->m[i * out->number_of_cols + j];
-		}
-	}
+	parallel_matrix_binary_kernel(kernels->multiply, out, product_one, product_two);
 }
 
 
@@ -266,10 +320,7 @@ void matrix_col_sum(vector* out, matrix* in) {
 	}
 	#endif
 	for (int i = 0; i < out->size; i++) {
-		out->v[i] = 0;
-		for (int j = 0; j < in->number_of_cols; j++) {
-			out->v[i] += VALUE_AT(in, i, j);
-		}
+		out->v[i] = kernels->sum(in->m + i * in->leading_dimension, in->number_of_cols);
 	}
 }
 
@@ -285,9 +336,11 @@ void copy_matrix(matrix* out, matrix* in) {
 	}
 	#endif
 
-	for (int i = 0; i < out->number_of_rows; i++) {
-		for (int j = 0; j < out->number_of_cols; j++) {
-			VALUE_AT(out, i, j) = VALUE_AT(in, i, j);
-		}
+	if (MATRIX_IS_CONTIGUOUS(out) && MATRIX_IS_CONTIGUOUS(in)) {
+		memcpy(out->m, in->m, out->number_of_rows * out->number_of_cols * sizeof(number));
+		return;
+	}
+	for (size_t i = 0; i < out->number_of_rows; i++) {
+		memcpy(out->m + i * out->leading_dimension, in->m + i * in->leading_dimension, out->number_of_cols * sizeof(number));
 	}
 }
@@ -1,11 +1,25 @@
 #include "../mllib.h"
+#include "arena.h"
 
 
 #ifndef MLLIB_MATRIX_H
 #define MLLIB_MATRIX_H
 
-// define a data type 'number' to take on float, double, or long double
+/**
+ * Define a data type 'number' to take on float or double, picked when the library is compiled:
+ *   MLLIB_PRECISION_F64   double
+ *   MLLIB_PRECISION_BF16  float arithmetic, with the weights read by pass_forward() kept as bfloat16
+ *   neither               float
+ */
+#if defined(MLLIB_PRECISION_F64)
+typedef double number;
+#else
 typedef float number;
+#endif
+
+#if defined(MLLIB_PRECISION_BF16)
+#define MLLIB_STORAGE_BF16
+#endif
 
 // define the basic vector data structures used for this project
 // since we are not using c++, we need to define vectors and matrices
@@ -19,10 +33,15 @@ struct matrix_ {
 	number* m;
 	size_t number_of_rows;
 	size_t number_of_cols;
+
+	// distance between the starts of two rows, in numbers. Equal to number_of_cols for a matrix that owns its
+	// data; a view onto part of a bigger matrix keeps the stride of the matrix it looks into
+	size_t leading_dimension;
 };
 typedef struct matrix_ matrix;
 
-#define VALUE_AT(mat, i, j) mat->m[i * mat->number_of_cols + j]
+#define VALUE_AT(mat, i, j) mat->m[(i) * mat->leading_dimension + (j)]
+#define MATRIX_IS_CONTIGUOUS(mat) ((mat)->leading_dimension == (mat)->number_of_cols)
 
 // basic data structure functions
 vector* init_vec(size_t size);
@@ -31,6 +50,20 @@ void del_vec(vector* mat);
 matrix* init_mat(size_t nrows, size_t ncols);
 void del_mat(matrix* mat);
 
+// arena-backed versions: header and data are carved contiguously out of the arena, with the data 64-byte aligned.
+// They are released with the arena, never with del_vec/del_mat.
+vector* init_vec_in(arena* memory, size_t size);
+matrix* init_mat_in(arena* memory, size_t nrows, size_t ncols);
+
+// a view of the nrows x ncols block starting at (first_row, first_col) of 'in', written into a header the caller
+// provides. No data is copied; the view is valid while 'in' is
+void init_mat_view(matrix* view, matrix* in, size_t first_row, size_t first_col, size_t nrows, size_t ncols);
+matrix* init_mat_view_in(arena* memory, matrix* in, size_t first_row, size_t first_col, size_t nrows, size_t ncols);
+
+// number of arena bytes the functions above take, for sizing an arena up front
+size_t vec_footprint(size_t size);
+size_t mat_footprint(size_t nrows, size_t ncols);
+
 // basic math functions required
 void vector_add(vector* out, vector* a, vector* b);
 void matrix_add(matrix* out, matrix* a, matrix* b);
@@ -41,6 +74,8 @@ void vector_scale(vector* out, vector* in, number scale);
 void matrix_scale(matrix* out, matrix* in, number scale);
 
 void matrix_mult(matrix* out, matrix* a, matrix* b);
+void matrix_mult_tn(matrix* out, matrix* a, matrix* b);	// out = transpose(a) * b
+void matrix_mult_nt(matrix* out, matrix* a, matrix* b);	// out = a * transpose(b)
 void matrix_vector_mult(vector* out, matrix* a, vector* b);
 void add_vector_to_matrix(matrix* out, matrix* mat, vector* vec);
 void matrix_entrywise_product(matrix* out, matrix* product_one, matrix* product_two);
@@ -1,4 +1,8 @@
 #include "batch.h"
+#include "thread_pool.h"
+
+// side of the square tiles the transposing gathers work through
+#define GATHER_TILE 32
 
 
 /**
@@ -15,12 +19,36 @@ batch* create_empty_batch(size_t number_of_vectors, size_t vec_size) {
 	
 	empty_batch->vector_size = vec_size;
 	empty_batch->number_of_vectors = number_of_vectors;
+	empty_batch->capacity = number_of_vectors;
 	
 	empty_batch->data = init_mat(vec_size, number_of_vectors);
 
 	return empty_batch;
 }
 
+batch* create_empty_batch_in(arena* memory, size_t number_of_vectors, size_t vec_size) {
+	batch* empty_batch = (batch *)arena_alloc(memory, sizeof(batch));
+
+	empty_batch->vector_size = vec_size;
+	empty_batch->number_of_vectors = number_of_vectors;
+	empty_batch->capacity = number_of_vectors;
+
+	empty_batch->data = init_mat_in(memory, vec_size, number_of_vectors);
+
+	return empty_batch;
+}
+
+batch* create_batch_view_in(arena* memory, matrix* dataset, size_t first_vector, size_t number_of_vectors) {
+	batch* view = (batch *)arena_alloc(memory, sizeof(batch));
+
+	view->vector_size = dataset->number_of_rows;
+	view->number_of_vectors = number_of_vectors;
+	view->capacity = number_of_vectors;	// not the dataset's width: past this are the next batch's samples
+	view->data = init_mat_view_in(memory, dataset, 0, first_vector, dataset->number_of_rows, number_of_vectors);
+
+	return view;
+}
+
 /**
  * This function deletes the batch structure. The contents are not freed however.
  */
@@ -29,6 +57,29 @@ void delete_batch(batch* batch_to_delete) {
 	free(batch_to_delete);
 }
 
+/**
+ * Write the samples as the columns of out. Samples are rows in memory and batches store them as columns, so one
+ * side of the copy is always strided; going through square tiles keeps both the rows read and the rows written
+ * in cache while a tile is in flight.
+ */
+static void gather_into_columns(matrix* out, vector** samples) {
+	size_t vector_size = out->number_of_rows;
+	size_t number_of_samples = out->number_of_cols;
+
+	for (size_t k0 = 0; k0 < number_of_samples; k0 += GATHER_TILE) {
+		size_t k_end = (k0 + GATHER_TILE < number_of_samples) ? k0 + GATHER_TILE : number_of_samples;
+		for (size_t j0 = 0; j0 < vector_size; j0 += GATHER_TILE) {
+			size_t j_end = (j0 + GATHER_TILE < vector_size) ? j0 + GATHER_TILE : vector_size;
+			for (size_t k = k0; k < k_end; k++) {
+				const number* sample = samples[k]->v;
+				for (size_t j = j0; j < j_end; j++) {
+					VALUE_AT(out, j, k) = sample[j];
+				}
+			}
+		}
+	}
+}
+
 void load_data_into_batch(batch* empty_batch, vector** huge_number_of_data, size_t number_of_data) {
 	size_t vector_size = huge_number_of_data[0]->size;
 
@@ -51,14 +102,72 @@ void load_data_into_batch(batch* empty_batch, vector** huge_number_of_data, size
 	}
 	#endif
 
-	for (int data_idx = 0; data_idx < number_of_data; data_idx++) {
-		for (int entry = 0; entry < vector_size; entry++) {
-			empty_batch->data->m[entry * number_of_data + data_idx] = huge_number_of_data[data_idx]->v[entry];
-		}
+	gather_into_columns(empty_batch->data, huge_number_of_data);
+}
+
+
+void resize_batch(batch* batch_to_resize, size_t number_of_vectors) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if (number_of_vectors > batch_to_resize->capacity) {
+		fprintf(stderr, "ERROR IN RESIZE BATCH: %zu vectors do not fit a batch with room for %zu\n", number_of_vectors, batch_to_resize->capacity);
+		exit(EXIT_FAILURE);
 	}
+	#endif
+
+	batch_to_resize->number_of_vectors = number_of_vectors;
+	batch_to_resize->data->number_of_cols = number_of_vectors;
 }
 
 
+struct load_batches_job_ {
+	m_batch* many_batches;
+	vector** huge_number_of_data;
+	size_t batch_size;
+};
+typedef struct load_batches_job_ load_batches_job;
+
+static void load_batch_task(void* context, size_t batch_index) {
+	load_batches_job* job = (load_batches_job *)context;
+	batch* current = job->many_batches->ray_of_batches[batch_index];
+
+	gather_into_columns(current->data, job->huge_number_of_data + batch_index * job->batch_size);
+}
+
+/**
+ * Empty batches of batch_size vectors each, and a shorter last one if needed, all allocated from one arena
+ */
+m_batch* create_empty_batches(size_t number_of_data, size_t batch_size, size_t vector_size) {
+	m_batch* many_batches;
+	#ifdef ML_LIB_DEBUG_MODE
+	many_batches = (m_batch *)calloc(1, sizeof(m_batch));
+	#else
+	many_batches = (m_batch *)malloc(sizeof(m_batch));
+	#endif
+
+	size_t number_of_full_batches = number_of_data / batch_size;
+	size_t tail_size = number_of_data % batch_size;
+	size_t number_of_batches = number_of_full_batches + (tail_size > 0);
+	many_batches->number_of_batches = number_of_batches;
+	many_batches->total_number_of_vectors = number_of_data;
+	many_batches->vector_size = vector_size;
+
+	// all of the batches come out of one arena rather than three allocations each
+	size_t arena_size = ARENA_ROUND_UP(number_of_batches * sizeof(batch *))
+		+ number_of_full_batches * (ARENA_ROUND_UP(sizeof(batch)) + mat_footprint(vector_size, batch_size));
+	if (tail_size > 0) {
+		arena_size += ARENA_ROUND_UP(sizeof(batch)) + mat_footprint(vector_size, tail_size);
+	}
+	many_batches->memory = init_arena(arena_size);
+
+	many_batches->ray_of_batches = (batch **)arena_alloc(many_batches->memory, number_of_batches * sizeof(batch *));
+	for (int i = 0; i < number_of_batches; i++) {
+		size_t size = (i < number_of_full_batches) ? batch_size : tail_size;
+		many_batches->ray_of_batches[i] = create_empty_batch_in(many_batches->memory, size, vector_size);
+	}
+
+	return many_batches;
+}
+
 m_batch* load_data_into_batches(vector** huge_number_of_data, size_t number_of_data, size_t batch_size) {
 	#ifdef ML_LIB_DEBUG_MODE
 	for (int i = 0; i < number_of_data; i++) {
@@ -69,6 +178,17 @@ m_batch* load_data_into_batches(vector** huge_number_of_data, size_t number_of_d
 	}
 	#endif
 
+	m_batch* many_batches = create_empty_batches(number_of_data, batch_size, huge_number_of_data[0]->size);	// should be same across all values
+
+	// the batches are disjoint, so they can be filled in parallel
+	load_batches_job job = { .many_batches = many_batches, .huge_number_of_data = huge_number_of_data, .batch_size = batch_size };
+	parallel_for(many_batches->number_of_batches, load_batch_task, &job);
+	
+	return many_batches;
+}
+
+
+m_batch* slice_into_batches(matrix* dataset, size_t batch_size) {
 	m_batch* many_batches;
 	#ifdef ML_LIB_DEBUG_MODE
 	many_batches = (m_batch *)calloc(1, sizeof(m_batch));
@@ -76,37 +196,123 @@ m_batch* load_data_into_batches(vector** huge_number_of_data, size_t number_of_d
 	many_batches = (m_batch *)malloc(sizeof(m_batch));
 	#endif
 
-	size_t number_of_batches = number_of_data / batch_size;
+	size_t number_of_vectors = dataset->number_of_cols;
+	size_t number_of_batches = (number_of_vectors + batch_size - 1) / batch_size;
 	many_batches->number_of_batches = number_of_batches;
-	many_batches->total_number_of_vectors = number_of_data;
-	
-	many_batches->vector_size = huge_number_of_data[0]->size; // should be same across all values
+	many_batches->total_number_of_vectors = number_of_vectors;
+	many_batches->vector_size = dataset->number_of_rows;
 
-	#ifdef ML_LIB_DEBUG_MODE
-	many_batches->ray_of_batches = (batch **)calloc(number_of_batches, sizeof(batch *));
-	#else
-	many_batches->ray_of_batches = (batch **)malloc(number_of_batches * sizeof(batch *));
-	#endif
+	// only the headers are allocated; the data stays where it is
+	size_t arena_size = ARENA_ROUND_UP(number_of_batches * sizeof(batch *))
+		+ number_of_batches * (ARENA_ROUND_UP(sizeof(batch)) + ARENA_ROUND_UP(sizeof(matrix)));
+	many_batches->memory = init_arena(arena_size);
 
+	many_batches->ray_of_batches = (batch **)arena_alloc(many_batches->memory, number_of_batches * sizeof(batch *));
 	for (int i = 0; i < number_of_batches; i++) {
-		many_batches->ray_of_batches[i] = create_empty_batch(batch_size, many_batches->vector_size);
+		size_t first_vector = i * batch_size;
+		size_t size = (number_of_vectors - first_vector < batch_size) ? number_of_vectors - first_vector : batch_size;
+		many_batches->ray_of_batches[i] = create_batch_view_in(many_batches->memory, dataset, first_vector, size);
+	}
+
+	return many_batches;
+}
 
-		for (int j = 0; j < many_batches->vector_size; j++) {
-			for (int k = 0; k < batch_size; k++) {
-				VALUE_AT(many_batches->ray_of_batches[i]->data, j, k) = huge_number_of_data[i * batch_size + k]->v[j];
+
+/**
+ * splitmix64, which is small, fast and good enough to shuffle with; rand() is left alone for the callers that
+ * seed it
+ */
+static unsigned long long next_random(unsigned long long* state) {
+	unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+void random_permutation(size_t* indices, size_t n, unsigned long long* state) {
+	for (size_t i = 0; i < n; i++) {
+		indices[i] = i;
+	}
+	// Fisher-Yates
+	for (size_t i = n; i > 1; i--) {
+		size_t j = next_random(state) % i;
+		size_t swap = indices[i - 1];
+		indices[i - 1] = indices[j];
+		indices[j] = swap;
+	}
+}
+
+
+// below this many entries a gather stays on the calling thread
+#define GATHER_PARALLEL_MIN 65536
+
+struct gather_job_ {
+	matrix* out;
+	const matrix* dataset;
+	const size_t* indices;
+	size_t rows_per_task;
+};
+typedef struct gather_job_ gather_job;
+
+/**
+ * Rows [begin, end) of an indexed gather. The indices are taken a tile at a time and reused across every row,
+ * so each output row is written front to back and the tile of indices stays in L1.
+ */
+static void gather_rows(const gather_job* job, size_t begin, size_t end) {
+	size_t number_of_vectors = job->out->number_of_cols;
+	for (size_t k0 = 0; k0 < number_of_vectors; k0 += GATHER_TILE) {
+		size_t k_end = (k0 + GATHER_TILE < number_of_vectors) ? k0 + GATHER_TILE : number_of_vectors;
+		for (size_t j = begin; j < end; j++) {
+			number* out_row = &VALUE_AT(job->out, j, 0);
+			const number* dataset_row = &VALUE_AT(job->dataset, j, 0);
+			for (size_t k = k0; k < k_end; k++) {
+				out_row[k] = dataset_row[job->indices[k]];
 			}
 		}
 	}
-	
-	return many_batches;
+}
+
+static void gather_task(void* context, size_t task_index) {
+	gather_job* job = (gather_job *)context;
+	size_t begin = task_index * job->rows_per_task;
+	size_t end = (begin + job->rows_per_task < job->out->number_of_rows) ? begin + job->rows_per_task : job->out->number_of_rows;
+	gather_rows(job, begin, end);
+}
+
+void gather_indexed_columns(matrix* out, const matrix* dataset, const size_t* indices) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if (out->number_of_rows != dataset->number_of_rows) {
+		fprintf(stderr, "ERROR IN GATHER INDEXED COLUMNS: The output and the dataset have different column lengths.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t k = 0; k < out->number_of_cols; k++) {
+		if (indices[k] >= dataset->number_of_cols) {
+			fprintf(stderr, "ERROR IN GATHER INDEXED COLUMNS: Index %zu is past the %zu columns of the dataset.\n", indices[k], dataset->number_of_cols);
+			exit(EXIT_FAILURE);
+		}
+	}
+	#endif
+
+	gather_job job = { .out = out, .dataset = dataset, .indices = indices, .rows_per_task = out->number_of_rows };
+	size_t number_of_threads = get_number_of_threads();
+	if (number_of_threads == 1 || out->number_of_rows * out->number_of_cols < GATHER_PARALLEL_MIN) {
+		gather_rows(&job, 0, out->number_of_rows);
+		return;
+	}
+	job.rows_per_task = (out->number_of_rows + number_of_threads - 1) / number_of_threads;
+	parallel_for((out->number_of_rows + job.rows_per_task - 1) / job.rows_per_task, gather_task, &job);
 }
 
 
 void delete_batches(m_batch* many_batches) {
-	for (int i = 0; i < many_batches->number_of_batches; i++) {
-		delete_batch(many_batches->ray_of_batches[i]);
+	if (many_batches->memory != NULL) {
+		del_arena(many_batches->memory);
+	} else {
+		for (int i = 0; i < many_batches->number_of_batches; i++) {
+			delete_batch(many_batches->ray_of_batches[i]);
+		}
+		free(many_batches->ray_of_batches);
 	}
-	free(many_batches->ray_of_batches);
 	free(many_batches);
 }
 
@@ -8,6 +8,7 @@ struct batch_ {
 	matrix* data;
 	size_t number_of_vectors;
 	size_t vector_size; // vector_size == data[i]->size for all i
+	size_t capacity;	// the number of vectors it was created with, which resize_batch() may not go past
 };
 typedef struct batch_ batch;
 
@@ -16,6 +17,9 @@ struct m_batch_ {
 	size_t number_of_batches;
 	size_t total_number_of_vectors;
 	size_t vector_size;
+
+	// the batches, their matrices and ray_of_batches itself are allocated from here
+	arena* memory;
 };
 typedef struct m_batch_ m_batch;
 
@@ -23,15 +27,45 @@ typedef struct m_batch_ m_batch;
  * Batch initialization, deletion, and loading
  */
 batch* create_empty_batch(size_t number_of_vectors, size_t vec_size);
+batch* create_empty_batch_in(arena* memory, size_t number_of_vectors, size_t vec_size);	// released with the arena
 void delete_batch(batch* batch_to_delete);
+
+/**
+ * A batch that owns nothing: its data is a view of columns [first_vector, first_vector + number_of_vectors) of
+ * a dataset matrix holding one sample per column. It is released with the arena and must not outlive the dataset.
+ */
+batch* create_batch_view_in(arena* memory, matrix* dataset, size_t first_vector, size_t number_of_vectors);
 void load_data_into_batch(batch* empty_batch, vector** huge_number_of_data, size_t number_of_data);
 
 /**
- * Initialize many batches from one huge input
+ * Change how many vectors a batch holds without touching its memory, up to the number it was created with.
+ * The columns keep their stride, so a batch can be shrunk for a short last batch and grown back afterwards.
+ */
+void resize_batch(batch* batch_to_resize, size_t number_of_vectors);
+
+/**
+ * Initialize many batches from one huge input. number_of_data vectors make full batches of batch_size plus, when
+ * it does not divide evenly, one shorter batch at the end holding the rest, so no vector is left out.
  */
+m_batch* create_empty_batches(size_t number_of_data, size_t batch_size, size_t vector_size);
 m_batch* load_data_into_batches(vector** huge_number_of_data, size_t number_of_data, size_t batch_size);
 void delete_batches(m_batch* many_batches);
 
+/**
+ * Cut a dataset matrix (one sample per column) into batches of consecutive columns without copying it. Only the
+ * headers are allocated; the batches are views that stay valid while the dataset does, and delete_batches()
+ * leaves the dataset alone. As with load_data_into_batches, the last batch holds whatever is left over.
+ */
+m_batch* slice_into_batches(matrix* dataset, size_t batch_size);
+
+/**
+ * Shuffling. random_permutation() writes a uniformly random permutation of 0 .. n - 1 to indices, drawn from
+ * and advancing *state, so the same seed always gives the same sequence of permutations.
+ * gather_indexed_columns() sets column k of out to column indices[k] of the dataset, for every column of out.
+ */
+void random_permutation(size_t* indices, size_t n, unsigned long long* state);
+void gather_indexed_columns(matrix* out, const matrix* dataset, const size_t* indices);
+
 /**
  * Batch operations
  */
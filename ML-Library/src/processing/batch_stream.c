@@ -0,0 +1,285 @@
+// Ring of batches filled by a background thread
+#include "batch_stream.h"
+
+static void* producer_loop(void* argument) {
+	batch_stream* stream = (batch_stream *)argument;
+
+	pthread_mutex_lock(&stream->lock);
+	while (TRUE) {
+		// every slot is either ready or held by the consumer
+		while (stream->number_ready + stream->holding == stream->depth && !stream->stopping) {
+			pthread_cond_wait(&stream->slot_freed, &stream->lock);
+		}
+		if (stream->stopping) {
+			break;
+		}
+		size_t slot = stream->produce_index;
+		pthread_mutex_unlock(&stream->lock);
+
+		boolean produced = stream->producer(stream->context, stream->inputs[slot], stream->outputs[slot]);
+
+		pthread_mutex_lock(&stream->lock);
+		if (!produced) {
+			stream->finished = TRUE;
+			pthread_cond_signal(&stream->slot_filled);
+			break;
+		}
+		stream->produce_index = (slot + 1) % stream->depth;
+		stream->number_ready++;
+		pthread_cond_signal(&stream->slot_filled);
+	}
+	pthread_mutex_unlock(&stream->lock);
+
+	return NULL;
+}
+
+batch_stream* open_batch_stream(size_t input_size, size_t output_size, size_t batch_size, size_t depth,
+		batch_producer producer, void* context) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if (depth < 2) {
+		fprintf(stderr, "ERROR IN OPEN BATCH STREAM: A depth of %zu leaves nothing to prefetch into\n", depth);
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	batch_stream* stream;
+	#ifdef ML_LIB_DEBUG_MODE
+	stream = (batch_stream *)calloc(1, sizeof(batch_stream));
+	#else
+	stream = (batch_stream *)malloc(sizeof(batch_stream));
+	#endif
+
+	stream->batch_size = batch_size;
+	stream->input_size = input_size;
+	stream->output_size = output_size;
+	stream->producer = producer;
+	stream->context = context;
+	stream->owns_context = FALSE;
+
+	size_t arena_size = 2 * ARENA_ROUND_UP(depth * sizeof(batch *))
+		+ depth * (2 * ARENA_ROUND_UP(sizeof(batch)) + mat_footprint(input_size, batch_size) + mat_footprint(output_size, batch_size));
+	stream->memory = init_arena(arena_size);
+
+	stream->depth = depth;
+	stream->inputs = (batch **)arena_alloc(stream->memory, depth * sizeof(batch *));
+	stream->outputs = (batch **)arena_alloc(stream->memory, depth * sizeof(batch *));
+	for (size_t i = 0; i < depth; i++) {
+		stream->inputs[i] = create_empty_batch_in(stream->memory, batch_size, input_size);
+		stream->outputs[i] = create_empty_batch_in(stream->memory, batch_size, output_size);
+	}
+
+	stream->produce_index = 0;
+	stream->consume_index = 0;
+	stream->number_ready = 0;
+	stream->holding = FALSE;
+	stream->finished = FALSE;
+	stream->stopping = FALSE;
+
+	pthread_mutex_init(&stream->lock, NULL);
+	pthread_cond_init(&stream->slot_filled, NULL);
+	pthread_cond_init(&stream->slot_freed, NULL);
+	pthread_create(&stream->thread, NULL, producer_loop, stream);
+
+	return stream;
+}
+
+boolean next_batch(batch_stream* stream, batch** inputs, batch** outputs) {
+	pthread_mutex_lock(&stream->lock);
+
+	// the slot handed out last time goes back to the producer
+	if (stream->holding) {
+		stream->holding = FALSE;
+		stream->consume_index = (stream->consume_index + 1) % stream->depth;
+		pthread_cond_signal(&stream->slot_freed);
+	}
+
+	while (stream->number_ready == 0 && !stream->finished) {
+		pthread_cond_wait(&stream->slot_filled, &stream->lock);
+	}
+	if (stream->number_ready == 0) {
+		pthread_mutex_unlock(&stream->lock);
+		return FALSE;
+	}
+
+	stream->number_ready--;
+	stream->holding = TRUE;
+	*inputs = stream->inputs[stream->consume_index];
+	*outputs = stream->outputs[stream->consume_index];
+
+	pthread_mutex_unlock(&stream->lock);
+	return TRUE;
+}
+
+void close_batch_stream(batch_stream* stream) {
+	pthread_mutex_lock(&stream->lock);
+	stream->stopping = TRUE;
+	pthread_cond_signal(&stream->slot_freed);
+	pthread_mutex_unlock(&stream->lock);
+
+	pthread_join(stream->thread, NULL);
+
+	pthread_mutex_destroy(&stream->lock);
+	pthread_cond_destroy(&stream->slot_filled);
+	pthread_cond_destroy(&stream->slot_freed);
+
+	if (stream->owns_context) {
+		free(stream->context);
+	}
+	del_arena(stream->memory);
+	free(stream);
+}
+
+
+
+/**
+ * Position of an IDX stream in its files
+ */
+struct idx_cursor_ {
+	const idx_file* images;
+	const idx_file* labels;
+	number scale;
+	size_t batch_size;
+	size_t next_item;
+	size_t epoch;
+	size_t number_of_epochs;
+};
+typedef struct idx_cursor_ idx_cursor;
+
+static boolean produce_from_idx(void* context, batch* inputs, batch* outputs) {
+	idx_cursor* cursor = (idx_cursor *)context;
+
+	if (cursor->next_item == cursor->images->number_of_items) {
+		cursor->next_item = 0;
+		cursor->epoch++;
+	}
+	if (cursor->epoch >= cursor->number_of_epochs) {
+		return FALSE;
+	}
+
+	// the last batch of an epoch takes what is left, in the same buffers
+	size_t remaining = cursor->images->number_of_items - cursor->next_item;
+	size_t number_of_vectors = (remaining < cursor->batch_size) ? remaining : cursor->batch_size;
+	resize_batch(inputs, number_of_vectors);
+	resize_batch(outputs, number_of_vectors);
+
+	load_idx_images_into_batch(inputs, cursor->images, cursor->next_item, cursor->scale);
+	load_idx_labels_into_batch(outputs, cursor->labels, cursor->next_item);
+	cursor->next_item += inputs->number_of_vectors;
+
+	return TRUE;
+}
+
+batch_stream* open_idx_batch_stream(const idx_file* images, const idx_file* labels, size_t number_of_classes,
+		size_t batch_size, number scale, size_t number_of_epochs, size_t depth) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if (images->number_of_items != labels->number_of_items) {
+		fprintf(stderr, "ERROR IN OPEN IDX BATCH STREAM: %zu images but %zu labels\n", images->number_of_items, labels->number_of_items);
+		exit(EXIT_FAILURE);
+	}
+	if (batch_size > images->number_of_items) {
+		fprintf(stderr, "ERROR IN OPEN IDX BATCH STREAM: A batch is bigger than the whole file\n");
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	idx_cursor* cursor;
+	#ifdef ML_LIB_DEBUG_MODE
+	cursor = (idx_cursor *)calloc(1, sizeof(idx_cursor));
+	#else
+	cursor = (idx_cursor *)malloc(sizeof(idx_cursor));
+	#endif
+	cursor->images = images;
+	cursor->labels = labels;
+	cursor->scale = scale;
+	cursor->batch_size = batch_size;
+	cursor->next_item = 0;
+	cursor->epoch = 0;
+	cursor->number_of_epochs = number_of_epochs;
+
+	batch_stream* stream = open_batch_stream(images->item_size, number_of_classes, batch_size, depth, produce_from_idx, cursor);
+	stream->owns_context = TRUE;
+	return stream;
+}
+
+
+
+/**
+ * Position of a shuffled stream in the current epoch. The permutation is stored right after the cursor.
+ */
+struct shuffle_cursor_ {
+	matrix* inputs;
+	matrix* outputs;
+	size_t* permutation;
+	size_t batch_size;
+	size_t number_of_batches;
+	size_t next_batch_index;
+	size_t epoch;
+	size_t number_of_epochs;
+	unsigned long long random_state;
+};
+typedef struct shuffle_cursor_ shuffle_cursor;
+
+static boolean produce_shuffled(void* context, batch* inputs, batch* outputs) {
+	shuffle_cursor* cursor = (shuffle_cursor *)context;
+
+	if (cursor->next_batch_index == cursor->number_of_batches) {
+		cursor->next_batch_index = 0;
+		cursor->epoch++;
+		if (cursor->epoch < cursor->number_of_epochs) {
+			random_permutation(cursor->permutation, cursor->inputs->number_of_cols, &cursor->random_state);
+		}
+	}
+	if (cursor->epoch >= cursor->number_of_epochs) {
+		return FALSE;
+	}
+
+	// the last batch of an epoch takes what is left, in the same buffers
+	size_t first_sample = cursor->next_batch_index * cursor->batch_size;
+	size_t remaining = cursor->inputs->number_of_cols - first_sample;
+	size_t number_of_vectors = (remaining < cursor->batch_size) ? remaining : cursor->batch_size;
+	resize_batch(inputs, number_of_vectors);
+	resize_batch(outputs, number_of_vectors);
+
+	const size_t* indices = cursor->permutation + first_sample;
+	gather_indexed_columns(inputs->data, cursor->inputs, indices);
+	gather_indexed_columns(outputs->data, cursor->outputs, indices);
+	cursor->next_batch_index++;
+
+	return TRUE;
+}
+
+batch_stream* open_shuffled_batch_stream(matrix* inputs, matrix* outputs, size_t batch_size, size_t number_of_epochs,
+		unsigned long long seed, size_t depth) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if (inputs->number_of_cols != outputs->number_of_cols) {
+		fprintf(stderr, "ERROR IN OPEN SHUFFLED BATCH STREAM: %zu inputs but %zu outputs\n", inputs->number_of_cols, outputs->number_of_cols);
+		exit(EXIT_FAILURE);
+	}
+	if (batch_size > inputs->number_of_cols) {
+		fprintf(stderr, "ERROR IN OPEN SHUFFLED BATCH STREAM: A batch is bigger than the whole dataset\n");
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	size_t number_of_samples = inputs->number_of_cols;
+	shuffle_cursor* cursor;
+	#ifdef ML_LIB_DEBUG_MODE
+	cursor = (shuffle_cursor *)calloc(1, sizeof(shuffle_cursor) + number_of_samples * sizeof(size_t));
+	#else
+	cursor = (shuffle_cursor *)malloc(sizeof(shuffle_cursor) + number_of_samples * sizeof(size_t));
+	#endif
+	cursor->inputs = inputs;
+	cursor->outputs = outputs;
+	cursor->permutation = (size_t *)(cursor + 1);
+	cursor->batch_size = batch_size;
+	cursor->number_of_batches = (number_of_samples + batch_size - 1) / batch_size;
+	cursor->next_batch_index = 0;
+	cursor->epoch = 0;
+	cursor->number_of_epochs = number_of_epochs;
+	cursor->random_state = seed;
+	random_permutation(cursor->permutation, number_of_samples, &cursor->random_state);
+
+	batch_stream* stream = open_batch_stream(inputs->number_of_rows, outputs->number_of_rows, batch_size, depth, produce_shuffled, cursor);
+	stream->owns_context = TRUE;
+	return stream;
+}
@@ -0,0 +1,83 @@
+#include "../mllib.h"
+#include "batch.h"
+#include "idx.h"
+#include <pthread.h>
+
+#ifndef MLLIB_BATCH_STREAM_H
+#define MLLIB_BATCH_STREAM_H
+
+/**
+ * Fills one pair of input and output batches with the next step of data. Returns FALSE, leaving the batches
+ * alone, once there is nothing left. Called on the stream's background thread, one call at a time.
+ */
+typedef boolean (*batch_producer)(void* context, batch* inputs, batch* outputs);
+
+/**
+ * A pull-based source of batches for data that is too big, or too slow, to hold as an m_batch. A background
+ * thread runs the producer into a ring of 'depth' preallocated batch pairs while the consumer works on an
+ * earlier one, so reading and decoding overlap with training. Nothing is allocated after open_batch_stream().
+ * A producer may hand over fewer than batch_size vectors by shrinking the batches with resize_batch().
+ */
+struct batch_stream_ {
+	size_t batch_size;
+	size_t input_size;
+	size_t output_size;
+
+	batch_producer producer;
+	void* context;
+	boolean owns_context;	// freed on close, for streams that made their own
+
+	// the ring; the consumer holds at most one slot at a time, from next_batch() until the following call
+	size_t depth;
+	batch** inputs;
+	batch** outputs;
+	size_t produce_index;
+	size_t consume_index;
+	size_t number_ready;
+	boolean holding;
+	boolean finished;
+	boolean stopping;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t slot_filled;
+	pthread_cond_t slot_freed;
+
+	arena* memory;
+};
+typedef struct batch_stream_ batch_stream;
+
+/**
+ * Start a stream of batches of batch_size vectors. depth is the number of batch pairs in flight, at least 2;
+ * 3 lets the producer stay a full batch ahead while the consumer is between two steps.
+ */
+batch_stream* open_batch_stream(size_t input_size, size_t output_size, size_t batch_size, size_t depth,
+	batch_producer producer, void* context);
+
+/**
+ * Stream MNIST-style data from mapped IDX files for number_of_epochs passes. The last batch of each epoch holds the items
+ * left over, and may be shorter than the rest.
+ * The files must stay open until the stream is closed.
+ */
+batch_stream* open_idx_batch_stream(const idx_file* images, const idx_file* labels, size_t number_of_classes,
+	size_t batch_size, number scale, size_t number_of_epochs, size_t depth);
+
+/**
+ * Stream a dataset held as two matrices with one sample per column, reshuffled every epoch. Each epoch draws a
+ * new permutation of the samples from 'seed' and gathers every batch from it into the stream's own buffers, so
+ * nothing is reallocated between epochs and the same seed replays the same order. The last batch of an epoch
+ * holds the samples left over, and may be shorter than the rest. The matrices must outlive the stream.
+ */
+batch_stream* open_shuffled_batch_stream(matrix* inputs, matrix* outputs, size_t batch_size, size_t number_of_epochs,
+	unsigned long long seed, size_t depth);
+
+/**
+ * Hand out the next pair of batches, blocking until the producer has one ready. The batches stay valid until the
+ * next call to next_batch() or close_batch_stream(). Returns FALSE at the end of the stream.
+ */
+boolean next_batch(batch_stream* stream, batch** inputs, batch** outputs);
+
+// Stops the background thread, even in the middle of the stream, and frees everything
+void close_batch_stream(batch_stream* stream);
+
+#endif
@@ -0,0 +1,228 @@
+// Zero-copy reader for IDX files, the format MNIST is distributed in
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "idx.h"
+#include "thread_pool.h"
+
+#define IDX_TYPE_UNSIGNED_BYTE 0x08
+
+// side of the square tiles images are transposed through
+#define IDX_GATHER_TILE 32
+
+// header sizes are stored big-endian
+static size_t read_big_endian(const unsigned char* bytes) {
+	return ((size_t)bytes[0] << 24) | ((size_t)bytes[1] << 16) | ((size_t)bytes[2] << 8) | (size_t)bytes[3];
+}
+
+idx_file* open_idx(const char* path) {
+	int descriptor = open(path, O_RDONLY);
+	if (descriptor < 0) {
+		fprintf(stderr, "ERROR IN OPEN IDX: Cannot open %s\n", path);
+		return NULL;
+	}
+
+	struct stat status;
+	if (fstat(descriptor, &status) != 0 || status.st_size < 4) {
+		fprintf(stderr, "ERROR IN OPEN IDX: %s is too short to be an IDX file\n", path);
+		close(descriptor);
+		return NULL;
+	}
+
+	size_t mapping_size = (size_t)status.st_size;
+	void* mapping = mmap(NULL, mapping_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+	close(descriptor);	// the mapping keeps the file alive
+	if (mapping == MAP_FAILED) {
+		fprintf(stderr, "ERROR IN OPEN IDX: Cannot map %s\n", path);
+		return NULL;
+	}
+	const unsigned char* bytes = (const unsigned char *)mapping;
+
+	// magic number: two zero bytes, the type code, then the number of dimensions
+	size_t number_of_dimensions = bytes[3];
+	if (bytes[0] != 0 || bytes[1] != 0 || bytes[2] != IDX_TYPE_UNSIGNED_BYTE ||
+		number_of_dimensions < 1 || number_of_dimensions > IDX_MAX_DIMENSIONS ||
+		mapping_size < 4 + 4 * number_of_dimensions) {
+		fprintf(stderr, "ERROR IN OPEN IDX: %s does not have an unsigned byte IDX header\n", path);
+		munmap(mapping, mapping_size);
+		return NULL;
+	}
+
+	// an item is the product of every dimension but the first, which must neither be empty nor wrap
+	size_t item_size = 1;
+	boolean valid = TRUE;
+	for (size_t i = 1; valid && i < number_of_dimensions; i++) {
+		size_t dimension = read_big_endian(bytes + 4 + 4 * i);
+		valid = dimension > 0 && !__builtin_mul_overflow(item_size, dimension, &item_size);
+	}
+	if (!valid) {
+		fprintf(stderr, "ERROR IN OPEN IDX: %s has an item size that is zero or too large\n", path);
+		munmap(mapping, mapping_size);
+		return NULL;
+	}
+
+	size_t header_size = 4 + 4 * number_of_dimensions;
+	if ((mapping_size - header_size) / item_size < read_big_endian(bytes + 4)) {
+		fprintf(stderr, "ERROR IN OPEN IDX: %s is shorter than its header says\n", path);
+		munmap(mapping, mapping_size);
+		return NULL;
+	}
+
+	idx_file* file;
+	#ifdef ML_LIB_DEBUG_MODE
+	file = (idx_file *)calloc(1, sizeof(idx_file));
+	#else
+	file = (idx_file *)malloc(sizeof(idx_file));
+	#endif
+
+	file->number_of_dimensions = number_of_dimensions;
+	for (size_t i = 0; i < number_of_dimensions; i++) {
+		file->dimensions[i] = read_big_endian(bytes + 4 + 4 * i);
+	}
+	file->item_size = item_size;
+	file->number_of_items = file->dimensions[0];
+	file->data = bytes + header_size;
+	file->mapping = mapping;
+	file->mapping_size = mapping_size;
+
+	// the batch builders read each item once, front to back
+	madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+
+	return file;
+}
+
+void close_idx(idx_file* file) {
+	munmap(file->mapping, file->mapping_size);
+	free(file);
+}
+
+const unsigned char* idx_item(const idx_file* file, size_t index) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if (index >= file->number_of_items) {
+		fprintf(stderr, "ERROR IN IDX ITEM: Index %zu is past the %zu items of the file\n", index, file->number_of_items);
+		exit(EXIT_FAILURE);
+	}
+	#endif
+	return file->data + index * file->item_size;
+}
+
+
+
+void load_idx_images_into_batch(batch* empty_batch, const idx_file* images, size_t first_item, number scale) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if (empty_batch->vector_size != images->item_size) {
+		fprintf(stderr, "ERROR IN LOAD IDX IMAGES INTO BATCH: The batch vector size does not match the image size\n");
+		exit(EXIT_FAILURE);
+	}
+	if (first_item + empty_batch->number_of_vectors > images->number_of_items) {
+		fprintf(stderr, "ERROR IN LOAD IDX IMAGES INTO BATCH: The batch runs past the end of the file\n");
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	// images are rows of the file and columns of the batch, so the transposing copy goes through square tiles
+	size_t batch_size = empty_batch->number_of_vectors;
+	size_t vector_size = empty_batch->vector_size;
+	for (size_t k0 = 0; k0 < batch_size; k0 += IDX_GATHER_TILE) {
+		size_t k_end = (k0 + IDX_GATHER_TILE < batch_size) ? k0 + IDX_GATHER_TILE : batch_size;
+		for (size_t j0 = 0; j0 < vector_size; j0 += IDX_GATHER_TILE) {
+			size_t j_end = (j0 + IDX_GATHER_TILE < vector_size) ? j0 + IDX_GATHER_TILE : vector_size;
+			for (size_t k = k0; k < k_end; k++) {
+				const unsigned char* item = images->data + (first_item + k) * images->item_size;
+				for (size_t j = j0; j < j_end; j++) {
+					VALUE_AT(empty_batch->data, j, k) = item[j] * scale;
+				}
+			}
+		}
+	}
+}
+
+void load_idx_labels_into_batch(batch* empty_batch, const idx_file* labels, size_t first_item) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if (labels->item_size != 1) {
+		fprintf(stderr, "ERROR IN LOAD IDX LABELS INTO BATCH: Labels must be single bytes\n");
+		exit(EXIT_FAILURE);
+	}
+	if (first_item + empty_batch->number_of_vectors > labels->number_of_items) {
+		fprintf(stderr, "ERROR IN LOAD IDX LABELS INTO BATCH: The batch runs past the end of the file\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t k = 0; k < empty_batch->number_of_vectors; k++) {
+		if (labels->data[first_item + k] >= empty_batch->vector_size) {
+			fprintf(stderr, "ERROR IN LOAD IDX LABELS INTO BATCH: Label %d of item %zu is not below %zu\n",
+				labels->data[first_item + k], first_item + k, empty_batch->vector_size);
+			exit(EXIT_FAILURE);
+		}
+	}
+	#endif
+
+	// a label sets a single one in a zeroed column; the file is not trusted, so a label past the classes leaves
+	// its column all zero rather than writing outside the batch
+	size_t batch_size = empty_batch->number_of_vectors;
+	for (size_t j = 0; j < empty_batch->vector_size; j++) {
+		memset(&VALUE_AT(empty_batch->data, j, 0), 0, batch_size * sizeof(number));
+	}
+	for (size_t k = 0; k < batch_size; k++) {
+		size_t label = labels->data[first_item + k];
+		if (label < empty_batch->vector_size) {
+			VALUE_AT(empty_batch->data, label, k) = 1;
+		}
+	}
+}
+
+
+
+struct idx_batches_job_ {
+	m_batch* many_batches;
+	const idx_file* file;
+	size_t batch_size;
+	number scale;
+	boolean one_hot;
+};
+typedef struct idx_batches_job_ idx_batches_job;
+
+static void idx_batch_task(void* context, size_t batch_index) {
+	idx_batches_job* job = (idx_batches_job *)context;
+	batch* current = job->many_batches->ray_of_batches[batch_index];
+	size_t first_item = batch_index * job->batch_size;
+
+	if (job->one_hot) {
+		load_idx_labels_into_batch(current, job->file, first_item);
+	} else {
+		load_idx_images_into_batch(current, job->file, first_item, job->scale);
+	}
+}
+
+m_batch* load_idx_images_into_batches(const idx_file* images, size_t number_of_data, size_t batch_size, number scale) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if (number_of_data > images->number_of_items) {
+		fprintf(stderr, "ERROR IN LOAD IDX IMAGES: %zu items requested but the file has %zu\n", number_of_data, images->number_of_items);
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	m_batch* many_batches = create_empty_batches(number_of_data, batch_size, images->item_size);
+
+	idx_batches_job job = { .many_batches = many_batches, .file = images, .batch_size = batch_size, .scale = scale, .one_hot = FALSE };
+	parallel_for(many_batches->number_of_batches, idx_batch_task, &job);
+
+	return many_batches;
+}
+
+m_batch* load_idx_labels_into_batches(const idx_file* labels, size_t number_of_data, size_t batch_size, size_t number_of_classes) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if (number_of_data > labels->number_of_items) {
+		fprintf(stderr, "ERROR IN LOAD IDX LABELS: %zu items requested but the file has %zu\n", number_of_data, labels->number_of_items);
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	m_batch* many_batches = create_empty_batches(number_of_data, batch_size, number_of_classes);
+
+	idx_batches_job job = { .many_batches = many_batches, .file = labels, .batch_size = batch_size, .one_hot = TRUE };
+	parallel_for(many_batches->number_of_batches, idx_batch_task, &job);
+
+	return many_batches;
+}
@@ -0,0 +1,52 @@
+#include "../mllib.h"
+#include "batch.h"
+#include <stddef.h>
+
+#ifndef MLLIB_IDX_H
+#define MLLIB_IDX_H
+
+// IDX files (the MNIST format) with more dimensions than this are rejected
+#define IDX_MAX_DIMENSIONS 4
+
+/**
+ * An IDX file mapped read-only into memory. Only unsigned byte data (type code 0x08) is supported, which is what
+ * MNIST uses. The first dimension counts the items; each item is the product of the remaining dimensions in bytes,
+ * so a train-images file holds 60000 items of 28 * 28 bytes and a labels file 60000 items of one byte.
+ * 'data' points straight into the mapping, so reading an item costs nothing until its page is touched.
+ */
+struct idx_file_ {
+	const unsigned char* data;
+	size_t number_of_items;
+	size_t item_size;
+
+	size_t number_of_dimensions;
+	size_t dimensions[IDX_MAX_DIMENSIONS];
+
+	void* mapping;
+	size_t mapping_size;
+};
+typedef struct idx_file_ idx_file;
+
+/**
+ * Map and validate an IDX file. Returns NULL, after saying why on stderr, if the file cannot be opened or its
+ * header does not describe an unsigned byte IDX file that fits in it, with items of at least one byte.
+ */
+idx_file* open_idx(const char* path);
+void close_idx(idx_file* file);
+
+// The bytes of item 'index'
+const unsigned char* idx_item(const idx_file* file, size_t index);
+
+/**
+ * Build batches straight from the mapping, one column per item. Images are converted to 'number' and multiplied
+ * by 'scale' on the way in (1.0 / 256 matches the old Python loader); labels are one-hot encoded over
+ * number_of_classes rows. Only the first number_of_data items are used, and as in load_data_into_batches the
+ * last batch holds whatever is left over. The single batch versions fill an existing batch from items
+ * [first_item, first_item + number_of_vectors), with the number of classes taken from its vector size.
+ */
+void load_idx_images_into_batch(batch* empty_batch, const idx_file* images, size_t first_item, number scale);
+void load_idx_labels_into_batch(batch* empty_batch, const idx_file* labels, size_t first_item);
+m_batch* load_idx_images_into_batches(const idx_file* images, size_t number_of_data, size_t batch_size, number scale);
+m_batch* load_idx_labels_into_batches(const idx_file* labels, size_t number_of_data, size_t batch_size, size_t number_of_classes);
+
+#endif
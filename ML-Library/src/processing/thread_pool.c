@@ -0,0 +1,180 @@
+// Persistent worker threads for the parallel kernels
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "thread_pool.h"
+
+struct thread_pool_ {
+	pthread_t* workers;
+	// workers plus the calling thread. Written under submit_lock, but read without it by get_number_of_threads(),
+	// which nested callers reach from inside a job
+	_Atomic size_t number_of_threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_ready;
+	pthread_cond_t work_done;
+	unsigned long generation;	// bumped for every job, so workers can tell a new job from a spurious wakeup
+	unsigned long start_generation;	// the generation when the workers were started
+	size_t workers_running;
+	boolean shutting_down;
+
+	// the current job
+	void (*task)(void* context, size_t task_index);
+	void* context;
+	size_t number_of_tasks;
+};
+typedef struct thread_pool_ thread_pool;
+
+static thread_pool pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work_ready = PTHREAD_COND_INITIALIZER,
+	.work_done = PTHREAD_COND_INITIALIZER,
+};
+
+// held by whoever is currently submitting a job; others fall back to running serially
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t pool_started = PTHREAD_ONCE_INIT;
+
+// set on pool threads, and on a caller while it runs its share, to keep nested calls serial
+static _Thread_local boolean inside_pool = FALSE;
+
+/**
+ * Thread 'thread_index' of 'number_of_threads' gets the tasks [begin, end)
+ */
+static void run_share(size_t thread_index, size_t number_of_threads) {
+	size_t begin = pool.number_of_tasks * thread_index / number_of_threads;
+	size_t end = pool.number_of_tasks * (thread_index + 1) / number_of_threads;
+	for (size_t i = begin; i < end; i++) {
+		pool.task(pool.context, i);
+	}
+}
+
+static void* worker_loop(void* argument) {
+	size_t thread_index = (size_t)argument;
+	inside_pool = TRUE;
+
+	// taken from when the pool was started rather than when this thread got scheduled, so a job submitted
+	// in between is not missed
+	pthread_mutex_lock(&pool.lock);
+	unsigned long seen_generation = pool.start_generation;
+	while (TRUE) {
+		while (pool.generation == seen_generation && !pool.shutting_down) {
+			pthread_cond_wait(&pool.work_ready, &pool.lock);
+		}
+		if (pool.shutting_down) {
+			break;
+		}
+		seen_generation = pool.generation;
+		size_t number_of_threads = pool.number_of_threads;
+		pthread_mutex_unlock(&pool.lock);
+
+		run_share(thread_index, number_of_threads);
+
+		pthread_mutex_lock(&pool.lock);
+		pool.workers_running--;
+		if (pool.workers_running == 0) {
+			pthread_cond_signal(&pool.work_done);
+		}
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+static void stop_workers(void) {
+	pthread_mutex_lock(&pool.lock);
+	pool.shutting_down = TRUE;
+	pthread_cond_broadcast(&pool.work_ready);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (size_t i = 1; i < pool.number_of_threads; i++) {
+		pthread_join(pool.workers[i - 1], NULL);
+	}
+	free(pool.workers);
+	pool.workers = NULL;
+	pool.number_of_threads = 1;
+	pool.shutting_down = FALSE;
+}
+
+static void start_workers(size_t number_of_threads) {
+	if (number_of_threads < 1) {
+		number_of_threads = 1;
+	}
+
+	pool.number_of_threads = number_of_threads;
+	pool.start_generation = pool.generation;
+	pool.workers = (pthread_t *)malloc(number_of_threads * sizeof(pthread_t));
+	for (size_t i = 1; i < number_of_threads; i++) {
+		pthread_create(&pool.workers[i - 1], NULL, worker_loop, (void *)i);
+	}
+}
+
+static void start_default_pool(void) {
+	const char* requested = getenv("MLLIB_NUM_THREADS");
+	long number_of_threads = (requested != NULL) ? atol(requested) : sysconf(_SC_NPROCESSORS_ONLN);
+	start_workers(number_of_threads > 0 ? (size_t)number_of_threads : 1);
+}
+
+/**
+ * Join the workers when the library is unloaded, so leak checkers see a clean exit
+ */
+__attribute__((destructor))
+static void shutdown_pool(void) {
+	if (pool.workers != NULL) {
+		stop_workers();
+	}
+}
+
+void set_number_of_threads(size_t number_of_threads) {
+	pthread_once(&pool_started, start_default_pool);
+
+	pthread_mutex_lock(&submit_lock);
+	stop_workers();
+	start_workers(number_of_threads);
+	pthread_mutex_unlock(&submit_lock);
+}
+
+size_t get_number_of_threads(void) {
+	pthread_once(&pool_started, start_default_pool);
+	return pool.number_of_threads;
+}
+
+void parallel_for(size_t number_of_tasks, void (*task)(void* context, size_t task_index), void* context) {
+	pthread_once(&pool_started, start_default_pool);
+
+	boolean serial = inside_pool || number_of_tasks <= 1 || pool.number_of_threads <= 1;
+	if (!serial && pthread_mutex_trylock(&submit_lock) != 0) {
+		serial = TRUE;
+	}
+
+	if (serial) {
+		for (size_t i = 0; i < number_of_tasks; i++) {
+			task(context, i);
+		}
+		return;
+	}
+
+	// holding submit_lock, the pool cannot be resized until the job is done
+	size_t number_of_threads = pool.number_of_threads;
+	pthread_mutex_lock(&pool.lock);
+	pool.task = task;
+	pool.context = context;
+	pool.number_of_tasks = number_of_tasks;
+	pool.workers_running = number_of_threads - 1;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.work_ready);
+	pthread_mutex_unlock(&pool.lock);
+
+	inside_pool = TRUE;
+	run_share(0, number_of_threads);
+	inside_pool = FALSE;
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.workers_running > 0) {
+		pthread_cond_wait(&pool.work_done, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	pthread_mutex_unlock(&submit_lock);
+}
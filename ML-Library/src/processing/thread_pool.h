@@ -0,0 +1,30 @@
+#include "../mllib.h"
+#include <stddef.h>
+
+#ifndef MLLIB_THREAD_POOL_H
+#define MLLIB_THREAD_POOL_H
+
+/**
+ * The library keeps one pool of worker threads per process. It is started the first time it is needed with
+ * the number of threads given by the environment variable MLLIB_NUM_THREADS, or one per online CPU when that is
+ * unset, and can be resized with set_number_of_threads(). The calling thread always takes part in the work, so a
+ * pool of one thread runs everything serially on the caller.
+ *
+ * Resizing while the library is training or running inference on another thread is not supported: those size
+ * their per-task buffers from get_number_of_threads() at the start of a step, and the count may change under
+ * them. get_number_of_threads() itself is safe to call from any thread.
+ */
+void set_number_of_threads(size_t number_of_threads);
+size_t get_number_of_threads(void);
+
+/**
+ * Run task(context, i) for every i in [0, number_of_tasks) and return once all of them have finished.
+ * Tasks are handed out in fixed contiguous ranges, one range per thread, so the same thread count always
+ * splits the work the same way. Tasks must not depend on each other.
+ *
+ * Calls made from inside a task, or while another thread is using the pool, run serially on the calling thread
+ * instead of waiting, so nested parallel code and concurrent callers are safe.
+ */
+void parallel_for(size_t number_of_tasks, void (*task)(void* context, size_t task_index), void* context);
+
+#endif
@@ -1,56 +1,170 @@
+#include <math.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 #include "ann.h"
+#include "checkpoint.h"
+#include "optimizer.h"
+#include "../math/kernels.h"
+#include "../math/gemm.h"
+#include "../processing/thread_pool.h"
 
-ann* initialize_ann(size_t* sizes, size_t number_of_layers) {
+ann* allocate_ann(size_t* sizes, size_t number_of_layers) {
 	ann* neural_network;
 
 	#ifdef ML_LIB_DEBUG_MODE
 	neural_network = (ann *)calloc(1, sizeof(ann));
-	neural_network->layers = (size_t *)calloc(number_of_layers, sizeof(size_t));
-
-	neural_network->biases = (vector **)calloc(number_of_layers - 1, sizeof(vector *));
-	neural_network->weights = (matrix **)calloc(number_of_layers - 1, sizeof(matrix *));
 	#else
-	neural_network = (ann *)malloc(1, sizeof(ann));
-	neural_network->layers = (size_t *)malloc(number_of_layers * sizeof(size_t));
-
-	neural_network->biases = (vector **)malloc((number_of_layers - 1) * sizeof(vector *));
-	neural_network->weights = (matrix **)malloc((number_of_layers - 1) * sizeof(matrix *));
+	neural_network = (ann *)malloc(sizeof(ann));
 	#endif
 
+	// size one arena for all of the parameters, so the whole network is a single allocation
+	size_t arena_size = ARENA_ROUND_UP(number_of_layers * sizeof(size_t))
+		+ 2 * ARENA_ROUND_UP((number_of_layers - 1) * sizeof(void *));
+	for (int i = 0; i < number_of_layers - 1; i++) {
+		arena_size += mat_footprint(sizes[i + 1], sizes[i]) + vec_footprint(sizes[i + 1]);
+	}
+	neural_network->memory = init_arena(arena_size);
+
+	neural_network->layers = (size_t *)arena_alloc(neural_network->memory, number_of_layers * sizeof(size_t));
+	neural_network->biases = (vector **)arena_alloc(neural_network->memory, (number_of_layers - 1) * sizeof(vector *));
+	neural_network->weights = (matrix **)arena_alloc(neural_network->memory, (number_of_layers - 1) * sizeof(matrix *));
+
 	for (int i = 0; i < number_of_layers - 1; i++) {
-		neural_network->weights[i] = init_mat(sizes[i + 1], sizes[i]);
-		neural_network->biases[i] = init_vec(sizes[i + 1]);
+		neural_network->weights[i] = init_mat_in(neural_network->memory, sizes[i + 1], sizes[i]);
+		neural_network->biases[i] = init_vec_in(neural_network->memory, sizes[i + 1]);
+		neural_network->layers[i] = sizes[i];
+	}
+	neural_network->layers[number_of_layers - 1] = sizes[number_of_layers - 1];
+	neural_network->number_of_layers = number_of_layers;
+	neural_network->gamma = 0.001;
+	neural_network->output_activation = ACTIVATION_LEAKY_RELU;
+	neural_network->workspace = NULL;
+	neural_network->checkpointer = NULL;
+	neural_network->optimizer = NULL;
+	neural_network->inference_weights = NULL;
+	neural_network->inference_weights_stale = TRUE;
+	neural_network->mapping = NULL;
+	neural_network->mapping_size = 0;
+
+	return neural_network;
+}
+
+/**
+ * Called by whatever just finished writing the weights, such as the end of training. In MLLIB_STORAGE_BF16
+ * builds the bfloat16 copies are remade here, on the writing thread, so inference only ever reads them.
+ */
+static void weights_updated(ann* neural_network) {
+	#ifdef MLLIB_STORAGE_BF16
+	store_inference_weights(neural_network);
+	#endif
+}
 
+ann* initialize_ann(size_t* sizes, size_t number_of_layers) {
+	ann* neural_network = allocate_ann(sizes, number_of_layers);
+
+	for (int i = 0; i < number_of_layers - 1; i++) {
 		for (int j = 0; j < sizes[i + 1]; j++) {
 			for (int k = 0; k < sizes[i]; k++) {
 				VALUE_AT(neural_network->weights[i], j, k) = 0.5 + 0.5 * ((float)rand())/(RAND_MAX); //1;
 			}
 			neural_network->biases[i]->v[j] = 0.5 + 0.5 * ((float)rand())/(RAND_MAX); //1;
 		}
-
-		neural_network->layers[i] = sizes[i];
 	}
-	neural_network->layers[number_of_layers - 1] = sizes[number_of_layers - 1];
-	neural_network->number_of_layers = number_of_layers;
-	neural_network->gamma = 0.001;
+	weights_updated(neural_network);
 
 	return neural_network;
 }
 
 void deallocate_ann(ann* neural_network) {
-	for (int i = 0; i < neural_network->number_of_layers - 1; i++) {
-		del_mat(neural_network->weights[i]);
-		del_vec(neural_network->biases[i]);
+	stop_checkpointing(neural_network);
+	if (neural_network->workspace != NULL) {
+		delete_ann_workspace(neural_network->workspace);
+	}
+	if (neural_network->optimizer != NULL) {
+		delete_optimizer(neural_network->optimizer);
+	}
+	// weights, biases and layers all live in the arena, or for a mapped network point into the file mapping
+	del_arena(neural_network->memory);
+	if (neural_network->mapping != NULL) {
+		munmap(neural_network->mapping, neural_network->mapping_size);
 	}
-	free(neural_network->weights);
-	free(neural_network->biases);
-	free(neural_network->layers);
 	free(neural_network);
 }
 
 
 
 
+/**
+ * Allocate every intermediate that train() needs for one batch. Layer i of the forward pass writes
+ * z_intermediate_outputs[i] and y_intermediate_outputs[i]; layer i of
+ * the backward pass reads dE_dy[i] and writes dE_dz[i] and dE_dy[i - 1].
+ */
+ann_workspace* create_ann_workspace(ann* neural_network, size_t batch_size) {
+	ann_workspace* workspace;
+	size_t number_of_layers = neural_network->number_of_layers;
+
+	#ifdef ML_LIB_DEBUG_MODE
+	workspace = (ann_workspace *)calloc(1, sizeof(ann_workspace));
+	#else
+	workspace = (ann_workspace *)malloc(sizeof(ann_workspace));
+	#endif
+
+	// four matrices per layer, all out of one arena
+	size_t arena_size = 4 * ARENA_ROUND_UP(number_of_layers * sizeof(matrix *));
+	for (int i = 0; i < number_of_layers; i++) {
+		arena_size += 4 * mat_footprint(neural_network->layers[i], batch_size);
+	}
+	workspace->memory = init_arena(arena_size);
+
+	workspace->z_intermediate_outputs = (matrix **)arena_alloc(workspace->memory, number_of_layers * sizeof(matrix *));
+	workspace->y_intermediate_outputs = (matrix **)arena_alloc(workspace->memory, number_of_layers * sizeof(matrix *));
+	workspace->dE_dy = (matrix **)arena_alloc(workspace->memory, number_of_layers * sizeof(matrix *));
+	workspace->dE_dz = (matrix **)arena_alloc(workspace->memory, number_of_layers * sizeof(matrix *));
+
+	workspace->batch_size = batch_size;
+	workspace->number_of_layers = number_of_layers;
+
+	for (int i = 0; i < number_of_layers; i++) {
+		workspace->z_intermediate_outputs[i] = init_mat_in(workspace->memory, neural_network->layers[i], batch_size);
+		workspace->y_intermediate_outputs[i] = (i > 0) ? init_mat_in(workspace->memory, neural_network->layers[i], batch_size) : NULL;
+		workspace->dE_dy[i] = init_mat_in(workspace->memory, neural_network->layers[i], batch_size);
+		workspace->dE_dz[i] = init_mat_in(workspace->memory, neural_network->layers[i], batch_size);
+	}
+
+	return workspace;
+}
+
+/**
+ * Reshape every intermediate to number_of_vectors columns, at most the batch size the workspace was created for.
+ * Each matrix keeps its buffer and is read as a smaller contiguous matrix, so a short batch costs no allocation
+ * and no work on columns it does not have.
+ */
+void resize_ann_workspace(ann_workspace* workspace, size_t number_of_vectors) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if (number_of_vectors > workspace->batch_size) {
+		fprintf(stderr, "ERROR IN RESIZE ANN WORKSPACE: %zu vectors do not fit a workspace made for %zu\n", number_of_vectors, workspace->batch_size);
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	matrix** all[] = { workspace->z_intermediate_outputs, workspace->y_intermediate_outputs, workspace->dE_dy, workspace->dE_dz };
+	for (int a = 0; a < sizeof(all) / sizeof(all[0]); a++) {
+		// y_intermediate_outputs[0] belongs to the caller
+		for (int i = (all[a] == workspace->y_intermediate_outputs) ? 1 : 0; i < workspace->number_of_layers; i++) {
+			all[a][i]->number_of_cols = number_of_vectors;
+			all[a][i]->leading_dimension = number_of_vectors;
+		}
+	}
+}
+
+void delete_ann_workspace(ann_workspace* workspace) {
+	del_arena(workspace->memory);
+	free(workspace);
+}
+
+
 /**
  * Leaky ReLU for nonlinear transformation applied on matrix. Applied to all entries
  */
@@ -62,12 +176,7 @@ void nonlinear_transform_mat(matrix* output, matrix* input) {
 	}
 	#endif
 
-	for (int i = 0; i < input->number_of_rows; i++) {
-		for (int j = 0; j < input->number_of_cols; j++) {
-			number entry = input->m[i * input->number_of_cols + j];
-			output->m[i * output->number_of_cols + j] = (entry > 0) ? entry : (0.1 * entry);
-		}
-	}
+	parallel_matrix_scalar_kernel(kernels->leaky_relu, output, input, LEAKY_RELU_SLOPE);
 }
 
 /**
@@ -81,328 +190,1587 @@ void nonlinear_transform_derivative_mat(matrix* output, matrix* input) {
 	}
 	#endif
 
-	for (int i = 0; i < input->number_of_rows; i++) {
-		for (int j = 0; j < input->number_of_cols; j++) {
-			number entry = input->m[i * input->number_of_cols + j];
-			output->m[i * output->number_of_cols + j] = (entry > 0) ? 1.0 : 0.1;
-		}
-	}
+	parallel_matrix_scalar_kernel(kernels->leaky_relu_derivative, output, input, LEAKY_RELU_SLOPE);
 }
 
 
 
 /**
- * Training function for the neural network. Accepts a batch of inputs and a batch of outputs.
+ * One fully connected layer: z = W*x + b and y = f(z). The bias and the activation are applied in the epilogue
+ * of the matrix multiplication, tile by tile, so z and y are each written once. z may be NULL when only y is
+ * wanted, as in inference. Softmax needs whole columns, so it follows the multiplication as one more pass over y.
  */
-void train(ann* neural_network, m_batch* many_batches_training_input, m_batch* many_batches_training_output) {
+void layer_forward(matrix* y, matrix* z, matrix* weights, vector* bias, matrix* x) {
+	layer_forward_activation(y, z, weights, bias, x, ACTIVATION_LEAKY_RELU);
+}
+
+void layer_forward_activation(matrix* y, matrix* z, matrix* weights, vector* bias, matrix* x, layer_activation activation) {
 	#ifdef ML_LIB_DEBUG_MODE
-	if (many_batches_training_input->total_number_of_vectors != many_batches_training_output->total_number_of_vectors) {
-		fprintf(stderr, "ANN TRAINING ERROR: Number of inputs does not match number of outputs\n");
-		exit(EXIT_FAILURE);
-	}
-	if (many_batches_training_input->vector_size != neural_network->layers[0]) {
-		fprintf(stderr, "ANN TRAINING ERROR: Size of inputs do not match input layer of neural network\n");
+	if ( (weights->number_of_cols != x->number_of_rows) || (weights->number_of_rows != y->number_of_rows) ||
+		 (x->number_of_cols != y->number_of_cols) || (bias->size != y->number_of_rows) ) {
+		fprintf(stderr, "ERROR IN LAYER FORWARD: Dimensions of weights, bias, input and output do not match.\n");
 		exit(EXIT_FAILURE);
 	}
-	if (many_batches_training_output->vector_size != neural_network->layers[neural_network->number_of_layers - 1]) {
-		fprintf(stderr, "ANN TRAINING ERROR: Size of outputs does not match output layer of neural network\n");
+	if ( (z != NULL) && ((z->number_of_rows != y->number_of_rows) || (z->number_of_cols != y->number_of_cols)) ) {
+		fprintf(stderr, "ERROR IN LAYER FORWARD: Dimensions of z do not match the output.\n");
 		exit(EXIT_FAILURE);
 	}
-	for (int i = 0; i < many_batches_training_input->number_of_batches; i++) {
-		if ((many_batches_training_input->ray_of_batches[0]->number_of_vectors != many_batches_training_input->ray_of_batches[i]->number_of_vectors) ||
-			(many_batches_training_output->ray_of_batches[0]->number_of_vectors != many_batches_training_output->ray_of_batches[i]->number_of_vectors)) {
-			fprintf(stderr, "ANN TRAINING ERROR: Inconsistent batch sizes.\n");
-			exit(EXIT_FAILURE);
-		}
-	}
 	#endif
 
-	// store weights and biases
-	// matrix** weights = neural_network->weights;
-	// vector** biases = neural_network->biases;
-	size_t number_of_layers = neural_network->number_of_layers;
+	gemm_epilogue epilogue = {
+		.row_bias = bias->v,
+		.z = (z != NULL) ? z->m : NULL,
+		.ldz = (z != NULL) ? z->leading_dimension : 0,
+		.apply_leaky_relu = (activation == ACTIVATION_LEAKY_RELU),
+		.slope = LEAKY_RELU_SLOPE,
+	};
+	general_matrix_mult_epilogue(FALSE, FALSE, y->number_of_rows, y->number_of_cols, weights->number_of_cols,
+		1, weights->m, weights->leading_dimension, x->m, x->leading_dimension, 0, y->m, y->leading_dimension, &epilogue);
+
+	if (activation == ACTIVATION_SOFTMAX) {
+		softmax_cross_entropy(y, y, NULL);
+	}
+}
 
-	matrix** linear_intermediate_outputs;
-	matrix** z_intermediate_outputs;
-	matrix** y_intermediate_outputs;
 
+void layer_forward_bf16(matrix* y, const bfloat16* weights, vector* bias, matrix* x) {
+	layer_forward_bf16_activation(y, weights, bias, x, ACTIVATION_LEAKY_RELU);
+}
+
+void layer_forward_bf16_activation(matrix* y, const bfloat16* weights, vector* bias, matrix* x, layer_activation activation) {
 	#ifdef ML_LIB_DEBUG_MODE
-	linear_intermediate_outputs = (matrix **)calloc(neural_network->number_of_layers, sizeof(matrix *));
-	y_intermediate_outputs = (matrix **)calloc(neural_network->number_of_layers, sizeof(matrix *));
-	z_intermediate_outputs = (matrix **)calloc(neural_network->number_of_layers, sizeof(matrix *));
-	#else
-	linear_intermediate_outputs = (matrix **)malloc(neural_network->number_of_layers * sizeof(matrix *));
-	y_intermediate_outputs = (matrix **)malloc(neural_network->number_of_layers * sizeof(matrix *));
-	z_intermediate_outputs = (matrix **)malloc(neural_network->number_of_layers * sizeof(matrix *));
+	if ( (x->number_of_cols != y->number_of_cols) || (bias->size != y->number_of_rows) ) {
+		fprintf(stderr, "ERROR IN LAYER FORWARD BF16: Dimensions of bias, input and output do not match.\n");
+		exit(EXIT_FAILURE);
+	}
 	#endif
 
-	size_t io_number_of_vectors = many_batches_training_input->ray_of_batches[0]->number_of_vectors;
+	gemm_epilogue epilogue = {
+		.row_bias = bias->v,
+		.apply_leaky_relu = (activation == ACTIVATION_LEAKY_RELU),
+		.slope = LEAKY_RELU_SLOPE,
+	};
+	general_matrix_mult_bf16_epilogue(FALSE, FALSE, y->number_of_rows, y->number_of_cols, x->number_of_rows,
+		1, weights, x->number_of_rows, x->m, x->leading_dimension, 0, y->m, y->leading_dimension, &epilogue);
 
-	for (int i = 0; i < number_of_layers; i++) {
-		linear_intermediate_outputs[i] = init_mat(neural_network->layers[i], io_number_of_vectors);
-		z_intermediate_outputs[i] = init_mat(neural_network->layers[i], io_number_of_vectors);
-		y_intermediate_outputs[i] = init_mat(neural_network->layers[i], io_number_of_vectors);
+	if (activation == ACTIVATION_SOFTMAX) {
+		softmax_cross_entropy(y, y, NULL);
 	}
+}
 
-	int nloops = 100;
-	int idx = 0;
-	int curr_nloops = 0;
-	while (curr_nloops < nloops * many_batches_training_input->number_of_batches) { //many_batches_training_input->number_of_batches
-		batch* training_input = many_batches_training_input->ray_of_batches[idx % many_batches_training_input->number_of_batches];
-		batch* training_output = many_batches_training_output->ray_of_batches[idx % many_batches_training_output->number_of_batches];
-		idx = idx + 1;
+number softmax_cross_entropy(matrix* out, matrix* z, matrix* target) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if ( (out->number_of_rows != z->number_of_rows) || (out->number_of_cols != z->number_of_cols) ) {
+		fprintf(stderr, "ERROR IN SOFTMAX CROSS ENTROPY: Dimensions of the output and the logits do not match.\n");
+		exit(EXIT_FAILURE);
+	}
+	if ( (target != NULL) && ((target->number_of_rows != z->number_of_rows) || (target->number_of_cols != z->number_of_cols)) ) {
+		fprintf(stderr, "ERROR IN SOFTMAX CROSS ENTROPY: Dimensions of the target do not match the logits.\n");
+		exit(EXIT_FAILURE);
+	}
+	if ( (out->m == z->m) && (out->leading_dimension != z->leading_dimension) ) {
+		fprintf(stderr, "ERROR IN SOFTMAX CROSS ENTROPY: The output may only alias the logits exactly.\n");
+		exit(EXIT_FAILURE);
+	}
+	#endif
 
-		// copy training_input into y_intermediate_outputs[0]
-		// to make y_0 == x_1
-		// copy_batch(y_intermediate_outputs[0], training_input);
-		copy_matrix(y_intermediate_outputs[0], training_input->data);
+	return kernels->softmax_cross_entropy(out->m, out->leading_dimension, z->m, z->leading_dimension,
+		(target != NULL) ? target->m : NULL, (target != NULL) ? target->leading_dimension : 0, z->number_of_rows, z->number_of_cols);
+}
 
-		// forward propagation
-		for (int i = 1; i < number_of_layers; i++) {
-			// l_i = W*x_i where (x_i == y_{i - 1})
-			// multiply_batch_by_matrix(linear_intermediate_outputs[i]->data, weights[i - 1], y_intermediate_outputs[i - 1]->data);
-			matrix_mult(linear_intermediate_outputs[i], neural_network->weights[i - 1], y_intermediate_outputs[i - 1]);
 
-			// z_i = l_i + b_i
-			// add_vector_to_batch(z_intermediate_outputs[i], linear_intermediate_outputs[i], biases[i - 1]);
-			add_vector_to_matrix(z_intermediate_outputs[i], linear_intermediate_outputs[i], neural_network->biases[i - 1]);
+// below this many entries of dE/dz the row sweep of layer_backward stays on the calling thread
+#define LAYER_BACKWARD_PARALLEL_MIN 65536
 
-			// y_i = f(z_i)
-			// nonlinear_transform(y_intermediate_outputs[1], z_intermediate_outputs[1]);
-			nonlinear_transform_mat(y_intermediate_outputs[i], z_intermediate_outputs[i]);
-		}
+struct layer_backward_job_ {
+	matrix* dE_dz;
+	matrix* dE_dy;
+	matrix* target;
+	matrix* z;
+	vector* bias;
+	number learning_rate;
+	size_t rows_per_task;
+	number* squared_errors;	// one per task, at the output layer
+};
+typedef struct layer_backward_job_ layer_backward_job;
 
-		/*
-		for (int idx = 0; idx < number_of_layers - 1; idx++) {
-			fprintf(stdout, "----------\n");
-			for (int x = 0; x < neural_network->weights[idx]->number_of_rows; x++) {
-				for (int y = 0; y < neural_network->weights[idx]->number_of_cols; y++) {
-					fprintf(stdout, "%f ", VALUE_AT(neural_network->weights[idx], x, y));
-				}
-				fprintf(stdout, "\n");
-			}
-			fprintf(stdout, "----------\n");
-		}
-		*/
-		
+/**
+ * The rows of one task of layer_backward. Each row owns its entry of the bias, so tasks never share a write.
+ */
+static void layer_backward_rows(void* context, size_t task_index) {
+	layer_backward_job* job = (layer_backward_job *)context;
+	size_t ncols = job->dE_dz->number_of_cols;
+	size_t begin = task_index * job->rows_per_task;
+	size_t end = begin + job->rows_per_task;
+	if (end > job->dE_dz->number_of_rows) {
+		end = job->dE_dz->number_of_rows;
+	}
 
-		#ifdef ML_LIB_DEBUG_MODE
-		// calculate error
-		number total_error = 0;
-		for (int x = 0; x < training_output->data->number_of_rows; x++) {
-			for (int y = 0; y < training_output->data->number_of_cols; y++) {
-				total_error += (VALUE_AT(training_output->data, x, y) - VALUE_AT(y_intermediate_outputs[number_of_layers - 1], x, y)) * (VALUE_AT(training_output->data, x, y) - VALUE_AT(y_intermediate_outputs[number_of_layers - 1], x, y));
-			}
-		}
-		total_error /= io_number_of_vectors;
-		fprintf(stdout, "Error so far: %f\n", total_error);
-		
-		if (total_error / 5000 < neural_network->gamma) {
-			neural_network->gamma /= 2;
-		}
-		#endif
+	job->squared_errors[task_index] = 0;
+	for (size_t i = begin; i < end; i++) {
+		number bias_gradient = (job->target != NULL)
+			? kernels->leaky_relu_output_backward(&VALUE_AT(job->dE_dz, i, 0), &VALUE_AT(job->dE_dy, i, 0),
+				&VALUE_AT(job->target, i, 0), &VALUE_AT(job->z, i, 0), LEAKY_RELU_SLOPE, ncols, &job->squared_errors[task_index])
+			: kernels->leaky_relu_backward(&VALUE_AT(job->dE_dz, i, 0), &VALUE_AT(job->dE_dy, i, 0), NULL,
+				&VALUE_AT(job->z, i, 0), LEAKY_RELU_SLOPE, ncols);
+		job->bias->v[i] -= job->learning_rate * bias_gradient;
+	}
+}
 
-		// backward propagation
-		// batch* layer_output = training_output;
-		matrix* layer_output = training_output->data;
-		for (int j = number_of_layers - 1; j > 0; j--) {
-			matrix* dE_dy = init_mat(layer_output->number_of_rows,layer_output->number_of_cols);
-			matrix* dy_dz = init_mat(layer_output->number_of_rows,layer_output->number_of_cols);
-			matrix* dE_dz = init_mat(layer_output->number_of_rows,layer_output->number_of_cols);
+/**
+ * Fused backward step of one layer and its SGD update. A single sweep over each row computes
+ * dE_dz = (dE_dy - target) * f'(z), sums the row into the bias gradient and applies it to the bias.
+ * The weight update W -= learning_rate * dE_dz * transpose(x) is then accumulated straight into W by the GEMM.
+ * At the output layer dE_dy is y and target is the expected output; elsewhere target is NULL.
+ * Returns the squared error sum((y - target)^2) of the output layer, taken in the same sweep, or 0 elsewhere.
+ */
+number layer_backward(matrix* dE_dz, matrix* dE_dy, matrix* target, matrix* z, matrix* x,
+		matrix* weights, vector* bias, number learning_rate) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if ( (dE_dz->number_of_rows != dE_dy->number_of_rows) || (dE_dz->number_of_cols != dE_dy->number_of_cols) ||
+		 (dE_dz->number_of_rows != z->number_of_rows) || (dE_dz->number_of_cols != z->number_of_cols) ) {
+		fprintf(stderr, "ERROR IN LAYER BACKWARD: Dimensions of dE/dz, dE/dy and z do not match.\n");
+		exit(EXIT_FAILURE);
+	}
+	if ( (target != NULL) && ((target->number_of_rows != dE_dz->number_of_rows) || (target->number_of_cols != dE_dz->number_of_cols)) ) {
+		fprintf(stderr, "ERROR IN LAYER BACKWARD: Dimensions of the target do not match dE/dz.\n");
+		exit(EXIT_FAILURE);
+	}
+	if ( (weights->number_of_rows != dE_dz->number_of_rows) || (weights->number_of_cols != x->number_of_rows) ||
+		 (x->number_of_cols != dE_dz->number_of_cols) || (bias->size != dE_dz->number_of_rows) ) {
+		fprintf(stderr, "ERROR IN LAYER BACKWARD: Dimensions of weights, bias and input do not match dE/dz.\n");
+		exit(EXIT_FAILURE);
+	}
+	#endif
 
-			matrix* grad_w = init_mat(neural_network->weights[j - 1]->number_of_rows, neural_network->weights[j - 1]->number_of_cols);
-			vector* grad_b = init_vec(neural_network->biases[j - 1]->size);
+	size_t ncols = dE_dz->number_of_cols;
+	size_t number_of_threads = get_number_of_threads();
+	number squared_errors[number_of_threads];
+	layer_backward_job job = {
+		.dE_dz = dE_dz, .dE_dy = dE_dy, .target = target, .z = z, .bias = bias, .learning_rate = learning_rate,
+		.rows_per_task = dE_dz->number_of_rows, .squared_errors = squared_errors,
+	};
+	size_t number_of_tasks = 1;
+	if (number_of_threads == 1 || dE_dz->number_of_rows * ncols < LAYER_BACKWARD_PARALLEL_MIN) {
+		layer_backward_rows(&job, 0);
+	} else {
+		job.rows_per_task = (dE_dz->number_of_rows + number_of_threads - 1) / number_of_threads;
+		number_of_tasks = (dE_dz->number_of_rows + job.rows_per_task - 1) / job.rows_per_task;
+		parallel_for(number_of_tasks, layer_backward_rows, &job);
+	}
 
-			// dE/dy = y_intermediate_outputs[j] - y_theoretical_outputs[j]
-			if (j == number_of_layers - 1) {
-				matrix_sub(dE_dy, y_intermediate_outputs[j], layer_output);
-			} else {
-				copy_matrix(dE_dy, layer_output);
-			}
-			// dy/dz = f'(y_intermediates_outputs[j - 1]) or f'(x)
-			// nonlinear_transform_derivative(dy_dz, y_intermediate_outputs[j - 1]);
-			nonlinear_transform_derivative_mat(dy_dz, z_intermediate_outputs[j]);
+	general_matrix_mult(FALSE, TRUE, weights->number_of_rows, weights->number_of_cols, ncols,
+		-learning_rate, dE_dz->m, dE_dz->leading_dimension, x->m, x->leading_dimension, 1, weights->m, weights->leading_dimension);
 
-			// dE/dz = dE/dy . dy/dz
-			// batch_hadamard_product(dE_dz, dE_dy, dy_dz);
-			matrix_entrywise_product(dE_dz, dE_dy, dy_dz);
-			
-			// grad_w = dE_dz * transpose(y_intermediate_outputs[j - 1])
-			// auxillary_function_one(grad_w, dE_dz, y_intermediate_outputs[j - 1], neural_network->gamma);
-			// auxillary_function_two(grad_b, dE_dz, neural_network->gamma);
-			matrix* x_intermediate_transpose = init_mat(y_intermediate_outputs[j - 1]->number_of_cols, y_intermediate_outputs[j - 1]->number_of_rows);
-			matrix_transpose(x_intermediate_transpose, y_intermediate_outputs[j - 1]);
-			matrix_mult(grad_w, dE_dz, x_intermediate_transpose);
-			del_mat(x_intermediate_transpose);
-
-			matrix_col_sum(grad_b, dE_dz);
-			
-			/*
-			fprintf(stdout, "----------\ngrad_w\n");
-			for (int x = 0; x < grad_w->number_of_rows; x++) {
-				for (int y = 0; y < grad_w->number_of_cols; y++) {
-					fprintf(stdout, "%f ", VALUE_AT(grad_w, x, y));
-				}
-				fprintf(stdout, "\n");
-			}
-			fprintf(stdout, "----------\ngrad_b\n");
-			for (int x = 0; x < grad_b->size; x++) {
-				fprintf(stdout, "%f ", grad_b->v[x]);
-			}
-			fprintf(stdout, "\n----------\n");
-			*/
-			
+	number squared_error = 0;
+	for (size_t t = 0; t < number_of_tasks; t++) {
+		squared_error += squared_errors[t];
+	}
+	return squared_error;
+}
 
-			
-			// update weights and biases
-			// auxillary_function_three(neural_network->weights[j], grad_w);
-			// auxillary_function_four(neural_network->biases[j], grad_b);
+/**
+ * Backward step of one layer without the update: dE_dz as in layer_backward, grad_b = the row sums of dE_dz
+ * and grad_w = dE_dz * transpose(x). The gradients are overwritten, not accumulated. Returns the squared error
+ * of the output layer like layer_backward.
+ */
+number layer_gradient(matrix* dE_dz, matrix* dE_dy, matrix* target, matrix* z, matrix* x,
+		matrix* grad_w, vector* grad_b) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if ( (dE_dz->number_of_rows != dE_dy->number_of_rows) || (dE_dz->number_of_cols != dE_dy->number_of_cols) ||
+		 (dE_dz->number_of_rows != z->number_of_rows) || (dE_dz->number_of_cols != z->number_of_cols) ) {
+		fprintf(stderr, "ERROR IN LAYER GRADIENT: Dimensions of dE/dz, dE/dy and z do not match.\n");
+		exit(EXIT_FAILURE);
+	}
+	if ( (target != NULL) && ((target->number_of_rows != dE_dz->number_of_rows) || (target->number_of_cols != dE_dz->number_of_cols)) ) {
+		fprintf(stderr, "ERROR IN LAYER GRADIENT: Dimensions of the target do not match dE/dz.\n");
+		exit(EXIT_FAILURE);
+	}
+	if ( (grad_w->number_of_rows != dE_dz->number_of_rows) || (grad_w->number_of_cols != x->number_of_rows) ||
+		 (x->number_of_cols != dE_dz->number_of_cols) || (grad_b->size != dE_dz->number_of_rows) ) {
+		fprintf(stderr, "ERROR IN LAYER GRADIENT: Dimensions of the gradients and input do not match dE/dz.\n");
+		exit(EXIT_FAILURE);
+	}
+	#endif
 
-			matrix_scale(grad_w, grad_w, neural_network->gamma / io_number_of_vectors);
-			vector_scale(grad_b, grad_b, neural_network->gamma / io_number_of_vectors);
+	size_t ncols = dE_dz->number_of_cols;
+	number squared_error = 0;
+	for (int i = 0; i < dE_dz->number_of_rows; i++) {
+		grad_b->v[i] = (target != NULL)
+			? kernels->leaky_relu_output_backward(&VALUE_AT(dE_dz, i, 0), &VALUE_AT(dE_dy, i, 0), &VALUE_AT(target, i, 0),
+				&VALUE_AT(z, i, 0), LEAKY_RELU_SLOPE, ncols, &squared_error)
+			: kernels->leaky_relu_backward(&VALUE_AT(dE_dz, i, 0), &VALUE_AT(dE_dy, i, 0), NULL, &VALUE_AT(z, i, 0),
+				LEAKY_RELU_SLOPE, ncols);
+	}
 
-			matrix_sub(neural_network->weights[j - 1], neural_network->weights[j - 1], grad_w);
-			vector_sub(neural_network->biases[j - 1], neural_network->biases[j - 1], grad_b);
+	general_matrix_mult(FALSE, TRUE, grad_w->number_of_rows, grad_w->number_of_cols, ncols,
+		1, dE_dz->m, dE_dz->leading_dimension, x->m, x->leading_dimension, 0, grad_w->m, grad_w->leading_dimension);
+	return squared_error;
+}
 
-			if (j != 1) {
-				// batch* dE_dx = create_empty_batch(layer_output->number_of_vectors, y_intermediate_outputs[j - 1]->vector_size);
-				matrix* dE_dx = init_mat(y_intermediate_outputs[j - 1]->number_of_rows, layer_output->number_of_cols);
-				matrix* weight_transpose = init_mat(neural_network->weights[j - 1]->number_of_cols, neural_network->weights[j - 1]->number_of_rows);
-				matrix_transpose(weight_transpose, neural_network->weights[j - 1]);
-
-				// multiply_batch_by_matrix(dE_dx, neural_network->weights[j], dE_dz);
-				// auxillary_function_five(y_intermediate_outputs[j - 1], y_intermediate_outputs[j - 1], dE_dx, neural_network->gamma);
-				
-				matrix_mult(dE_dx, weight_transpose, dE_dz);
-				matrix_scale(dE_dx, dE_dx, neural_network->gamma / io_number_of_vectors);
-
-				// set layer_output to be dE_dx
-				if (j != number_of_layers - 1) {
-					del_mat(layer_output);
-				}
-				layer_output = init_mat(dE_dx->number_of_rows, dE_dx->number_of_cols);
-				copy_matrix(layer_output, dE_dx);
-
-				/*
-				fprintf(stdout, "----------\ndE/dx\n");
-				for (int x = 0; x < dE_dx->number_of_rows; x++) {
-					for (int y = 0; y < dE_dx->number_of_cols; y++) {
-						fprintf(stdout, "%f ", VALUE_AT(dE_dx, x, y));
-					}
-					fprintf(stdout, "\n");
-				}
-				fprintf(stdout, "----------\n");
-				*/
-				
-				// ;ADFJSLKFDSAIOFJPASDJFLKSAD;NJFAPSLDI
-				// THIS WAS THE PROBLEM!!!!!
-				// layer_output = y_intermediate_outputs[j - 1];
-
-				// delete_batch(dE_dx);
-				del_mat(weight_transpose);
-				del_mat(dE_dx);
-			} else {
-				// delete final layer matrix
-				del_mat(layer_output);
-			}
+/**
+ * The gradients of a layer whose dE/dz is already formed: grad_b = the row sums of dE_dz, grad_w = dE_dz * transpose(x)
+ */
+static void output_error_gradient(matrix* dE_dz, matrix* x, matrix* grad_w, vector* grad_b) {
+	size_t ncols = dE_dz->number_of_cols;
+	for (size_t i = 0; i < dE_dz->number_of_rows; i++) {
+		grad_b->v[i] = kernels->sum(&VALUE_AT(dE_dz, i, 0), ncols);
+	}
+	general_matrix_mult(FALSE, TRUE, grad_w->number_of_rows, grad_w->number_of_cols, ncols,
+		1, dE_dz->m, dE_dz->leading_dimension, x->m, x->leading_dimension, 0, grad_w->m, grad_w->leading_dimension);
+}
 
+#ifdef ML_LIB_DEBUG_MODE
+static void check_softmax_layer(const char* caller, matrix* dE_dz, matrix* z, matrix* target, matrix* x,
+		matrix* weights, vector* bias) {
+	if ( (dE_dz->number_of_rows != z->number_of_rows) || (dE_dz->number_of_cols != z->number_of_cols) ||
+		 (target->number_of_rows != z->number_of_rows) || (target->number_of_cols != z->number_of_cols) ) {
+		fprintf(stderr, "ERROR IN %s: Dimensions of dE/dz, z and the target do not match.\n", caller);
+		exit(EXIT_FAILURE);
+	}
+	if ( (weights->number_of_rows != dE_dz->number_of_rows) || (weights->number_of_cols != x->number_of_rows) ||
+		 (x->number_of_cols != dE_dz->number_of_cols) || (bias->size != dE_dz->number_of_rows) ) {
+		fprintf(stderr, "ERROR IN %s: Dimensions of weights, bias and input do not match dE/dz.\n", caller);
+		exit(EXIT_FAILURE);
+	}
+}
+#endif
 
-			del_mat(dE_dy);
-			del_mat(dy_dz);
-			del_mat(dE_dz);
-			
-			del_mat(grad_w);
-			del_vec(grad_b);
-		}		
+number softmax_layer_backward(matrix* dE_dz, matrix* z, matrix* target, matrix* x,
+		matrix* weights, vector* bias, number learning_rate) {
+	#ifdef ML_LIB_DEBUG_MODE
+	check_softmax_layer("SOFTMAX LAYER BACKWARD", dE_dz, z, target, x, weights, bias);
+	#endif
 
-		curr_nloops++;
+	number cross_entropy = softmax_cross_entropy(dE_dz, z, target);
+	size_t ncols = dE_dz->number_of_cols;
+	for (size_t i = 0; i < dE_dz->number_of_rows; i++) {
+		bias->v[i] -= learning_rate * kernels->sum(&VALUE_AT(dE_dz, i, 0), ncols);
 	}
+	general_matrix_mult(FALSE, TRUE, weights->number_of_rows, weights->number_of_cols, ncols,
+		-learning_rate, dE_dz->m, dE_dz->leading_dimension, x->m, x->leading_dimension, 1, weights->m, weights->leading_dimension);
+	return cross_entropy;
+}
 
-	// delete the intermediate batches
-	// this only works if the batch_size for all batches are the same
-	for (int i = 0; i < neural_network->number_of_layers; i++) {
-		del_mat(linear_intermediate_outputs[i]);
-		del_mat(z_intermediate_outputs[i]);
-		del_mat(y_intermediate_outputs[i]);
-	}
-	free(linear_intermediate_outputs);
-	free(z_intermediate_outputs);
-	free(y_intermediate_outputs);
+number softmax_layer_gradient(matrix* dE_dz, matrix* z, matrix* target, matrix* x,
+		matrix* grad_w, vector* grad_b) {
+	#ifdef ML_LIB_DEBUG_MODE
+	check_softmax_layer("SOFTMAX LAYER GRADIENT", dE_dz, z, target, x, grad_w, grad_b);
+	#endif
 
+	number cross_entropy = softmax_cross_entropy(dE_dz, z, target);
+	output_error_gradient(dE_dz, x, grad_w, grad_b);
+	return cross_entropy;
 }
 
+static double seconds_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
 
+/**
+ * Layer i of the forward pass of a training step. The softmax head stops at the logits, in z: its backward step
+ * forms the softmax itself, fused with the cross-entropy.
+ */
+static void training_layer_forward(ann* neural_network, int i, matrix* y, matrix* z, matrix* x) {
+	if (i == neural_network->number_of_layers - 1 && neural_network->output_activation == ACTIVATION_SOFTMAX) {
+		layer_forward_activation(z, NULL, neural_network->weights[i - 1], neural_network->biases[i - 1], x, ACTIVATION_LINEAR);
+	} else {
+		layer_forward(y, z, neural_network->weights[i - 1], neural_network->biases[i - 1], x);
+	}
+}
 
+/**
+ * layer_backward() and layer_gradient() at the output layer, with the loss of the network's head. y is only read
+ * by the Leaky-ReLU head, z only by the softmax one. Both return the loss of the batch.
+ */
+static number output_layer_backward(ann* neural_network, matrix* dE_dz, matrix* y, matrix* target, matrix* z, matrix* x,
+		number learning_rate) {
+	size_t last = neural_network->number_of_layers - 2;
+	if (neural_network->output_activation == ACTIVATION_SOFTMAX) {
+		return softmax_layer_backward(dE_dz, z, target, x, neural_network->weights[last], neural_network->biases[last], learning_rate);
+	}
+	return layer_backward(dE_dz, y, target, z, x, neural_network->weights[last], neural_network->biases[last], learning_rate);
+}
 
+static number output_layer_gradient(ann* neural_network, matrix* dE_dz, matrix* y, matrix* target, matrix* z, matrix* x,
+		matrix* grad_w, vector* grad_b) {
+	if (neural_network->output_activation == ACTIVATION_SOFTMAX) {
+		return softmax_layer_gradient(dE_dz, z, target, x, grad_w, grad_b);
+	}
+	return layer_gradient(dE_dz, y, target, z, x, grad_w, grad_b);
+}
 
+/**
+ * The workspace is kept with the network, so later calls with batches no larger than it reuse it
+ */
+static ann_workspace* training_workspace(ann* neural_network, size_t batch_size) {
+	if (neural_network->workspace == NULL || neural_network->workspace->batch_size < batch_size) {
+		if (neural_network->workspace != NULL) {
+			delete_ann_workspace(neural_network->workspace);
+		}
+		neural_network->workspace = create_ann_workspace(neural_network, batch_size);
+	}
+	return neural_network->workspace;
+}
 
+/**
+ * Number of vectors in the biggest batch, which is what a workspace has to hold
+ */
+static size_t largest_batch(m_batch* many_batches) {
+	size_t largest = 0;
+	for (int i = 0; i < many_batches->number_of_batches; i++) {
+		if (many_batches->ray_of_batches[i]->number_of_vectors > largest) {
+			largest = many_batches->ray_of_batches[i]->number_of_vectors;
+		}
+	}
+	return largest;
+}
 
+/**
+ * Backward pass of train_step() for a network with an optimizer: the gradients of every layer go into the
+ * optimizer's buffers, dE/dx is taken through the weights as they were before the step, and then every layer is
+ * updated at once
+ */
+static number optimizer_backward(ann* neural_network, ann_workspace* workspace, batch* training_output,
+		number learning_rate, size_t number_of_vectors) {
+	ann_optimizer* optimizer = neural_network->optimizer;
+	size_t number_of_layers = neural_network->number_of_layers;
+	matrix** z_intermediate_outputs = workspace->z_intermediate_outputs;
+	matrix** y_intermediate_outputs = workspace->y_intermediate_outputs;
+
+	number loss = 0;
+	for (int j = number_of_layers - 1; j > 0; j--) {
+		matrix* dE_dz = workspace->dE_dz[j];
+		if (j == number_of_layers - 1) {
+			loss = output_layer_gradient(neural_network, dE_dz, y_intermediate_outputs[j], training_output->data,
+				z_intermediate_outputs[j], y_intermediate_outputs[j - 1], optimizer->grad_w[j - 1], optimizer->grad_b[j - 1]);
+		} else {
+			layer_gradient(dE_dz, workspace->dE_dy[j], NULL, z_intermediate_outputs[j],
+				y_intermediate_outputs[j - 1], optimizer->grad_w[j - 1], optimizer->grad_b[j - 1]);
+		}
 
+		if (j != 1) {
+			// dE/dx = transpose(W) * dE/dz, unscaled: the optimizer takes the mean over the batch itself
+			matrix* dE_dx = workspace->dE_dy[j - 1];
+			general_matrix_mult(TRUE, FALSE, dE_dx->number_of_rows, dE_dx->number_of_cols, dE_dz->number_of_rows,
+				1, neural_network->weights[j - 1]->m, neural_network->weights[j - 1]->leading_dimension,
+				dE_dz->m, dE_dz->leading_dimension, 0, dE_dx->m, dE_dx->leading_dimension);
+		}
+	}
 
+	optimizer_step(neural_network, optimizer->grad_w, optimizer->grad_b, learning_rate, (number)1 / number_of_vectors);
+	return loss;
+}
 
+/**
+ * One step of train() on one pair of batches, of any size up to that of the workspace: SGD fused into the
+ * backward pass, or the network's optimizer. Returns the loss of the batch, as it was before the step.
+ */
+static number train_step(ann* neural_network, ann_workspace* workspace, batch* training_input, batch* training_output,
+		number learning_rate) {
+	size_t number_of_layers = neural_network->number_of_layers;
+	matrix** z_intermediate_outputs = workspace->z_intermediate_outputs;
+	matrix** y_intermediate_outputs = workspace->y_intermediate_outputs;
 
+	resize_ann_workspace(workspace, training_input->number_of_vectors);
 
+	// y_0 == x_1 is the input batch itself, read in place even when it is a view into a bigger dataset
+	// copy_batch(y_intermediate_outputs[0], training_input);
+	y_intermediate_outputs[0] = training_input->data;
 
+	// forward propagation
+	for (int i = 1; i < number_of_layers; i++) {
+		// z_i = W*x_i + b_i where (x_i == y_{i - 1}), y_i = f(z_i), in one pass
+		training_layer_forward(neural_network, i, y_intermediate_outputs[i], z_intermediate_outputs[i], y_intermediate_outputs[i - 1]);
+	}
 
-batch* pass_forward(ann* neural_network, batch* inputs) {
-	#ifdef ML_LIB_DEBUG_MODE
-	if (inputs->vector_size != neural_network->layers[0]) {
-		fprintf(stderr, "ANN PASS FORWARD: Size of inputs do not match input layer of neural network\n");
-		exit(EXIT_FAILURE);
+	/*
+	for (int idx = 0; idx < number_of_layers - 1; idx++) {
+		fprintf(stdout, "----------\n");
+		for (int x = 0; x < neural_network->weights[idx]->number_of_rows; x++) {
+			for (int y = 0; y < neural_network->weights[idx]->number_of_cols; y++) {
+				fprintf(stdout, "%f ", VALUE_AT(neural_network->weights[idx], x, y));
+			}
+			fprintf(stdout, "\n");
+		}
+		fprintf(stdout, "----------\n");
 	}
-	#endif
+	*/
+	
 
-	batch* predictions = create_empty_batch(inputs->number_of_vectors, inputs->vector_size);
-	size_t io_number_of_vectors = inputs->number_of_vectors;
+	if (neural_network->optimizer != NULL) {
+		return optimizer_backward(neural_network, workspace, training_output, learning_rate, training_input->number_of_vectors);
+	}
 
-	matrix** linear_intermediate_outputs;
-	matrix** z_intermediate_outputs;
-	matrix** y_intermediate_outputs;
+	// backward propagation; the loss comes out of the output layer's gradient sweep
+	number loss = 0;
+	for (int j = number_of_layers - 1; j > 0; j--) {
+		// dE/dy of layer j is either the output error or was written by layer j + 1 as its dE/dx
+		matrix* dE_dz = workspace->dE_dz[j];
+
+		// dE/dz = dE/dy . f'(z), with dE/dy = y_intermediate_outputs[j] - y_theoretical_outputs[j] at the output
+		// (softmax(z) - target for the softmax head). The bias and the weights are updated in the same call,
+		// without forming grad_w or grad_b.
+		if (j == number_of_layers - 1) {
+			loss = output_layer_backward(neural_network, dE_dz, y_intermediate_outputs[j], training_output->data,
+				z_intermediate_outputs[j], y_intermediate_outputs[j - 1], learning_rate / training_input->number_of_vectors);
+		} else {
+			layer_backward(dE_dz, workspace->dE_dy[j], NULL, z_intermediate_outputs[j],
+				y_intermediate_outputs[j - 1], neural_network->weights[j - 1], neural_network->biases[j - 1],
+				learning_rate / training_input->number_of_vectors);
+		}
 
-	size_t number_of_layers = neural_network->number_of_layers;
+		if (j != 1) {
+			// dE/dx of this layer is dE/dy of the layer below
+			matrix* dE_dx = workspace->dE_dy[j - 1];
 
-	#ifdef ML_LIB_DEBUG_MODE
-	linear_intermediate_outputs = (matrix **)calloc(neural_network->number_of_layers, sizeof(matrix *));
-	y_intermediate_outputs = (matrix **)calloc(neural_network->number_of_layers, sizeof(matrix *));
-	z_intermediate_outputs = (matrix **)calloc(neural_network->number_of_layers, sizeof(matrix *));
-	#else
-	linear_intermediate_outputs = (matrix **)malloc(neural_network->number_of_layers * sizeof(matrix *));
-	y_intermediate_outputs = (matrix **)malloc(neural_network->number_of_layers * sizeof(matrix *));
-	z_intermediate_outputs = (matrix **)malloc(neural_network->number_of_layers * sizeof(matrix *));
-	#endif
+			// multiply_batch_by_matrix(dE_dx, neural_network->weights[j], dE_dz);
+			// auxillary_function_five(y_intermediate_outputs[j - 1], y_intermediate_outputs[j - 1], dE_dx, neural_network->gamma);
+			
+			// dE/dx = (gamma / n) * transpose(W) * dE/dz, read in place with the scale folded into the product
+			general_matrix_mult(TRUE, FALSE, dE_dx->number_of_rows, dE_dx->number_of_cols, dE_dz->number_of_rows,
+				learning_rate / training_input->number_of_vectors, neural_network->weights[j - 1]->m, neural_network->weights[j - 1]->leading_dimension,
+				dE_dz->m, dE_dz->leading_dimension, 0, dE_dx->m, dE_dx->leading_dimension);
 
-	for (int i = 0; i < number_of_layers; i++) {
-		linear_intermediate_outputs[i] = init_mat(neural_network->layers[i], io_number_of_vectors);
-		z_intermediate_outputs[i] = init_mat(neural_network->layers[i], io_number_of_vectors);
-		y_intermediate_outputs[i] = init_mat(neural_network->layers[i], io_number_of_vectors);
+			/*
+			fprintf(stdout, "----------\ndE/dx\n");
+			for (int x = 0; x < dE_dx->number_of_rows; x++) {
+				for (int y = 0; y < dE_dx->number_of_cols; y++) {
+					fprintf(stdout, "%f ", VALUE_AT(dE_dx, x, y));
+				}
+				fprintf(stdout, "\n");
+			}
+			fprintf(stdout, "----------\n");
+			*/
+			
+			// ;ADFJSLKFDSAIOFJPASDJFLKSAD;NJFAPSLDI
+			// THIS WAS THE PROBLEM!!!!!
+			// layer_output = y_intermediate_outputs[j - 1];
+		}
 	}
 
-	copy_matrix(y_intermediate_outputs[0], inputs->data);
-
-	// forward propagation
-	for (int i = 1; i < number_of_layers; i++) {
-		// l_i = W*x_i where (x_i == y_{i - 1})
-		matrix_mult(linear_intermediate_outputs[i], neural_network->weights[i - 1], y_intermediate_outputs[i - 1]);
+	return loss;
+}
 
-		// z_i = l_i + b_i
-		add_vector_to_matrix(z_intermediate_outputs[i], linear_intermediate_outputs[i], neural_network->biases[i - 1]);
+train_config default_train_config(void) {
+	train_config config = {
+		.epochs = TRAIN_DEFAULT_EPOCHS,
+		.max_steps = 0,
+		.schedule = LEARNING_RATE_CONSTANT,
+		.decay_factor = 1,
+		.decay_epochs = 1,
+		.warmup_steps = 0,
+		.patience = 0,
+		.tolerance = 0,
+		.callback = NULL,
+		.callback_context = NULL,
+		.shuffle = FALSE,
+		.shuffle_seed = 0,
+	};
+	return config;
+}
 
-		// y_i = f(z_i)
-		nonlinear_transform_mat(y_intermediate_outputs[i], z_intermediate_outputs[i]);
+/**
+ * The learning rate of a step under the schedule, from the network's gamma
+ */
+static number scheduled_learning_rate(number gamma, const train_config* config, size_t epoch, size_t step) {
+	number rate = gamma;
+	switch (config->schedule) {
+		case LEARNING_RATE_CONSTANT:
+			break;
+		case LEARNING_RATE_STEP_DECAY:
+			for (size_t decays = epoch / config->decay_epochs; decays > 0; decays--) {
+				rate *= config->decay_factor;
+			}
+			break;
+		case LEARNING_RATE_INVERSE_TIME:
+			rate = gamma / (1 + config->decay_factor * epoch);
+			break;
 	}
+	if (step < config->warmup_steps) {
+		rate = rate * (step + 1) / config->warmup_steps;
+	}
+	return rate;
+}
 
-	copy_matrix(predictions->data, y_intermediate_outputs[number_of_layers - 1]);
+/**
+ * One step of a training loop: updates the network from a pair of batches at the given learning rate and returns
+ * their squared error
+ */
+typedef number (*training_step)(void* context, batch* training_input, batch* training_output, number learning_rate);
 
-	// delete the intermediate batches
-	// this only works if the batch_size for all batches are the same
-	for (int i = 0; i < neural_network->number_of_layers; i++) {
-		del_mat(linear_intermediate_outputs[i]);
-		del_mat(z_intermediate_outputs[i]);
-		del_mat(y_intermediate_outputs[i]);
+/**
+ * The samples of an m_batch as one dataset matrix, numbered in order from the first batch on. Batches cut out of
+ * one dataset by slice_into_batches() are read where they are; any others are copied into the arena once.
+ */
+static void m_batch_dataset(matrix* dataset, m_batch* many_batches, arena* memory) {
+	size_t total = many_batches->total_number_of_vectors;
+	matrix* first = many_batches->ray_of_batches[0]->data;
+
+	boolean contiguous = TRUE;
+	size_t column = 0;
+	for (int b = 0; contiguous && b < many_batches->number_of_batches; b++) {
+		matrix* data = many_batches->ray_of_batches[b]->data;
+		contiguous = (data->leading_dimension == total && data->m == first->m + column);
+		column += data->number_of_cols;
+	}
+	if (contiguous) {
+		*dataset = (matrix){ .m = first->m, .number_of_rows = first->number_of_rows, .number_of_cols = total, .leading_dimension = total };
+		return;
 	}
-	free(linear_intermediate_outputs);
-	free(z_intermediate_outputs);
-	free(y_intermediate_outputs);
 
-	return predictions;
-}
\ No newline at end of file
+	*dataset = *init_mat_in(memory, first->number_of_rows, total);
+	column = 0;
+	for (int b = 0; b < many_batches->number_of_batches; b++) {
+		matrix* data = many_batches->ray_of_batches[b]->data;
+		for (size_t i = 0; i < data->number_of_rows; i++) {
+			memcpy(&VALUE_AT(dataset, i, column), &VALUE_AT(data, i, 0), data->number_of_cols * sizeof(number));
+		}
+		column += data->number_of_cols;
+	}
+}
+
+/**
+ * What run_training() needs to reshuffle the samples every epoch: the datasets, the permutation of the epoch and
+ * a pair of batches the steps are gathered into, reused for every step
+ */
+struct epoch_shuffle_ {
+	matrix inputs;
+	matrix outputs;
+	size_t* permutation;
+	size_t next_sample;	// the first sample of the permutation not yet handed out this epoch
+	batch* input_batch;
+	batch* output_batch;
+	unsigned long long random_state;
+	arena* memory;
+};
+typedef struct epoch_shuffle_ epoch_shuffle;
+
+static void start_epoch_shuffle(epoch_shuffle* shuffle, m_batch* many_batches_training_input,
+		m_batch* many_batches_training_output, unsigned long long seed) {
+	size_t total = many_batches_training_input->total_number_of_vectors;
+	size_t largest = largest_batch(many_batches_training_input);
+	size_t input_size = many_batches_training_input->vector_size;
+	size_t output_size = many_batches_training_output->vector_size;
+
+	// room for the copies too, in case the batches are not views of one dataset
+	shuffle->memory = init_arena(ARENA_ROUND_UP(total * sizeof(size_t)) + 2 * ARENA_ROUND_UP(sizeof(batch))
+		+ mat_footprint(input_size, largest) + mat_footprint(output_size, largest)
+		+ mat_footprint(input_size, total) + mat_footprint(output_size, total));
+	m_batch_dataset(&shuffle->inputs, many_batches_training_input, shuffle->memory);
+	m_batch_dataset(&shuffle->outputs, many_batches_training_output, shuffle->memory);
+	shuffle->permutation = (size_t *)arena_alloc(shuffle->memory, total * sizeof(size_t));
+	shuffle->input_batch = create_empty_batch_in(shuffle->memory, largest, input_size);
+	shuffle->output_batch = create_empty_batch_in(shuffle->memory, largest, output_size);
+	shuffle->random_state = seed;
+}
+
+// the next number_of_vectors samples of the epoch's permutation, gathered into the shuffle's batches
+static void next_shuffled_batches(epoch_shuffle* shuffle, size_t number_of_vectors) {
+	resize_batch(shuffle->input_batch, number_of_vectors);
+	resize_batch(shuffle->output_batch, number_of_vectors);
+	gather_indexed_columns(shuffle->input_batch->data, &shuffle->inputs, shuffle->permutation + shuffle->next_sample);
+	gather_indexed_columns(shuffle->output_batch->data, &shuffle->outputs, shuffle->permutation + shuffle->next_sample);
+	shuffle->next_sample += number_of_vectors;
+}
+
+/**
+ * The loop shared by the m_batch training functions: epochs over the batches, in order or reshuffled, with the
+ * schedule, the limits, early stopping, the callback and the checkpoint hook
+ */
+static void run_training(ann* neural_network, m_batch* many_batches_training_input, m_batch* many_batches_training_output,
+		const train_config* config, train_result* result, training_step step_function, void* context) {
+	size_t number_of_batches = many_batches_training_input->number_of_batches;
+	double start = seconds_now();
+
+	epoch_shuffle shuffle;
+	if (config->shuffle) {
+		start_epoch_shuffle(&shuffle, many_batches_training_input, many_batches_training_output, config->shuffle_seed);
+	}
+
+	train_result outcome = { .stop_reason = TRAIN_COMPLETED };
+	number best_loss = 0;
+	size_t epochs_without_improvement = 0;
+
+	for (size_t epoch = 0; epoch < config->epochs && outcome.stop_reason == TRAIN_COMPLETED; epoch++) {
+		number epoch_loss = 0;
+		size_t epoch_samples = 0;
+		if (config->shuffle) {
+			random_permutation(shuffle.permutation, many_batches_training_input->total_number_of_vectors, &shuffle.random_state);
+			shuffle.next_sample = 0;
+		}
+		size_t b = 0;
+		for (; b < number_of_batches; b++) {
+			if (config->max_steps > 0 && outcome.steps == config->max_steps) {
+				outcome.stop_reason = TRAIN_REACHED_MAX_STEPS;
+				break;
+			}
+
+			// a shuffled epoch keeps the sizes of the batches, filled from the permutation
+			batch* training_input = many_batches_training_input->ray_of_batches[b];
+			batch* training_output = many_batches_training_output->ray_of_batches[b];
+			if (config->shuffle) {
+				next_shuffled_batches(&shuffle, training_input->number_of_vectors);
+				training_input = shuffle.input_batch;
+				training_output = shuffle.output_batch;
+			}
+			number learning_rate = scheduled_learning_rate(neural_network->gamma, config, epoch, outcome.steps);
+
+			double step_start = seconds_now();
+			number loss = step_function(context, training_input, training_output, learning_rate);
+			double step_end = seconds_now();
+
+			outcome.steps++;
+			epoch_loss += loss;
+			epoch_samples += training_input->number_of_vectors;
+			boolean end_of_epoch = (b == number_of_batches - 1);
+			checkpoint_after_step(neural_network, end_of_epoch);
+
+			if (config->callback != NULL) {
+				train_step_report report = {
+					.epoch = epoch,
+					.step = outcome.steps - 1,
+					.batch_size = training_input->number_of_vectors,
+					.loss = loss / training_input->number_of_vectors,
+					.learning_rate = learning_rate,
+					.step_seconds = step_end - step_start,
+					.elapsed_seconds = step_end - start,
+					.end_of_epoch = end_of_epoch,
+					.epoch_loss = end_of_epoch ? epoch_loss / epoch_samples : 0,
+				};
+				if (!config->callback(&report, config->callback_context)) {
+					outcome.stop_reason = TRAIN_STOPPED_BY_CALLBACK;
+					b++;
+					break;
+				}
+			}
+		}
+
+		if (epoch_samples > 0) {
+			outcome.final_loss = epoch_loss / epoch_samples;
+		}
+		if (b < number_of_batches) {
+			break;
+		}
+
+		// a whole epoch: measure it against the best so far
+		outcome.epochs++;
+		if (outcome.epochs == 1 || outcome.final_loss < best_loss - config->tolerance) {
+			best_loss = outcome.final_loss;
+			epochs_without_improvement = 0;
+		} else if (config->patience > 0 && ++epochs_without_improvement >= config->patience) {
+			outcome.stop_reason = TRAIN_STOPPED_EARLY;
+		}
+	}
+
+	if (config->shuffle) {
+		del_arena(shuffle.memory);
+	}
+	weights_updated(neural_network);
+	if (result != NULL) {
+		outcome.best_loss = best_loss;
+		outcome.seconds = seconds_now() - start;
+		*result = outcome;
+	}
+}
+
+/**
+ * Training function for the neural network. Accepts a batch of inputs and a batch of outputs.
+ */
+void train(ann* neural_network, m_batch* many_batches_training_input, m_batch* many_batches_training_output) {
+	train_config config = default_train_config();
+	train_with_config(neural_network, many_batches_training_input, many_batches_training_output, &config, NULL);
+}
+
+struct serial_training_ {
+	ann* neural_network;
+	ann_workspace* workspace;
+};
+typedef struct serial_training_ serial_training;
+
+static number serial_training_step(void* context, batch* training_input, batch* training_output, number learning_rate) {
+	serial_training* training = (serial_training *)context;
+	return train_step(training->neural_network, training->workspace, training_input, training_output, learning_rate);
+}
+
+#ifdef ML_LIB_DEBUG_MODE
+// the weights of a mapped network are the read-only file mapping, so every training entry point refuses one
+static void check_trainable(ann* neural_network, const char* caller) {
+	if (neural_network->mapping != NULL) {
+		fprintf(stderr, "ERROR IN %s: A mapped network cannot be trained\n", caller);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// the checks every train_config entry point shares
+static void check_train_config(ann* neural_network, const train_config* config) {
+	if (config->schedule == LEARNING_RATE_STEP_DECAY && config->decay_epochs == 0) {
+		fprintf(stderr, "ANN TRAINING ERROR: Step decay needs decay_epochs of at least 1\n");
+		exit(EXIT_FAILURE);
+	}
+	if (neural_network->output_activation != ACTIVATION_LEAKY_RELU && neural_network->output_activation != ACTIVATION_SOFTMAX) {
+		fprintf(stderr, "ANN TRAINING ERROR: The output layer must be Leaky-ReLU or softmax\n");
+		exit(EXIT_FAILURE);
+	}
+}
+#endif
+
+void train_with_config(ann* neural_network, m_batch* many_batches_training_input, m_batch* many_batches_training_output,
+		const train_config* config, train_result* result) {
+	#ifdef ML_LIB_DEBUG_MODE
+	check_trainable(neural_network, "TRAIN WITH CONFIG");
+	if (many_batches_training_input->total_number_of_vectors != many_batches_training_output->total_number_of_vectors) {
+		fprintf(stderr, "ANN TRAINING ERROR: Number of inputs does not match number of outputs\n");
+		exit(EXIT_FAILURE);
+	}
+	if (many_batches_training_input->vector_size != neural_network->layers[0]) {
+		fprintf(stderr, "ANN TRAINING ERROR: Size of inputs do not match input layer of neural network\n");
+		exit(EXIT_FAILURE);
+	}
+	if (many_batches_training_output->vector_size != neural_network->layers[neural_network->number_of_layers - 1]) {
+		fprintf(stderr, "ANN TRAINING ERROR: Size of outputs does not match output layer of neural network\n");
+		exit(EXIT_FAILURE);
+	}
+	// batches may differ in size, such as a short last batch, but each input batch must match its output batch
+	for (int i = 0; i < many_batches_training_input->number_of_batches; i++) {
+		if (many_batches_training_input->ray_of_batches[i]->number_of_vectors != many_batches_training_output->ray_of_batches[i]->number_of_vectors) {
+			fprintf(stderr, "ANN TRAINING ERROR: Input and output batch %d have different sizes.\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	check_train_config(neural_network, config);
+	#endif
+
+	neural_network->inference_weights_stale = TRUE;
+	serial_training training = {
+		.neural_network = neural_network,
+		.workspace = training_workspace(neural_network, largest_batch(many_batches_training_input)),
+	};
+	run_training(neural_network, many_batches_training_input, many_batches_training_output, config, result,
+		serial_training_step, &training);
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+/**
+ * SGD over a batch stream, one step per batch until the stream runs out. Each step is exactly a step of train(),
+ * and the next batch is being prepared by the stream while it runs.
+ */
+void train_from_stream(ann* neural_network, batch_stream* stream) {
+	#ifdef ML_LIB_DEBUG_MODE
+	check_trainable(neural_network, "TRAIN FROM STREAM");
+	if (stream->input_size != neural_network->layers[0]) {
+		fprintf(stderr, "ANN STREAM TRAINING ERROR: Size of inputs do not match input layer of neural network\n");
+		exit(EXIT_FAILURE);
+	}
+	if (stream->output_size != neural_network->layers[neural_network->number_of_layers - 1]) {
+		fprintf(stderr, "ANN STREAM TRAINING ERROR: Size of outputs does not match output layer of neural network\n");
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	neural_network->inference_weights_stale = TRUE;
+	ann_workspace* workspace = training_workspace(neural_network, stream->batch_size);
+
+	batch* training_input;
+	batch* training_output;
+	while (next_batch(stream, &training_input, &training_output)) {
+		train_step(neural_network, workspace, training_input, training_output, neural_network->gamma);
+		checkpoint_after_step(neural_network, FALSE);
+	}
+	weights_updated(neural_network);
+}
+
+/**
+ * One slice of the columns of a batch, with everything a worker needs to take its gradient
+ */
+struct ann_shard_ {
+	size_t first_column;
+	size_t width;
+	ann_workspace* workspace;
+	matrix input;	// views of the shard's columns of the batch
+	matrix target;
+	matrix** grad_w;
+	vector** grad_b;
+	number error;
+};
+typedef struct ann_shard_ ann_shard;
+
+struct train_parallel_job_ {
+	ann* neural_network;
+	ann_shard* shards;
+	size_t number_of_shards;
+	batch* training_input;
+	batch* training_output;
+	number learning_rate;
+	number dE_dx_scale;	// learning_rate as in train(), or 1 with an optimizer
+	size_t stride;	// distance between the two shards merged by a reduction task
+};
+typedef struct train_parallel_job_ train_parallel_job;
+
+/**
+ * Forward and backward pass of one shard against the weights as they were at the start of the step
+ */
+static void shard_gradient_task(void* context, size_t shard_index) {
+	train_parallel_job* job = (train_parallel_job *)context;
+	ann* neural_network = job->neural_network;
+	ann_shard* shard = &job->shards[shard_index];
+	ann_workspace* workspace = shard->workspace;
+	size_t number_of_layers = neural_network->number_of_layers;
+
+	matrix** z_intermediate_outputs = workspace->z_intermediate_outputs;
+	matrix** y_intermediate_outputs = workspace->y_intermediate_outputs;
+
+	// a short batch can leave a slice empty, which then contributes zero gradients
+	resize_ann_workspace(workspace, shard->width);
+	init_mat_view(&shard->input, job->training_input->data, 0, shard->first_column, job->training_input->vector_size, shard->width);
+	init_mat_view(&shard->target, job->training_output->data, 0, shard->first_column, job->training_output->vector_size, shard->width);
+	y_intermediate_outputs[0] = &shard->input;
+
+	for (int i = 1; i < number_of_layers; i++) {
+		training_layer_forward(neural_network, i, y_intermediate_outputs[i], z_intermediate_outputs[i], y_intermediate_outputs[i - 1]);
+	}
+
+	for (int j = number_of_layers - 1; j > 0; j--) {
+		if (j == number_of_layers - 1) {
+			shard->error = output_layer_gradient(neural_network, workspace->dE_dz[j], y_intermediate_outputs[j], &shard->target,
+				z_intermediate_outputs[j], y_intermediate_outputs[j - 1], shard->grad_w[j - 1], shard->grad_b[j - 1]);
+		} else {
+			layer_gradient(workspace->dE_dz[j], workspace->dE_dy[j], NULL, z_intermediate_outputs[j],
+				y_intermediate_outputs[j - 1], shard->grad_w[j - 1], shard->grad_b[j - 1]);
+		}
+
+		if (j != 1) {
+			// same scaling of dE/dx as train()
+			matrix* dE_dz = workspace->dE_dz[j];
+			matrix* dE_dx = workspace->dE_dy[j - 1];
+			general_matrix_mult(TRUE, FALSE, dE_dx->number_of_rows, dE_dx->number_of_cols, dE_dz->number_of_rows,
+				job->dE_dx_scale, neural_network->weights[j - 1]->m, neural_network->weights[j - 1]->leading_dimension,
+				dE_dz->m, dE_dz->leading_dimension, 0, dE_dx->m, dE_dx->leading_dimension);
+		}
+	}
+}
+
+/**
+ * One node of the reduction tree: shard 'index * 2 * stride' absorbs the gradients of shard 'index * 2 * stride + stride'
+ */
+static void shard_reduce_task(void* context, size_t task_index) {
+	train_parallel_job* job = (train_parallel_job *)context;
+	ann_shard* into = &job->shards[task_index * 2 * job->stride];
+	ann_shard* from = &job->shards[task_index * 2 * job->stride + job->stride];
+
+	for (int i = 0; i < job->neural_network->number_of_layers - 1; i++) {
+		matrix* grad_w = into->grad_w[i];
+		kernels->add(grad_w->m, grad_w->m, from->grad_w[i]->m, grad_w->number_of_rows * grad_w->number_of_cols);
+		kernels->add(into->grad_b[i]->v, into->grad_b[i]->v, from->grad_b[i]->v, into->grad_b[i]->size);
+	}
+	into->error += from->error;
+}
+
+/**
+ * One step of train_parallel(): gradients of the slices, their sum, and the update
+ */
+static number parallel_training_step(void* context, batch* training_input, batch* training_output, number learning_rate) {
+	train_parallel_job* job = (train_parallel_job *)context;
+	ann* neural_network = job->neural_network;
+	ann_shard* shards = job->shards;
+	size_t number_of_shards = job->number_of_shards;
+	job->training_input = training_input;
+	job->training_output = training_output;
+
+	// the slices are recut for every batch, so a short one is spread over the threads like the rest
+	size_t number_of_vectors = training_input->number_of_vectors;
+	job->learning_rate = learning_rate / number_of_vectors;
+	job->dE_dx_scale = (neural_network->optimizer != NULL) ? 1 : job->learning_rate;
+	for (int s = 0; s < number_of_shards; s++) {
+		shards[s].first_column = number_of_vectors * s / number_of_shards;
+		shards[s].width = number_of_vectors * (s + 1) / number_of_shards - shards[s].first_column;
+	}
+
+	parallel_for(number_of_shards, shard_gradient_task, job);
+
+	// pairwise sums, so the work on the critical path grows with log2 of the number of shards
+	for (job->stride = 1; job->stride < number_of_shards; job->stride *= 2) {
+		size_t number_of_pairs = (number_of_shards - job->stride + 2 * job->stride - 1) / (2 * job->stride);
+		parallel_for(number_of_pairs, shard_reduce_task, job);
+	}
+
+	if (neural_network->optimizer != NULL) {
+		optimizer_step(neural_network, shards[0].grad_w, shards[0].grad_b, learning_rate, (number)1 / number_of_vectors);
+		return shards[0].error;
+	}
+
+	// one update from the summed gradient: W -= (gamma / n) * grad_w, b -= (gamma / n) * grad_b
+	for (int i = 0; i < neural_network->number_of_layers - 1; i++) {
+		matrix_scale(shards[0].grad_w[i], shards[0].grad_w[i], -job->learning_rate);
+		matrix_add(neural_network->weights[i], neural_network->weights[i], shards[0].grad_w[i]);
+		vector_scale(shards[0].grad_b[i], shards[0].grad_b[i], -job->learning_rate);
+		vector_add(neural_network->biases[i], neural_network->biases[i], shards[0].grad_b[i]);
+	}
+
+	return shards[0].error;
+}
+
+/**
+ * Synchronous data-parallel training. Every batch is cut into one slice of columns per thread; each thread runs
+ * the forward and backward pass of its slice in its own workspace, the per-slice gradients are summed pairwise
+ * in a tree, and a single SGD step is applied to the network. The steps, learning rate and batch order are those
+ * of train(), but all layers take their gradient against the weights from the start of the step.
+ * For a fixed number of threads the result does not depend on scheduling.
+ */
+void train_parallel(ann* neural_network, m_batch* many_batches_training_input, m_batch* many_batches_training_output) {
+	train_config config = default_train_config();
+	train_parallel_with_config(neural_network, many_batches_training_input, many_batches_training_output, &config, NULL);
+}
+
+void train_parallel_with_config(ann* neural_network, m_batch* many_batches_training_input, m_batch* many_batches_training_output,
+		const train_config* config, train_result* result) {
+	#ifdef ML_LIB_DEBUG_MODE
+	check_trainable(neural_network, "TRAIN PARALLEL");
+	if (many_batches_training_input->total_number_of_vectors != many_batches_training_output->total_number_of_vectors) {
+		fprintf(stderr, "ANN PARALLEL TRAINING ERROR: Number of inputs does not match number of outputs\n");
+		exit(EXIT_FAILURE);
+	}
+	if (many_batches_training_input->vector_size != neural_network->layers[0]) {
+		fprintf(stderr, "ANN PARALLEL TRAINING ERROR: Size of inputs do not match input layer of neural network\n");
+		exit(EXIT_FAILURE);
+	}
+	if (many_batches_training_output->vector_size != neural_network->layers[neural_network->number_of_layers - 1]) {
+		fprintf(stderr, "ANN PARALLEL TRAINING ERROR: Size of outputs does not match output layer of neural network\n");
+		exit(EXIT_FAILURE);
+	}
+	// batches may differ in size, such as a short last batch, but each input batch must match its output batch
+	for (int i = 0; i < many_batches_training_input->number_of_batches; i++) {
+		if (many_batches_training_input->ray_of_batches[i]->number_of_vectors != many_batches_training_output->ray_of_batches[i]->number_of_vectors) {
+			fprintf(stderr, "ANN PARALLEL TRAINING ERROR: Input and output batch %d have different sizes.\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	check_train_config(neural_network, config);
+	#endif
+
+	neural_network->inference_weights_stale = TRUE;
+	size_t number_of_layers = neural_network->number_of_layers;
+	size_t io_number_of_vectors = largest_batch(many_batches_training_input);
+
+	size_t number_of_shards = get_number_of_threads();
+	if (number_of_shards > io_number_of_vectors) {
+		number_of_shards = io_number_of_vectors;
+	}
+
+	// the shard table and gradients share one arena; the workspaces bring their own
+	size_t arena_size = ARENA_ROUND_UP(number_of_shards * sizeof(ann_shard));
+	for (int s = 0; s < number_of_shards; s++) {
+		arena_size += 2 * ARENA_ROUND_UP((number_of_layers - 1) * sizeof(void *));
+		for (int i = 0; i < number_of_layers - 1; i++) {
+			arena_size += mat_footprint(neural_network->layers[i + 1], neural_network->layers[i]) + vec_footprint(neural_network->layers[i + 1]);
+		}
+	}
+	arena* memory = init_arena(arena_size);
+
+	ann_shard* shards = (ann_shard *)arena_alloc(memory, number_of_shards * sizeof(ann_shard));
+	// no slice of any batch is wider than this
+	size_t widest_shard = (io_number_of_vectors + number_of_shards - 1) / number_of_shards;
+	for (int s = 0; s < number_of_shards; s++) {
+		shards[s].workspace = create_ann_workspace(neural_network, widest_shard);
+		shards[s].grad_w = (matrix **)arena_alloc(memory, (number_of_layers - 1) * sizeof(matrix *));
+		shards[s].grad_b = (vector **)arena_alloc(memory, (number_of_layers - 1) * sizeof(vector *));
+		for (int i = 0; i < number_of_layers - 1; i++) {
+			shards[s].grad_w[i] = init_mat_in(memory, neural_network->layers[i + 1], neural_network->layers[i]);
+			shards[s].grad_b[i] = init_vec_in(memory, neural_network->layers[i + 1]);
+		}
+		shards[s].error = 0;
+	}
+
+	train_parallel_job job = { .neural_network = neural_network, .shards = shards, .number_of_shards = number_of_shards };
+	run_training(neural_network, many_batches_training_input, many_batches_training_output, config, result,
+		parallel_training_step, &job);
+
+	for (int s = 0; s < number_of_shards; s++) {
+		delete_ann_workspace(shards[s].workspace);
+	}
+	del_arena(memory);
+}
+
+struct hogwild_job_ {
+	ann* neural_network;
+	m_batch* training_input;
+	m_batch* training_output;
+	ann_workspace** workspaces;
+	training_thread_stats* stats;
+	number gamma;
+	size_t total_steps;
+	atomic_size_t next_step;
+};
+typedef struct hogwild_job_ hogwild_job;
+
+/**
+ * One Hogwild worker. Claims steps from the shared cursor until there are none left and runs each one exactly
+ * like an iteration of train(), writing straight into the shared weights and biases.
+ */
+static void hogwild_worker(void* context, size_t worker_index) {
+	hogwild_job* job = (hogwild_job *)context;
+	ann* neural_network = job->neural_network;
+	ann_workspace* workspace = job->workspaces[worker_index];
+	size_t number_of_layers = neural_network->number_of_layers;
+	size_t number_of_batches = job->training_input->number_of_batches;
+
+	matrix** z_intermediate_outputs = workspace->z_intermediate_outputs;
+	matrix** y_intermediate_outputs = workspace->y_intermediate_outputs;
+
+	training_thread_stats* stats = &job->stats[worker_index];
+	double start = seconds_now();
+
+	size_t step;
+	while ((step = atomic_fetch_add_explicit(&job->next_step, 1, memory_order_relaxed)) < job->total_steps) {
+		batch* training_input = job->training_input->ray_of_batches[step % number_of_batches];
+		batch* training_output = job->training_output->ray_of_batches[step % number_of_batches];
+		number learning_rate = job->gamma / training_input->number_of_vectors;
+
+		resize_ann_workspace(workspace, training_input->number_of_vectors);
+		y_intermediate_outputs[0] = training_input->data;
+		for (int i = 1; i < number_of_layers; i++) {
+			training_layer_forward(neural_network, i, y_intermediate_outputs[i], z_intermediate_outputs[i], y_intermediate_outputs[i - 1]);
+		}
+
+		for (int j = number_of_layers - 1; j > 0; j--) {
+			if (j == number_of_layers - 1) {
+				output_layer_backward(neural_network, workspace->dE_dz[j], y_intermediate_outputs[j], training_output->data,
+					z_intermediate_outputs[j], y_intermediate_outputs[j - 1], learning_rate);
+			} else {
+				layer_backward(workspace->dE_dz[j], workspace->dE_dy[j], NULL, z_intermediate_outputs[j],
+					y_intermediate_outputs[j - 1], neural_network->weights[j - 1], neural_network->biases[j - 1], learning_rate);
+			}
+
+			if (j != 1) {
+				matrix* dE_dz = workspace->dE_dz[j];
+				matrix* dE_dx = workspace->dE_dy[j - 1];
+				general_matrix_mult(TRUE, FALSE, dE_dx->number_of_rows, dE_dx->number_of_cols, dE_dz->number_of_rows,
+					learning_rate, neural_network->weights[j - 1]->m, neural_network->weights[j - 1]->leading_dimension,
+					dE_dz->m, dE_dz->leading_dimension, 0, dE_dx->m, dE_dx->leading_dimension);
+			}
+		}
+
+		stats->batches++;
+		stats->samples += training_input->number_of_vectors;
+	}
+
+	stats->seconds = seconds_now() - start;
+	stats->samples_per_second = (stats->seconds > 0) ? stats->samples / stats->seconds : 0;
+}
+
+/**
+ * Asynchronous lock-free training in the style of Hogwild!. One worker per pool thread pulls steps from an
+ * atomic cursor and updates the shared weights and biases in place with no locking, so workers see each other's
+ * updates whenever they happen to land. This trades exact reproducibility for the absence of any barrier between
+ * steps; results vary from run to run once more than one thread is used.
+ *
+ * The number of steps and the batch order match train(). The learning rate is gamma throughout: Hogwild takes no
+ * train_config, so the schedules, early stopping and callbacks of train_with_config() do not apply.
+ * If stats is not NULL it must have room for get_number_of_threads() entries and receives the work and throughput
+ * of each worker.
+ */
+void train_hogwild(ann* neural_network, m_batch* many_batches_training_input, m_batch* many_batches_training_output,
+		training_thread_stats* stats) {
+	#ifdef ML_LIB_DEBUG_MODE
+	check_trainable(neural_network, "TRAIN HOGWILD");
+	if (neural_network->optimizer != NULL) {
+		fprintf(stderr, "ANN HOGWILD TRAINING ERROR: Hogwild takes plain SGD steps, set OPTIMIZER_SGD first\n");
+		exit(EXIT_FAILURE);
+	}
+	if (many_batches_training_input->total_number_of_vectors != many_batches_training_output->total_number_of_vectors) {
+		fprintf(stderr, "ANN HOGWILD TRAINING ERROR: Number of inputs does not match number of outputs\n");
+		exit(EXIT_FAILURE);
+	}
+	if (many_batches_training_input->vector_size != neural_network->layers[0]) {
+		fprintf(stderr, "ANN HOGWILD TRAINING ERROR: Size of inputs do not match input layer of neural network\n");
+		exit(EXIT_FAILURE);
+	}
+	if (many_batches_training_output->vector_size != neural_network->layers[neural_network->number_of_layers - 1]) {
+		fprintf(stderr, "ANN HOGWILD TRAINING ERROR: Size of outputs does not match output layer of neural network\n");
+		exit(EXIT_FAILURE);
+	}
+	// batches may differ in size, such as a short last batch, but each input batch must match its output batch
+	for (int i = 0; i < many_batches_training_input->number_of_batches; i++) {
+		if (many_batches_training_input->ray_of_batches[i]->number_of_vectors != many_batches_training_output->ray_of_batches[i]->number_of_vectors) {
+			fprintf(stderr, "ANN HOGWILD TRAINING ERROR: Input and output batch %d have different sizes.\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	#endif
+
+	neural_network->inference_weights_stale = TRUE;
+	size_t io_number_of_vectors = largest_batch(many_batches_training_input);
+	size_t number_of_workers = get_number_of_threads();
+
+	hogwild_job job = {
+		.neural_network = neural_network,
+		.training_input = many_batches_training_input,
+		.training_output = many_batches_training_output,
+		.gamma = neural_network->gamma,
+		.total_steps = TRAIN_DEFAULT_EPOCHS * many_batches_training_input->number_of_batches,
+	};
+	atomic_init(&job.next_step, 0);
+
+	#ifdef ML_LIB_DEBUG_MODE
+	job.workspaces = (ann_workspace **)calloc(number_of_workers, sizeof(ann_workspace *));
+	job.stats = (training_thread_stats *)calloc(number_of_workers, sizeof(training_thread_stats));
+	#else
+	job.workspaces = (ann_workspace **)malloc(number_of_workers * sizeof(ann_workspace *));
+	job.stats = (training_thread_stats *)malloc(number_of_workers * sizeof(training_thread_stats));
+	#endif
+	for (int i = 0; i < number_of_workers; i++) {
+		job.workspaces[i] = create_ann_workspace(neural_network, io_number_of_vectors);
+		job.stats[i] = (training_thread_stats){ 0 };
+	}
+
+	parallel_for(number_of_workers, hogwild_worker, &job);
+	weights_updated(neural_network);
+
+	if (stats != NULL) {
+		memcpy(stats, job.stats, number_of_workers * sizeof(training_thread_stats));
+	}
+	for (int i = 0; i < number_of_workers; i++) {
+		delete_ann_workspace(job.workspaces[i]);
+	}
+	free(job.workspaces);
+	free(job.stats);
+}
+
+/**
+ * Scratch space of train_mixed_precision(). The 16-bit arrays hold one layer each, as rows of the current batch
+ * width stored one after the other. The full precision matrices are sized for the widest layer and reshaped for
+ * whichever layer they hold at the moment.
+ */
+struct mixed_precision_workspace_ {
+	uint16_t** y;	// indexed by layer, from 1
+	uint16_t** z;
+
+	matrix* activations[2];	// alternate between the input and output of a layer
+	matrix* z_scratch;
+	matrix* dE_dz;
+	matrix** grad_w;
+	vector** grad_b;
+
+	arena* memory;
+};
+typedef struct mixed_precision_workspace_ mixed_precision_workspace;
+
+static mixed_precision_workspace* create_mixed_precision_workspace(ann* neural_network, size_t batch_size) {
+	mixed_precision_workspace* workspace;
+	size_t number_of_layers = neural_network->number_of_layers;
+
+	#ifdef ML_LIB_DEBUG_MODE
+	workspace = (mixed_precision_workspace *)calloc(1, sizeof(mixed_precision_workspace));
+	#else
+	workspace = (mixed_precision_workspace *)malloc(sizeof(mixed_precision_workspace));
+	#endif
+
+	size_t widest_layer = 0;
+	for (int i = 1; i < number_of_layers; i++) {
+		widest_layer = (neural_network->layers[i] > widest_layer) ? neural_network->layers[i] : widest_layer;
+	}
+
+	size_t arena_size = 4 * ARENA_ROUND_UP(number_of_layers * sizeof(void *)) + 4 * mat_footprint(widest_layer, batch_size);
+	for (int i = 1; i < number_of_layers; i++) {
+		arena_size += ((i < number_of_layers - 1) ? 2 : 1) * ARENA_ROUND_UP(neural_network->layers[i] * batch_size * sizeof(uint16_t))
+			+ mat_footprint(neural_network->layers[i], neural_network->layers[i - 1]) + vec_footprint(neural_network->layers[i]);
+	}
+	workspace->memory = init_arena(arena_size);
+
+	workspace->y = (uint16_t **)arena_alloc(workspace->memory, number_of_layers * sizeof(uint16_t *));
+	workspace->z = (uint16_t **)arena_alloc(workspace->memory, number_of_layers * sizeof(uint16_t *));
+	workspace->grad_w = (matrix **)arena_alloc(workspace->memory, number_of_layers * sizeof(matrix *));
+	workspace->grad_b = (vector **)arena_alloc(workspace->memory, number_of_layers * sizeof(vector *));
+	for (int i = 1; i < number_of_layers; i++) {
+		// the output layer's y is never kept
+		workspace->y[i] = (i < number_of_layers - 1) ? (uint16_t *)arena_alloc(workspace->memory, neural_network->layers[i] * batch_size * sizeof(uint16_t)) : NULL;
+		workspace->z[i] = (uint16_t *)arena_alloc(workspace->memory, neural_network->layers[i] * batch_size * sizeof(uint16_t));
+		workspace->grad_w[i - 1] = init_mat_in(workspace->memory, neural_network->layers[i], neural_network->layers[i - 1]);
+		workspace->grad_b[i - 1] = init_vec_in(workspace->memory, neural_network->layers[i]);
+	}
+	workspace->activations[0] = init_mat_in(workspace->memory, widest_layer, batch_size);
+	workspace->activations[1] = init_mat_in(workspace->memory, widest_layer, batch_size);
+	workspace->z_scratch = init_mat_in(workspace->memory, widest_layer, batch_size);
+	workspace->dE_dz = init_mat_in(workspace->memory, widest_layer, batch_size);
+
+	return workspace;
+}
+
+/**
+ * Point a scratch matrix at the leading nrows x ncols of its buffer, as a contiguous matrix
+ */
+static matrix* reshape_scratch(matrix* scratch, size_t nrows, size_t ncols) {
+	scratch->number_of_rows = nrows;
+	scratch->number_of_cols = ncols;
+	scratch->leading_dimension = ncols;
+	return scratch;
+}
+
+static void store_half(half_format format, uint16_t* out, const matrix* in) {
+	for (size_t i = 0; i < in->number_of_rows; i++) {
+		if (format == HALF_BFLOAT16) {
+			convert_to_bfloat16(out + i * in->number_of_cols, &VALUE_AT(in, i, 0), in->number_of_cols);
+		} else {
+			convert_to_float16(out + i * in->number_of_cols, &VALUE_AT(in, i, 0), in->number_of_cols);
+		}
+	}
+}
+
+static void load_half(half_format format, matrix* out, const uint16_t* in) {
+	for (size_t i = 0; i < out->number_of_rows; i++) {
+		if (format == HALF_BFLOAT16) {
+			convert_from_bfloat16(&VALUE_AT(out, i, 0), in + i * out->number_of_cols, out->number_of_cols);
+		} else {
+			convert_from_float16(&VALUE_AT(out, i, 0), in + i * out->number_of_cols, out->number_of_cols);
+		}
+	}
+}
+
+// Round every entry to the nearest value the 16-bit format can hold
+static void round_to_half(half_format format, matrix* mat) {
+	for (size_t i = 0; i < mat->number_of_rows; i++) {
+		number* row = &VALUE_AT(mat, i, 0);
+		for (size_t j = 0; j < mat->number_of_cols; j++) {
+			row[j] = (format == HALF_BFLOAT16) ? bfloat16_to_float(float_to_bfloat16(row[j])) : float16_to_float(float_to_float16(row[j]));
+		}
+	}
+}
+
+/**
+ * One step of train_mixed_precision(). Returns FALSE, leaving the network alone, if a gradient overflowed.
+ * The loss of the batch is written to loss either way.
+ */
+static boolean mixed_precision_step(ann* neural_network, mixed_precision_workspace* workspace, batch* training_input,
+		batch* training_output, half_format format, number loss_scale, number learning_rate, number* loss) {
+	size_t number_of_layers = neural_network->number_of_layers;
+	size_t* layers = neural_network->layers;
+	size_t number_of_vectors = training_input->number_of_vectors;
+
+	// forward, keeping only the 16-bit copies of y and z for later
+	boolean softmax = (neural_network->output_activation == ACTIVATION_SOFTMAX);
+	matrix* x = training_input->data;
+	matrix* y = NULL;
+	for (int i = 1; i < number_of_layers; i++) {
+		y = reshape_scratch(workspace->activations[i % 2], layers[i], number_of_vectors);
+		if (softmax && i == number_of_layers - 1) {
+			// the softmax head's logits, which its error is taken from without z
+			layer_forward_activation(y, NULL, neural_network->weights[i - 1], neural_network->biases[i - 1], x, ACTIVATION_LINEAR);
+			break;
+		}
+		matrix* z = reshape_scratch(workspace->z_scratch, layers[i], number_of_vectors);
+		layer_forward(y, z, neural_network->weights[i - 1], neural_network->biases[i - 1], x);
+		// the output itself is only needed for the error, straight away
+		if (i < number_of_layers - 1) {
+			store_half(format, workspace->y[i], y);
+		}
+		store_half(format, workspace->z[i], z);
+		x = y;
+	}
+
+	// the rate applied to gradients summed over the batch
+	number batch_rate = learning_rate / number_of_vectors;
+	number dE_dx_scale = (neural_network->optimizer != NULL) ? 1 : batch_rate;
+
+	// the scaled output error, in place of the output, with the loss taken in the same pass. The softmax head's
+	// is dE/dz itself and goes straight to its buffer, leaving the logits' one free for dE/dx.
+	matrix* dE_dy = y;
+	if (softmax) {
+		matrix* dE_dz = reshape_scratch(workspace->dE_dz, layers[number_of_layers - 1], number_of_vectors);
+		*loss = softmax_cross_entropy(dE_dz, y, training_output->data);
+		matrix_scale(dE_dz, dE_dz, loss_scale);
+	} else {
+		number total_error = 0;
+		for (size_t r = 0; r < dE_dy->number_of_rows; r++) {
+			number* row = &VALUE_AT(dE_dy, r, 0);
+			const number* target = &VALUE_AT(training_output->data, r, 0);
+			for (size_t c = 0; c < number_of_vectors; c++) {
+				number error = row[c] - target[c];
+				total_error += error * error;
+				row[c] = error * loss_scale;
+			}
+		}
+		*loss = total_error;
+	}
+
+	for (int j = number_of_layers - 1; j > 0; j--) {
+		matrix* other = (dE_dy == workspace->activations[0]) ? workspace->activations[1] : workspace->activations[0];
+		matrix* x = training_input->data;
+		if (j > 1) {
+			x = reshape_scratch(other, layers[j - 1], number_of_vectors);
+			load_half(format, x, workspace->y[j - 1]);
+		}
+
+		matrix* dE_dz = reshape_scratch(workspace->dE_dz, layers[j], number_of_vectors);
+		if (softmax && j == number_of_layers - 1) {
+			output_error_gradient(dE_dz, x, workspace->grad_w[j - 1], workspace->grad_b[j - 1]);
+		} else {
+			matrix* z = reshape_scratch(workspace->z_scratch, layers[j], number_of_vectors);
+			load_half(format, z, workspace->z[j]);
+			layer_gradient(dE_dz, dE_dy, NULL, z, x, workspace->grad_w[j - 1], workspace->grad_b[j - 1]);
+		}
+
+		if (j > 1) {
+			// dE/dx as in train(), rounded to the 16-bit format like the activations, which is where a small
+			// gradient would be lost without the loss scale
+			matrix* dE_dx = reshape_scratch(dE_dy, layers[j - 1], number_of_vectors);
+			general_matrix_mult(TRUE, FALSE, dE_dx->number_of_rows, dE_dx->number_of_cols, dE_dz->number_of_rows,
+				dE_dx_scale, neural_network->weights[j - 1]->m, neural_network->weights[j - 1]->leading_dimension,
+				dE_dz->m, dE_dz->leading_dimension, 0, dE_dx->m, dE_dx->leading_dimension);
+			round_to_half(format, dE_dx);
+			dE_dy = dE_dx;
+		}
+	}
+
+	// an infinity or NaN anywhere makes the sum of its gradient one too
+	for (int i = 0; i < number_of_layers - 1; i++) {
+		matrix* grad_w = workspace->grad_w[i];
+		vector* grad_b = workspace->grad_b[i];
+		number total = kernels->sum(grad_w->m, grad_w->number_of_rows * grad_w->number_of_cols) + kernels->sum(grad_b->v, grad_b->size);
+		if (!isfinite(total)) {
+			return FALSE;
+		}
+	}
+
+	if (neural_network->optimizer != NULL) {
+		optimizer_step(neural_network, workspace->grad_w, workspace->grad_b, learning_rate, 1 / (number_of_vectors * loss_scale));
+		return TRUE;
+	}
+
+	for (int i = 0; i < number_of_layers - 1; i++) {
+		matrix_scale(workspace->grad_w[i], workspace->grad_w[i], -batch_rate / loss_scale);
+		matrix_add(neural_network->weights[i], neural_network->weights[i], workspace->grad_w[i]);
+		vector_scale(workspace->grad_b[i], workspace->grad_b[i], -batch_rate / loss_scale);
+		vector_add(neural_network->biases[i], neural_network->biases[i], workspace->grad_b[i]);
+	}
+	return TRUE;
+}
+
+struct mixed_precision_training_ {
+	ann* neural_network;
+	mixed_precision_workspace* workspace;
+	mixed_precision_options* options;
+	size_t clean_steps;	// steps in a row without overflow, for the dynamic loss scale
+};
+typedef struct mixed_precision_training_ mixed_precision_training;
+
+static number mixed_precision_training_step(void* context, batch* training_input, batch* training_output, number learning_rate) {
+	mixed_precision_training* training = (mixed_precision_training *)context;
+	mixed_precision_options* options = training->options;
+
+	number loss;
+	boolean applied = mixed_precision_step(training->neural_network, training->workspace, training_input, training_output,
+		options->activation_format, options->loss_scale, learning_rate, &loss);
+	if (!applied) {
+		options->skipped_steps++;
+	}
+
+	if (options->dynamic_loss_scale) {
+		if (!applied) {
+			options->loss_scale /= 2;
+			training->clean_steps = 0;
+		} else if (++training->clean_steps == MIXED_PRECISION_GROWTH_INTERVAL) {
+			options->loss_scale *= 2;
+			training->clean_steps = 0;
+		}
+	}
+	return loss;
+}
+
+void train_mixed_precision(ann* neural_network, m_batch* many_batches_training_input, m_batch* many_batches_training_output,
+		mixed_precision_options* options) {
+	train_config config = default_train_config();
+	train_mixed_precision_with_config(neural_network, many_batches_training_input, many_batches_training_output, options,
+		&config, NULL);
+}
+
+void train_mixed_precision_with_config(ann* neural_network, m_batch* many_batches_training_input,
+		m_batch* many_batches_training_output, mixed_precision_options* options, const train_config* config,
+		train_result* result) {
+	#ifdef ML_LIB_DEBUG_MODE
+	check_trainable(neural_network, "TRAIN MIXED PRECISION");
+	if (many_batches_training_input->total_number_of_vectors != many_batches_training_output->total_number_of_vectors) {
+		fprintf(stderr, "ANN MIXED PRECISION TRAINING ERROR: Number of inputs does not match number of outputs\n");
+		exit(EXIT_FAILURE);
+	}
+	if (many_batches_training_input->vector_size != neural_network->layers[0]) {
+		fprintf(stderr, "ANN MIXED PRECISION TRAINING ERROR: Size of inputs do not match input layer of neural network\n");
+		exit(EXIT_FAILURE);
+	}
+	if (many_batches_training_output->vector_size != neural_network->layers[neural_network->number_of_layers - 1]) {
+		fprintf(stderr, "ANN MIXED PRECISION TRAINING ERROR: Size of outputs does not match output layer of neural network\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < many_batches_training_input->number_of_batches; i++) {
+		if (many_batches_training_input->ray_of_batches[i]->number_of_vectors != many_batches_training_output->ray_of_batches[i]->number_of_vectors) {
+			fprintf(stderr, "ANN MIXED PRECISION TRAINING ERROR: Input and output batch %d have different sizes.\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!(options->loss_scale > 0)) {
+		fprintf(stderr, "ANN MIXED PRECISION TRAINING ERROR: The loss scale must be positive\n");
+		exit(EXIT_FAILURE);
+	}
+	check_train_config(neural_network, config);
+	#endif
+
+	neural_network->inference_weights_stale = TRUE;
+	options->skipped_steps = 0;
+	mixed_precision_training training = {
+		.neural_network = neural_network,
+		.workspace = create_mixed_precision_workspace(neural_network, largest_batch(many_batches_training_input)),
+		.options = options,
+		.clean_steps = 0,
+	};
+	mixed_precision_workspace* workspace = training.workspace;
+
+	run_training(neural_network, many_batches_training_input, many_batches_training_output, config, result,
+		mixed_precision_training_step, &training);
+
+	del_arena(workspace->memory);
+	free(workspace);
+}
+
+/**
+ * Round the weights to bfloat16 into copies kept with the network, allocated from its arena the first time
+ */
+void store_inference_weights(ann* neural_network) {
+	size_t number_of_layers = neural_network->number_of_layers;
+
+	if (neural_network->inference_weights == NULL) {
+		neural_network->inference_weights = (bfloat16 **)arena_alloc(neural_network->memory, (number_of_layers - 1) * sizeof(bfloat16 *));
+		for (int i = 0; i < number_of_layers - 1; i++) {
+			size_t size = neural_network->layers[i + 1] * neural_network->layers[i];
+			neural_network->inference_weights[i] = (bfloat16 *)arena_alloc(neural_network->memory, size * sizeof(bfloat16));
+		}
+	}
+
+	for (int i = 0; i < number_of_layers - 1; i++) {
+		matrix_to_bfloat16(neural_network->inference_weights[i], neural_network->layers[i], neural_network->weights[i]);
+	}
+	neural_network->inference_weights_stale = FALSE;
+}
+
+inference_session* create_inference_session(ann* neural_network, size_t max_batch_size) {
+	inference_session* session;
+
+	#ifdef ML_LIB_DEBUG_MODE
+	session = (inference_session *)calloc(1, sizeof(inference_session));
+	#else
+	session = (inference_session *)malloc(sizeof(inference_session));
+	#endif
+
+	size_t widest_hidden = 0;
+	for (int i = 1; i < neural_network->number_of_layers - 1; i++) {
+		widest_hidden = (neural_network->layers[i] > widest_hidden) ? neural_network->layers[i] : widest_hidden;
+	}
+
+	session->neural_network = neural_network;
+	session->max_batch_size = max_batch_size;
+	session->memory = init_arena(2 * mat_footprint(widest_hidden, max_batch_size));
+	session->activations[0] = init_mat_in(session->memory, widest_hidden, max_batch_size);
+	session->activations[1] = init_mat_in(session->memory, widest_hidden, max_batch_size);
+
+	// the network is only read here: the bfloat16 copies are remade by whatever changed the weights
+	#ifdef MLLIB_STORAGE_BF16
+	#ifdef ML_LIB_DEBUG_MODE
+	if (neural_network->inference_weights_stale) {
+		fprintf(stderr, "ERROR IN CREATE INFERENCE SESSION: The bfloat16 weights are out of date; call store_inference_weights() after changing the weights\n");
+		exit(EXIT_FAILURE);
+	}
+	#endif
+	#endif
+
+	return session;
+}
+
+void delete_inference_session(inference_session* session) {
+	del_arena(session->memory);
+	free(session);
+}
+
+/**
+ * The forward pass of a session from x to y, which may be strided views. Each hidden layer is written over the
+ * activations of the layer before the one it reads.
+ */
+static void session_forward_matrices(inference_session* session, matrix* x, matrix* y) {
+	ann* neural_network = session->neural_network;
+	size_t number_of_layers = neural_network->number_of_layers;
+	size_t number_of_vectors = x->number_of_cols;
+
+	#ifdef ML_LIB_DEBUG_MODE
+	if (number_of_vectors > session->max_batch_size) {
+		fprintf(stderr, "ERROR IN SESSION FORWARD: %zu vectors do not fit a session made for %zu\n", number_of_vectors, session->max_batch_size);
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	matrix* input = x;
+	for (int i = 1; i < number_of_layers; i++) {
+		matrix* output = y;
+		if (i < number_of_layers - 1) {
+			output = session->activations[i % 2];
+			output->number_of_rows = neural_network->layers[i];
+			output->number_of_cols = number_of_vectors;
+			output->leading_dimension = number_of_vectors;
+		}
+
+		// y_i = f(W*x_i + b_i) where (x_i == y_{i - 1}), with the network's own activation at the output
+		layer_activation activation = (i == number_of_layers - 1) ? neural_network->output_activation : ACTIVATION_LEAKY_RELU;
+		#ifdef MLLIB_STORAGE_BF16
+		layer_forward_bf16_activation(output, neural_network->inference_weights[i - 1], neural_network->biases[i - 1], input, activation);
+		#else
+		layer_forward_activation(output, NULL, neural_network->weights[i - 1], neural_network->biases[i - 1], input, activation);
+		#endif
+		input = output;
+	}
+}
+
+void session_forward(inference_session* session, const number* inputs, size_t number_of_vectors, number* outputs) {
+	ann* neural_network = session->neural_network;
+	matrix x = {
+		.m = (number *)inputs,
+		.number_of_rows = neural_network->layers[0],
+		.number_of_cols = number_of_vectors,
+		.leading_dimension = number_of_vectors,
+	};
+	matrix y = {
+		.m = outputs,
+		.number_of_rows = neural_network->layers[neural_network->number_of_layers - 1],
+		.number_of_cols = number_of_vectors,
+		.leading_dimension = number_of_vectors,
+	};
+	session_forward_matrices(session, &x, &y);
+}
+
+batch* pass_forward(ann* neural_network, batch* inputs) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if (inputs->vector_size != neural_network->layers[0]) {
+		fprintf(stderr, "ANN PASS FORWARD: Size of inputs do not match input layer of neural network\n");
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	size_t number_of_layers = neural_network->number_of_layers;
+	batch* predictions = create_empty_batch(inputs->number_of_vectors, neural_network->layers[number_of_layers - 1]);
+
+	// the input is read in place and the last layer writes straight into the predictions
+	inference_session* session = create_inference_session(neural_network, inputs->number_of_vectors);
+	session_forward_matrices(session, inputs->data, predictions->data);
+	delete_inference_session(session);
+
+	return predictions;
+}
@@ -1,39 +1,333 @@
 #include "../mllib.h"
 #include "../math/matrix.h"
+#include "../math/bfloat16.h"
+#include "../math/float16.h"
 #include "../processing/batch.h"
+#include "../processing/batch_stream.h"
 
 #ifndef MLLIB_ANN_H
 #define MLLIB_ANN_H
 
+/**
+ * Intermediate matrices of a training step, sized once from the layers of the network and the batch size
+ * and reused for every batch, so the training loop never allocates. Arrays are indexed by layer and have
+ * number_of_layers entries. y_intermediate_outputs[0] is not allocated: each step points it at its input batch,
+ * which is read in place.
+ */
+struct ann_workspace_ {
+	size_t batch_size;	// the largest batch the workspace holds; smaller ones go through resize_ann_workspace()
+	size_t number_of_layers;
+
+	matrix** z_intermediate_outputs;
+	matrix** y_intermediate_outputs;
+
+	matrix** dE_dy;
+	matrix** dE_dz;
+
+	// everything above is carved out of this arena
+	arena* memory;
+};
+typedef struct ann_workspace_ ann_workspace;
+
+/**
+ * What a layer applies to z = W*x + b. Every hidden layer uses Leaky-ReLU. The output layer does too by default,
+ * training on the squared error; with ACTIVATION_SOFTMAX it turns each sample into a probability distribution
+ * and trains on the cross-entropy against the target, for classification with one-hot labels.
+ */
+enum layer_activation_ {
+	ACTIVATION_LEAKY_RELU,
+	ACTIVATION_LINEAR,	// y = z, which training uses to stop at the logits of a softmax layer
+	ACTIVATION_SOFTMAX,
+};
+typedef enum layer_activation_ layer_activation;
+
 struct ann_ {
 	
 	/**
 	 * This structure contains an array of pointers to matrices and vectors, due to the way the matrix
-	 * and vector initialization is set up.
+	 * and vector initialization is set up. The arrays, matrices and vectors are all allocated from 'memory'.
 	 */
 	matrix** weights;
 	vector** biases;
 	size_t* layers;
 	size_t number_of_layers;
 	number gamma;
+	layer_activation output_activation;	// ACTIVATION_LEAKY_RELU or ACTIVATION_SOFTMAX, set after initialize_ann()
+
+	// training scratch space, created by the first call to train() and kept for later calls
+	ann_workspace* workspace;
+
+	// set by start_checkpointing() in checkpoint.h
+	struct ann_checkpointer_* checkpointer;
+
+	// set by set_optimizer() in optimizer.h; NULL for plain SGD
+	struct ann_optimizer_* optimizer;
+
+	// bfloat16 copies of the weights for pass_forward() in MLLIB_STORAGE_BF16 builds, remade after training
+	bfloat16** inference_weights;
+	boolean inference_weights_stale;
+
+	arena* memory;
+
+	// for a network opened with map_ann(), the read-only file mapping its weights and biases point into
+	void* mapping;
+	size_t mapping_size;
 };
 typedef struct ann_ ann;
 
 
 ann* initialize_ann(size_t* sizes, size_t number_of_layers);
+
+// The same without setting the weights and biases, for callers that fill them in themselves
+ann* allocate_ann(size_t* sizes, size_t number_of_layers);
 void deallocate_ann(ann* neural_network);
 
+ann_workspace* create_ann_workspace(ann* neural_network, size_t batch_size);
+void resize_ann_workspace(ann_workspace* workspace, size_t number_of_vectors);
+void delete_ann_workspace(ann_workspace* workspace);
+
 /**
  * Nonlinear functions and derivatives
  */
+#define LEAKY_RELU_SLOPE 0.1
+
 void nonlinear_transform_mat(matrix* output, matrix* input);
 void nonlinear_transform_derivative_mat(matrix* output, matrix* input);
 
 /**
- * Training and testing of the neural network
+ * Fused forward step of one layer, y = f(W*x + b), also storing z = W*x + b unless z is NULL
+ */
+void layer_forward(matrix* y, matrix* z, matrix* weights, vector* bias, matrix* x);
+
+// The same without z, with the weights a contiguous bfloat16 matrix of y->number_of_rows x x->number_of_rows
+void layer_forward_bf16(matrix* y, const bfloat16* weights, vector* bias, matrix* x);
+
+/**
+ * Both of the above with any activation. For ACTIVATION_SOFTMAX, z holds the logits and y their softmax over
+ * each column.
+ */
+void layer_forward_activation(matrix* y, matrix* z, matrix* weights, vector* bias, matrix* x, layer_activation activation);
+void layer_forward_bf16_activation(matrix* y, const bfloat16* weights, vector* bias, matrix* x, layer_activation activation);
+
+/**
+ * Softmax over each column of the logits z into out, in a single fused kernel that is stable for logits of
+ * any size. With a target, out is instead the gradient softmax(z) - target of the cross-entropy, which is
+ * returned summed over the columns; without one, 0 is returned. out may be z itself.
+ */
+number softmax_cross_entropy(matrix* out, matrix* z, matrix* target);
+
+/**
+ * Fused backward step of one layer: computes dE_dz and applies the SGD update to the weights and bias.
+ * At the output layer (target not NULL) returns the squared error sum((y - target)^2), taken in the same pass.
+ */
+number layer_backward(matrix* dE_dz, matrix* dE_dy, matrix* target, matrix* z, matrix* x,
+	matrix* weights, vector* bias, number learning_rate);
+
+/**
+ * Backward step of one layer that leaves the network alone: computes dE_dz and writes the bias and weight
+ * gradients to grad_b and grad_w. Returns the squared error at the output layer like layer_backward().
+ */
+number layer_gradient(matrix* dE_dz, matrix* dE_dy, matrix* target, matrix* z, matrix* x,
+	matrix* grad_w, vector* grad_b);
+
+/**
+ * layer_backward() and layer_gradient() for the output layer of the softmax head, from its logits z:
+ * dE_dz = softmax(z) - target, taken straight from the fused kernel with no derivative of the activation.
+ * Return the cross-entropy of the batch.
+ */
+number softmax_layer_backward(matrix* dE_dz, matrix* z, matrix* target, matrix* x,
+	matrix* weights, vector* bias, number learning_rate);
+number softmax_layer_gradient(matrix* dE_dz, matrix* z, matrix* target, matrix* x,
+	matrix* grad_w, vector* grad_b);
+
+/**
+ * Training and testing of the neural network. train() runs TRAIN_DEFAULT_EPOCHS passes over the batches at
+ * the network's gamma; train_with_config() takes the loop settings from a train_config.
+ */
+#define TRAIN_DEFAULT_EPOCHS 100
+
+enum learning_rate_schedule_ {
+	LEARNING_RATE_CONSTANT,	// gamma throughout
+	LEARNING_RATE_STEP_DECAY,	// gamma * decay_factor^(epoch / decay_epochs)
+	LEARNING_RATE_INVERSE_TIME,	// gamma / (1 + decay_factor * epoch)
+};
+typedef enum learning_rate_schedule_ learning_rate_schedule;
+
+enum train_stop_reason_ {
+	TRAIN_COMPLETED,	// ran all of its epochs
+	TRAIN_REACHED_MAX_STEPS,
+	TRAIN_STOPPED_EARLY,	// the epoch loss stopped improving
+	TRAIN_STOPPED_BY_CALLBACK,
+};
+typedef enum train_stop_reason_ train_stop_reason;
+
+/**
+ * What the callback of train_with_config() is told after every step. loss is the mean loss per sample of the
+ * batch before the step: the squared error summed over the outputs, or the cross-entropy for the softmax head.
+ * epoch_loss, the mean of loss over the epoch, is only set on the last step of an epoch.
  */
+struct train_step_report_ {
+	size_t epoch;
+	size_t step;	// counted from 0 across epochs
+	size_t batch_size;
+	number loss;
+	number learning_rate;
+	double step_seconds;
+	double elapsed_seconds;
+	boolean end_of_epoch;
+	number epoch_loss;
+};
+typedef struct train_step_report_ train_step_report;
+
+// Return FALSE to stop training after this step
+typedef boolean (*train_callback)(const train_step_report* report, void* context);
+
+struct train_config_ {
+	size_t epochs;
+	size_t max_steps;	// 0 for no limit
+	learning_rate_schedule schedule;
+	number decay_factor;
+	size_t decay_epochs;	// epochs between decays of LEARNING_RATE_STEP_DECAY
+	size_t warmup_steps;	// the learning rate ramps up linearly over this many steps, 0 for none
+	// stop once the epoch loss has not improved by more than tolerance on the best so far for patience epochs,
+	// 0 for never
+	size_t patience;
+	number tolerance;
+	train_callback callback;	// may be NULL
+	void* callback_context;
+	// reshuffle the samples at the start of every epoch, keeping the sizes of the batches; the same seed gives
+	// the same order
+	boolean shuffle;
+	unsigned long long shuffle_seed;
+};
+typedef struct train_config_ train_config;
+
+struct train_result_ {
+	size_t epochs;	// started, including a partial one
+	size_t steps;
+	number final_loss;	// mean loss of the last epoch, partial or not
+	number best_loss;
+	train_stop_reason stop_reason;
+	double seconds;
+};
+typedef struct train_result_ train_result;
+
+// TRAIN_DEFAULT_EPOCHS epochs in order at a constant learning rate, no limits and no callback: what train() runs
+train_config default_train_config(void);
+
+/**
+ * train() with the loop settings of config. result, which may be NULL, receives how the run went.
+ * The learning rate of a step is the network's gamma put through the schedule.
+ */
+void train_with_config(ann* neural_network, m_batch* training_input, m_batch* training_output,
+	const train_config* config, train_result* result);
+
 void train(ann* neural_network, m_batch* training_input, m_batch* training_output);
+
+/**
+ * Same steps as train(), pulling batches from a stream until it ends instead of cycling over an m_batch
+ */
+void train_from_stream(ann* neural_network, batch_stream* stream);
+
+/**
+ * Same loop as train(), with every batch split across the thread pool and one SGD step per batch from the
+ * summed gradients of the slices
+ */
+void train_parallel(ann* neural_network, m_batch* training_input, m_batch* training_output);
+
+// train_parallel() with the loop settings of config, as train_with_config()
+void train_parallel_with_config(ann* neural_network, m_batch* training_input, m_batch* training_output,
+	const train_config* config, train_result* result);
+
+/**
+ * Work done by one worker thread of train_hogwild()
+ */
+struct training_thread_stats_ {
+	size_t batches;
+	size_t samples;
+	double seconds;
+	double samples_per_second;
+};
+typedef struct training_thread_stats_ training_thread_stats;
+
+/**
+ * Lock-free asynchronous SGD: every pool thread claims batches from a shared cursor and updates the network in
+ * place without synchronization. stats may be NULL, or have get_number_of_threads() entries.
+ * The steps are plain SGD at the network's gamma: a network with an optimizer must have it removed first, with
+ * set_optimizer() and OPTIMIZER_SGD.
+ */
+void train_hogwild(ann* neural_network, m_batch* training_input, m_batch* training_output,
+	training_thread_stats* stats);
+
+enum half_format_ {
+	HALF_BFLOAT16,	// the range of float, 8 bits of precision
+	HALF_FLOAT16	// IEEE half, 11 bits of precision but nothing outside [2^-24, 65504]
+};
+typedef enum half_format_ half_format;
+
+#define MIXED_PRECISION_GROWTH_INTERVAL 2000
+
+struct mixed_precision_options_ {
+	half_format activation_format;
+	number loss_scale;
+	boolean dynamic_loss_scale;
+	size_t skipped_steps;	// set by train_mixed_precision()
+};
+typedef struct mixed_precision_options_ mixed_precision_options;
+
+/**
+ * Mixed precision training. The weights stay in 'number', but the activations y and z that the backward pass needs
+ * are stored in a 16-bit format and widened a layer at a time as they are used, so the memory that grows with the
+ * batch is about halved. dE/dx is rounded to the same format on its way from one layer to the next.
+ *
+ * The output error is multiplied by loss_scale before the backward pass and the gradients are divided by it
+ * again before the update, which keeps small gradients from flushing to zero in float16. With dynamic_loss_scale
+ * set, a step whose gradients overflow is skipped and the scale halved, and the scale is doubled after
+ * MIXED_PRECISION_GROWTH_INTERVAL steps in a row without overflow. loss_scale is left at its final value.
+ */
+void train_mixed_precision(ann* neural_network, m_batch* training_input, m_batch* training_output,
+	mixed_precision_options* options);
+
+// train_mixed_precision() with the loop settings of config, as train_with_config()
+void train_mixed_precision_with_config(ann* neural_network, m_batch* training_input, m_batch* training_output,
+	mixed_precision_options* options, const train_config* config, train_result* result);
+
 void test(ann* neural_network, m_batch* testing_input, m_batch* testing_output);
 
+/**
+ * Inference. In MLLIB_STORAGE_BF16 builds the weights are read from bfloat16 copies, which initialize_ann(),
+ * load_ann(), map_ann() and the training functions remake when they are done with the weights. Call
+ * store_inference_weights() after changing the weights any other way, before inference.
+ */
+batch* pass_forward(ann* neural_network, batch* inputs);
+void store_inference_weights(ann* neural_network);
+
+/**
+ * Repeated inference without allocation. A session holds the activations of a forward pass of up to
+ * max_batch_size vectors, two layers at a time, so after the first call (which sizes the GEMM's per-thread
+ * packing buffers) session_forward() does no heap allocation. The network is only read: any number of sessions,
+ * each used by one thread at a time, can run against the same network at once, as long as it is not trained
+ * meanwhile. Creating a session does not write to the network either, so sessions can be made concurrently too.
+ */
+struct inference_session_ {
+	ann* neural_network;
+	size_t max_batch_size;
+
+	// the outputs of the hidden layers, layer i in activations[i % 2], sized for the widest of them
+	matrix* activations[2];
+
+	arena* memory;
+};
+typedef struct inference_session_ inference_session;
+
+inference_session* create_inference_session(ann* neural_network, size_t max_batch_size);
+void delete_inference_session(inference_session* session);
+
+/**
+ * Run number_of_vectors inputs through the network. inputs holds them one per column, as in a batch: a contiguous
+ * layers[0] x number_of_vectors matrix. outputs receives the predictions the same way.
+ */
+void session_forward(inference_session* session, const number* inputs, size_t number_of_vectors, number* outputs);
+
 
 #endif
\ No newline at end of file
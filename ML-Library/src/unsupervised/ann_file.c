@@ -0,0 +1,328 @@
+// Saving, loading and mapping of network checkpoints
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ann_file.h"
+
+// the sections are written as they sit in memory
+_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "checkpoints are little-endian");
+_Static_assert(sizeof(ann_file_header) == ANN_FILE_ALIGNMENT, "the header fills the first section");
+_Static_assert(sizeof(size_t) == sizeof(uint64_t), "the layers of a network are read straight from the file");
+
+#define ANN_FILE_ROUND_UP(bytes) (((bytes) + ANN_FILE_ALIGNMENT - 1) & ~(size_t)(ANN_FILE_ALIGNMENT - 1))
+
+#define CHECKSUM_LANES 4
+
+/**
+ * Offsets of the sections of a network with the given layers, filled in by file_layout(), which returns the
+ * size of the whole file. weights and biases have number_of_layers - 1 entries.
+ */
+static size_t file_layout(const size_t* layers, size_t number_of_layers, size_t* weights, size_t* biases) {
+	size_t offset = sizeof(ann_file_header) + ANN_FILE_ROUND_UP(number_of_layers * sizeof(uint64_t));
+	for (size_t i = 0; i < number_of_layers - 1; i++) {
+		weights[i] = offset;
+		offset += ANN_FILE_ROUND_UP(layers[i + 1] * layers[i] * sizeof(number));
+		biases[i] = offset;
+		offset += ANN_FILE_ROUND_UP(layers[i + 1] * sizeof(number));
+	}
+	return offset;
+}
+
+// size is a multiple of ANN_FILE_ALIGNMENT, so whole rounds of the lanes
+static void checksum_update(uint64_t lanes[CHECKSUM_LANES], const void* data, size_t size) {
+	const uint64_t* words = (const uint64_t *)data;
+	for (size_t w = 0; w < size / sizeof(uint64_t); w += CHECKSUM_LANES) {
+		for (int l = 0; l < CHECKSUM_LANES; l++) {
+			lanes[l] = (lanes[l] ^ words[w + l]) * ANN_FILE_CHECKSUM_PRIME;
+		}
+	}
+}
+
+static uint64_t file_checksum(const unsigned char* image, size_t size) {
+	uint64_t lanes[CHECKSUM_LANES] = {0};
+
+	ann_file_header header;
+	memcpy(&header, image, sizeof(ann_file_header));
+	header.checksum = 0;
+	checksum_update(lanes, &header, sizeof(ann_file_header));
+	checksum_update(lanes, image + sizeof(ann_file_header), size - sizeof(ann_file_header));
+
+	uint64_t checksum = size;
+	for (int l = 0; l < CHECKSUM_LANES; l++) {
+		checksum = (checksum ^ lanes[l]) * ANN_FILE_CHECKSUM_PRIME;
+	}
+	return checksum;
+}
+
+size_t ann_image_size(ann* neural_network) {
+	size_t number_of_layers = neural_network->number_of_layers;
+	size_t weights[number_of_layers - 1];
+	size_t biases[number_of_layers - 1];
+	return file_layout(neural_network->layers, number_of_layers, weights, biases);
+}
+
+void write_ann_image(ann* neural_network, void* image) {
+	size_t number_of_layers = neural_network->number_of_layers;
+	const size_t* layers = neural_network->layers;
+	size_t weights[number_of_layers - 1];
+	size_t biases[number_of_layers - 1];
+	unsigned char* bytes = (unsigned char *)image;
+
+	size_t size = file_layout(layers, number_of_layers, weights, biases);
+
+	// the header and the layers, with their padding
+	memset(image, 0, weights[0]);
+	ann_file_header* header = (ann_file_header *)image;
+	memcpy(header->magic, ANN_FILE_MAGIC, sizeof(header->magic));
+	header->version = ANN_FILE_VERSION;
+	header->number_size = sizeof(number);
+	header->number_of_layers = number_of_layers;
+	header->file_size = size;
+	header->gamma = neural_network->gamma;
+	header->output_activation = neural_network->output_activation;
+	memcpy(bytes + sizeof(ann_file_header), layers, number_of_layers * sizeof(size_t));
+
+	// the parameters, zeroing only the padding behind each section
+	for (size_t i = 0; i < number_of_layers - 1; i++) {
+		matrix* w = neural_network->weights[i];
+		size_t weight_bytes = w->number_of_rows * w->number_of_cols * sizeof(number);
+		for (size_t row = 0; row < w->number_of_rows; row++) {
+			memcpy(bytes + weights[i] + row * w->number_of_cols * sizeof(number), w->m + row * w->leading_dimension,
+				w->number_of_cols * sizeof(number));
+		}
+		memset(bytes + weights[i] + weight_bytes, 0, biases[i] - weights[i] - weight_bytes);
+
+		size_t bias_bytes = layers[i + 1] * sizeof(number);
+		size_t section_end = (i + 1 < number_of_layers - 1) ? weights[i + 1] : size;
+		memcpy(bytes + biases[i], neural_network->biases[i]->v, bias_bytes);
+		memset(bytes + biases[i] + bias_bytes, 0, section_end - biases[i] - bias_bytes);
+	}
+}
+
+boolean save_ann_image(void* image, size_t size, const char* path) {
+	((ann_file_header *)image)->checksum = file_checksum((const unsigned char *)image, size);
+
+	size_t path_length = strlen(path);
+	char temporary_path[path_length + sizeof(".tmp")];
+	memcpy(temporary_path, path, path_length);
+	memcpy(temporary_path + path_length, ".tmp", sizeof(".tmp"));
+
+	int descriptor = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (descriptor < 0) {
+		fprintf(stderr, "ERROR IN SAVE ANN: Cannot create %s\n", temporary_path);
+		return FALSE;
+	}
+
+	const unsigned char* bytes = (const unsigned char *)image;
+	size_t written = 0;
+	while (written < size) {
+		ssize_t result = write(descriptor, bytes + written, size - written);
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+		if (result <= 0) {
+			fprintf(stderr, "ERROR IN SAVE ANN: Cannot write %s\n", temporary_path);
+			close(descriptor);
+			unlink(temporary_path);
+			return FALSE;
+		}
+		written += (size_t)result;
+	}
+
+	if (fsync(descriptor) != 0 || close(descriptor) != 0 || rename(temporary_path, path) != 0) {
+		fprintf(stderr, "ERROR IN SAVE ANN: Cannot move %s into place\n", temporary_path);
+		unlink(temporary_path);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+boolean save_ann(ann* neural_network, const char* path) {
+	size_t size = ann_image_size(neural_network);
+	void* image = aligned_alloc(ANN_FILE_ALIGNMENT, size);
+	if (image == NULL) {
+		fprintf(stderr, "ERROR IN SAVE ANN: Cannot allocate %zu bytes\n", size);
+		return FALSE;
+	}
+
+	write_ann_image(neural_network, image);
+	boolean saved = save_ann_image(image, size, path);
+	free(image);
+	return saved;
+}
+
+/**
+ * Map a checkpoint and check that it is one this library can read. Returns the mapping, or NULL after saying
+ * why on stderr. caller names the public function in the messages.
+ */
+static const unsigned char* map_checkpoint(const char* path, const char* caller, boolean verify_checksum,
+		size_t* mapping_size) {
+	int descriptor = open(path, O_RDONLY);
+	if (descriptor < 0) {
+		fprintf(stderr, "ERROR IN %s: Cannot open %s\n", caller, path);
+		return NULL;
+	}
+
+	struct stat status;
+	if (fstat(descriptor, &status) != 0 || status.st_size < (off_t)sizeof(ann_file_header)) {
+		fprintf(stderr, "ERROR IN %s: %s is too short to be a checkpoint\n", caller, path);
+		close(descriptor);
+		return NULL;
+	}
+
+	size_t size = (size_t)status.st_size;
+	void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+	close(descriptor);	// the mapping keeps the file alive
+	if (mapping == MAP_FAILED) {
+		fprintf(stderr, "ERROR IN %s: Cannot map %s\n", caller, path);
+		return NULL;
+	}
+	const unsigned char* bytes = (const unsigned char *)mapping;
+	const ann_file_header* header = (const ann_file_header *)mapping;
+
+	if (memcmp(header->magic, ANN_FILE_MAGIC, sizeof(header->magic)) != 0 || header->version != ANN_FILE_VERSION) {
+		fprintf(stderr, "ERROR IN %s: %s is not a version %d checkpoint\n", caller, path, ANN_FILE_VERSION);
+		munmap(mapping, size);
+		return NULL;
+	}
+	if (header->number_size != sizeof(number)) {
+		fprintf(stderr, "ERROR IN %s: %s holds %u-byte numbers, this library uses %zu-byte ones\n", caller, path,
+			header->number_size, sizeof(number));
+		munmap(mapping, size);
+		return NULL;
+	}
+	if (header->output_activation != ACTIVATION_LEAKY_RELU && header->output_activation != ACTIVATION_SOFTMAX) {
+		fprintf(stderr, "ERROR IN %s: %s has an unknown output activation %u\n", caller, path, header->output_activation);
+		munmap(mapping, size);
+		return NULL;
+	}
+
+	// the layers must fit in the file before they can be read, and their parameters before the layout is worked
+	// out, which keeps every sum below from wrapping
+	size_t number_of_layers = header->number_of_layers;
+	size_t size_in_numbers = size / sizeof(number);
+	boolean fits = header->file_size == size && number_of_layers >= 2 &&
+		number_of_layers <= (size - sizeof(ann_file_header)) / sizeof(uint64_t);
+	const size_t* layers = (const size_t *)(bytes + sizeof(ann_file_header));
+	size_t parameters = 0;
+	for (size_t i = 0; fits && i < number_of_layers - 1; i++) {
+		fits = layers[i] > 0 && layers[i] <= size_in_numbers && layers[i + 1] > 0 &&
+			layers[i + 1] <= size_in_numbers / layers[i];
+		parameters += fits ? layers[i + 1] * layers[i] + layers[i + 1] : 0;
+		fits = fits && parameters <= size_in_numbers;
+	}
+	if (fits) {
+		size_t* offsets = (size_t *)malloc(2 * (number_of_layers - 1) * sizeof(size_t));
+		fits = file_layout(layers, number_of_layers, offsets, offsets + number_of_layers - 1) == size;
+		free(offsets);
+	}
+	if (!fits) {
+		fprintf(stderr, "ERROR IN %s: %s does not have the size its header says\n", caller, path);
+		munmap(mapping, size);
+		return NULL;
+	}
+
+	if (verify_checksum && file_checksum(bytes, size) != header->checksum) {
+		fprintf(stderr, "ERROR IN %s: %s fails its checksum\n", caller, path);
+		munmap(mapping, size);
+		return NULL;
+	}
+
+	*mapping_size = size;
+	return bytes;
+}
+
+ann* load_ann(const char* path) {
+	size_t mapping_size;
+	const unsigned char* bytes = map_checkpoint(path, "LOAD ANN", TRUE, &mapping_size);
+	if (bytes == NULL) {
+		return NULL;
+	}
+
+	const ann_file_header* header = (const ann_file_header *)bytes;
+	const size_t* layers = (const size_t *)(bytes + sizeof(ann_file_header));
+	size_t number_of_layers = header->number_of_layers;
+	size_t weights[number_of_layers - 1];
+	size_t biases[number_of_layers - 1];
+	file_layout(layers, number_of_layers, weights, biases);
+
+	ann* neural_network = allocate_ann((size_t *)layers, number_of_layers);
+	neural_network->gamma = header->gamma;
+	neural_network->output_activation = (layer_activation)header->output_activation;
+	for (size_t i = 0; i < number_of_layers - 1; i++) {
+		memcpy(neural_network->weights[i]->m, bytes + weights[i], layers[i + 1] * layers[i] * sizeof(number));
+		memcpy(neural_network->biases[i]->v, bytes + biases[i], layers[i + 1] * sizeof(number));
+	}
+	#ifdef MLLIB_STORAGE_BF16
+	store_inference_weights(neural_network);
+	#endif
+
+	munmap((void *)bytes, mapping_size);
+	return neural_network;
+}
+
+ann* map_ann(const char* path, boolean verify_checksum) {
+	size_t mapping_size;
+	const unsigned char* bytes = map_checkpoint(path, "MAP ANN", verify_checksum, &mapping_size);
+	if (bytes == NULL) {
+		return NULL;
+	}
+
+	const ann_file_header* header = (const ann_file_header *)bytes;
+	const size_t* layers = (const size_t *)(bytes + sizeof(ann_file_header));
+	size_t number_of_layers = header->number_of_layers;
+	size_t weights[number_of_layers - 1];
+	size_t biases[number_of_layers - 1];
+	file_layout(layers, number_of_layers, weights, biases);
+
+	ann* neural_network;
+	#ifdef ML_LIB_DEBUG_MODE
+	neural_network = (ann *)calloc(1, sizeof(ann));
+	#else
+	neural_network = (ann *)malloc(sizeof(ann));
+	#endif
+
+	// only the headers live in the arena; their data is the file
+	neural_network->memory = init_arena(ARENA_ROUND_UP(number_of_layers * sizeof(size_t))
+		+ 2 * ARENA_ROUND_UP((number_of_layers - 1) * sizeof(void *))
+		+ (number_of_layers - 1) * (ARENA_ROUND_UP(sizeof(matrix)) + ARENA_ROUND_UP(sizeof(vector))));
+	neural_network->layers = (size_t *)arena_alloc(neural_network->memory, number_of_layers * sizeof(size_t));
+	neural_network->biases = (vector **)arena_alloc(neural_network->memory, (number_of_layers - 1) * sizeof(vector *));
+	neural_network->weights = (matrix **)arena_alloc(neural_network->memory, (number_of_layers - 1) * sizeof(matrix *));
+
+	for (size_t i = 0; i < number_of_layers; i++) {
+		neural_network->layers[i] = layers[i];
+	}
+	for (size_t i = 0; i < number_of_layers - 1; i++) {
+		matrix* w = (matrix *)arena_alloc(neural_network->memory, sizeof(matrix));
+		w->m = (number *)(bytes + weights[i]);
+		w->number_of_rows = layers[i + 1];
+		w->number_of_cols = layers[i];
+		w->leading_dimension = layers[i];
+		neural_network->weights[i] = w;
+
+		vector* b = (vector *)arena_alloc(neural_network->memory, sizeof(vector));
+		b->v = (number *)(bytes + biases[i]);
+		b->size = layers[i + 1];
+		neural_network->biases[i] = b;
+	}
+
+	neural_network->number_of_layers = number_of_layers;
+	neural_network->gamma = header->gamma;
+	neural_network->output_activation = (layer_activation)header->output_activation;
+	neural_network->workspace = NULL;
+	neural_network->checkpointer = NULL;
+	neural_network->optimizer = NULL;
+	neural_network->inference_weights = NULL;
+	neural_network->inference_weights_stale = TRUE;
+	neural_network->mapping = (void *)bytes;
+	neural_network->mapping_size = mapping_size;
+	#ifdef MLLIB_STORAGE_BF16
+	store_inference_weights(neural_network);
+	#endif
+
+	return neural_network;
+}
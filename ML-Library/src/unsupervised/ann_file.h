@@ -0,0 +1,71 @@
+#include "../mllib.h"
+#include "ann.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef MLLIB_ANN_FILE_H
+#define MLLIB_ANN_FILE_H
+
+/**
+ * Binary checkpoints of a network. A file is a 64-byte header followed by sections that each start on a 64-byte
+ * boundary and are zero-padded up to the next one:
+ *   the sizes of the layers, number_of_layers little-endian uint64s
+ *   for every layer i: the weights, layers[i + 1] x layers[i] 'number's row-major, then the bias, layers[i + 1]
+ * Everything is little-endian and the 'number's are stored as they are in memory, so map_ann() can point a
+ * network straight into the file. Files only open at the width of 'number' they were written with: f32 and bf16
+ * builds share theirs, f64 builds have their own.
+ *
+ * The checksum is taken over the whole file with the checksum field zeroed: the file is read as uint64 words,
+ * word w goes into lane w % 4 as lane = (lane ^ word) * ANN_FILE_CHECKSUM_PRIME, and the lanes are folded into
+ * one the same way, starting from the file size. Changing any single word always changes the checksum.
+ */
+#define ANN_FILE_MAGIC "MLLIBANN"
+#define ANN_FILE_VERSION 1
+#define ANN_FILE_ALIGNMENT 64
+#define ANN_FILE_CHECKSUM_PRIME 0x100000001b3ULL
+
+struct ann_file_header_ {
+	char magic[8];
+	uint32_t version;
+	uint32_t number_size;	// sizeof(number) of the library that wrote the file
+	uint64_t number_of_layers;
+	uint64_t file_size;
+	uint64_t checksum;
+	double gamma;
+	uint32_t output_activation;	// a layer_activation; files from before the softmax head have 0, Leaky-ReLU
+	uint8_t reserved[12];	// zero
+};
+typedef struct ann_file_header_ ann_file_header;
+
+/**
+ * Save a network. The file is written under a temporary name, flushed to disk and then renamed over path, so a
+ * crash never leaves a half written checkpoint behind. Returns FALSE, after saying why on stderr, on failure.
+ */
+boolean save_ann(ann* neural_network, const char* path);
+
+/**
+ * Read a checkpoint into a new network, as initialize_ann() would have made it. Returns NULL, after saying why
+ * on stderr, if the file cannot be read, is not a checkpoint of this version and width of 'number', or fails
+ * its checksum.
+ */
+ann* load_ann(const char* path);
+
+/**
+ * Map a checkpoint read-only and point the weights and biases of a new network into the mapping, so nothing
+ * is copied and processes mapping the same file share its pages. Skipping the checksum leaves the weights
+ * unread until the first pass touches them, though MLLIB_STORAGE_BF16 builds read them here to make their
+ * bfloat16 copies; the header and the layout are checked either way.
+ * The network can run inference, but must not be trained: its weights are read-only. deallocate_ann() unmaps it.
+ */
+ann* map_ann(const char* path, boolean verify_checksum);
+
+/**
+ * The file as an image in memory, for writers that take the snapshot and the disk write apart. image must be
+ * ANN_FILE_ALIGNMENT-aligned and ann_image_size() bytes long. write_ann_image() only copies; the checksum is
+ * filled in by save_ann_image(), on whichever thread does the writing.
+ */
+size_t ann_image_size(ann* neural_network);
+void write_ann_image(ann* neural_network, void* image);
+boolean save_ann_image(void* image, size_t size, const char* path);
+
+#endif
@@ -0,0 +1,158 @@
+// Double-buffered checkpoints written by a background thread while training goes on
+#include <string.h>
+#include "checkpoint.h"
+#include "ann_file.h"
+
+static void* checkpoint_writer_loop(void* argument) {
+	ann_checkpointer* checkpointer = (ann_checkpointer *)argument;
+
+	pthread_mutex_lock(&checkpointer->lock);
+	while (TRUE) {
+		while (checkpointer->pending == CHECKPOINT_NO_IMAGE && !checkpointer->stopping) {
+			pthread_cond_wait(&checkpointer->work_ready, &checkpointer->lock);
+		}
+		if (checkpointer->pending == CHECKPOINT_NO_IMAGE) {
+			break;
+		}
+
+		int image = checkpointer->pending;
+		checkpointer->pending = CHECKPOINT_NO_IMAGE;
+		checkpointer->writing = image;
+		pthread_mutex_unlock(&checkpointer->lock);
+
+		boolean saved = save_ann_image(checkpointer->images[image], checkpointer->image_size, checkpointer->path);
+
+		pthread_mutex_lock(&checkpointer->lock);
+		checkpointer->writing = CHECKPOINT_NO_IMAGE;
+		if (saved) {
+			checkpointer->written++;
+		} else {
+			checkpointer->failed++;
+		}
+		pthread_cond_broadcast(&checkpointer->work_done);
+	}
+	pthread_mutex_unlock(&checkpointer->lock);
+
+	return NULL;
+}
+
+ann_checkpointer* start_checkpointing(ann* neural_network, const char* path, size_t every_epochs, size_t every_steps) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if (neural_network->checkpointer != NULL) {
+		fprintf(stderr, "ERROR IN START CHECKPOINTING: The network is already being checkpointed\n");
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	ann_checkpointer* checkpointer;
+
+	#ifdef ML_LIB_DEBUG_MODE
+	checkpointer = (ann_checkpointer *)calloc(1, sizeof(ann_checkpointer));
+	#else
+	checkpointer = (ann_checkpointer *)malloc(sizeof(ann_checkpointer));
+	#endif
+
+	checkpointer->path = strdup(path);
+	checkpointer->every_epochs = every_epochs;
+	checkpointer->every_steps = every_steps;
+	checkpointer->steps = 0;
+	checkpointer->epochs = 0;
+
+	checkpointer->image_size = ann_image_size(neural_network);
+	checkpointer->images[0] = aligned_alloc(ANN_FILE_ALIGNMENT, checkpointer->image_size);
+	checkpointer->images[1] = aligned_alloc(ANN_FILE_ALIGNMENT, checkpointer->image_size);
+	if (checkpointer->images[0] == NULL || checkpointer->images[1] == NULL) {
+		fprintf(stderr, "ERROR IN START CHECKPOINTING: Cannot allocate two images of %zu bytes\n", checkpointer->image_size);
+		exit(EXIT_FAILURE);
+	}
+	checkpointer->pending = CHECKPOINT_NO_IMAGE;
+	checkpointer->writing = CHECKPOINT_NO_IMAGE;
+
+	checkpointer->written = 0;
+	checkpointer->superseded = 0;
+	checkpointer->failed = 0;
+
+	checkpointer->stopping = FALSE;
+	pthread_mutex_init(&checkpointer->lock, NULL);
+	pthread_cond_init(&checkpointer->work_ready, NULL);
+	pthread_cond_init(&checkpointer->work_done, NULL);
+	pthread_create(&checkpointer->writer, NULL, checkpoint_writer_loop, checkpointer);
+
+	neural_network->checkpointer = checkpointer;
+	return checkpointer;
+}
+
+void stop_checkpointing(ann* neural_network) {
+	ann_checkpointer* checkpointer = neural_network->checkpointer;
+	if (checkpointer == NULL) {
+		return;
+	}
+
+	// the writer finishes the pending image before it looks at stopping
+	pthread_mutex_lock(&checkpointer->lock);
+	checkpointer->stopping = TRUE;
+	pthread_cond_signal(&checkpointer->work_ready);
+	pthread_mutex_unlock(&checkpointer->lock);
+	pthread_join(checkpointer->writer, NULL);
+
+	pthread_mutex_destroy(&checkpointer->lock);
+	pthread_cond_destroy(&checkpointer->work_ready);
+	pthread_cond_destroy(&checkpointer->work_done);
+	free(checkpointer->images[0]);
+	free(checkpointer->images[1]);
+	free(checkpointer->path);
+	free(checkpointer);
+	neural_network->checkpointer = NULL;
+}
+
+void checkpoint_now(ann* neural_network) {
+	ann_checkpointer* checkpointer = neural_network->checkpointer;
+
+	// take the image the writer is not on; if it still holds an unwritten snapshot, this one replaces it
+	pthread_mutex_lock(&checkpointer->lock);
+	int image = (checkpointer->writing == 0) ? 1 : 0;
+	if (checkpointer->pending == image) {
+		checkpointer->pending = CHECKPOINT_NO_IMAGE;
+		checkpointer->superseded++;
+	}
+	pthread_mutex_unlock(&checkpointer->lock);
+
+	// the writer only ever takes the pending image, so this one is the training thread's until it is handed over
+	write_ann_image(neural_network, checkpointer->images[image]);
+
+	pthread_mutex_lock(&checkpointer->lock);
+	if (checkpointer->pending != CHECKPOINT_NO_IMAGE) {
+		checkpointer->superseded++;
+	}
+	checkpointer->pending = image;
+	pthread_cond_signal(&checkpointer->work_ready);
+	pthread_mutex_unlock(&checkpointer->lock);
+}
+
+void checkpoint_after_step(ann* neural_network, boolean end_of_epoch) {
+	ann_checkpointer* checkpointer = neural_network->checkpointer;
+	if (checkpointer == NULL) {
+		return;
+	}
+
+	checkpointer->steps++;
+	checkpointer->epochs += end_of_epoch ? 1 : 0;
+	boolean step_due = checkpointer->every_steps > 0 && checkpointer->steps % checkpointer->every_steps == 0;
+	boolean epoch_due = end_of_epoch && checkpointer->every_epochs > 0 && checkpointer->epochs % checkpointer->every_epochs == 0;
+	if (step_due || epoch_due) {
+		checkpoint_now(neural_network);
+	}
+}
+
+void wait_for_checkpoints(ann* neural_network) {
+	ann_checkpointer* checkpointer = neural_network->checkpointer;
+	if (checkpointer == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&checkpointer->lock);
+	while (checkpointer->pending != CHECKPOINT_NO_IMAGE || checkpointer->writing != CHECKPOINT_NO_IMAGE) {
+		pthread_cond_wait(&checkpointer->work_done, &checkpointer->lock);
+	}
+	pthread_mutex_unlock(&checkpointer->lock);
+}
@@ -0,0 +1,73 @@
+#include "../mllib.h"
+#include "ann.h"
+#include <pthread.h>
+
+#ifndef MLLIB_CHECKPOINT_H
+#define MLLIB_CHECKPOINT_H
+
+/**
+ * Periodic checkpoints of a network while it trains. Every every_steps steps, and at the end of every
+ * every_epochs passes over the data, the training thread copies the weights and biases into one of two
+ * preallocated file images and hands it to a background thread, which checksums it and writes it to path with
+ * save_ann_image(). The training loop only ever pays for the copy: while one image is being written the other
+ * one takes the next snapshot, and a snapshot that is still waiting for the writer when a newer one is taken is
+ * replaced by it (and counted in superseded). Each checkpoint replaces the file atomically, so path always holds
+ * the latest complete one.
+ *
+ * train(), train_parallel(), train_mixed_precision() and train_from_stream() (which has no epochs, only steps)
+ * check the network's checkpointer after every step. train_hogwild() does not, as its workers update the weights
+ * with no step that one of them could snapshot between.
+ */
+#define CHECKPOINT_NO_IMAGE -1
+
+struct ann_checkpointer_ {
+	char* path;
+	size_t every_epochs;	// 0 for none
+	size_t every_steps;	// 0 for none
+
+	// counted across training calls
+	size_t steps;
+	size_t epochs;
+
+	// the two file images; the writer owns images[writing], the training thread fills the other one
+	void* images[2];
+	size_t image_size;
+	int pending;	// an image waiting for the writer, or CHECKPOINT_NO_IMAGE
+	int writing;	// the image being written, or CHECKPOINT_NO_IMAGE
+
+	size_t written;
+	size_t superseded;
+	size_t failed;
+
+	boolean stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t work_ready;
+	pthread_cond_t work_done;
+	pthread_t writer;
+};
+typedef struct ann_checkpointer_ ann_checkpointer;
+
+/**
+ * Start checkpointing a network to path. At least one of every_epochs and every_steps should be nonzero.
+ * The network keeps the checkpointer until stop_checkpointing() or deallocate_ann().
+ */
+ann_checkpointer* start_checkpointing(ann* neural_network, const char* path, size_t every_epochs, size_t every_steps);
+
+// Write whatever snapshot is still pending, then stop the writer and detach the checkpointer from the network
+void stop_checkpointing(ann* neural_network);
+
+/**
+ * Take a snapshot now, outside of the intervals, such as after the last step
+ */
+void checkpoint_now(ann* neural_network);
+
+/**
+ * The hook the training loops call after every step, with end_of_epoch set on the last step of a pass over the
+ * data. Does nothing for a network without a checkpointer.
+ */
+void checkpoint_after_step(ann* neural_network, boolean end_of_epoch);
+
+// Block until every snapshot taken so far is on disk
+void wait_for_checkpoints(ann* neural_network);
+
+#endif
@@ -0,0 +1,312 @@
+// Dispatcher thread and request queue of the micro-batching inference server
+#include <string.h>
+#include <time.h>
+#include "inference_server.h"
+
+// how long an idle dispatcher sleeps before looking at the queue again, in case a wakeup was missed
+#define INFERENCE_IDLE_WAIT 0.1
+
+static double seconds_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static struct timespec to_timespec(double seconds) {
+	struct timespec time;
+	time.tv_sec = (time_t)seconds;
+	time.tv_nsec = (long)((seconds - time.tv_sec) * 1e9);
+	return time;
+}
+
+void init_inference_request(inference_request* request, const number* input, number* output,
+		void (*callback)(inference_request* request, void* context), void* context) {
+	request->input = input;
+	request->output = output;
+	request->callback = callback;
+	request->context = context;
+	request->submit_time = 0;
+	atomic_init(&request->done, FALSE);
+	atomic_init(&request->next, NULL);
+}
+
+/* *** Request queue *** */
+
+static void queue_push(inference_server* server, inference_request* request) {
+	atomic_store_explicit(&request->next, NULL, memory_order_relaxed);
+	inference_request* previous = atomic_exchange(&server->head, request);
+	atomic_store_explicit(&previous->next, request, memory_order_release);
+}
+
+/**
+ * Take the oldest request, or return NULL if there is none. NULL is also returned for a moment while a producer
+ * is between swapping itself in and linking itself up; its wakeup comes after it has linked.
+ */
+static inference_request* queue_pop(inference_server* server) {
+	inference_request* tail = server->tail;
+	inference_request* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+	if (tail == &server->stub) {
+		if (next == NULL) {
+			return NULL;
+		}
+		server->tail = next;
+		tail = next;
+		next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	}
+
+	if (next != NULL) {
+		server->tail = next;
+		return tail;
+	}
+
+	// tail is the last request in the list; put the stub behind it so it can be handed out
+	if (tail != atomic_load(&server->head)) {
+		return NULL;
+	}
+	queue_push(server, &server->stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next != NULL) {
+		server->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+static boolean queue_is_empty(inference_server* server) {
+	return server->tail == &server->stub && atomic_load(&server->head) == &server->stub;
+}
+
+/* *** Dispatcher *** */
+
+/**
+ * Sleep until a producer signals or the deadline passes. The flag is raised before the queue is checked and
+ * producers look at it after pushing, so one of the two always sees the other.
+ */
+static void wait_for_work(inference_server* server, double deadline) {
+	pthread_mutex_lock(&server->lock);
+	atomic_store(&server->dispatcher_sleeping, TRUE);
+	if (queue_is_empty(server) && !atomic_load(&server->stopping)) {
+		struct timespec until = to_timespec(deadline);
+		pthread_cond_timedwait(&server->work_ready, &server->lock, &until);
+	}
+	atomic_store(&server->dispatcher_sleeping, FALSE);
+	pthread_mutex_unlock(&server->lock);
+}
+
+static size_t latency_bucket(double seconds) {
+	uint64_t microseconds = (seconds > 0) ? (uint64_t)(seconds * 1e6) : 0;
+	if (microseconds < INFERENCE_LATENCY_BUCKETS_PER_DOUBLING) {
+		return microseconds;
+	}
+	int top_bit = 63 - __builtin_clzll(microseconds);
+	size_t bucket = (top_bit - 2) * INFERENCE_LATENCY_BUCKETS_PER_DOUBLING
+		+ ((microseconds >> (top_bit - 3)) & (INFERENCE_LATENCY_BUCKETS_PER_DOUBLING - 1));
+	return (bucket < INFERENCE_LATENCY_BUCKETS) ? bucket : INFERENCE_LATENCY_BUCKETS - 1;
+}
+
+// the upper edge of a bucket, in seconds
+static double latency_bucket_limit(size_t bucket) {
+	if (bucket < INFERENCE_LATENCY_BUCKETS_PER_DOUBLING) {
+		return (bucket + 1) * 1e-6;
+	}
+	size_t top_bit = bucket / INFERENCE_LATENCY_BUCKETS_PER_DOUBLING + 2;
+	size_t step = bucket % INFERENCE_LATENCY_BUCKETS_PER_DOUBLING;
+	return (double)((INFERENCE_LATENCY_BUCKETS_PER_DOUBLING + step + 1) << (top_bit - 3)) * 1e-6;
+}
+
+/**
+ * One forward pass over the collected requests: their inputs become the columns of a batch, and the columns
+ * of the predictions go back to their outputs
+ */
+static void run_batch(inference_server* server, size_t number_of_requests) {
+	ann* neural_network = server->neural_network;
+	size_t input_size = neural_network->layers[0];
+	size_t output_size = neural_network->layers[neural_network->number_of_layers - 1];
+
+	for (size_t j = 0; j < number_of_requests; j++) {
+		const number* input = server->batch_requests[j]->input;
+		for (size_t p = 0; p < input_size; p++) {
+			server->batch_inputs[p * number_of_requests + j] = input[p];
+		}
+	}
+
+	session_forward(server->session, server->batch_inputs, number_of_requests, server->batch_outputs);
+
+	double finish_time = seconds_now();
+	size_t* buckets = server->batch_latency_buckets;
+	for (size_t j = 0; j < number_of_requests; j++) {
+		inference_request* request = server->batch_requests[j];
+		for (size_t q = 0; q < output_size; q++) {
+			request->output[q] = server->batch_outputs[q * number_of_requests + j];
+		}
+		buckets[j] = latency_bucket(finish_time - request->submit_time);
+
+		if (request->callback != NULL) {
+			request->callback(request, request->context);
+		}
+		// the caller may free the request as soon as it is marked done, so this comes last
+		atomic_store_explicit(&request->done, TRUE, memory_order_release);
+	}
+
+	pthread_mutex_lock(&server->lock);
+	for (size_t j = 0; j < number_of_requests; j++) {
+		server->latency_histogram[buckets[j]]++;
+	}
+	server->requests += number_of_requests;
+	server->batches++;
+	pthread_cond_broadcast(&server->work_done);
+	pthread_mutex_unlock(&server->lock);
+}
+
+static void* dispatcher_loop(void* argument) {
+	inference_server* server = (inference_server *)argument;
+
+	while (TRUE) {
+		inference_request* first = queue_pop(server);
+		if (first == NULL) {
+			if (atomic_load(&server->stopping) && queue_is_empty(server)) {
+				break;
+			}
+			wait_for_work(server, seconds_now() + INFERENCE_IDLE_WAIT);
+			continue;
+		}
+
+		// gather until the batch is full or the first request has waited long enough
+		size_t number_of_requests = 0;
+		server->batch_requests[number_of_requests++] = first;
+		double deadline = first->submit_time + server->max_latency;
+		while (number_of_requests < server->max_batch_size) {
+			inference_request* request = queue_pop(server);
+			if (request != NULL) {
+				server->batch_requests[number_of_requests++] = request;
+				continue;
+			}
+			if (seconds_now() >= deadline || atomic_load(&server->stopping)) {
+				break;
+			}
+			wait_for_work(server, deadline);
+		}
+
+		run_batch(server, number_of_requests);
+	}
+
+	return NULL;
+}
+
+/* *** Server *** */
+
+inference_server* start_inference_server(ann* neural_network, size_t max_batch_size, double max_latency) {
+	inference_server* server;
+
+	#ifdef ML_LIB_DEBUG_MODE
+	server = (inference_server *)calloc(1, sizeof(inference_server));
+	#else
+	server = (inference_server *)malloc(sizeof(inference_server));
+	memset(server, 0, sizeof(inference_server));
+	#endif
+
+	size_t input_size = neural_network->layers[0];
+	size_t output_size = neural_network->layers[neural_network->number_of_layers - 1];
+
+	server->neural_network = neural_network;
+	server->session = create_inference_session(neural_network, max_batch_size);
+	server->max_batch_size = max_batch_size;
+	server->max_latency = max_latency;
+
+	server->memory = init_arena(ARENA_ROUND_UP(max_batch_size * sizeof(inference_request *))
+		+ ARENA_ROUND_UP(max_batch_size * sizeof(size_t))
+		+ ARENA_ROUND_UP(input_size * max_batch_size * sizeof(number))
+		+ ARENA_ROUND_UP(output_size * max_batch_size * sizeof(number)));
+	server->batch_requests = (inference_request **)arena_alloc(server->memory, max_batch_size * sizeof(inference_request *));
+	server->batch_latency_buckets = (size_t *)arena_alloc(server->memory, max_batch_size * sizeof(size_t));
+	server->batch_inputs = (number *)arena_alloc(server->memory, input_size * max_batch_size * sizeof(number));
+	server->batch_outputs = (number *)arena_alloc(server->memory, output_size * max_batch_size * sizeof(number));
+
+	atomic_init(&server->stub.next, NULL);
+	atomic_init(&server->head, &server->stub);
+	server->tail = &server->stub;
+	atomic_init(&server->dispatcher_sleeping, FALSE);
+	atomic_init(&server->stopping, FALSE);
+
+	// deadlines are taken from the monotonic clock
+	pthread_condattr_t monotonic;
+	pthread_condattr_init(&monotonic);
+	pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+	pthread_mutex_init(&server->lock, NULL);
+	pthread_cond_init(&server->work_ready, &monotonic);
+	pthread_cond_init(&server->work_done, NULL);
+	pthread_condattr_destroy(&monotonic);
+
+	pthread_create(&server->dispatcher, NULL, dispatcher_loop, server);
+	return server;
+}
+
+void stop_inference_server(inference_server* server) {
+	pthread_mutex_lock(&server->lock);
+	atomic_store(&server->stopping, TRUE);
+	pthread_cond_signal(&server->work_ready);
+	pthread_mutex_unlock(&server->lock);
+	pthread_join(server->dispatcher, NULL);
+
+	pthread_mutex_destroy(&server->lock);
+	pthread_cond_destroy(&server->work_ready);
+	pthread_cond_destroy(&server->work_done);
+	delete_inference_session(server->session);
+	del_arena(server->memory);
+	free(server);
+}
+
+void submit_inference(inference_server* server, inference_request* request) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if (atomic_load(&server->stopping)) {
+		fprintf(stderr, "ERROR IN SUBMIT INFERENCE: The server is stopping\n");
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	request->submit_time = seconds_now();
+	atomic_store_explicit(&request->done, FALSE, memory_order_relaxed);
+	queue_push(server, request);
+
+	if (atomic_load(&server->dispatcher_sleeping)) {
+		pthread_mutex_lock(&server->lock);
+		pthread_cond_signal(&server->work_ready);
+		pthread_mutex_unlock(&server->lock);
+	}
+}
+
+void wait_for_inference(inference_server* server, inference_request* request) {
+	if (atomic_load_explicit(&request->done, memory_order_acquire)) {
+		return;
+	}
+	pthread_mutex_lock(&server->lock);
+	while (!atomic_load_explicit(&request->done, memory_order_acquire)) {
+		pthread_cond_wait(&server->work_done, &server->lock);
+	}
+	pthread_mutex_unlock(&server->lock);
+}
+
+void get_inference_server_stats(inference_server* server, inference_server_stats* stats) {
+	pthread_mutex_lock(&server->lock);
+	stats->requests = server->requests;
+	stats->batches = server->batches;
+	stats->mean_batch_fill = (server->batches > 0) ? (double)server->requests / (server->batches * server->max_batch_size) : 0;
+
+	// the first bucket that reaches each rank
+	size_t p50_rank = (server->requests + 1) / 2;
+	size_t p99_rank = (server->requests * 99 + 99) / 100;
+	size_t seen = 0;
+	stats->p50_latency = 0;
+	stats->p99_latency = 0;
+	for (size_t b = 0; b < INFERENCE_LATENCY_BUCKETS && seen < p99_rank; b++) {
+		if (seen < p50_rank && seen + server->latency_histogram[b] >= p50_rank) {
+			stats->p50_latency = latency_bucket_limit(b);
+		}
+		seen += server->latency_histogram[b];
+		if (seen >= p99_rank) {
+			stats->p99_latency = latency_bucket_limit(b);
+		}
+	}
+	pthread_mutex_unlock(&server->lock);
+}
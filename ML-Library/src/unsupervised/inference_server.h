@@ -0,0 +1,99 @@
+#include "../mllib.h"
+#include "../math/matrix.h"
+#include "ann.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#ifndef MLLIB_INFERENCE_SERVER_H
+#define MLLIB_INFERENCE_SERVER_H
+
+/**
+ * Micro-batching for traffic that arrives one vector at a time. Callers submit requests from any number of
+ * threads into a lock-free queue; a dispatcher thread collects them into a batch until it holds max_batch_size
+ * requests or the oldest one has waited max_latency seconds, runs one forward pass over the batch through an
+ * inference_session, and completes every request in it.
+ *
+ * A request is owned by the caller and must stay alive, with its input and output, until it completes. It is
+ * complete when wait_for_inference() returns, or when its callback runs. Callbacks run on the dispatcher thread,
+ * so they should be short and must not wait on the server.
+ */
+struct inference_request_ {
+	const number* input;	// layers[0] entries
+	number* output;	// receives layers[number_of_layers - 1] entries
+	void (*callback)(struct inference_request_* request, void* context);	// may be NULL
+	void* context;
+
+	// set by the server
+	double submit_time;
+	atomic_int done;
+	_Atomic(struct inference_request_ *) next;
+};
+typedef struct inference_request_ inference_request;
+
+void init_inference_request(inference_request* request, const number* input, number* output,
+	void (*callback)(inference_request* request, void* context), void* context);
+
+// latencies are counted in a histogram of microseconds with this many buckets per doubling
+#define INFERENCE_LATENCY_BUCKETS_PER_DOUBLING 8
+#define INFERENCE_LATENCY_BUCKETS (INFERENCE_LATENCY_BUCKETS_PER_DOUBLING * 40)
+
+struct inference_server_stats_ {
+	size_t requests;
+	size_t batches;
+	double mean_batch_fill;	// the average batch size as a fraction of max_batch_size
+	double p50_latency;	// seconds from submission to completion, accurate to one bucket of the histogram
+	double p99_latency;
+};
+typedef struct inference_server_stats_ inference_server_stats;
+
+struct inference_server_ {
+	ann* neural_network;
+	inference_session* session;
+	size_t max_batch_size;
+	double max_latency;
+
+	// the batch being run: its requests, their latency buckets, and their inputs and outputs one per column
+	inference_request** batch_requests;
+	size_t* batch_latency_buckets;
+	number* batch_inputs;
+	number* batch_outputs;
+
+	// intrusive multi-producer single-consumer queue: producers swap themselves in at head, the dispatcher
+	// follows next pointers from tail. stub keeps the list from ever being empty
+	_Atomic(inference_request *) head;
+	inference_request* tail;
+	inference_request stub;
+
+	// the dispatcher sleeps on work_ready when the queue runs dry, and waiters on work_done
+	atomic_int dispatcher_sleeping;
+	atomic_int stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t work_ready;
+	pthread_cond_t work_done;
+	pthread_t dispatcher;
+
+	// statistics, updated under lock after every batch
+	size_t latency_histogram[INFERENCE_LATENCY_BUCKETS];
+	size_t requests;
+	size_t batches;
+
+	// the batch buffers are carved out of this arena
+	arena* memory;
+};
+typedef struct inference_server_ inference_server;
+
+/**
+ * Start the dispatcher. The network is only read, as with an inference_session, and must outlive the server.
+ */
+inference_server* start_inference_server(ann* neural_network, size_t max_batch_size, double max_latency);
+
+// Stop the dispatcher once every request submitted so far has been completed, and free the server
+void stop_inference_server(inference_server* server);
+
+void submit_inference(inference_server* server, inference_request* request);
+void wait_for_inference(inference_server* server, inference_request* request);
+
+void get_inference_server_stats(inference_server* server, inference_server_stats* stats);
+
+#endif
@@ -0,0 +1,193 @@
+// Momentum and Adam, with their state kept alongside the network
+#include <string.h>
+#include "optimizer.h"
+#include "../math/kernels.h"
+#include "../processing/thread_pool.h"
+
+optimizer_options default_optimizer_options(optimizer_kind kind) {
+	optimizer_options options = {
+		.kind = kind,
+		.momentum = 0.9,
+		.beta1 = 0.9,
+		.beta2 = 0.999,
+		.epsilon = 1e-8,
+	};
+	return options;
+}
+
+ann_optimizer* set_optimizer(ann* neural_network, const optimizer_options* options) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if (neural_network->mapping != NULL) {
+		fprintf(stderr, "ERROR IN SET OPTIMIZER: A mapped network cannot be trained\n");
+		exit(EXIT_FAILURE);
+	}
+	if (options->kind == OPTIMIZER_MOMENTUM && !(options->momentum >= 0 && options->momentum < 1)) {
+		fprintf(stderr, "ERROR IN SET OPTIMIZER: The momentum must be in [0, 1)\n");
+		exit(EXIT_FAILURE);
+	}
+	if (options->kind == OPTIMIZER_ADAM && !(options->beta1 >= 0 && options->beta1 < 1 && options->beta2 >= 0
+			&& options->beta2 < 1 && options->epsilon > 0)) {
+		fprintf(stderr, "ERROR IN SET OPTIMIZER: Adam needs beta1 and beta2 in [0, 1) and epsilon above 0\n");
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	if (neural_network->optimizer != NULL) {
+		delete_optimizer(neural_network->optimizer);
+		neural_network->optimizer = NULL;
+	}
+	if (options->kind == OPTIMIZER_SGD) {
+		return NULL;
+	}
+
+	ann_optimizer* optimizer;
+
+	#ifdef ML_LIB_DEBUG_MODE
+	optimizer = (ann_optimizer *)calloc(1, sizeof(ann_optimizer));
+	#else
+	optimizer = (ann_optimizer *)malloc(sizeof(ann_optimizer));
+	#endif
+
+	optimizer->options = *options;
+	optimizer->steps = 0;
+	optimizer->beta1_power = 1;
+	optimizer->beta2_power = 1;
+
+	// the gradients and the first moment always, the second moment for Adam
+	size_t number_of_layers = neural_network->number_of_layers;
+	size_t arrays = (options->kind == OPTIMIZER_ADAM) ? 3 : 2;
+	size_t arena_size = 2 * arrays * ARENA_ROUND_UP((number_of_layers - 1) * sizeof(void *));
+	for (int i = 0; i < number_of_layers - 1; i++) {
+		matrix* weights = neural_network->weights[i];
+		arena_size += arrays * (mat_footprint(weights->number_of_rows, weights->number_of_cols) + vec_footprint(weights->number_of_rows));
+	}
+	optimizer->memory = init_arena(arena_size);
+
+	optimizer->grad_w = (matrix **)arena_alloc(optimizer->memory, (number_of_layers - 1) * sizeof(matrix *));
+	optimizer->grad_b = (vector **)arena_alloc(optimizer->memory, (number_of_layers - 1) * sizeof(vector *));
+	optimizer->first_moment_w = (matrix **)arena_alloc(optimizer->memory, (number_of_layers - 1) * sizeof(matrix *));
+	optimizer->first_moment_b = (vector **)arena_alloc(optimizer->memory, (number_of_layers - 1) * sizeof(vector *));
+	optimizer->second_moment_w = NULL;
+	optimizer->second_moment_b = NULL;
+	if (options->kind == OPTIMIZER_ADAM) {
+		optimizer->second_moment_w = (matrix **)arena_alloc(optimizer->memory, (number_of_layers - 1) * sizeof(matrix *));
+		optimizer->second_moment_b = (vector **)arena_alloc(optimizer->memory, (number_of_layers - 1) * sizeof(vector *));
+	}
+
+	for (int i = 0; i < number_of_layers - 1; i++) {
+		size_t rows = neural_network->weights[i]->number_of_rows;
+		size_t cols = neural_network->weights[i]->number_of_cols;
+		optimizer->grad_w[i] = init_mat_in(optimizer->memory, rows, cols);
+		optimizer->grad_b[i] = init_vec_in(optimizer->memory, rows);
+		optimizer->first_moment_w[i] = init_mat_in(optimizer->memory, rows, cols);
+		optimizer->first_moment_b[i] = init_vec_in(optimizer->memory, rows);
+		memset(optimizer->first_moment_w[i]->m, 0, rows * cols * sizeof(number));
+		memset(optimizer->first_moment_b[i]->v, 0, rows * sizeof(number));
+		if (options->kind == OPTIMIZER_ADAM) {
+			optimizer->second_moment_w[i] = init_mat_in(optimizer->memory, rows, cols);
+			optimizer->second_moment_b[i] = init_vec_in(optimizer->memory, rows);
+			memset(optimizer->second_moment_w[i]->m, 0, rows * cols * sizeof(number));
+			memset(optimizer->second_moment_b[i]->v, 0, rows * sizeof(number));
+		}
+	}
+
+	neural_network->optimizer = optimizer;
+	return optimizer;
+}
+
+void delete_optimizer(ann_optimizer* optimizer) {
+	del_arena(optimizer->memory);
+	free(optimizer);
+}
+
+// below this many parameters an array is updated on the calling thread
+#define OPTIMIZER_PARALLEL_MIN 65536
+
+// chunk boundaries fall on whole cache lines so no two threads write to the same one
+#define OPTIMIZER_CHUNK_ALIGN (64 / sizeof(number))
+
+struct optimizer_update_job_ {
+	optimizer_kind kind;
+	const optimizer_constants* constants;
+	number* parameters;
+	number* first_moment;
+	number* second_moment;	// NULL but for Adam
+	const number* gradient;
+	size_t n;
+	size_t chunk;
+};
+typedef struct optimizer_update_job_ optimizer_update_job;
+
+static void optimizer_update_task(void* context, size_t task_index) {
+	optimizer_update_job* job = (optimizer_update_job *)context;
+	size_t begin = task_index * job->chunk;
+	if (begin >= job->n) {
+		return;
+	}
+	size_t count = (job->n - begin < job->chunk) ? job->n - begin : job->chunk;
+
+	if (job->kind == OPTIMIZER_ADAM) {
+		kernels->adam_update(job->parameters + begin, job->first_moment + begin, job->second_moment + begin,
+			job->gradient + begin, job->constants, count);
+	} else {
+		kernels->momentum_update(job->parameters + begin, job->first_moment + begin, job->gradient + begin,
+			job->constants, count);
+	}
+}
+
+static void update_parameters(optimizer_update_job* job, number* parameters, number* first_moment, number* second_moment,
+		const number* gradient, size_t n) {
+	job->parameters = parameters;
+	job->first_moment = first_moment;
+	job->second_moment = second_moment;
+	job->gradient = gradient;
+	job->n = n;
+
+	size_t number_of_threads = get_number_of_threads();
+	if (number_of_threads == 1 || n < OPTIMIZER_PARALLEL_MIN) {
+		job->chunk = n;
+		optimizer_update_task(job, 0);
+		return;
+	}
+
+	size_t chunk = (n + number_of_threads - 1) / number_of_threads;
+	job->chunk = (chunk + OPTIMIZER_CHUNK_ALIGN - 1) / OPTIMIZER_CHUNK_ALIGN * OPTIMIZER_CHUNK_ALIGN;
+	parallel_for((n + job->chunk - 1) / job->chunk, optimizer_update_task, job);
+}
+
+/**
+ * Adam's bias corrections divide m by 1 - beta1^t and v by 1 - beta2^t. With c = sqrt(1 - beta2^t), the update
+ * m_hat / (sqrt(v_hat) + epsilon) equals (c / (1 - beta1^t)) * m / (sqrt(v) + c * epsilon), so both corrections
+ * are folded into the learning rate and epsilon of the step and the kernel never sees them.
+ */
+void optimizer_step(ann* neural_network, matrix** grad_w, vector** grad_b, number learning_rate, number gradient_scale) {
+	ann_optimizer* optimizer = neural_network->optimizer;
+	optimizer_options* options = &optimizer->options;
+	optimizer->steps++;
+
+	optimizer_constants constants = {
+		.gradient_scale = gradient_scale,
+		.learning_rate = learning_rate,
+		.beta1 = options->momentum,
+	};
+	if (options->kind == OPTIMIZER_ADAM) {
+		optimizer->beta1_power *= options->beta1;
+		optimizer->beta2_power *= options->beta2;
+		number correction = NUMBER_SQRT(1 - optimizer->beta2_power);
+		constants.learning_rate = learning_rate * correction / (1 - optimizer->beta1_power);
+		constants.beta1 = options->beta1;
+		constants.beta2 = options->beta2;
+		constants.epsilon = options->epsilon * correction;
+	}
+
+	optimizer_update_job job = { .kind = options->kind, .constants = &constants };
+	boolean adam = (options->kind == OPTIMIZER_ADAM);
+	for (int i = 0; i < neural_network->number_of_layers - 1; i++) {
+		matrix* weights = neural_network->weights[i];
+		vector* bias = neural_network->biases[i];
+		update_parameters(&job, weights->m, optimizer->first_moment_w[i]->m, adam ? optimizer->second_moment_w[i]->m : NULL,
+			grad_w[i]->m, weights->number_of_rows * weights->number_of_cols);
+		update_parameters(&job, bias->v, optimizer->first_moment_b[i]->v, adam ? optimizer->second_moment_b[i]->v : NULL,
+			grad_b[i]->v, bias->size);
+	}
+}
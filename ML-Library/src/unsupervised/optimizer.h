@@ -0,0 +1,80 @@
+#include "../mllib.h"
+#include "../math/matrix.h"
+#include "../math/arena.h"
+#include "ann.h"
+
+#ifndef MLLIB_OPTIMIZER_H
+#define MLLIB_OPTIMIZER_H
+
+/**
+ * Optimizers other than plain SGD. A network without one (the default) takes SGD steps fused into the backward
+ * pass, with no gradient ever formed. With one, the training step forms the gradients of every layer, takes dE/dx
+ * through the weights as they were before the step, and hands the gradients to optimizer_step(), which updates each
+ * array of parameters in one pass of a fused kernel over the parameters, their gradient and the optimizer's state.
+ *
+ * train(), train_with_config(), train_from_stream(), train_parallel() and train_mixed_precision() use the network's
+ * optimizer. train_hogwild() only takes plain SGD steps, since its workers update the weights with no step to hang
+ * the state off, and refuses a network with an optimizer.
+ *
+ * The learning rate is still the network's gamma through the schedule of train_with_config(). Adam typically
+ * wants a smaller one than SGD.
+ */
+enum optimizer_kind_ {
+	OPTIMIZER_SGD,
+	OPTIMIZER_MOMENTUM,	// heavy ball: velocity = momentum * velocity + g, w -= learning_rate * velocity
+	OPTIMIZER_ADAM,
+};
+typedef enum optimizer_kind_ optimizer_kind;
+
+struct optimizer_options_ {
+	optimizer_kind kind;
+	number momentum;	// OPTIMIZER_MOMENTUM, in [0, 1)
+	number beta1;	// OPTIMIZER_ADAM, in [0, 1)
+	number beta2;	// OPTIMIZER_ADAM, in [0, 1)
+	number epsilon;	// OPTIMIZER_ADAM, above 0
+};
+typedef struct optimizer_options_ optimizer_options;
+
+struct ann_optimizer_ {
+	optimizer_options options;
+	size_t steps;
+
+	// beta1^steps and beta2^steps, for Adam's bias corrections
+	number beta1_power;
+	number beta2_power;
+
+	/**
+	 * Arrays indexed by layer, shaped like the weights and biases. The gradients are filled by the serial
+	 * training step; the first moment is the velocity of momentum. The second moment is only allocated for Adam.
+	 */
+	matrix** grad_w;
+	vector** grad_b;
+	matrix** first_moment_w;
+	vector** first_moment_b;
+	matrix** second_moment_w;
+	vector** second_moment_b;
+
+	// everything above is carved out of this arena
+	arena* memory;
+};
+typedef struct ann_optimizer_ ann_optimizer;
+
+// The usual settings: momentum 0.9, Adam's beta1 0.9, beta2 0.999 and epsilon 1e-8
+optimizer_options default_optimizer_options(optimizer_kind kind);
+
+/**
+ * Give a network an optimizer, with its state zeroed, in place of any it had. The state is allocated here, once,
+ * and kept with the network until the next set_optimizer() or deallocate_ann(). OPTIMIZER_SGD removes the
+ * optimizer and returns NULL. The state is not saved by save_ann().
+ */
+ann_optimizer* set_optimizer(ann* neural_network, const optimizer_options* options);
+
+void delete_optimizer(ann_optimizer* optimizer);
+
+/**
+ * One update of every layer of the network from the summed gradients grad_w and grad_b, which are scaled by
+ * gradient_scale first. Large layers are split across the thread pool.
+ */
+void optimizer_step(ann* neural_network, matrix** grad_w, vector** grad_b, number learning_rate, number gradient_scale);
+
+#endif
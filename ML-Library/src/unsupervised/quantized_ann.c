@@ -0,0 +1,234 @@
+#include <string.h>
+#include "quantized_ann.h"
+#include "../math/kernels.h"
+#include "../processing/thread_pool.h"
+
+// samples per task of pass_forward_quantized; a task runs its samples through every layer
+#define QUANTIZED_SAMPLES_PER_TASK INT8_GEMM_N_ALIGN
+
+static size_t pad_inputs(size_t number_of_inputs) {
+	return (number_of_inputs + INT8_GEMM_K_ALIGN - 1) / INT8_GEMM_K_ALIGN * INT8_GEMM_K_ALIGN;
+}
+
+// the scale that maps the largest magnitude onto QUANTIZED_MAX; all-zero data gets 1 so nothing divides by zero
+static number quantization_scale(number largest_magnitude) {
+	return (largest_magnitude > 0) ? largest_magnitude / QUANTIZED_MAX : 1;
+}
+
+// round to nearest, clamped to [-QUANTIZED_MAX, QUANTIZED_MAX]. Written without branches so the loops calling it
+// vectorize
+static inline int8_t quantize(number value, number inverse_scale) {
+	number scaled = value * inverse_scale;
+	scaled = (scaled > QUANTIZED_MAX) ? QUANTIZED_MAX : scaled;
+	scaled = (scaled < -QUANTIZED_MAX) ? -QUANTIZED_MAX : scaled;
+	return (int8_t)(int32_t)(scaled + ((scaled >= 0) ? (number)0.5 : (number)-0.5));
+}
+
+static number largest_magnitude(const matrix* mat) {
+	number largest = 0;
+	for (size_t i = 0; i < mat->number_of_rows; i++) {
+		for (size_t j = 0; j < mat->number_of_cols; j++) {
+			number magnitude = (VALUE_AT(mat, i, j) < 0) ? -VALUE_AT(mat, i, j) : VALUE_AT(mat, i, j);
+			largest = (magnitude > largest) ? magnitude : largest;
+		}
+	}
+	return largest;
+}
+
+/**
+ * Per-row symmetric quantization of one layer's weights. The input scale must already be set.
+ */
+static void quantize_layer(quantized_layer* layer, matrix* weights, vector* bias) {
+	for (size_t i = 0; i < layer->number_of_outputs; i++) {
+		number row_largest = 0;
+		for (size_t p = 0; p < layer->number_of_inputs; p++) {
+			number magnitude = (VALUE_AT(weights, i, p) < 0) ? -VALUE_AT(weights, i, p) : VALUE_AT(weights, i, p);
+			row_largest = (magnitude > row_largest) ? magnitude : row_largest;
+		}
+		layer->weight_scales[i] = quantization_scale(row_largest);
+
+		int8_t* row = layer->weights + i * layer->padded_inputs;
+		number inverse_scale = 1 / layer->weight_scales[i];
+		for (size_t p = 0; p < layer->number_of_inputs; p++) {
+			row[p] = quantize(VALUE_AT(weights, i, p), inverse_scale);
+		}
+		memset(row + layer->number_of_inputs, 0, layer->padded_inputs - layer->number_of_inputs);
+
+		layer->output_scales[i] = layer->weight_scales[i] * layer->input_scale;
+		layer->bias[i] = bias->v[i];
+	}
+}
+
+quantized_ann* quantize_ann(ann* neural_network, batch* calibration_inputs) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if (calibration_inputs->vector_size != neural_network->layers[0]) {
+		fprintf(stderr, "ERROR IN QUANTIZE ANN: Size of calibration inputs does not match the input layer of the neural network\n");
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	quantized_ann* quantized_network;
+	size_t number_of_layers = neural_network->number_of_layers;
+
+	#ifdef ML_LIB_DEBUG_MODE
+	quantized_network = (quantized_ann *)calloc(1, sizeof(quantized_ann));
+	#else
+	quantized_network = (quantized_ann *)malloc(sizeof(quantized_ann));
+	#endif
+
+	size_t arena_size = ARENA_ROUND_UP(number_of_layers * sizeof(size_t))
+		+ ARENA_ROUND_UP((number_of_layers - 1) * sizeof(quantized_layer));
+	for (int i = 0; i < number_of_layers - 1; i++) {
+		size_t number_of_outputs = neural_network->layers[i + 1];
+		arena_size += ARENA_ROUND_UP(number_of_outputs * pad_inputs(neural_network->layers[i]))
+			+ 3 * ARENA_ROUND_UP(number_of_outputs * sizeof(number));
+	}
+	quantized_network->memory = init_arena(arena_size);
+
+	quantized_network->number_of_layers = number_of_layers;
+	quantized_network->output_activation = neural_network->output_activation;
+	quantized_network->sizes = (size_t *)arena_alloc(quantized_network->memory, number_of_layers * sizeof(size_t));
+	memcpy(quantized_network->sizes, neural_network->layers, number_of_layers * sizeof(size_t));
+	quantized_network->layers = (quantized_layer *)arena_alloc(quantized_network->memory, (number_of_layers - 1) * sizeof(quantized_layer));
+
+	// calibration: a float pass over the sample, taking the largest magnitude that goes into each layer
+	matrix* x = calibration_inputs->data;
+	for (int i = 0; i < number_of_layers - 1; i++) {
+		quantized_layer* layer = &quantized_network->layers[i];
+		layer->number_of_inputs = neural_network->layers[i];
+		layer->number_of_outputs = neural_network->layers[i + 1];
+		layer->padded_inputs = pad_inputs(layer->number_of_inputs);
+		layer->weights = (int8_t *)arena_alloc(quantized_network->memory, layer->number_of_outputs * layer->padded_inputs);
+		layer->weight_scales = (number *)arena_alloc(quantized_network->memory, layer->number_of_outputs * sizeof(number));
+		layer->output_scales = (number *)arena_alloc(quantized_network->memory, layer->number_of_outputs * sizeof(number));
+		layer->bias = (number *)arena_alloc(quantized_network->memory, layer->number_of_outputs * sizeof(number));
+
+		layer->input_scale = quantization_scale(largest_magnitude(x));
+		quantize_layer(layer, neural_network->weights[i], neural_network->biases[i]);
+
+		if (i < number_of_layers - 2) {
+			matrix* y = init_mat(layer->number_of_outputs, x->number_of_cols);
+			layer_forward(y, NULL, neural_network->weights[i], neural_network->biases[i], x);
+			if (x != calibration_inputs->data) {
+				del_mat(x);
+			}
+			x = y;
+		}
+	}
+	if (x != calibration_inputs->data) {
+		del_mat(x);
+	}
+
+	return quantized_network;
+}
+
+void deallocate_quantized_ann(quantized_ann* quantized_network) {
+	del_arena(quantized_network->memory);
+	free(quantized_network);
+}
+
+struct quantized_forward_job_ {
+	quantized_ann* quantized_network;
+	matrix* inputs;
+	matrix* hidden[2];	// outputs of the hidden layers, alternating, with one column per sample
+	matrix* predictions;
+
+	// the quantized input of the layer being computed, one block of task_inputs bytes per task
+	int8_t* quantized_inputs;
+	size_t task_inputs;
+
+	size_t number_of_samples;
+};
+typedef struct quantized_forward_job_ quantized_forward_job;
+
+/**
+ * Quantize columns [begin, end) of the first number_of_inputs rows of x into the layout of the int8 kernels:
+ * groups of four inputs, one group of every sample after another. Inputs up to padded_inputs and samples up to
+ * QUANTIZED_SAMPLES_PER_TASK are zero.
+ */
+static void quantize_columns(int8_t* out, const matrix* x, size_t number_of_inputs, size_t padded_inputs,
+		size_t begin, size_t end, number inverse_scale) {
+	size_t ldo = 4 * QUANTIZED_SAMPLES_PER_TASK;
+	static const number zeros[QUANTIZED_SAMPLES_PER_TASK] = {0};
+	if (end - begin < QUANTIZED_SAMPLES_PER_TASK) {
+		memset(out, 0, padded_inputs / 4 * ldo);
+	}
+	for (size_t p = 0; p < number_of_inputs; p += 4) {
+		// a last group short of four inputs reads a row of zeros for the rest
+		const number* rows[4];
+		for (int q = 0; q < 4; q++) {
+			rows[q] = (p + q < number_of_inputs) ? x->m + (p + q) * x->leading_dimension + begin : zeros;
+		}
+		kernels->quantize_int8(out + (p / 4) * ldo, rows, inverse_scale, end - begin);
+	}
+}
+
+static void quantized_forward_task(void* context, size_t task_index) {
+	quantized_forward_job* job = (quantized_forward_job *)context;
+	quantized_ann* quantized_network = job->quantized_network;
+	size_t begin = task_index * QUANTIZED_SAMPLES_PER_TASK;
+	size_t end = (begin + QUANTIZED_SAMPLES_PER_TASK < job->number_of_samples) ? begin + QUANTIZED_SAMPLES_PER_TASK : job->number_of_samples;
+	int8_t* quantized_inputs = job->quantized_inputs + task_index * job->task_inputs;
+
+	matrix* x = job->inputs;
+	for (int i = 0; i < quantized_network->number_of_layers - 1; i++) {
+		quantized_layer* layer = &quantized_network->layers[i];
+		boolean output_layer = (i == quantized_network->number_of_layers - 2);
+		boolean softmax = output_layer && quantized_network->output_activation == ACTIVATION_SOFTMAX;
+		matrix* y = output_layer ? job->predictions : job->hidden[i % 2];
+
+		// a slope of 1 leaves the logits of a softmax head as they are
+		quantize_columns(quantized_inputs, x, layer->number_of_inputs, layer->padded_inputs, begin, end, 1 / layer->input_scale);
+		kernels->int8_gemm(y->m + begin, y->leading_dimension, layer->weights, layer->padded_inputs,
+			quantized_inputs, 4 * QUANTIZED_SAMPLES_PER_TASK, layer->number_of_outputs, end - begin, layer->padded_inputs,
+			layer->output_scales, layer->bias, softmax ? 1 : LEAKY_RELU_SLOPE);
+		if (softmax) {
+			kernels->softmax_cross_entropy(y->m + begin, y->leading_dimension, y->m + begin, y->leading_dimension,
+				NULL, 0, layer->number_of_outputs, end - begin);
+		}
+		x = y;
+	}
+}
+
+batch* pass_forward_quantized(quantized_ann* quantized_network, batch* inputs) {
+	#ifdef ML_LIB_DEBUG_MODE
+	if (inputs->vector_size != quantized_network->sizes[0]) {
+		fprintf(stderr, "ERROR IN PASS FORWARD QUANTIZED: Size of inputs do not match input layer of neural network\n");
+		exit(EXIT_FAILURE);
+	}
+	#endif
+
+	size_t number_of_layers = quantized_network->number_of_layers;
+	size_t number_of_samples = inputs->number_of_vectors;
+	size_t number_of_tasks = (number_of_samples + QUANTIZED_SAMPLES_PER_TASK - 1) / QUANTIZED_SAMPLES_PER_TASK;
+	batch* predictions = create_empty_batch(number_of_samples, quantized_network->sizes[number_of_layers - 1]);
+
+	size_t widest_hidden = 0;
+	size_t widest_padded_input = 0;
+	for (int i = 0; i < number_of_layers - 1; i++) {
+		if (i > 0 && quantized_network->sizes[i] > widest_hidden) {
+			widest_hidden = quantized_network->sizes[i];
+		}
+		if (quantized_network->layers[i].padded_inputs > widest_padded_input) {
+			widest_padded_input = quantized_network->layers[i].padded_inputs;
+		}
+	}
+	size_t task_inputs = widest_padded_input * QUANTIZED_SAMPLES_PER_TASK;
+
+	arena* memory = init_arena(2 * mat_footprint(widest_hidden, number_of_samples)
+		+ ARENA_ROUND_UP(number_of_tasks * task_inputs));
+	quantized_forward_job job = {
+		.quantized_network = quantized_network,
+		.inputs = inputs->data,
+		.hidden = { init_mat_in(memory, widest_hidden, number_of_samples), init_mat_in(memory, widest_hidden, number_of_samples) },
+		.predictions = predictions->data,
+		.quantized_inputs = (int8_t *)arena_alloc(memory, number_of_tasks * task_inputs),
+		.task_inputs = task_inputs,
+		.number_of_samples = number_of_samples,
+	};
+
+	parallel_for(number_of_tasks, quantized_forward_task, &job);
+
+	del_arena(memory);
+	return predictions;
+}
@@ -0,0 +1,56 @@
+#include "../mllib.h"
+#include "../math/matrix.h"
+#include "../processing/batch.h"
+#include "ann.h"
+#include <stdint.h>
+
+#ifndef MLLIB_QUANTIZED_ANN_H
+#define MLLIB_QUANTIZED_ANN_H
+
+/**
+ * A trained network converted for int8 inference. Each row of weights is scaled symmetrically onto [-127, 127]
+ * with its own scale, and each layer's input is scaled the same way with one scale calibrated on sample data,
+ * so a layer is an int8 GEMM with int32 sums that are turned back into 'number' together with the bias and the
+ * Leaky-ReLU. The weights take a quarter of the memory of float ones. A softmax head keeps its output layer
+ * linear in the GEMM and takes the softmax of each sample after it, in 'number'.
+ */
+#define QUANTIZED_MAX 127
+
+struct quantized_layer_ {
+	size_t number_of_inputs;
+	size_t number_of_outputs;
+	size_t padded_inputs;	// number_of_inputs rounded up to INT8_GEMM_K_ALIGN; the weights are zero past the real inputs
+
+	int8_t* weights;	// number_of_outputs x padded_inputs
+	number* weight_scales;	// per row, the largest magnitude in the row / QUANTIZED_MAX
+	number input_scale;	// the largest input magnitude seen during calibration / QUANTIZED_MAX
+	number* output_scales;	// weight_scales[i] * input_scale, taking an int32 sum back to 'number'
+	number* bias;
+};
+typedef struct quantized_layer_ quantized_layer;
+
+struct quantized_ann_ {
+	quantized_layer* layers;	// number_of_layers - 1 of them, like the weights of an ann
+	size_t* sizes;
+	size_t number_of_layers;
+	layer_activation output_activation;	// copied from the network
+
+	// everything above is carved out of this arena
+	arena* memory;
+};
+typedef struct quantized_ann_ quantized_ann;
+
+/**
+ * Quantize the weights of a network, calibrating the input scale of every layer with a float pass over
+ * calibration_inputs. Inputs larger than anything in the calibration batch are clamped when quantized.
+ * The network is not changed and can be deallocated afterwards.
+ */
+quantized_ann* quantize_ann(ann* neural_network, batch* calibration_inputs);
+void deallocate_quantized_ann(quantized_ann* quantized_network);
+
+/**
+ * Inference with the int8 weights, split across the thread pool by samples
+ */
+batch* pass_forward_quantized(quantized_ann* quantized_network, batch* inputs);
+
+#endif
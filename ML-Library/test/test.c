@@ -1,9 +1,22 @@
 /**
  * 		Testing various methods in ML-Library
  */
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
 #include "../src/math/matrix.h"
+#include "../src/math/kernels.h"
+#include "../src/math/gemm.h"
 #include "../src/processing/batch.h"
+#include "../src/processing/thread_pool.h"
+#include "../src/processing/idx.h"
+#include "../src/processing/batch_stream.h"
 #include "../src/unsupervised/ann.h"
+#include "../src/unsupervised/quantized_ann.h"
+#include "../src/unsupervised/inference_server.h"
+#include "../src/unsupervised/ann_file.h"
+#include "../src/unsupervised/checkpoint.h"
+#include "../src/unsupervised/optimizer.h"
 
 void print_mat(matrix* mat) {
 	size_t nrows = mat->number_of_rows;
@@ -162,6 +175,2148 @@ void test_mat_mult() {
 	fprintf(stdout, "\n--------------------\nEND TESTING OF MATRIX MULTIPLICATION\n--------------------\n");
 }
 
+void test_arena() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF ARENA ALLOCATION\n--------------------\n");
+
+	arena* memory = init_arena(mat_footprint(10, 10) + vec_footprint(7));
+	matrix* mat = init_mat_in(memory, 10, 10);
+	vector* vec = init_vec_in(memory, 7);
+	fprintf(stdout, "Matrix data aligned: %d \t Vector data aligned: %d\n",
+		((size_t)mat->m % ARENA_ALIGNMENT) == 0, ((size_t)vec->v % ARENA_ALIGNMENT) == 0);
+	fprintf(stdout, "Header and data contiguous: %d\n", (char *)mat->m - (char *)mat == ARENA_ROUND_UP(sizeof(matrix)));
+
+	// the first slab is full, so this one spills into a second slab
+	matrix* spill = init_mat_in(memory, 100, 100);
+	fprintf(stdout, "Spilled matrix aligned: %d\n", ((size_t)spill->m % ARENA_ALIGNMENT) == 0);
+
+	reset_arena(memory);
+	matrix* reused = init_mat_in(memory, 10, 10);
+	fprintf(stdout, "Reset reuses the first slab: %d\n", reused == mat);
+
+	if (((size_t)mat->m % ARENA_ALIGNMENT) != 0 || ((size_t)vec->v % ARENA_ALIGNMENT) != 0 || reused != mat) {
+		fprintf(stderr, "ERROR IN ARENA TEST: Allocations are misaligned or the arena was not rewound\n");
+		exit(EXIT_FAILURE);
+	}
+
+	del_arena(memory);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF ARENA ALLOCATION\n--------------------\n");
+}
+
+/**
+ * Compare the blocked matrix multiplication against the textbook triple loop on shapes that exercise
+ * the edge tiles and multiple cache blocks.
+ */
+void test_mat_mult_blocked() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF BLOCKED MATRIX MULTIPLICATION\n--------------------\n");
+
+	size_t shapes[][3] = { {1, 1, 1}, {7, 5, 3}, {37, 53, 29}, {128, 784, 256}, {10, 128, 256}, {300, 300, 300} };
+	size_t number_of_shapes = sizeof(shapes) / sizeof(shapes[0]);
+
+	for (int s = 0; s < number_of_shapes; s++) {
+		size_t m = shapes[s][0], k = shapes[s][1], n = shapes[s][2];
+		matrix* a = init_mat(m, k);
+		matrix* b = init_mat(k, n);
+		matrix* out = init_mat(m, n);
+
+		for (int i = 0; i < m * k; i++) {
+			a->m[i] = ((number)rand()) / RAND_MAX - 0.5;
+		}
+		for (int i = 0; i < k * n; i++) {
+			b->m[i] = ((number)rand()) / RAND_MAX - 0.5;
+		}
+
+		matrix_mult(out, a, b);
+
+		number max_error = 0;
+		for (int i = 0; i < m; i++) {
+			for (int j = 0; j < n; j++) {
+				double expected = 0;
+				for (int p = 0; p < k; p++) {
+					expected += (double)VALUE_AT(a, i, p) * VALUE_AT(b, p, j);
+				}
+				number error = fabs(expected - VALUE_AT(out, i, j));
+				max_error = (error > max_error) ? error : max_error;
+			}
+		}
+
+		fprintf(stdout, "(%lu x %lu) * (%lu x %lu): max error %g\n", m, k, k, n, max_error);
+		if (max_error > 1e-3) {
+			fprintf(stderr, "ERROR IN BLOCKED MATRIX MULTIPLICATION TEST: Result does not match reference\n");
+			exit(EXIT_FAILURE);
+		}
+
+		del_mat(a);
+		del_mat(b);
+		del_mat(out);
+	}
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF BLOCKED MATRIX MULTIPLICATION\n--------------------\n");
+}
+
+/**
+ * The transpose-free products should agree with an explicit transpose followed by matrix_mult.
+ */
+void test_mat_mult_transposed() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF TRANSPOSED MATRIX MULTIPLICATION\n--------------------\n");
+
+	size_t shapes[][3] = { {3, 4, 5}, {128, 784, 256}, {10, 128, 33} };
+
+	for (int s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+		size_t m = shapes[s][0], k = shapes[s][1], n = shapes[s][2];
+		matrix* a = init_mat(k, m);		// used as transpose(a), which is (m, k)
+		matrix* b = init_mat(n, k);		// used as transpose(b), which is (k, n)
+		matrix* a_transpose = init_mat(m, k);
+		matrix* b_transpose = init_mat(k, n);
+		matrix* expected = init_mat(m, n);
+		matrix* actual = init_mat(m, n);
+
+		for (int i = 0; i < m * k; i++) {
+			a->m[i] = ((number)rand()) / RAND_MAX - 0.5;
+		}
+		for (int i = 0; i < k * n; i++) {
+			b->m[i] = ((number)rand()) / RAND_MAX - 0.5;
+		}
+		matrix_transpose(a_transpose, a);
+		matrix_transpose(b_transpose, b);
+
+		number max_error = 0;
+		matrix_mult(expected, a_transpose, b_transpose);
+
+		matrix_mult_tn(actual, a, b_transpose);
+		for (int i = 0; i < m * n; i++) {
+			number error = fabs(expected->m[i] - actual->m[i]);
+			max_error = (error > max_error) ? error : max_error;
+		}
+
+		matrix_mult_nt(actual, a_transpose, b);
+		for (int i = 0; i < m * n; i++) {
+			number error = fabs(expected->m[i] - actual->m[i]);
+			max_error = (error > max_error) ? error : max_error;
+		}
+
+		fprintf(stdout, "(%lu x %lu) * (%lu x %lu): max error %g\n", m, k, k, n, max_error);
+		if (max_error > 1e-4) {
+			fprintf(stderr, "ERROR IN TRANSPOSED MATRIX MULTIPLICATION TEST: Result does not match explicit transpose\n");
+			exit(EXIT_FAILURE);
+		}
+
+		del_mat(a);
+		del_mat(b);
+		del_mat(a_transpose);
+		del_mat(b_transpose);
+		del_mat(expected);
+		del_mat(actual);
+	}
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF TRANSPOSED MATRIX MULTIPLICATION\n--------------------\n");
+}
+
+/**
+ * The fused layer should match the three separate passes it replaces.
+ */
+void test_layer_forward() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF FUSED LAYER FORWARD\n--------------------\n");
+
+	size_t shapes[][3] = { {4, 4, 16}, {128, 784, 256}, {10, 128, 37} };
+
+	for (int s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+		size_t outputs = shapes[s][0], inputs = shapes[s][1], batch_size = shapes[s][2];
+		matrix* weights = init_mat(outputs, inputs);
+		vector* bias = init_vec(outputs);
+		matrix* x = init_mat(inputs, batch_size);
+		for (int i = 0; i < outputs * inputs; i++) {
+			weights->m[i] = ((number)rand()) / RAND_MAX - 0.5;
+		}
+		for (int i = 0; i < outputs; i++) {
+			bias->v[i] = ((number)rand()) / RAND_MAX - 0.5;
+		}
+		for (int i = 0; i < inputs * batch_size; i++) {
+			x->m[i] = ((number)rand()) / RAND_MAX;
+		}
+
+		matrix* linear = init_mat(outputs, batch_size);
+		matrix* z_expected = init_mat(outputs, batch_size);
+		matrix* y_expected = init_mat(outputs, batch_size);
+		matrix_mult(linear, weights, x);
+		add_vector_to_matrix(z_expected, linear, bias);
+		nonlinear_transform_mat(y_expected, z_expected);
+
+		matrix* z = init_mat(outputs, batch_size);
+		matrix* y = init_mat(outputs, batch_size);
+		matrix* y_only = init_mat(outputs, batch_size);
+		layer_forward(y, z, weights, bias, x);
+		layer_forward(y_only, NULL, weights, bias, x);
+
+		number max_error = 0;
+		for (int i = 0; i < outputs * batch_size; i++) {
+			number errors[3] = { fabs(z->m[i] - z_expected->m[i]), fabs(y->m[i] - y_expected->m[i]), fabs(y_only->m[i] - y_expected->m[i]) };
+			for (int e = 0; e < 3; e++) {
+				max_error = (errors[e] > max_error) ? errors[e] : max_error;
+			}
+		}
+
+		fprintf(stdout, "(%lu x %lu) layer, batch of %lu: max error %g\n", outputs, inputs, batch_size, max_error);
+		if (max_error > 1e-4) {
+			fprintf(stderr, "ERROR IN FUSED LAYER FORWARD TEST: Result does not match the unfused passes\n");
+			exit(EXIT_FAILURE);
+		}
+
+		del_mat(weights);
+		del_vec(bias);
+		del_mat(x);
+		del_mat(linear);
+		del_mat(z_expected);
+		del_mat(y_expected);
+		del_mat(z);
+		del_mat(y);
+		del_mat(y_only);
+	}
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF FUSED LAYER FORWARD\n--------------------\n");
+}
+
+/**
+ * Run every elementwise kernel and the matrix multiplication under each instruction set the host supports,
+ * and compare against the scalar kernels.
+ */
+void test_kernels() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF SIMD KERNELS\n--------------------\n");
+
+	const char* previous = kernels->name;
+	const char* instruction_sets[] = { "sse", "avx2", "avx512", "avx512vnni" };
+	size_t n = 1000 + 13;
+
+	matrix* a = init_mat(37, n / 37 + 1);
+	matrix* b = init_mat(a->number_of_rows, a->number_of_cols);
+	matrix* expected = init_mat(a->number_of_rows, a->number_of_cols);
+	matrix* actual = init_mat(a->number_of_rows, a->number_of_cols);
+	size_t size = a->number_of_rows * a->number_of_cols;
+	for (int i = 0; i < size; i++) {
+		a->m[i] = ((number)rand()) / RAND_MAX - 0.5;
+		b->m[i] = ((number)rand()) / RAND_MAX - 0.5;
+	}
+	// optimizer state for the update kernels, which work in place
+	matrix* first_expected = init_mat(a->number_of_rows, a->number_of_cols);
+	matrix* first_actual = init_mat(a->number_of_rows, a->number_of_cols);
+	matrix* second_expected = init_mat(a->number_of_rows, a->number_of_cols);
+	matrix* second_actual = init_mat(a->number_of_rows, a->number_of_cols);
+	optimizer_constants constants = { .gradient_scale = 0.5, .learning_rate = 0.01, .beta1 = 0.9, .beta2 = 0.999, .epsilon = 1e-8 };
+
+	for (int s = 0; s < sizeof(instruction_sets) / sizeof(instruction_sets[0]); s++) {
+		if (!use_kernels(instruction_sets[s])) {
+			fprintf(stdout, "%s: not supported by this host\n", instruction_sets[s]);
+			continue;
+		}
+
+		number max_error = 0;
+		for (int op = 0; op < 11; op++) {
+			use_kernels("scalar");
+			const kernel_table* reference = kernels;
+			use_kernels(instruction_sets[s]);
+
+			// odd lengths and offsets exercise the remainder loops
+			size_t length = size - op;
+			switch (op) {
+				case 0: reference->add(expected->m, a->m, b->m, length); kernels->add(actual->m, a->m, b->m, length); break;
+				case 1: reference->sub(expected->m, a->m, b->m, length); kernels->sub(actual->m, a->m, b->m, length); break;
+				case 2: reference->scale(expected->m, a->m, 0.3, length); kernels->scale(actual->m, a->m, 0.3, length); break;
+				case 3: reference->multiply(expected->m, a->m, b->m, length); kernels->multiply(actual->m, a->m, b->m, length); break;
+				case 4: reference->leaky_relu(expected->m, a->m, LEAKY_RELU_SLOPE, length); kernels->leaky_relu(actual->m, a->m, LEAKY_RELU_SLOPE, length); break;
+				case 5: reference->leaky_relu_derivative(expected->m, a->m, LEAKY_RELU_SLOPE, length); kernels->leaky_relu_derivative(actual->m, a->m, LEAKY_RELU_SLOPE, length); break;
+				case 6:
+					expected->m[0] = reference->sum(a->m + 1, length - 1);
+					actual->m[0] = kernels->sum(a->m + 1, length - 1);
+					length = 1;
+					break;
+				case 7: {
+					number expected_sum = reference->leaky_relu_backward(expected->m, a->m, b->m, b->m, LEAKY_RELU_SLOPE, length);
+					number actual_sum = kernels->leaky_relu_backward(actual->m, a->m, b->m, b->m, LEAKY_RELU_SLOPE, length);
+					max_error = (fabs(expected_sum - actual_sum) > max_error) ? fabs(expected_sum - actual_sum) : max_error;
+					break;
+				}
+				case 8: {
+					number expected_loss = 0;
+					number actual_loss = 0;
+					number expected_sum = reference->leaky_relu_output_backward(expected->m, a->m, b->m, b->m, LEAKY_RELU_SLOPE, length, &expected_loss);
+					number actual_sum = kernels->leaky_relu_output_backward(actual->m, a->m, b->m, b->m, LEAKY_RELU_SLOPE, length, &actual_loss);
+					max_error = (fabs(expected_sum - actual_sum) > max_error) ? fabs(expected_sum - actual_sum) : max_error;
+					max_error = (fabs(expected_loss - actual_loss) > max_error) ? fabs(expected_loss - actual_loss) : max_error;
+					break;
+				}
+				case 9:
+				case 10:
+					// the weights are a, the gradient b, and the state starts out at b and b^2
+					memcpy(expected->m, a->m, length * sizeof(number));
+					memcpy(actual->m, a->m, length * sizeof(number));
+					memcpy(first_expected->m, b->m, length * sizeof(number));
+					memcpy(first_actual->m, b->m, length * sizeof(number));
+					for (int i = 0; i < length; i++) {
+						second_expected->m[i] = second_actual->m[i] = b->m[i] * b->m[i];
+					}
+					if (op == 9) {
+						reference->momentum_update(expected->m, first_expected->m, b->m, &constants, length);
+						kernels->momentum_update(actual->m, first_actual->m, b->m, &constants, length);
+					} else {
+						reference->adam_update(expected->m, first_expected->m, second_expected->m, b->m, &constants, length);
+						kernels->adam_update(actual->m, first_actual->m, second_actual->m, b->m, &constants, length);
+					}
+					for (int i = 0; i < length; i++) {
+						number error = fabs(first_expected->m[i] - first_actual->m[i]) + fabs(second_expected->m[i] - second_actual->m[i]);
+						max_error = (error > max_error) ? error : max_error;
+					}
+					break;
+			}
+
+			for (int i = 0; i < length; i++) {
+				number error = fabs(expected->m[i] - actual->m[i]);
+				max_error = (error > max_error) ? error : max_error;
+			}
+		}
+
+		matrix* product = init_mat(a->number_of_rows, a->number_of_rows);
+		matrix* b_transpose = init_mat(b->number_of_cols, b->number_of_rows);
+		matrix_transpose(b_transpose, b);
+		matrix_mult(product, a, b_transpose);
+		for (int i = 0; i < a->number_of_rows; i++) {
+			for (int j = 0; j < a->number_of_rows; j++) {
+				double reference = 0;
+				for (int p = 0; p < a->number_of_cols; p++) {
+					reference += (double)VALUE_AT(a, i, p) * VALUE_AT(b, j, p);
+				}
+				number error = fabs(reference - VALUE_AT(product, i, j));
+				max_error = (error > max_error) ? error : max_error;
+			}
+		}
+		del_mat(product);
+		del_mat(b_transpose);
+
+		fprintf(stdout, "%s: max error %g\n", kernels->name, max_error);
+		if (max_error > 1e-3) {
+			fprintf(stderr, "ERROR IN SIMD KERNEL TEST: %s kernels do not match the scalar kernels\n", kernels->name);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	use_kernels(previous);
+	del_mat(a);
+	del_mat(b);
+	del_mat(expected);
+	del_mat(actual);
+	del_mat(first_expected);
+	del_mat(first_actual);
+	del_mat(second_expected);
+	del_mat(second_actual);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF SIMD KERNELS\n--------------------\n");
+}
+
+void test_thread_pool() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF THE THREAD POOL\n--------------------\n");
+
+	size_t previous = get_number_of_threads();
+
+	// big enough to cross the thresholds for the threaded GEMM and elementwise paths, with ragged edges
+	size_t m = 301, k = 257, n = 263;
+	matrix* a = init_mat(m, k);
+	matrix* b = init_mat(k, n);
+	matrix* serial = init_mat(m, n);
+	matrix* threaded = init_mat(m, n);
+	for (int i = 0; i < m * k; i++) {
+		a->m[i] = ((number)rand()) / RAND_MAX - 0.5;
+	}
+	for (int i = 0; i < k * n; i++) {
+		b->m[i] = ((number)rand()) / RAND_MAX - 0.5;
+	}
+
+	matrix* square = init_mat(m, m);
+	matrix* square_serial = init_mat(m, m);
+	matrix* square_threaded = init_mat(m, m);
+	for (int i = 0; i < m * m; i++) {
+		square->m[i] = ((number)rand()) / RAND_MAX - 0.5;
+	}
+
+	set_number_of_threads(1);
+	matrix_mult(serial, a, b);
+	matrix_entrywise_product(square_serial, square, square);
+	matrix_add(square_serial, square_serial, square);
+	nonlinear_transform_mat(square_serial, square_serial);
+
+	size_t thread_counts[] = { 2, 3, 4 };
+	for (int t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+		set_number_of_threads(thread_counts[t]);
+		matrix_mult(threaded, a, b);
+		matrix_entrywise_product(square_threaded, square, square);
+		matrix_add(square_threaded, square_threaded, square);
+		nonlinear_transform_mat(square_threaded, square_threaded);
+
+		// every entry is computed by the same sequence of operations, so the results must match exactly
+		if (memcmp(serial->m, threaded->m, m * n * sizeof(number)) != 0 ||
+			memcmp(square_serial->m, square_threaded->m, m * m * sizeof(number)) != 0) {
+			fprintf(stderr, "ERROR IN THREAD POOL TEST: %zu threads do not reproduce the serial result\n", thread_counts[t]);
+			exit(EXIT_FAILURE);
+		}
+		fprintf(stdout, "%zu threads: identical to serial\n", thread_counts[t]);
+	}
+
+	set_number_of_threads(previous);
+	del_mat(a);
+	del_mat(b);
+	del_mat(serial);
+	del_mat(threaded);
+	del_mat(square);
+	del_mat(square_serial);
+	del_mat(square_threaded);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF THE THREAD POOL\n--------------------\n");
+}
+
+/**
+ * Mean squared error of the network over one batch
+ */
+number batch_error(ann* neural_network, batch* inputs, batch* outputs) {
+	batch* predictions = pass_forward(neural_network, inputs);
+	number total_error = 0;
+	size_t size = outputs->data->number_of_rows * outputs->data->number_of_cols;
+	for (int i = 0; i < size; i++) {
+		total_error += (outputs->data->m[i] - predictions->data->m[i]) * (outputs->data->m[i] - predictions->data->m[i]);
+	}
+	delete_batch(predictions);
+	return total_error / outputs->number_of_vectors;
+}
+
+void test_train_parallel() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF DATA-PARALLEL TRAINING\n--------------------\n");
+
+	size_t previous = get_number_of_threads();
+	size_t sizes[] = { 4, 8, 4 };
+	ann* nn = initialize_ann(sizes, 3);
+	ann* twin = initialize_ann(sizes, 3);
+	for (int i = 0; i < 2; i++) {
+		copy_matrix(twin->weights[i], nn->weights[i]);
+		memcpy(twin->biases[i]->v, nn->biases[i]->v, nn->biases[i]->size * sizeof(number));
+	}
+
+	vector** data = (vector **)calloc(16, sizeof(vector *));
+	for (int i = 0; i < 16; i++) {
+		data[i] = init_vec(4);
+		int t = i;
+		for (int j = 0; j < 4; j++) {
+			data[i]->v[j] = t % 2;
+			t = t >> 1;
+		}
+	}
+	m_batch* mb_input = load_data_into_batches(data, 16, 16);
+	m_batch* mb_output = load_data_into_batches(data, 16, 16);
+
+	// 16 columns over 3 threads gives uneven slices and an odd leaf in the reduction tree
+	set_number_of_threads(3);
+	number error_before = batch_error(nn, mb_input->ray_of_batches[0], mb_output->ray_of_batches[0]);
+	train_parallel(nn, mb_input, mb_output);
+	train_parallel(twin, mb_input, mb_output);
+	number error_after = batch_error(nn, mb_input->ray_of_batches[0], mb_output->ray_of_batches[0]);
+
+	fprintf(stdout, "error before %f, after %f\n", error_before, error_after);
+	if (!(error_after < error_before)) {
+		fprintf(stderr, "ERROR IN DATA-PARALLEL TRAINING TEST: The error did not go down\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < 2; i++) {
+		if (memcmp(nn->weights[i]->m, twin->weights[i]->m, nn->weights[i]->number_of_rows * nn->weights[i]->number_of_cols * sizeof(number)) != 0 ||
+			memcmp(nn->biases[i]->v, twin->biases[i]->v, nn->biases[i]->size * sizeof(number)) != 0) {
+			fprintf(stderr, "ERROR IN DATA-PARALLEL TRAINING TEST: Two identical runs gave different networks\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	set_number_of_threads(previous);
+	delete_batches(mb_input);
+	delete_batches(mb_output);
+	for (int i = 0; i < 16; i++) {
+		del_vec(data[i]);
+	}
+	free(data);
+	deallocate_ann(nn);
+	deallocate_ann(twin);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF DATA-PARALLEL TRAINING\n--------------------\n");
+}
+
+void test_train_hogwild() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF HOGWILD TRAINING\n--------------------\n");
+
+	size_t previous = get_number_of_threads();
+	size_t sizes[] = { 4, 8, 4 };
+	ann* nn = initialize_ann(sizes, 3);
+
+	vector** data = (vector **)calloc(16, sizeof(vector *));
+	for (int i = 0; i < 16; i++) {
+		data[i] = init_vec(4);
+		int t = i;
+		for (int j = 0; j < 4; j++) {
+			data[i]->v[j] = t % 2;
+			t = t >> 1;
+		}
+	}
+	m_batch* mb_input = load_data_into_batches(data, 16, 2);
+	m_batch* mb_output = load_data_into_batches(data, 16, 2);
+	m_batch* everything = load_data_into_batches(data, 16, 16);
+
+	set_number_of_threads(3);
+	training_thread_stats stats[3];
+	number error_before = batch_error(nn, everything->ray_of_batches[0], everything->ray_of_batches[0]);
+	train_hogwild(nn, mb_input, mb_output, stats);
+	number error_after = batch_error(nn, everything->ray_of_batches[0], everything->ray_of_batches[0]);
+
+	size_t total_batches = 0;
+	for (int i = 0; i < 3; i++) {
+		fprintf(stdout, "Hogwild worker %d: %zu batches, %.0f samples/s\n", i, stats[i].batches, stats[i].samples_per_second);
+		total_batches += stats[i].batches;
+	}
+
+	fprintf(stdout, "error before %f, after %f, %zu batches\n", error_before, error_after, total_batches);
+	if (!(error_after < error_before)) {
+		fprintf(stderr, "ERROR IN HOGWILD TRAINING TEST: The error did not go down\n");
+		exit(EXIT_FAILURE);
+	}
+	if (total_batches != 100 * mb_input->number_of_batches) {
+		fprintf(stderr, "ERROR IN HOGWILD TRAINING TEST: The workers did not run every step exactly once\n");
+		exit(EXIT_FAILURE);
+	}
+
+	set_number_of_threads(previous);
+	delete_batches(mb_input);
+	delete_batches(mb_output);
+	delete_batches(everything);
+	for (int i = 0; i < 16; i++) {
+		del_vec(data[i]);
+	}
+	free(data);
+	deallocate_ann(nn);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF HOGWILD TRAINING\n--------------------\n");
+}
+
+/**
+ * Write an unsigned byte IDX file with the given dimensions and contents
+ */
+void write_idx(const char* path, size_t number_of_dimensions, size_t* dimensions, unsigned char* contents, size_t size) {
+	FILE* file = fopen(path, "wb");
+	unsigned char magic[4] = { 0, 0, 0x08, (unsigned char)number_of_dimensions };
+	fwrite(magic, 1, 4, file);
+	for (int i = 0; i < number_of_dimensions; i++) {
+		unsigned char dimension[4] = { dimensions[i] >> 24, dimensions[i] >> 16, dimensions[i] >> 8, dimensions[i] };
+		fwrite(dimension, 1, 4, file);
+	}
+	fwrite(contents, 1, size, file);
+	fclose(file);
+}
+
+void test_idx() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF IDX LOADING\n--------------------\n");
+
+	// 10 images of 3 x 2 pixels, and their labels
+	size_t number_of_items = 10;
+	size_t image_dimensions[] = { number_of_items, 3, 2 };
+	size_t label_dimensions[] = { number_of_items };
+	unsigned char pixels[60];
+	unsigned char labels[10];
+	for (int i = 0; i < 60; i++) {
+		pixels[i] = (unsigned char)(i * 4);
+	}
+	for (int i = 0; i < 10; i++) {
+		labels[i] = (unsigned char)((i * 7) % 10);
+	}
+	write_idx("/tmp/mllib_test_images.idx3-ubyte", 3, image_dimensions, pixels, sizeof(pixels));
+	write_idx("/tmp/mllib_test_labels.idx1-ubyte", 1, label_dimensions, labels, sizeof(labels));
+
+	idx_file* images = open_idx("/tmp/mllib_test_images.idx3-ubyte");
+	idx_file* label_file = open_idx("/tmp/mllib_test_labels.idx1-ubyte");
+	if (images == NULL || label_file == NULL || images->number_of_items != 10 || images->item_size != 6 ||
+		label_file->item_size != 1 || idx_item(images, 2)[1] != pixels[13]) {
+		fprintf(stderr, "ERROR IN IDX TEST: The header or the items were not read back correctly\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// three batches of three and one holding the tenth item
+	m_batch* inputs = load_idx_images_into_batches(images, number_of_items, 3, 1.0 / 256);
+	m_batch* outputs = load_idx_labels_into_batches(label_file, number_of_items, 3, 10);
+	if (inputs->number_of_batches != 4 || inputs->ray_of_batches[3]->number_of_vectors != 1 || outputs->ray_of_batches[3]->number_of_vectors != 1) {
+		fprintf(stderr, "ERROR IN IDX TEST: The last item did not get a batch of its own\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int b = 0; b < 4; b++) {
+		for (int k = 0; k < inputs->ray_of_batches[b]->number_of_vectors; k++) {
+			size_t item = b * 3 + k;
+			for (int j = 0; j < 6; j++) {
+				if (VALUE_AT(inputs->ray_of_batches[b]->data, j, k) != pixels[item * 6 + j] / 256.0f) {
+					fprintf(stderr, "ERROR IN IDX TEST: Pixel %d of image %zu is wrong\n", j, item);
+					exit(EXIT_FAILURE);
+				}
+			}
+			for (int c = 0; c < 10; c++) {
+				if (VALUE_AT(outputs->ray_of_batches[b]->data, c, k) != (c == labels[item] ? 1 : 0)) {
+					fprintf(stderr, "ERROR IN IDX TEST: One-hot label of item %zu is wrong\n", item);
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+	}
+	fprintf(stdout, "%zu batches of images and labels match the file\n", inputs->number_of_batches);
+
+	// a text file is not an IDX file
+	FILE* not_idx = fopen("/tmp/mllib_test_not_idx", "w");
+	fprintf(not_idx, "hello world\n");
+	fclose(not_idx);
+	if (open_idx("/tmp/mllib_test_not_idx") != NULL || open_idx("/tmp/mllib_test_missing_file") != NULL) {
+		fprintf(stderr, "ERROR IN IDX TEST: An invalid file was accepted\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// nor is one whose items are empty, or so large that their size wraps
+	size_t empty_dimensions[] = { number_of_items, 0, 2 };
+	size_t huge_dimensions[] = { 1, 0xffffffff, 0xffffffff, 0xffffffff };
+	write_idx("/tmp/mllib_test_empty.idx3-ubyte", 3, empty_dimensions, pixels, sizeof(pixels));
+	write_idx("/tmp/mllib_test_huge.idx4-ubyte", 4, huge_dimensions, pixels, sizeof(pixels));
+	if (open_idx("/tmp/mllib_test_empty.idx3-ubyte") != NULL || open_idx("/tmp/mllib_test_huge.idx4-ubyte") != NULL) {
+		fprintf(stderr, "ERROR IN IDX TEST: A file with a zero or wrapping item size was accepted\n");
+		exit(EXIT_FAILURE);
+	}
+	remove("/tmp/mllib_test_empty.idx3-ubyte");
+	remove("/tmp/mllib_test_huge.idx4-ubyte");
+
+	delete_batches(inputs);
+	delete_batches(outputs);
+	close_idx(images);
+	close_idx(label_file);
+	remove("/tmp/mllib_test_images.idx3-ubyte");
+	remove("/tmp/mllib_test_labels.idx1-ubyte");
+	remove("/tmp/mllib_test_not_idx");
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF IDX LOADING\n--------------------\n");
+}
+
+/**
+ * Replays an m_batch pair in the order train() visits it, for a fixed number of steps
+ */
+struct replay_context_ {
+	m_batch* inputs;
+	m_batch* outputs;
+	size_t step;
+	size_t number_of_steps;
+};
+typedef struct replay_context_ replay_context;
+
+boolean replay_batches(void* context, batch* inputs, batch* outputs) {
+	replay_context* replay = (replay_context *)context;
+	if (replay->step == replay->number_of_steps) {
+		return FALSE;
+	}
+	size_t index = replay->step % replay->inputs->number_of_batches;
+	copy_matrix(inputs->data, replay->inputs->ray_of_batches[index]->data);
+	copy_matrix(outputs->data, replay->outputs->ray_of_batches[index]->data);
+	replay->step++;
+	return TRUE;
+}
+
+void test_batch_stream() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF BATCH STREAMS\n--------------------\n");
+
+	size_t sizes[] = { 4, 8, 4 };
+	ann* nn = initialize_ann(sizes, 3);
+	ann* twin = initialize_ann(sizes, 3);
+	for (int i = 0; i < 2; i++) {
+		copy_matrix(twin->weights[i], nn->weights[i]);
+		memcpy(twin->biases[i]->v, nn->biases[i]->v, nn->biases[i]->size * sizeof(number));
+	}
+
+	vector** data = (vector **)calloc(16, sizeof(vector *));
+	for (int i = 0; i < 16; i++) {
+		data[i] = init_vec(4);
+		int t = i;
+		for (int j = 0; j < 4; j++) {
+			data[i]->v[j] = t % 2;
+			t = t >> 1;
+		}
+	}
+	m_batch* mb_input = load_data_into_batches(data, 16, 2);
+	m_batch* mb_output = load_data_into_batches(data, 16, 2);
+
+	// the stream hands out every batch, in order, and then ends
+	replay_context replay = { .inputs = mb_input, .outputs = mb_output, .step = 0, .number_of_steps = 20 };
+	batch_stream* stream = open_batch_stream(4, 4, 2, 3, replay_batches, &replay);
+	batch* inputs;
+	batch* outputs;
+	size_t count = 0;
+	while (next_batch(stream, &inputs, &outputs)) {
+		batch* expected = mb_input->ray_of_batches[count % mb_input->number_of_batches];
+		if (memcmp(inputs->data->m, expected->data->m, 8 * sizeof(number)) != 0) {
+			fprintf(stderr, "ERROR IN BATCH STREAM TEST: Batch %zu came out wrong or out of order\n", count);
+			exit(EXIT_FAILURE);
+		}
+		count++;
+	}
+	close_batch_stream(stream);
+	if (count != 20) {
+		fprintf(stderr, "ERROR IN BATCH STREAM TEST: %zu batches came out of a stream of 20\n", count);
+		exit(EXIT_FAILURE);
+	}
+
+	// closing in the middle of a stream stops the producer
+	replay.step = 0;
+	stream = open_batch_stream(4, 4, 2, 2, replay_batches, &replay);
+	next_batch(stream, &inputs, &outputs);
+	close_batch_stream(stream);
+
+	// streaming the batches train() would visit gives the same network as train()
+	replay.step = 0;
+	replay.number_of_steps = 100 * mb_input->number_of_batches;
+	stream = open_batch_stream(4, 4, 2, 3, replay_batches, &replay);
+	train_from_stream(nn, stream);
+	close_batch_stream(stream);
+	train(twin, mb_input, mb_output);
+
+	for (int i = 0; i < 2; i++) {
+		if (memcmp(nn->weights[i]->m, twin->weights[i]->m, nn->weights[i]->number_of_rows * nn->weights[i]->number_of_cols * sizeof(number)) != 0 ||
+			memcmp(nn->biases[i]->v, twin->biases[i]->v, nn->biases[i]->size * sizeof(number)) != 0) {
+			fprintf(stderr, "ERROR IN BATCH STREAM TEST: Training from a stream differs from train()\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	fprintf(stdout, "stream of %zu batches trains the same network as train()\n", replay.number_of_steps);
+
+	delete_batches(mb_input);
+	delete_batches(mb_output);
+	for (int i = 0; i < 16; i++) {
+		del_vec(data[i]);
+	}
+	free(data);
+	deallocate_ann(nn);
+	deallocate_ann(twin);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF BATCH STREAMS\n--------------------\n");
+}
+
+void test_batch_views() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF BATCH VIEWS\n--------------------\n");
+
+	size_t sizes[] = { 4, 8, 4 };
+	ann* nn = initialize_ann(sizes, 3);
+	ann* twin = initialize_ann(sizes, 3);
+	for (int i = 0; i < 2; i++) {
+		copy_matrix(twin->weights[i], nn->weights[i]);
+		memcpy(twin->biases[i]->v, nn->biases[i]->v, nn->biases[i]->size * sizeof(number));
+	}
+
+	// the same 16 samples as copied batches and as one dataset matrix with a sample per column
+	vector** data = (vector **)calloc(16, sizeof(vector *));
+	matrix* dataset = init_mat(4, 16);
+	for (int i = 0; i < 16; i++) {
+		data[i] = init_vec(4);
+		int t = i;
+		for (int j = 0; j < 4; j++) {
+			data[i]->v[j] = t % 2;
+			VALUE_AT(dataset, j, i) = t % 2;
+			t = t >> 1;
+		}
+	}
+	m_batch* mb_copied = load_data_into_batches(data, 16, 4);
+	m_batch* mb_views = slice_into_batches(dataset, 4);
+
+	for (int b = 0; b < 4; b++) {
+		matrix* view = mb_views->ray_of_batches[b]->data;
+		if (view->m != dataset->m + 4 * b || view->leading_dimension != 16 || mb_views->ray_of_batches[b]->capacity != 4) {
+			fprintf(stderr, "ERROR IN BATCH VIEW TEST: Batch %d is not a view into the dataset\n", b);
+			exit(EXIT_FAILURE);
+		}
+		for (int j = 0; j < 4; j++) {
+			for (int k = 0; k < 4; k++) {
+				if (VALUE_AT(view, j, k) != VALUE_AT(mb_copied->ray_of_batches[b]->data, j, k)) {
+					fprintf(stderr, "ERROR IN BATCH VIEW TEST: The gathered and viewed batches differ\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+	}
+
+	// training reads a view in place and gives the same network as training on copies
+	train(nn, mb_views, mb_views);
+	train(twin, mb_copied, mb_copied);
+	for (int i = 0; i < 2; i++) {
+		if (memcmp(nn->weights[i]->m, twin->weights[i]->m, nn->weights[i]->number_of_rows * nn->weights[i]->number_of_cols * sizeof(number)) != 0 ||
+			memcmp(nn->biases[i]->v, twin->biases[i]->v, nn->biases[i]->size * sizeof(number)) != 0) {
+			fprintf(stderr, "ERROR IN BATCH VIEW TEST: Training on views differs from training on copies\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	fprintf(stdout, "views alias the dataset and train the same network as copies\n");
+
+	delete_batches(mb_copied);
+	delete_batches(mb_views);
+	del_mat(dataset);
+	for (int i = 0; i < 16; i++) {
+		del_vec(data[i]);
+	}
+	free(data);
+	deallocate_ann(nn);
+	deallocate_ann(twin);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF BATCH VIEWS\n--------------------\n");
+}
+
+void test_shuffling() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF SHUFFLING\n--------------------\n");
+
+	// every index appears exactly once, and a seed replays the same permutation
+	size_t n = 1000;
+	size_t* first = (size_t *)malloc(n * sizeof(size_t));
+	size_t* second = (size_t *)malloc(n * sizeof(size_t));
+	boolean* seen = (boolean *)calloc(n, sizeof(boolean));
+	unsigned long long state = 42;
+	random_permutation(first, n, &state);
+	state = 42;
+	random_permutation(second, n, &state);
+	size_t fixed_points = 0;
+	for (int i = 0; i < n; i++) {
+		if (seen[first[i]] || first[i] != second[i]) {
+			fprintf(stderr, "ERROR IN SHUFFLING TEST: The permutation repeats an index or depends on more than the seed\n");
+			exit(EXIT_FAILURE);
+		}
+		seen[first[i]] = TRUE;
+		fixed_points += (first[i] == i);
+	}
+	if (fixed_points > 10) {
+		fprintf(stderr, "ERROR IN SHUFFLING TEST: %zu of %zu indices did not move\n", fixed_points, n);
+		exit(EXIT_FAILURE);
+	}
+
+	// the gathered columns are the permuted columns of the dataset
+	matrix* dataset = init_mat(37, n);
+	for (int i = 0; i < 37 * n; i++) {
+		dataset->m[i] = i;
+	}
+	matrix* gathered = init_mat(37, 100);
+	gather_indexed_columns(gathered, dataset, first);
+	for (int j = 0; j < 37; j++) {
+		for (int k = 0; k < 100; k++) {
+			if (VALUE_AT(gathered, j, k) != VALUE_AT(dataset, j, first[k])) {
+				fprintf(stderr, "ERROR IN SHUFFLING TEST: Gathered entry (%d, %d) is wrong\n", j, k);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	fprintf(stdout, "permutation and gather are correct\n");
+
+	// training on reshuffled epochs learns, and replays exactly from the seed
+	size_t sizes[] = { 4, 8, 4 };
+	ann* nn = initialize_ann(sizes, 3);
+	ann* twin = initialize_ann(sizes, 3);
+	for (int i = 0; i < 2; i++) {
+		copy_matrix(twin->weights[i], nn->weights[i]);
+		memcpy(twin->biases[i]->v, nn->biases[i]->v, nn->biases[i]->size * sizeof(number));
+	}
+	matrix* samples = init_mat(4, 16);
+	for (int i = 0; i < 16; i++) {
+		int t = i;
+		for (int j = 0; j < 4; j++) {
+			VALUE_AT(samples, j, i) = t % 2;
+			t = t >> 1;
+		}
+	}
+	batch whole = { .data = samples, .number_of_vectors = 16, .vector_size = 4, .capacity = 16 };
+
+	number error_before = batch_error(nn, &whole, &whole);
+	batch_stream* stream = open_shuffled_batch_stream(samples, samples, 4, 100, 7, 3);
+	train_from_stream(nn, stream);
+	close_batch_stream(stream);
+	stream = open_shuffled_batch_stream(samples, samples, 4, 100, 7, 3);
+	train_from_stream(twin, stream);
+	close_batch_stream(stream);
+	number error_after = batch_error(nn, &whole, &whole);
+
+	fprintf(stdout, "error before %f, after %f\n", error_before, error_after);
+	if (!(error_after < error_before)) {
+		fprintf(stderr, "ERROR IN SHUFFLING TEST: The error did not go down\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < 2; i++) {
+		if (memcmp(nn->weights[i]->m, twin->weights[i]->m, nn->weights[i]->number_of_rows * nn->weights[i]->number_of_cols * sizeof(number)) != 0) {
+			fprintf(stderr, "ERROR IN SHUFFLING TEST: The same seed trained two different networks\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	free(first);
+	free(second);
+	free(seen);
+	del_mat(dataset);
+	del_mat(gathered);
+	del_mat(samples);
+	deallocate_ann(nn);
+	deallocate_ann(twin);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF SHUFFLING\n--------------------\n");
+}
+
+void test_ragged_batches() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF RAGGED BATCHES\n--------------------\n");
+
+	size_t previous = get_number_of_threads();
+	size_t sizes[] = { 4, 8, 4 };
+	ann* nn = initialize_ann(sizes, 3);
+	ann* twin = initialize_ann(sizes, 3);
+	for (int i = 0; i < 2; i++) {
+		copy_matrix(twin->weights[i], nn->weights[i]);
+		memcpy(twin->biases[i]->v, nn->biases[i]->v, nn->biases[i]->size * sizeof(number));
+	}
+
+	// 18 samples in batches of 16 leave a last batch of 2, fewer columns than there are threads below
+	vector** data = (vector **)calloc(18, sizeof(vector *));
+	matrix* dataset = init_mat(4, 18);
+	for (int i = 0; i < 18; i++) {
+		data[i] = init_vec(4);
+		int t = i % 16;
+		for (int j = 0; j < 4; j++) {
+			data[i]->v[j] = t % 2;
+			VALUE_AT(dataset, j, i) = t % 2;
+			t = t >> 1;
+		}
+	}
+	m_batch* mb_copied = load_data_into_batches(data, 18, 16);
+	m_batch* mb_views = slice_into_batches(dataset, 16);
+	m_batch* everything = load_data_into_batches(data, 18, 18);
+
+	if (mb_copied->number_of_batches != 2 || mb_copied->total_number_of_vectors != 18 ||
+		mb_copied->ray_of_batches[1]->number_of_vectors != 2 || mb_views->number_of_batches != 2 ||
+		mb_views->ray_of_batches[1]->number_of_vectors != 2 || mb_views->ray_of_batches[1]->data->m != dataset->m + 16) {
+		fprintf(stderr, "ERROR IN RAGGED BATCH TEST: The last two samples are not in a short last batch\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int j = 0; j < 4; j++) {
+		for (int k = 0; k < 2; k++) {
+			if (VALUE_AT(mb_copied->ray_of_batches[1]->data, j, k) != data[16 + k]->v[j]) {
+				fprintf(stderr, "ERROR IN RAGGED BATCH TEST: The short batch holds the wrong samples\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	// the workspace is sized once for the full batches and reshaped for the short one
+	train(nn, mb_copied, mb_copied);
+	train(twin, mb_views, mb_views);
+	for (int i = 0; i < 2; i++) {
+		if (memcmp(nn->weights[i]->m, twin->weights[i]->m, nn->weights[i]->number_of_rows * nn->weights[i]->number_of_cols * sizeof(number)) != 0 ||
+			memcmp(nn->biases[i]->v, twin->biases[i]->v, nn->biases[i]->size * sizeof(number)) != 0) {
+			fprintf(stderr, "ERROR IN RAGGED BATCH TEST: Training on views differs from training on copies\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (nn->workspace->batch_size != 16) {
+		fprintf(stderr, "ERROR IN RAGGED BATCH TEST: The workspace was not kept at the size of the full batches\n");
+		exit(EXIT_FAILURE);
+	}
+
+	set_number_of_threads(3);
+	number error_before = batch_error(nn, everything->ray_of_batches[0], everything->ray_of_batches[0]);
+	train_parallel(nn, mb_copied, mb_copied);
+	train_hogwild(nn, mb_copied, mb_copied, NULL);
+	number error_after = batch_error(nn, everything->ray_of_batches[0], everything->ray_of_batches[0]);
+	fprintf(stdout, "error before %f, after %f\n", error_before, error_after);
+	if (!(error_after <= error_before)) {
+		fprintf(stderr, "ERROR IN RAGGED BATCH TEST: Parallel training on a short batch made the error worse\n");
+		exit(EXIT_FAILURE);
+	}
+	set_number_of_threads(previous);
+
+	// a shuffled epoch hands out every sample once, the last two in a batch of their own
+	matrix* numbered = init_mat(1, 18);
+	for (int i = 0; i < 18; i++) {
+		numbered->m[i] = i;
+	}
+	boolean seen[18] = { FALSE };
+	size_t batch_sizes[2] = { 0, 0 };
+	size_t number_of_batches = 0;
+	batch_stream* stream = open_shuffled_batch_stream(numbered, numbered, 16, 1, 3, 2);
+	batch* inputs;
+	batch* outputs;
+	while (next_batch(stream, &inputs, &outputs)) {
+		if (number_of_batches < 2) {
+			batch_sizes[number_of_batches] = inputs->number_of_vectors;
+		}
+		for (int k = 0; k < inputs->number_of_vectors; k++) {
+			seen[(size_t)VALUE_AT(inputs->data, 0, k)] = TRUE;
+		}
+		number_of_batches++;
+	}
+	close_batch_stream(stream);
+	for (int i = 0; i < 18; i++) {
+		if (!seen[i]) {
+			fprintf(stderr, "ERROR IN RAGGED BATCH TEST: Sample %d was left out of the shuffled epoch\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (number_of_batches != 2 || batch_sizes[0] != 16 || batch_sizes[1] != 2) {
+		fprintf(stderr, "ERROR IN RAGGED BATCH TEST: The shuffled epoch was not cut into 16 and 2\n");
+		exit(EXIT_FAILURE);
+	}
+	fprintf(stdout, "no sample is dropped and the short batch trains in place\n");
+
+	delete_batches(mb_copied);
+	delete_batches(mb_views);
+	delete_batches(everything);
+	del_mat(dataset);
+	del_mat(numbered);
+	for (int i = 0; i < 18; i++) {
+		del_vec(data[i]);
+	}
+	free(data);
+	deallocate_ann(nn);
+	deallocate_ann(twin);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF RAGGED BATCHES\n--------------------\n");
+}
+
+void test_bfloat16() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF BFLOAT16 STORAGE\n--------------------\n");
+
+	// 1 + 2^-8 is halfway between two bfloat16 values and rounds to the even one, 1 + 3 * 2^-9 rounds up
+	if (bfloat16_to_float(float_to_bfloat16(1.0f)) != 1.0f || bfloat16_to_float(float_to_bfloat16(-2.5f)) != -2.5f ||
+		bfloat16_to_float(float_to_bfloat16(1.0f + 1.0f / 256)) != 1.0f ||
+		bfloat16_to_float(float_to_bfloat16(1.0f + 3.0f / 512)) != 1.0f + 1.0f / 128 ||
+		!isnan(bfloat16_to_float(float_to_bfloat16(NAN)))) {
+		fprintf(stderr, "ERROR IN BFLOAT16 TEST: Rounding to bfloat16 is wrong\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// with a already representable, the bfloat16 product is exactly the full precision one, on every code path
+	size_t previous = get_number_of_threads();
+	set_number_of_threads(3);
+	size_t shapes[][3] = { {7, 5, 3}, {37, 53, 29}, {200, 300, 100} };
+	for (int s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+		size_t m = shapes[s][0], k = shapes[s][1], n = shapes[s][2];
+		matrix* a = init_mat(m, k);
+		matrix* b = init_mat(k, n);
+		matrix* expected = init_mat(m, n);
+		matrix* out = init_mat(m, n);
+		bfloat16* a_bf16 = (bfloat16 *)malloc(m * k * sizeof(bfloat16));
+		for (int i = 0; i < m * k; i++) {
+			a->m[i] = (rand() % 64 - 32) / 16.0;
+		}
+		for (int i = 0; i < k * n; i++) {
+			b->m[i] = ((number)rand()) / RAND_MAX - 0.5;
+		}
+		matrix_to_bfloat16(a_bf16, k, a);
+
+		general_matrix_mult(FALSE, FALSE, m, n, k, 1, a->m, k, b->m, n, 0, expected->m, n);
+		general_matrix_mult_bf16_epilogue(FALSE, FALSE, m, n, k, 1, a_bf16, k, b->m, n, 0, out->m, n, NULL);
+		if (memcmp(out->m, expected->m, m * n * sizeof(number)) != 0) {
+			fprintf(stderr, "ERROR IN BFLOAT16 TEST: The bfloat16 product of (%zu x %zu) * (%zu x %zu) differs\n", m, k, k, n);
+			exit(EXIT_FAILURE);
+		}
+
+		del_mat(a);
+		del_mat(b);
+		del_mat(expected);
+		del_mat(out);
+		free(a_bf16);
+	}
+	set_number_of_threads(previous);
+
+	// a layer with rounded weights stays within the precision of bfloat16 of the exact one
+	size_t sizes[] = { 16, 32 };
+	ann* nn = initialize_ann(sizes, 2);
+	matrix* x = init_mat(16, 8);
+	matrix* y = init_mat(32, 8);
+	matrix* y_bf16 = init_mat(32, 8);
+	for (int i = 0; i < 16 * 8; i++) {
+		x->m[i] = ((number)rand()) / RAND_MAX;
+	}
+	store_inference_weights(nn);
+	layer_forward(y, NULL, nn->weights[0], nn->biases[0], x);
+	layer_forward_bf16(y_bf16, nn->inference_weights[0], nn->biases[0], x);
+	number max_relative_error = 0;
+	for (int i = 0; i < 32 * 8; i++) {
+		number error = fabs(y->m[i] - y_bf16->m[i]) / fabs(y->m[i]);
+		max_relative_error = (error > max_relative_error) ? error : max_relative_error;
+	}
+	fprintf(stdout, "largest relative error of a bfloat16 layer: %g\n", max_relative_error);
+	if (max_relative_error > 1.0 / 128) {
+		fprintf(stderr, "ERROR IN BFLOAT16 TEST: The bfloat16 layer is further off than rounding explains\n");
+		exit(EXIT_FAILURE);
+	}
+
+	del_mat(x);
+	del_mat(y);
+	del_mat(y_bf16);
+	deallocate_ann(nn);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF BFLOAT16 STORAGE\n--------------------\n");
+}
+
+void test_mixed_precision() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF MIXED PRECISION TRAINING\n--------------------\n");
+
+	// float16 keeps 11 bits, overflows past 65504 and flushes below 2^-25
+	if (float16_to_float(float_to_float16(1.0f)) != 1.0f || float16_to_float(float_to_float16(65504.0f)) != 65504.0f ||
+		!isinf(float16_to_float(float_to_float16(70000.0f))) || float16_to_float(float_to_float16(1.0f / 16777216)) != 1.0f / 16777216 ||
+		float16_to_float(float_to_float16(1.0f / 33554432)) != 0 || float16_to_float(float_to_float16(1.0f + 1.0f / 2048)) != 1.0f ||
+		float16_to_float(float_to_float16(-3.0f / 67108864)) != -1.0f / 16777216) {
+		fprintf(stderr, "ERROR IN MIXED PRECISION TEST: Rounding to float16 is wrong\n");
+		exit(EXIT_FAILURE);
+	}
+
+	size_t sizes[] = { 4, 8, 4 };
+	vector** data = (vector **)calloc(16, sizeof(vector *));
+	for (int i = 0; i < 16; i++) {
+		data[i] = init_vec(4);
+		int t = i;
+		for (int j = 0; j < 4; j++) {
+			data[i]->v[j] = t % 2;
+			t = t >> 1;
+		}
+	}
+	m_batch* mb = load_data_into_batches(data, 16, 16);
+	batch* everything = mb->ray_of_batches[0];
+
+	// both formats learn, and a power of two loss scale changes no bits when nothing overflows or underflows
+	ann* networks[3];
+	mixed_precision_options options[3] = {
+		{ .activation_format = HALF_BFLOAT16, .loss_scale = 1 },
+		{ .activation_format = HALF_BFLOAT16, .loss_scale = 1024 },
+		{ .activation_format = HALF_FLOAT16, .loss_scale = 1 },
+	};
+	for (int c = 0; c < 3; c++) {
+		networks[c] = initialize_ann(sizes, 3);
+		if (c > 0) {
+			for (int i = 0; i < 2; i++) {
+				copy_matrix(networks[c]->weights[i], networks[0]->weights[i]);
+				memcpy(networks[c]->biases[i]->v, networks[0]->biases[i]->v, networks[0]->biases[i]->size * sizeof(number));
+			}
+		}
+	}
+	number error_before = batch_error(networks[0], everything, everything);
+	for (int c = 0; c < 3; c++) {
+		train_mixed_precision(networks[c], mb, mb, &options[c]);
+		number error_after = batch_error(networks[c], everything, everything);
+		fprintf(stdout, "format %d, loss scale %g: error before %f, after %f\n", options[c].activation_format, options[c].loss_scale, error_before, error_after);
+		if (!(error_after < error_before) || options[c].skipped_steps != 0) {
+			fprintf(stderr, "ERROR IN MIXED PRECISION TEST: Training in a 16-bit format did not learn\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (int i = 0; i < 2; i++) {
+		if (memcmp(networks[0]->weights[i]->m, networks[1]->weights[i]->m, networks[0]->weights[i]->number_of_rows * networks[0]->weights[i]->number_of_cols * sizeof(number)) != 0) {
+			fprintf(stderr, "ERROR IN MIXED PRECISION TEST: Scaling the loss by a power of two changed the result\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// a scale far too big overflows float16, so steps are skipped until the dynamic scale has come down
+	ann* nn = initialize_ann(sizes, 3);
+	mixed_precision_options dynamic = { .activation_format = HALF_FLOAT16, .loss_scale = 1099511627776.0, .dynamic_loss_scale = TRUE };
+	error_before = batch_error(nn, everything, everything);
+	train_mixed_precision(nn, mb, mb, &dynamic);
+	number error_after = batch_error(nn, everything, everything);
+	fprintf(stdout, "dynamic loss scale: %zu steps skipped, final scale %g, error before %f, after %f\n",
+		dynamic.skipped_steps, dynamic.loss_scale, error_before, error_after);
+	if (dynamic.skipped_steps == 0 || dynamic.skipped_steps == 100 || !(error_after < error_before)) {
+		fprintf(stderr, "ERROR IN MIXED PRECISION TEST: The dynamic loss scale did not recover from overflow\n");
+		exit(EXIT_FAILURE);
+	}
+
+	delete_batches(mb);
+	for (int i = 0; i < 16; i++) {
+		del_vec(data[i]);
+	}
+	free(data);
+	for (int c = 0; c < 3; c++) {
+		deallocate_ann(networks[c]);
+	}
+	deallocate_ann(nn);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF MIXED PRECISION TRAINING\n--------------------\n");
+}
+
+void test_quantization() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF INT8 QUANTIZATION\n--------------------\n");
+
+	// every int8 kernel gives the exact dot products, with rows and samples left over past the last full tile
+	const char* previous = kernels->name;
+	const char* instruction_sets[] = { "scalar", "sse", "avx2", "avx512", "avx512vnni" };
+	size_t m = 13, n = INT8_GEMM_N_ALIGN + 7, k = 50 * INT8_GEMM_K_ALIGN;
+	size_t ldx = 4 * 2 * INT8_GEMM_N_ALIGN;
+	int8_t* w = (int8_t *)malloc(m * k);
+	int8_t* x = (int8_t *)calloc(k / 4 * ldx, 1);
+	for (int i = 0; i < m * k; i++) {
+		w[i] = rand() % 255 - 127;
+	}
+	for (int j = 0; j < n; j++) {
+		for (int p = 0; p < k; p++) {
+			x[(p / 4) * ldx + 4 * j + p % 4] = rand() % 255 - 127;
+		}
+	}
+	number* scale = (number *)malloc(m * sizeof(number));
+	number* bias = (number *)malloc(m * sizeof(number));
+	number* expected = (number *)malloc(m * n * sizeof(number));
+	number* actual = (number *)malloc(m * n * sizeof(number));
+	for (int i = 0; i < m; i++) {
+		scale[i] = 1;
+		bias[i] = 0;
+		for (int j = 0; j < n; j++) {
+			int32_t sum = 0;
+			for (int p = 0; p < k; p++) {
+				sum += w[i * k + p] * x[(p / 4) * ldx + 4 * j + p % 4];
+			}
+			expected[i * n + j] = sum;
+		}
+	}
+
+	for (int s = 0; s < sizeof(instruction_sets) / sizeof(instruction_sets[0]); s++) {
+		if (!use_kernels(instruction_sets[s])) {
+			fprintf(stdout, "%s: not supported by this host\n", instruction_sets[s]);
+			continue;
+		}
+		// a slope of 1 leaves the sums as they are
+		kernels->int8_gemm(actual, n, w, k, x, ldx, m, n, k, scale, bias, 1);
+		if (memcmp(actual, expected, m * n * sizeof(number)) != 0) {
+			fprintf(stderr, "ERROR IN QUANTIZATION TEST: The %s int8 kernel gives the wrong sums\n", kernels->name);
+			exit(EXIT_FAILURE);
+		}
+		fprintf(stdout, "%s: int8 sums exact\n", kernels->name);
+	}
+	use_kernels(previous);
+
+	free(w);
+	free(x);
+	free(scale);
+	free(bias);
+	free(expected);
+	free(actual);
+
+	// a quantized network stays close to the float one, with the samples split across threads
+	size_t previous_threads = get_number_of_threads();
+	set_number_of_threads(3);
+	size_t sizes[] = { 100, 64, 10 };
+	ann* nn = initialize_ann(sizes, 3);
+	batch* inputs = create_empty_batch(150, 100);
+	for (int i = 0; i < 100 * 150; i++) {
+		inputs->data->m[i] = ((number)rand()) / RAND_MAX;
+	}
+	quantized_ann* quantized_nn = quantize_ann(nn, inputs);
+	batch* float_predictions = pass_forward(nn, inputs);
+	batch* quantized_predictions = pass_forward_quantized(quantized_nn, inputs);
+	set_number_of_threads(previous_threads);
+
+	number max_relative_error = 0;
+	for (int i = 0; i < 10 * 150; i++) {
+		number error = fabs(float_predictions->data->m[i] - quantized_predictions->data->m[i]) / fabs(float_predictions->data->m[i]);
+		max_relative_error = (error > max_relative_error) ? error : max_relative_error;
+	}
+	fprintf(stdout, "largest relative error of the int8 network: %g\n", max_relative_error);
+	if (max_relative_error > 1.0 / 64) {
+		fprintf(stderr, "ERROR IN QUANTIZATION TEST: The int8 network is further off than rounding explains\n");
+		exit(EXIT_FAILURE);
+	}
+
+	delete_batch(inputs);
+	delete_batch(float_predictions);
+	delete_batch(quantized_predictions);
+	deallocate_quantized_ann(quantized_nn);
+	deallocate_ann(nn);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF INT8 QUANTIZATION\n--------------------\n");
+}
+
+struct session_thread_ {
+	ann* nn;
+	batch* inputs;
+	batch* expected;
+	boolean matches;
+};
+typedef struct session_thread_ session_thread;
+
+static void* run_session_thread(void* argument) {
+	session_thread* thread = (session_thread *)argument;
+	size_t n = thread->inputs->number_of_vectors;
+	inference_session* session = create_inference_session(thread->nn, n);
+	number* outputs = (number *)malloc(thread->expected->vector_size * n * sizeof(number));
+
+	thread->matches = TRUE;
+	for (int repeat = 0; repeat < 10; repeat++) {
+		session_forward(session, thread->inputs->data->m, n, outputs);
+		if (memcmp(outputs, thread->expected->data->m, thread->expected->vector_size * n * sizeof(number)) != 0) {
+			thread->matches = FALSE;
+		}
+	}
+
+	free(outputs);
+	delete_inference_session(session);
+	return NULL;
+}
+
+void test_inference_session() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF INFERENCE SESSIONS\n--------------------\n");
+
+	size_t previous = get_number_of_threads();
+	set_number_of_threads(3);
+
+	// big enough for the first layer to take the threaded GEMM whenever the pool is free
+	size_t sizes[] = { 64, 200, 100, 10 };
+	size_t n = 256;
+	ann* nn = initialize_ann(sizes, 4);
+	batch* inputs = create_empty_batch(n, sizes[0]);
+	for (int i = 0; i < sizes[0] * n; i++) {
+		inputs->data->m[i] = ((number)rand()) / RAND_MAX - 0.5;
+	}
+	batch* expected = pass_forward(nn, inputs);
+
+	// fewer vectors than the session was made for
+	size_t few = 7;
+	inference_session* session = create_inference_session(nn, n);
+	number* few_inputs = (number *)malloc(sizes[0] * few * sizeof(number));
+	number* few_outputs = (number *)malloc(sizes[3] * few * sizeof(number));
+	for (int i = 0; i < sizes[0]; i++) {
+		memcpy(few_inputs + i * few, inputs->data->m + i * n, few * sizeof(number));
+	}
+	session_forward(session, few_inputs, few, few_outputs);
+	for (int i = 0; i < sizes[3]; i++) {
+		for (int j = 0; j < few; j++) {
+			// a smaller product may take another GEMM path, which adds up in another order
+			number reference = VALUE_AT(expected->data, i, j);
+			if (fabs(few_outputs[i * few + j] - reference) > 1e-4 * fabs(reference)) {
+				fprintf(stderr, "ERROR IN INFERENCE SESSION TEST: A short batch differs from pass_forward\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	free(few_inputs);
+	free(few_outputs);
+	delete_inference_session(session);
+
+	// sessions on several threads at once share the network; whichever of them gets the pool, the results match
+	session_thread threads[4];
+	pthread_t handles[4];
+	for (int t = 0; t < 4; t++) {
+		threads[t] = (session_thread){ .nn = nn, .inputs = inputs, .expected = expected };
+		pthread_create(&handles[t], NULL, run_session_thread, &threads[t]);
+	}
+	for (int t = 0; t < 4; t++) {
+		pthread_join(handles[t], NULL);
+		if (!threads[t].matches) {
+			fprintf(stderr, "ERROR IN INFERENCE SESSION TEST: Concurrent session %d differs from pass_forward\n", t);
+			exit(EXIT_FAILURE);
+		}
+	}
+	fprintf(stdout, "4 concurrent sessions match pass_forward\n");
+
+	set_number_of_threads(previous);
+	delete_batch(inputs);
+	delete_batch(expected);
+	deallocate_ann(nn);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF INFERENCE SESSIONS\n--------------------\n");
+}
+
+#define SERVER_TEST_PRODUCERS 4
+#define SERVER_TEST_REQUESTS 300
+
+struct server_producer_ {
+	inference_server* server;
+	number* inputs;	// SERVER_TEST_REQUESTS vectors, one after another
+	number* outputs;
+	size_t input_size;
+	size_t output_size;
+	unsigned int seed;
+};
+typedef struct server_producer_ server_producer;
+
+static atomic_int server_test_callbacks;
+
+static void count_server_callback(inference_request* request, void* context) {
+	atomic_fetch_add(&server_test_callbacks, 1);
+}
+
+/**
+ * Synthetic load: bursts of 1 to 8 requests, every other one with a callback, waited on together and followed
+ * by a pause of up to half a millisecond
+ */
+static void* run_server_producer(void* argument) {
+	server_producer* producer = (server_producer *)argument;
+	inference_request requests[8];
+
+	size_t sent = 0;
+	while (sent < SERVER_TEST_REQUESTS) {
+		size_t burst = 1 + rand_r(&producer->seed) % 8;
+		burst = (burst < SERVER_TEST_REQUESTS - sent) ? burst : SERVER_TEST_REQUESTS - sent;
+		for (size_t r = 0; r < burst; r++) {
+			size_t index = sent + r;
+			init_inference_request(&requests[r], producer->inputs + index * producer->input_size,
+				producer->outputs + index * producer->output_size, (index % 2 == 0) ? count_server_callback : NULL, NULL);
+			submit_inference(producer->server, &requests[r]);
+		}
+		for (size_t r = 0; r < burst; r++) {
+			wait_for_inference(producer->server, &requests[r]);
+		}
+		sent += burst;
+
+		struct timespec pause = { .tv_sec = 0, .tv_nsec = rand_r(&producer->seed) % 500000 };
+		nanosleep(&pause, NULL);
+	}
+	return NULL;
+}
+
+void test_inference_server() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF THE INFERENCE SERVER\n--------------------\n");
+
+	size_t sizes[] = { 20, 30, 4 };
+	size_t total = SERVER_TEST_PRODUCERS * SERVER_TEST_REQUESTS;
+	ann* nn = initialize_ann(sizes, 3);
+
+	// the same vectors as one batch, for the expected predictions
+	number* inputs = (number *)malloc(total * sizes[0] * sizeof(number));
+	number* outputs = (number *)malloc(total * sizes[2] * sizeof(number));
+	batch* all_inputs = create_empty_batch(total, sizes[0]);
+	for (int j = 0; j < total; j++) {
+		for (int p = 0; p < sizes[0]; p++) {
+			inputs[j * sizes[0] + p] = ((number)rand()) / RAND_MAX - 0.5;
+			VALUE_AT(all_inputs->data, p, j) = inputs[j * sizes[0] + p];
+		}
+	}
+	batch* expected = pass_forward(nn, all_inputs);
+
+	atomic_store(&server_test_callbacks, 0);
+	inference_server* server = start_inference_server(nn, 16, 0.001);
+	server_producer producers[SERVER_TEST_PRODUCERS];
+	pthread_t handles[SERVER_TEST_PRODUCERS];
+	for (int t = 0; t < SERVER_TEST_PRODUCERS; t++) {
+		producers[t] = (server_producer){
+			.server = server,
+			.inputs = inputs + t * SERVER_TEST_REQUESTS * sizes[0],
+			.outputs = outputs + t * SERVER_TEST_REQUESTS * sizes[2],
+			.input_size = sizes[0],
+			.output_size = sizes[2],
+			.seed = t + 1,
+		};
+		pthread_create(&handles[t], NULL, run_server_producer, &producers[t]);
+	}
+	for (int t = 0; t < SERVER_TEST_PRODUCERS; t++) {
+		pthread_join(handles[t], NULL);
+	}
+
+	inference_server_stats stats;
+	get_inference_server_stats(server, &stats);
+	stop_inference_server(server);
+	fprintf(stdout, "%zu requests in %zu batches, %.0f%% full, p50 %.3g s, p99 %.3g s\n", stats.requests, stats.batches,
+		100 * stats.mean_batch_fill, stats.p50_latency, stats.p99_latency);
+
+	if (stats.requests != total || stats.batches < total / 16 || stats.batches > total ||
+		stats.p50_latency <= 0 || stats.p50_latency > stats.p99_latency) {
+		fprintf(stderr, "ERROR IN INFERENCE SERVER TEST: The statistics do not add up\n");
+		exit(EXIT_FAILURE);
+	}
+	if (atomic_load(&server_test_callbacks) != total / 2) {
+		fprintf(stderr, "ERROR IN INFERENCE SERVER TEST: %d callbacks ran for %zu requests\n", atomic_load(&server_test_callbacks), total / 2);
+		exit(EXIT_FAILURE);
+	}
+	for (int j = 0; j < total; j++) {
+		for (int q = 0; q < sizes[2]; q++) {
+			number reference = VALUE_AT(expected->data, q, j);
+			if (fabs(outputs[j * sizes[2] + q] - reference) > 1e-4 * (1 + fabs(reference))) {
+				fprintf(stderr, "ERROR IN INFERENCE SERVER TEST: Request %d got the wrong prediction\n", j);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	free(inputs);
+	free(outputs);
+	delete_batch(all_inputs);
+	delete_batch(expected);
+	deallocate_ann(nn);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF THE INFERENCE SERVER\n--------------------\n");
+}
+
+void test_ann_file() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF NETWORK CHECKPOINTS\n--------------------\n");
+
+	const char* path = "test_checkpoint.ann";
+	const char* damaged_path = "test_checkpoint_damaged.ann";
+	size_t sizes[] = { 30, 17, 5 };
+	ann* nn = initialize_ann(sizes, 3);
+	nn->gamma = 0.0125;
+
+	batch* inputs = create_empty_batch(40, sizes[0]);
+	for (int i = 0; i < sizes[0] * 40; i++) {
+		inputs->data->m[i] = ((number)rand()) / RAND_MAX;
+	}
+	batch* expected = pass_forward(nn, inputs);
+
+	if (!save_ann(nn, path)) {
+		fprintf(stderr, "ERROR IN CHECKPOINT TEST: The network was not saved\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// loaded and mapped copies hold exactly the same network
+	ann* loaded = load_ann(path);
+	ann* mapped = map_ann(path, TRUE);
+	ann* copies[2] = { loaded, mapped };
+	for (int c = 0; c < 2; c++) {
+		ann* copy = copies[c];
+		if (copy == NULL || copy->number_of_layers != 3 || copy->gamma != nn->gamma ||
+			memcmp(copy->layers, nn->layers, 3 * sizeof(size_t)) != 0) {
+			fprintf(stderr, "ERROR IN CHECKPOINT TEST: The %s network has the wrong shape\n", (c == 0) ? "loaded" : "mapped");
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < 2; i++) {
+			if (memcmp(copy->weights[i]->m, nn->weights[i]->m, sizes[i + 1] * sizes[i] * sizeof(number)) != 0 ||
+				memcmp(copy->biases[i]->v, nn->biases[i]->v, sizes[i + 1] * sizeof(number)) != 0 ||
+				(uintptr_t)copy->weights[i]->m % ARENA_ALIGNMENT != 0) {
+				fprintf(stderr, "ERROR IN CHECKPOINT TEST: The %s network has the wrong parameters\n", (c == 0) ? "loaded" : "mapped");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		batch* predictions = pass_forward(copy, inputs);
+		if (memcmp(predictions->data->m, expected->data->m, sizes[2] * 40 * sizeof(number)) != 0) {
+			fprintf(stderr, "ERROR IN CHECKPOINT TEST: The %s network predicts differently\n", (c == 0) ? "loaded" : "mapped");
+			exit(EXIT_FAILURE);
+		}
+		delete_batch(predictions);
+	}
+
+	// a flipped bit in the weights is caught by the checksum, and only by it
+	FILE* file = fopen(path, "rb");
+	fseek(file, 0, SEEK_END);
+	size_t size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	unsigned char* image = (unsigned char *)malloc(size);
+	if (fread(image, 1, size, file) != size) {
+		fprintf(stderr, "ERROR IN CHECKPOINT TEST: The checkpoint could not be read back\n");
+		exit(EXIT_FAILURE);
+	}
+	fclose(file);
+	if (size != ann_image_size(nn)) {
+		fprintf(stderr, "ERROR IN CHECKPOINT TEST: The checkpoint is %zu bytes, not %zu\n", size, ann_image_size(nn));
+		exit(EXIT_FAILURE);
+	}
+
+	image[size / 2] ^= 0x10;
+	file = fopen(damaged_path, "wb");
+	fwrite(image, 1, size, file);
+	fclose(file);
+	fprintf(stdout, "Expecting a checksum error:\n");
+	ann* damaged = load_ann(damaged_path);
+	ann* unverified = map_ann(damaged_path, FALSE);
+	if (damaged != NULL || unverified == NULL) {
+		fprintf(stderr, "ERROR IN CHECKPOINT TEST: The damaged checkpoint was not caught by its checksum\n");
+		exit(EXIT_FAILURE);
+	}
+	deallocate_ann(unverified);
+
+	// so is a file cut short
+	image[size / 2] ^= 0x10;
+	file = fopen(damaged_path, "wb");
+	fwrite(image, 1, size - ANN_FILE_ALIGNMENT, file);
+	fclose(file);
+	fprintf(stdout, "Expecting a size error:\n");
+	if (map_ann(damaged_path, FALSE) != NULL) {
+		fprintf(stderr, "ERROR IN CHECKPOINT TEST: The truncated checkpoint was mapped\n");
+		exit(EXIT_FAILURE);
+	}
+
+	remove(path);
+	remove(damaged_path);
+	free(image);
+	delete_batch(inputs);
+	delete_batch(expected);
+	deallocate_ann(loaded);
+	deallocate_ann(mapped);
+	deallocate_ann(nn);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF NETWORK CHECKPOINTS\n--------------------\n");
+}
+
+// TRUE if the checkpoint at path holds exactly the parameters of nn
+static boolean checkpoint_matches(const char* path, ann* nn) {
+	ann* saved = load_ann(path);
+	if (saved == NULL) {
+		return FALSE;
+	}
+	boolean matches = TRUE;
+	for (int i = 0; i < nn->number_of_layers - 1; i++) {
+		matches = matches && memcmp(saved->weights[i]->m, nn->weights[i]->m,
+			nn->weights[i]->number_of_rows * nn->weights[i]->number_of_cols * sizeof(number)) == 0;
+		matches = matches && memcmp(saved->biases[i]->v, nn->biases[i]->v, nn->biases[i]->size * sizeof(number)) == 0;
+	}
+	deallocate_ann(saved);
+	return matches;
+}
+
+void test_checkpointing() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF TRAINING CHECKPOINTS\n--------------------\n");
+
+	const char* path = "test_training.ann";
+	size_t sizes[] = { 4, 8, 4 };
+	ann* nn = initialize_ann(sizes, 3);
+
+	vector** data = (vector **)calloc(16, sizeof(vector *));
+	for (int i = 0; i < 16; i++) {
+		data[i] = init_vec(4);
+		int t = i;
+		for (int j = 0; j < 4; j++) {
+			data[i]->v[j] = t % 2;
+			t = t >> 1;
+		}
+	}
+	m_batch* mb_input = load_data_into_batches(data, 16, 8);
+	m_batch* mb_output = load_data_into_batches(data, 16, 8);
+
+	// every 25 of the 100 epochs of train(): the last checkpoint is the trained network
+	ann_checkpointer* checkpointer = start_checkpointing(nn, path, 25, 0);
+	train(nn, mb_input, mb_output);
+	wait_for_checkpoints(nn);
+	fprintf(stdout, "%zu checkpoints written, %zu superseded\n", checkpointer->written, checkpointer->superseded);
+	if (checkpointer->written + checkpointer->superseded != 4 || checkpointer->failed != 0 || !checkpoint_matches(path, nn)) {
+		fprintf(stderr, "ERROR IN CHECKPOINTING TEST: The epoch checkpoints are wrong\n");
+		exit(EXIT_FAILURE);
+	}
+	stop_checkpointing(nn);
+
+	// every 30 of 200 steps, and a last one by hand
+	checkpointer = start_checkpointing(nn, path, 0, 30);
+	train_parallel(nn, mb_input, mb_output);
+	checkpoint_now(nn);
+	wait_for_checkpoints(nn);
+	fprintf(stdout, "%zu checkpoints written, %zu superseded\n", checkpointer->written, checkpointer->superseded);
+	if (checkpointer->written + checkpointer->superseded != 200 / 30 + 1 || checkpointer->failed != 0 || !checkpoint_matches(path, nn)) {
+		fprintf(stderr, "ERROR IN CHECKPOINTING TEST: The step checkpoints are wrong\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// deallocate_ann() stops the checkpointer
+	remove(path);
+	delete_batches(mb_input);
+	delete_batches(mb_output);
+	for (int i = 0; i < 16; i++) {
+		del_vec(data[i]);
+	}
+	free(data);
+	deallocate_ann(nn);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF TRAINING CHECKPOINTS\n--------------------\n");
+}
+
+struct train_config_test_log_ {
+	size_t reports;
+	size_t stop_after;
+	number loss_sum;	// of the reported batch losses over the current epoch
+	boolean epoch_loss_matches;
+	number learning_rates[8];
+};
+typedef struct train_config_test_log_ train_config_test_log;
+
+static boolean train_config_test_callback(const train_step_report* report, void* context) {
+	train_config_test_log* log = (train_config_test_log *)context;
+	if (report->step != log->reports) {
+		log->epoch_loss_matches = FALSE;
+	}
+	if (report->step < 8) {
+		log->learning_rates[report->step] = report->learning_rate;
+	}
+	log->reports++;
+
+	// equal batch sizes, so the epoch loss is the mean of the batch losses
+	log->loss_sum += report->loss;
+	if (report->end_of_epoch) {
+		if (fabs(log->loss_sum / 2 - report->epoch_loss) > 1e-4 * (1 + report->epoch_loss)) {
+			log->epoch_loss_matches = FALSE;
+		}
+		log->loss_sum = 0;
+	}
+	return log->stop_after == 0 || log->reports < log->stop_after;
+}
+
+// final loss of a fresh network after the epochs given, shuffled with the seed given unless it is 0
+static number shuffled_training_loss(m_batch* input, m_batch* output, unsigned long long seed, size_t epochs,
+		boolean parallel) {
+	size_t sizes[] = { 4, 8, 4 };
+	srand(11);
+	ann* nn = initialize_ann(sizes, 3);
+	train_config config = default_train_config();
+	config.epochs = epochs;
+	config.shuffle = (seed != 0);
+	config.shuffle_seed = seed;
+	train_result result;
+	if (parallel) {
+		train_parallel_with_config(nn, input, output, &config, &result);
+	} else {
+		train_with_config(nn, input, output, &config, &result);
+	}
+	deallocate_ann(nn);
+	return result.final_loss;
+}
+
+void test_train_config() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF THE TRAINING LOOP SETTINGS\n--------------------\n");
+
+	size_t sizes[] = { 4, 8, 4 };
+	ann* nn = initialize_ann(sizes, 3);
+	number gamma = nn->gamma;
+
+	vector** data = (vector **)calloc(16, sizeof(vector *));
+	for (int i = 0; i < 16; i++) {
+		data[i] = init_vec(4);
+		int t = i;
+		for (int j = 0; j < 4; j++) {
+			data[i]->v[j] = t % 2;
+			t = t >> 1;
+		}
+	}
+	m_batch* mb_input = load_data_into_batches(data, 16, 8);
+	m_batch* mb_output = load_data_into_batches(data, 16, 8);
+
+	// a step limit partway through an epoch, with step decay and warmup seen by the callback
+	train_config config = default_train_config();
+	train_config_test_log log = { .epoch_loss_matches = TRUE };
+	config.max_steps = 7;
+	config.schedule = LEARNING_RATE_STEP_DECAY;
+	config.decay_factor = 0.5;
+	config.decay_epochs = 2;
+	config.warmup_steps = 2;
+	config.callback = train_config_test_callback;
+	config.callback_context = &log;
+	train_result result;
+	train_with_config(nn, mb_input, mb_output, &config, &result);
+	fprintf(stdout, "%zu steps over %zu epochs, stopped by %d, loss %f\n", result.steps, result.epochs,
+		result.stop_reason, result.final_loss);
+	number expected_rates[] = { gamma / 2, gamma, gamma, gamma, gamma / 2, gamma / 2, gamma / 2 };
+	boolean rates_match = TRUE;
+	for (int i = 0; i < 7; i++) {
+		rates_match = rates_match && fabs(log.learning_rates[i] - expected_rates[i]) <= 1e-6 * gamma;
+	}
+	if (result.steps != 7 || result.epochs != 3 || result.stop_reason != TRAIN_REACHED_MAX_STEPS || log.reports != 7
+			|| !log.epoch_loss_matches || !rates_match) {
+		fprintf(stderr, "ERROR IN TRAINING LOOP TEST: The step limit or the schedule is wrong\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// the callback stops the run
+	config = default_train_config();
+	log = (train_config_test_log){ .stop_after = 5, .epoch_loss_matches = TRUE };
+	config.callback = train_config_test_callback;
+	config.callback_context = &log;
+	train_with_config(nn, mb_input, mb_output, &config, &result);
+	if (result.steps != 5 || result.epochs != 2 || result.stop_reason != TRAIN_STOPPED_BY_CALLBACK) {
+		fprintf(stderr, "ERROR IN TRAINING LOOP TEST: The callback did not stop training\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// no improvement is ever large enough, so training stops patience epochs after the first
+	config = default_train_config();
+	config.patience = 3;
+	config.tolerance = 1e6;
+	train_with_config(nn, mb_input, mb_output, &config, &result);
+	if (result.epochs != 4 || result.steps != 8 || result.stop_reason != TRAIN_STOPPED_EARLY) {
+		fprintf(stderr, "ERROR IN TRAINING LOOP TEST: Early stopping is wrong\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// a full run brings the loss down from where it started
+	number first_loss = result.best_loss;
+	config = default_train_config();
+	config.epochs = 200;
+	train_with_config(nn, mb_input, mb_output, &config, &result);
+	fprintf(stdout, "loss %f after %zu epochs, from %f\n", result.final_loss, result.epochs, first_loss);
+	if (result.epochs != 200 || result.stop_reason != TRAIN_COMPLETED || !(result.final_loss < first_loss)
+			|| result.best_loss > result.final_loss) {
+		fprintf(stderr, "ERROR IN TRAINING LOOP TEST: The loss did not go down\n");
+		exit(EXIT_FAILURE);
+	}
+	delete_batches(mb_input);
+	delete_batches(mb_output);
+
+	// reshuffled epochs, with a short last batch: the same seed repeats the run, on copied batches or on views
+	mb_input = load_data_into_batches(data, 16, 6);
+	mb_output = load_data_into_batches(data, 16, 6);
+	matrix* dataset = init_mat(4, 16);
+	for (int i = 0; i < 16; i++) {
+		for (int j = 0; j < 4; j++) {
+			VALUE_AT(dataset, j, i) = data[i]->v[j];
+		}
+	}
+	m_batch* mb_sliced = slice_into_batches(dataset, 6);
+	number shuffled = shuffled_training_loss(mb_input, mb_output, 3, 50, FALSE);
+	number repeated = shuffled_training_loss(mb_input, mb_output, 3, 50, FALSE);
+	number sliced = shuffled_training_loss(mb_sliced, mb_sliced, 3, 50, FALSE);
+	number other_seed = shuffled_training_loss(mb_input, mb_output, 4, 50, FALSE);
+	number in_order = shuffled_training_loss(mb_input, mb_output, 0, 50, FALSE);
+	fprintf(stdout, "shuffled loss %f, with another seed %f, in order %f\n", shuffled, other_seed, in_order);
+	if (shuffled != repeated || shuffled != sliced || shuffled == other_seed || shuffled == in_order) {
+		fprintf(stderr, "ERROR IN TRAINING LOOP TEST: Shuffling does not follow the seed\n");
+		exit(EXIT_FAILURE);
+	}
+	number parallel_start = shuffled_training_loss(mb_input, mb_output, 3, 1, TRUE);
+	number parallel_end = shuffled_training_loss(mb_input, mb_output, 3, 50, TRUE);
+	if (!(parallel_end < parallel_start)) {
+		fprintf(stderr, "ERROR IN TRAINING LOOP TEST: Shuffled parallel training did not bring the loss down\n");
+		exit(EXIT_FAILURE);
+	}
+	delete_batches(mb_sliced);
+	del_mat(dataset);
+	delete_batches(mb_input);
+	delete_batches(mb_output);
+	for (int i = 0; i < 16; i++) {
+		del_vec(data[i]);
+	}
+	free(data);
+	deallocate_ann(nn);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF THE TRAINING LOOP SETTINGS\n--------------------\n");
+}
+
+/**
+ * Loss after a number of epochs of train_with_config() from the same starting weights, with the optimizer given
+ * (or plain SGD for OPTIMIZER_SGD). The other loops run TRAIN_DEFAULT_EPOCHS, and the loss is measured after.
+ */
+static number loss_after_training(m_batch* input, m_batch* output, optimizer_kind kind, number gamma, size_t epochs,
+		int loop) {
+	size_t sizes[] = { 4, 16, 4 };
+	srand(7);
+	ann* nn = initialize_ann(sizes, 3);
+	nn->gamma = gamma;
+	optimizer_options options = default_optimizer_options(kind);
+	set_optimizer(nn, &options);
+
+	train_config config = default_train_config();
+	config.epochs = epochs;
+	train_result result;
+	if (loop == 0) {
+		train_with_config(nn, input, output, &config, &result);
+	} else {
+		if (loop == 1) {
+			train_parallel(nn, input, output);
+		} else {
+			mixed_precision_options precision = { .activation_format = HALF_BFLOAT16, .loss_scale = 1, .dynamic_loss_scale = FALSE };
+			train_mixed_precision(nn, input, output, &precision);
+		}
+		config.epochs = 1;
+		nn->gamma = 0;
+		train_with_config(nn, input, output, &config, &result);
+	}
+	deallocate_ann(nn);
+	return result.final_loss;
+}
+
+void test_optimizers() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF THE OPTIMIZERS\n--------------------\n");
+
+	// two steps of each optimizer on a single layer against the textbook formulas, bias corrections included
+	size_t sizes[] = { 3, 2 };
+	number gradients[2][8] = {
+		{ 0.5, -1, 2, 0.25, 0, -3, 1, -0.5 },
+		{ -0.5, 2, 1, 0.75, 4, -1, 0.5, 0.5 },
+	};
+	optimizer_kind kinds[] = { OPTIMIZER_MOMENTUM, OPTIMIZER_ADAM };
+	for (int k = 0; k < 2; k++) {
+		ann* nn = initialize_ann(sizes, 2);
+		optimizer_options options = default_optimizer_options(kinds[k]);
+		set_optimizer(nn, &options);
+		matrix* grad_w = init_mat(2, 3);
+		vector* grad_b = init_vec(2);
+
+		double parameters[8];
+		double first[8] = {0};
+		double second[8] = {0};
+		for (int p = 0; p < 8; p++) {
+			parameters[p] = (p < 6) ? nn->weights[0]->m[p] : nn->biases[0]->v[p - 6];
+		}
+
+		number max_error = 0;
+		for (int t = 1; t <= 2; t++) {
+			for (int p = 0; p < 8; p++) {
+				if (p < 6) {
+					grad_w->m[p] = gradients[t - 1][p];
+				} else {
+					grad_b->v[p - 6] = gradients[t - 1][p];
+				}
+				// the gradients are sums over a batch of 4
+				double g = gradients[t - 1][p] / 4;
+				if (kinds[k] == OPTIMIZER_MOMENTUM) {
+					first[p] = 0.9 * first[p] + g;
+					parameters[p] -= 0.01 * first[p];
+				} else {
+					first[p] = 0.9 * first[p] + 0.1 * g;
+					second[p] = 0.999 * second[p] + 0.001 * g * g;
+					double first_hat = first[p] / (1 - pow(0.9, t));
+					double second_hat = second[p] / (1 - pow(0.999, t));
+					parameters[p] -= 0.01 * first_hat / (sqrt(second_hat) + 1e-8);
+				}
+			}
+			optimizer_step(nn, &grad_w, &grad_b, 0.01, 0.25);
+			for (int p = 0; p < 8; p++) {
+				number actual = (p < 6) ? nn->weights[0]->m[p] : nn->biases[0]->v[p - 6];
+				max_error = (fabs(actual - parameters[p]) > max_error) ? fabs(actual - parameters[p]) : max_error;
+			}
+		}
+		fprintf(stdout, "%s: max error %g against the formulas\n", (k == 0) ? "momentum" : "adam", max_error);
+		if (max_error > 1e-5) {
+			fprintf(stderr, "ERROR IN OPTIMIZER TEST: The update does not match the formulas\n");
+			exit(EXIT_FAILURE);
+		}
+		del_mat(grad_w);
+		del_vec(grad_b);
+		deallocate_ann(nn);
+	}
+
+	vector** data = (vector **)calloc(16, sizeof(vector *));
+	for (int i = 0; i < 16; i++) {
+		data[i] = init_vec(4);
+		int t = i;
+		for (int j = 0; j < 4; j++) {
+			data[i]->v[j] = t % 2;
+			t = t >> 1;
+		}
+	}
+	m_batch* mb_input = load_data_into_batches(data, 16, 4);
+	m_batch* mb_output = load_data_into_batches(data, 16, 4);
+
+	// at the same learning rate momentum takes longer strides than SGD; Adam gets down from the large loss of the
+	// starting weights in a few epochs
+	number sgd = loss_after_training(mb_input, mb_output, OPTIMIZER_SGD, 0.001, 200, 0);
+	number momentum = loss_after_training(mb_input, mb_output, OPTIMIZER_MOMENTUM, 0.001, 200, 0);
+	number adam_start = loss_after_training(mb_input, mb_output, OPTIMIZER_ADAM, 0.03, 1, 0);
+	number adam = loss_after_training(mb_input, mb_output, OPTIMIZER_ADAM, 0.03, 200, 0);
+	fprintf(stdout, "loss after 200 epochs: sgd %f, momentum %f, adam %f (%f after 1)\n", sgd, momentum, adam, adam_start);
+	if (!(momentum < sgd) || !(adam < 0.5) || !(adam < adam_start)) {
+		fprintf(stderr, "ERROR IN OPTIMIZER TEST: Momentum or Adam do not train\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// the other training loops take the same steps
+	number serial = loss_after_training(mb_input, mb_output, OPTIMIZER_ADAM, 0.03, TRAIN_DEFAULT_EPOCHS, 0);
+	number parallel = loss_after_training(mb_input, mb_output, OPTIMIZER_ADAM, 0.03, TRAIN_DEFAULT_EPOCHS, 1);
+	number mixed = loss_after_training(mb_input, mb_output, OPTIMIZER_ADAM, 0.03, TRAIN_DEFAULT_EPOCHS, 2);
+	fprintf(stdout, "adam after %d epochs: serial %f, parallel %f, mixed precision %f\n", TRAIN_DEFAULT_EPOCHS, serial, parallel, mixed);
+	if (fabs(parallel - serial) > 1e-2 * (1 + serial) || fabs(mixed - serial) > 0.2 * (1 + serial)) {
+		fprintf(stderr, "ERROR IN OPTIMIZER TEST: The parallel or mixed precision loops do not use the optimizer\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// OPTIMIZER_SGD takes the optimizer away again
+	ann* nn = initialize_ann(sizes, 2);
+	optimizer_options options = default_optimizer_options(OPTIMIZER_MOMENTUM);
+	set_optimizer(nn, &options);
+	options.kind = OPTIMIZER_SGD;
+	if (set_optimizer(nn, &options) != NULL || nn->optimizer != NULL) {
+		fprintf(stderr, "ERROR IN OPTIMIZER TEST: OPTIMIZER_SGD did not remove the optimizer\n");
+		exit(EXIT_FAILURE);
+	}
+	deallocate_ann(nn);
+
+	delete_batches(mb_input);
+	delete_batches(mb_output);
+	for (int i = 0; i < 16; i++) {
+		del_vec(data[i]);
+	}
+	free(data);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF THE OPTIMIZERS\n--------------------\n");
+}
+
+/**
+ * Trains a 4-16-4 classifier of the first two bits of its input with the given head and training loop, then
+ * returns the fraction of the 16 inputs whose largest output is the right class
+ */
+static number accuracy_after_training(m_batch* input, m_batch* output, layer_activation head, int loop, size_t epochs) {
+	size_t sizes[] = { 4, 16, 4 };
+	srand(11);
+	ann* nn = initialize_ann(sizes, 3);
+	nn->output_activation = head;
+	nn->gamma = 0.1;
+
+	train_config config = default_train_config();
+	config.epochs = epochs;
+	for (size_t epoch = 0; epoch < epochs; epoch += TRAIN_DEFAULT_EPOCHS) {
+		if (loop == 0) {
+			train_with_config(nn, input, output, &config, NULL);
+			break;
+		} else if (loop == 1) {
+			train_parallel(nn, input, output);
+		} else {
+			mixed_precision_options precision = { .activation_format = HALF_BFLOAT16, .loss_scale = 1, .dynamic_loss_scale = FALSE };
+			train_mixed_precision(nn, input, output, &precision);
+		}
+	}
+
+	size_t correct = 0;
+	for (int b = 0; b < input->number_of_batches; b++) {
+		batch* predictions = pass_forward(nn, input->ray_of_batches[b]);
+		matrix* target = output->ray_of_batches[b]->data;
+		for (size_t j = 0; j < predictions->number_of_vectors; j++) {
+			size_t predicted = 0;
+			size_t expected = 0;
+			for (size_t i = 1; i < 4; i++) {
+				predicted = (VALUE_AT(predictions->data, i, j) > VALUE_AT(predictions->data, predicted, j)) ? i : predicted;
+				expected = (VALUE_AT(target, i, j) > VALUE_AT(target, expected, j)) ? i : expected;
+			}
+			correct += (predicted == expected) ? 1 : 0;
+		}
+		delete_batch(predictions);
+	}
+	deallocate_ann(nn);
+	return (number)correct / 16;
+}
+
+void test_softmax() {
+	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF THE SOFTMAX HEAD\n--------------------\n");
+
+	// the fused kernel of every instruction set against libm, with logits far past where a plain exp overflows
+	const char* previous = kernels->name;
+	const char* instruction_sets[] = { "scalar", "sse", "avx2", "avx512", "avx512vnni" };
+	size_t rows = 10;
+	size_t cols = 37;
+	matrix* z = init_mat(rows, cols);
+	matrix* target = init_mat(rows, cols);
+	matrix* out = init_mat(rows, cols);
+	for (size_t j = 0; j < cols; j++) {
+		for (size_t i = 0; i < rows; i++) {
+			VALUE_AT(z, i, j) = 8 * (((number)rand()) / RAND_MAX - 0.5);
+			VALUE_AT(target, i, j) = (i == j % rows) ? 1 : 0;
+		}
+	}
+	VALUE_AT(z, 3, 0) = 1000;
+	VALUE_AT(z, 4, 1) = -1000;
+	VALUE_AT(z, 1, 2) = 1000;
+	VALUE_AT(z, 2, 2) = 999;
+
+	double expected_loss = 0;
+	double expected[rows * cols];
+	for (size_t j = 0; j < cols; j++) {
+		double largest = VALUE_AT(z, 0, j);
+		for (size_t i = 1; i < rows; i++) {
+			largest = (VALUE_AT(z, i, j) > largest) ? VALUE_AT(z, i, j) : largest;
+		}
+		double sum = 0;
+		for (size_t i = 0; i < rows; i++) {
+			sum += exp(VALUE_AT(z, i, j) - largest);
+		}
+		for (size_t i = 0; i < rows; i++) {
+			expected[i * cols + j] = exp(VALUE_AT(z, i, j) - largest) / sum;
+			expected_loss += VALUE_AT(target, i, j) * (largest + log(sum) - VALUE_AT(z, i, j));
+		}
+	}
+
+	for (int s = 0; s < sizeof(instruction_sets) / sizeof(instruction_sets[0]); s++) {
+		if (!use_kernels(instruction_sets[s])) {
+			fprintf(stdout, "%s: not supported by this host\n", instruction_sets[s]);
+			continue;
+		}
+
+		number max_error = 0;
+		for (int with_target = 0; with_target < 2; with_target++) {
+			number loss = softmax_cross_entropy(out, z, with_target ? target : NULL);
+			for (size_t i = 0; i < rows * cols; i++) {
+				double reference = expected[i] - (with_target ? target->m[i] : 0);
+				max_error = (fabs(out->m[i] - reference) > max_error) ? fabs(out->m[i] - reference) : max_error;
+			}
+			double loss_error = fabs(loss - (with_target ? expected_loss : 0)) / (1 + expected_loss);
+			max_error = (loss_error > max_error) ? loss_error : max_error;
+		}
+
+		// in place, as the forward pass takes it
+		memcpy(out->m, z->m, rows * cols * sizeof(number));
+		softmax_cross_entropy(out, out, NULL);
+		for (size_t i = 0; i < rows * cols; i++) {
+			max_error = (fabs(out->m[i] - expected[i]) > max_error) ? fabs(out->m[i] - expected[i]) : max_error;
+		}
+
+		fprintf(stdout, "%s: max error %g\n", kernels->name, max_error);
+		if (!(max_error < 1e-4)) {
+			fprintf(stderr, "ERROR IN SOFTMAX TEST: The %s kernel does not match libm\n", kernels->name);
+			exit(EXIT_FAILURE);
+		}
+	}
+	use_kernels(previous);
+	del_mat(z);
+	del_mat(target);
+	del_mat(out);
+
+	// one-hot labels of the first two bits of every 4-bit input
+	vector** inputs = (vector **)calloc(16, sizeof(vector *));
+	vector** labels = (vector **)calloc(16, sizeof(vector *));
+	for (int i = 0; i < 16; i++) {
+		inputs[i] = init_vec(4);
+		labels[i] = init_vec(4);
+		for (int j = 0; j < 4; j++) {
+			inputs[i]->v[j] = (i >> j) % 2;
+			labels[i]->v[j] = (j == i % 4) ? 1 : 0;
+		}
+	}
+	m_batch* mb_input = load_data_into_batches(inputs, 16, 4);
+	m_batch* mb_output = load_data_into_batches(labels, 16, 4);
+
+	// the cross-entropy keeps pulling the right class up where the squared error of Leaky-ReLU outputs stalls
+	number leaky = accuracy_after_training(mb_input, mb_output, ACTIVATION_LEAKY_RELU, 0, 300);
+	number softmax = accuracy_after_training(mb_input, mb_output, ACTIVATION_SOFTMAX, 0, 300);
+	number parallel = accuracy_after_training(mb_input, mb_output, ACTIVATION_SOFTMAX, 1, 300);
+	number mixed = accuracy_after_training(mb_input, mb_output, ACTIVATION_SOFTMAX, 2, 300);
+	fprintf(stdout, "accuracy after 300 epochs: leaky relu %f, softmax %f (parallel %f, mixed precision %f)\n",
+		leaky, softmax, parallel, mixed);
+	if (softmax != 1 || parallel != 1 || mixed != 1 || !(softmax >= leaky)) {
+		fprintf(stderr, "ERROR IN SOFTMAX TEST: The softmax head does not learn the classes\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// every output of a softmax network is a distribution, however it is run, and the head survives a checkpoint
+	const char* path = "test_softmax.ann";
+	size_t sizes[] = { 4, 16, 4 };
+	ann* nn = initialize_ann(sizes, 3);
+	nn->output_activation = ACTIVATION_SOFTMAX;
+	batch* samples = mb_input->ray_of_batches[0];
+	batch* predictions = pass_forward(nn, samples);
+	quantized_ann* quantized = quantize_ann(nn, samples);
+	batch* quantized_predictions = pass_forward_quantized(quantized, samples);
+	save_ann(nn, path);
+	ann* loaded = load_ann(path);
+	if (loaded == NULL || loaded->output_activation != ACTIVATION_SOFTMAX) {
+		fprintf(stderr, "ERROR IN SOFTMAX TEST: The checkpoint lost the softmax head\n");
+		exit(EXIT_FAILURE);
+	}
+	batch* loaded_predictions = pass_forward(loaded, samples);
+	for (size_t j = 0; j < samples->number_of_vectors; j++) {
+		number sum = 0;
+		number quantized_sum = 0;
+		for (size_t i = 0; i < 4; i++) {
+			sum += VALUE_AT(predictions->data, i, j);
+			quantized_sum += VALUE_AT(quantized_predictions->data, i, j);
+		}
+		if (fabs(sum - 1) > 1e-5 || fabs(quantized_sum - 1) > 1e-5 ||
+			memcmp(&VALUE_AT(predictions->data, 0, j), &VALUE_AT(loaded_predictions->data, 0, j), sizeof(number)) != 0) {
+			fprintf(stderr, "ERROR IN SOFTMAX TEST: Sample %zu is not a distribution (%f, quantized %f)\n", j, sum, quantized_sum);
+			exit(EXIT_FAILURE);
+		}
+	}
+	remove(path);
+	delete_batch(predictions);
+	delete_batch(quantized_predictions);
+	delete_batch(loaded_predictions);
+	deallocate_quantized_ann(quantized);
+	deallocate_ann(loaded);
+	deallocate_ann(nn);
+
+	delete_batches(mb_input);
+	delete_batches(mb_output);
+	for (int i = 0; i < 16; i++) {
+		del_vec(inputs[i]);
+		del_vec(labels[i]);
+	}
+	free(inputs);
+	free(labels);
+
+	fprintf(stdout, "\n--------------------\nEND TESTING OF THE SOFTMAX HEAD\n--------------------\n");
+}
+
 void test_mat_vec_mult() {
 	fprintf(stdout, "\n--------------------\nBEGIN TESTING OF MATRIX-VECTOR MULTIPLICATION\n--------------------\n");
 
@@ -320,6 +2475,29 @@ int main() {
 	// test_mat_vec_mult();
 	// test_batch();
 	test_ann();
+	test_arena();
+	test_mat_mult_blocked();
+	test_mat_mult_transposed();
+	test_layer_forward();
+	test_kernels();
+	test_thread_pool();
+	test_train_parallel();
+	test_train_hogwild();
+	test_idx();
+	test_batch_stream();
+	test_batch_views();
+	test_shuffling();
+	test_ragged_batches();
+	test_bfloat16();
+	test_mixed_precision();
+	test_quantization();
+	test_inference_session();
+	test_inference_server();
+	test_ann_file();
+	test_checkpointing();
+	test_train_config();
+	test_optimizers();
+	test_softmax();
 
 	fprintf(stdout, "\n\nEND TESTING\n\n");
 	return 0;